@@ -0,0 +1,170 @@
+/*
+ * Builds a synthetic mirror tree for benchmarking. Files are sparse, so
+ * multi-gigabyte "images" cost no disk space; reads of them return zeros.
+ *
+ * Usage: gen_tree <root> [--depth N] [--fanout N] [--files N]
+ *                        [--min-size BYTES] [--max-size BYTES] [--seed N]
+ *
+ * The top level gets `fanout` category directories, each with `fanout`
+ * subdirectories per level down to `depth`. Files are spread round-robin
+ * over every directory in the tree.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <limits.h>
+#include <sys/stat.h>
+
+typedef struct {
+    int depth;
+    int fanout;
+    long files;
+    long long min_size;
+    long long max_size;
+    unsigned int seed;
+} GenOptions;
+
+typedef struct {
+    char **paths;
+    size_t count;
+    size_t capacity;
+} DirList;
+
+static int dir_list_add(DirList *list, const char *path) {
+    if (list->count == list->capacity) {
+        size_t capacity = list->capacity ? list->capacity * 2 : 64;
+        char **grown = realloc(list->paths, capacity * sizeof(char *));
+        if (grown == NULL) {
+            return -1;
+        }
+        list->paths = grown;
+        list->capacity = capacity;
+    }
+    list->paths[list->count] = strdup(path);
+    return list->paths[list->count++] ? 0 : -1;
+}
+
+static int make_tree(const char *path, int level, const GenOptions *options, DirList *dirs) {
+    if (mkdir(path, 0755) != 0 && errno != EEXIST) {
+        fprintf(stderr, "mkdir %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+
+    /* Files are not placed in the root, so every one of them has a category. */
+    if (level > 0 && dir_list_add(dirs, path) != 0) {
+        return -1;
+    }
+
+    if (level == options->depth) {
+        return 0;
+    }
+
+    for (int i = 0; i < options->fanout; i++) {
+        char child[PATH_MAX];
+        snprintf(child, sizeof(child), level == 0 ? "%s/category-%02d" : "%s/dir-%02d", path, i);
+        if (make_tree(child, level + 1, options, dirs) != 0) {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+static long long parse_size(const char *value) {
+    char *end;
+    long long size = strtoll(value, &end, 10);
+    switch (*end) {
+        case 'k': case 'K': size <<= 10; break;
+        case 'm': case 'M': size <<= 20; break;
+        case 'g': case 'G': size <<= 30; break;
+        default: break;
+    }
+    return size;
+}
+
+int main(int argc, char **argv) {
+    GenOptions options = {
+        .depth = 2,
+        .fanout = 8,
+        .files = 10000,
+        .min_size = 1 << 20,
+        .max_size = 4LL << 30,
+        .seed = 1
+    };
+
+    if (argc < 2) {
+        fprintf(stderr, "usage: %s <root> [--depth N] [--fanout N] [--files N] "
+                        "[--min-size BYTES] [--max-size BYTES] [--seed N]\n", argv[0]);
+        return 2;
+    }
+
+    const char *root = argv[1];
+    for (int i = 2; i + 1 < argc; i += 2) {
+        if (strcmp(argv[i], "--depth") == 0) {
+            options.depth = atoi(argv[i + 1]);
+        } else if (strcmp(argv[i], "--fanout") == 0) {
+            options.fanout = atoi(argv[i + 1]);
+        } else if (strcmp(argv[i], "--files") == 0) {
+            options.files = atol(argv[i + 1]);
+        } else if (strcmp(argv[i], "--min-size") == 0) {
+            options.min_size = parse_size(argv[i + 1]);
+        } else if (strcmp(argv[i], "--max-size") == 0) {
+            options.max_size = parse_size(argv[i + 1]);
+        } else if (strcmp(argv[i], "--seed") == 0) {
+            options.seed = (unsigned int)strtoul(argv[i + 1], NULL, 10);
+        } else {
+            fprintf(stderr, "unknown option: %s\n", argv[i]);
+            return 2;
+        }
+    }
+
+    if (options.depth < 1 || options.fanout < 1 || options.files < 0 ||
+        options.min_size < 0 || options.max_size < options.min_size) {
+        fprintf(stderr, "invalid tree shape\n");
+        return 2;
+    }
+
+    DirList dirs = {0};
+    if (make_tree(root, 0, &options, &dirs) != 0) {
+        return 1;
+    }
+
+    srandom(options.seed);
+    long long total_size = 0;
+    unsigned long long span = (unsigned long long)(options.max_size - options.min_size) + 1;
+
+    for (long i = 0; i < options.files; i++) {
+        char path[PATH_MAX];
+        snprintf(path, sizeof(path), "%s/image-%07ld.%s",
+                 dirs.paths[i % dirs.count], i, i % 4 == 3 ? "img" : "iso");
+
+        unsigned long long r = ((unsigned long long)random() << 31) | (unsigned long long)random();
+        long long size = options.min_size + (long long)(r % span);
+
+        int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (fd == -1 || ftruncate(fd, size) != 0) {
+            fprintf(stderr, "create %s: %s\n", path, strerror(errno));
+            if (fd != -1) {
+                close(fd);
+            }
+            return 1;
+        }
+        close(fd);
+        total_size += size;
+    }
+
+    printf("{\"root\":\"%s\",\"depth\":%d,\"fanout\":%d,\"directories\":%zu,"
+           "\"files\":%ld,\"apparent_bytes\":%lld,\"seed\":%u}\n",
+           root, options.depth, options.fanout, dirs.count,
+           options.files, total_size, options.seed);
+
+    for (size_t i = 0; i < dirs.count; i++) {
+        free(dirs.paths[i]);
+    }
+    free(dirs.paths);
+    return 0;
+}
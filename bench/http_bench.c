@@ -0,0 +1,343 @@
+/*
+ * Closed-loop HTTP/1.1 load generator. Each client thread keeps one
+ * connection alive and issues the next GET as soon as the previous
+ * response body has been read in full.
+ *
+ * Usage: http_bench <host> <port> <path> [--concurrency 1,8,32]
+ *                   [--duration SECONDS] [--accept-encoding VALUE]
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#define BENCH_READ_SIZE (256 * 1024)
+#define BENCH_HEADER_MAX 8192
+
+typedef struct {
+    const char *host;
+    const char *port;
+    const char *request;
+    size_t request_length;
+    double deadline;
+} BenchTarget;
+
+typedef struct {
+    const BenchTarget *target;
+    uint64_t requests;
+    uint64_t errors;
+    uint64_t bytes;
+    uint32_t *latencies_us;
+    size_t latency_count;
+    size_t latency_capacity;
+} BenchClient;
+
+static double now_seconds() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (double)now.tv_sec + (double)now.tv_nsec / 1e9;
+}
+
+static int bench_connect(const BenchTarget *target) {
+    struct addrinfo hints = { .ai_family = AF_UNSPEC, .ai_socktype = SOCK_STREAM };
+    struct addrinfo *addresses;
+
+    if (getaddrinfo(target->host, target->port, &hints, &addresses) != 0) {
+        return -1;
+    }
+
+    int fd = -1;
+    for (struct addrinfo *ai = addresses; ai; ai = ai->ai_next) {
+        fd = socket(ai->ai_family, ai->ai_socktype | SOCK_CLOEXEC, ai->ai_protocol);
+        if (fd == -1) {
+            continue;
+        }
+        if (connect(fd, ai->ai_addr, ai->ai_addrlen) == 0) {
+            int one = 1;
+            setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+            break;
+        }
+        close(fd);
+        fd = -1;
+    }
+
+    freeaddrinfo(addresses);
+    return fd;
+}
+
+static int bench_send_all(int fd, const char *data, size_t length) {
+    while (length > 0) {
+        ssize_t sent = send(fd, data, length, MSG_NOSIGNAL);
+        if (sent <= 0) {
+            if (sent < 0 && errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        data += sent;
+        length -= (size_t)sent;
+    }
+    return 0;
+}
+
+/*
+ * Reads one response. Bytes past the header that belong to the body are
+ * counted against Content-Length; responses without one (304) have none.
+ * Returns the body length, or -1 if the connection must be reopened.
+ */
+static long long bench_read_response(int fd, char *buffer, bool *keep_alive) {
+    size_t have = 0;
+    char *header_end = NULL;
+
+    while (header_end == NULL) {
+        if (have == BENCH_HEADER_MAX) {
+            return -1;
+        }
+        ssize_t n = recv(fd, buffer + have, BENCH_HEADER_MAX - have, 0);
+        if (n <= 0) {
+            return -1;
+        }
+        have += (size_t)n;
+        buffer[have] = '\0';
+        header_end = memmem(buffer, have, "\r\n\r\n", 4);
+    }
+
+    size_t header_length = (size_t)(header_end - buffer) + 4;
+    int status = 0;
+    if (sscanf(buffer, "HTTP/1.%*d %d", &status) != 1 || status >= 400) {
+        return -1;
+    }
+
+    long long content_length = 0;
+    *keep_alive = true;
+
+    for (char *line = strstr(buffer, "\r\n"); line && line < header_end; line = strstr(line, "\r\n")) {
+        line += 2;
+        if (strncasecmp(line, "Content-Length:", 15) == 0) {
+            content_length = strtoll(line + 15, NULL, 10);
+        } else if (strncasecmp(line, "Connection: close", 17) == 0) {
+            *keep_alive = false;
+        } else if (strncasecmp(line, "Transfer-Encoding:", 18) == 0) {
+            return -1;
+        }
+    }
+
+    long long remaining = content_length - (long long)(have - header_length);
+    while (remaining > 0) {
+        size_t want = remaining < BENCH_READ_SIZE ? (size_t)remaining : BENCH_READ_SIZE;
+        ssize_t n = recv(fd, buffer, want, 0);
+        if (n <= 0) {
+            return -1;
+        }
+        remaining -= n;
+    }
+
+    return content_length;
+}
+
+static void bench_record_latency(BenchClient *client, double seconds) {
+    if (client->latency_count == client->latency_capacity) {
+        size_t capacity = client->latency_capacity ? client->latency_capacity * 2 : 4096;
+        uint32_t *grown = realloc(client->latencies_us, capacity * sizeof(uint32_t));
+        if (grown == NULL) {
+            return;
+        }
+        client->latencies_us = grown;
+        client->latency_capacity = capacity;
+    }
+    client->latencies_us[client->latency_count++] = (uint32_t)(seconds * 1e6);
+}
+
+static void* bench_client_main(void *arg) {
+    BenchClient *client = arg;
+    const BenchTarget *target = client->target;
+    /* Also used for headers, which need room for a terminator. */
+    char *buffer = malloc(BENCH_READ_SIZE > BENCH_HEADER_MAX ? BENCH_READ_SIZE : BENCH_HEADER_MAX + 1);
+    int fd = -1;
+
+    if (buffer == NULL) {
+        return NULL;
+    }
+
+    while (now_seconds() < target->deadline) {
+        if (fd == -1 && (fd = bench_connect(target)) == -1) {
+            client->errors++;
+            usleep(1000);
+            continue;
+        }
+
+        double started = now_seconds();
+        bool keep_alive = false;
+        long long body = -1;
+
+        if (bench_send_all(fd, target->request, target->request_length) == 0) {
+            body = bench_read_response(fd, buffer, &keep_alive);
+        }
+
+        if (body < 0) {
+            client->errors++;
+            close(fd);
+            fd = -1;
+            continue;
+        }
+
+        client->requests++;
+        client->bytes += (uint64_t)body;
+        bench_record_latency(client, now_seconds() - started);
+
+        if (!keep_alive) {
+            close(fd);
+            fd = -1;
+        }
+    }
+
+    if (fd != -1) {
+        close(fd);
+    }
+    free(buffer);
+    return NULL;
+}
+
+static int compare_u32(const void *a, const void *b) {
+    uint32_t x = *(const uint32_t *)a;
+    uint32_t y = *(const uint32_t *)b;
+    return (x > y) - (x < y);
+}
+
+static void bench_run(BenchTarget *target, int concurrency, double duration, bool first) {
+    BenchClient *clients = calloc((size_t)concurrency, sizeof(BenchClient));
+    pthread_t *threads = calloc((size_t)concurrency, sizeof(pthread_t));
+    if (clients == NULL || threads == NULL) {
+        exit(1);
+    }
+
+    double started = now_seconds();
+    target->deadline = started + duration;
+
+    int running = 0;
+    for (int i = 0; i < concurrency; i++) {
+        clients[i].target = target;
+        if (pthread_create(&threads[i], NULL, bench_client_main, &clients[i]) != 0) {
+            break;
+        }
+        running++;
+    }
+    for (int i = 0; i < running; i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    double elapsed = now_seconds() - started;
+    uint64_t requests = 0, errors = 0, bytes = 0;
+    size_t samples = 0;
+
+    for (int i = 0; i < running; i++) {
+        requests += clients[i].requests;
+        errors += clients[i].errors;
+        bytes += clients[i].bytes;
+        samples += clients[i].latency_count;
+    }
+
+    uint32_t *latencies = malloc((samples ? samples : 1) * sizeof(uint32_t));
+    size_t offset = 0;
+    for (int i = 0; i < running; i++) {
+        if (latencies) {
+            memcpy(latencies + offset, clients[i].latencies_us,
+                   clients[i].latency_count * sizeof(uint32_t));
+        }
+        offset += clients[i].latency_count;
+        free(clients[i].latencies_us);
+    }
+
+    double p50 = 0, p99 = 0, max = 0;
+    if (latencies && samples > 0) {
+        qsort(latencies, samples, sizeof(uint32_t), compare_u32);
+        p50 = latencies[samples / 2] / 1e3;
+        p99 = latencies[(size_t)((double)(samples - 1) * 0.99)] / 1e3;
+        max = latencies[samples - 1] / 1e3;
+    }
+
+    printf("%s{\"concurrency\":%d,\"requests\":%llu,\"errors\":%llu,\"seconds\":%.3f,"
+           "\"requests_per_sec\":%.1f,\"bytes\":%llu,\"mb_per_sec\":%.2f,"
+           "\"p50_ms\":%.3f,\"p99_ms\":%.3f,\"max_ms\":%.3f}",
+           first ? "" : ",", running,
+           (unsigned long long)requests, (unsigned long long)errors, elapsed,
+           (double)requests / elapsed, (unsigned long long)bytes,
+           (double)bytes / elapsed / (1024.0 * 1024.0), p50, p99, max);
+    fflush(stdout);
+
+    free(latencies);
+    free(clients);
+    free(threads);
+}
+
+int main(int argc, char **argv) {
+    const char *concurrency = "1,8,32";
+    const char *accept_encoding = "identity";
+    double duration = 5;
+
+    if (argc < 4) {
+        fprintf(stderr, "usage: %s <host> <port> <path> [--concurrency 1,8,32] "
+                        "[--duration SECONDS] [--accept-encoding VALUE]\n", argv[0]);
+        return 2;
+    }
+
+    for (int i = 4; i + 1 < argc; i += 2) {
+        if (strcmp(argv[i], "--concurrency") == 0) {
+            concurrency = argv[i + 1];
+        } else if (strcmp(argv[i], "--duration") == 0) {
+            duration = atof(argv[i + 1]);
+        } else if (strcmp(argv[i], "--accept-encoding") == 0) {
+            accept_encoding = argv[i + 1];
+        } else {
+            fprintf(stderr, "unknown option: %s\n", argv[i]);
+            return 2;
+        }
+    }
+
+    char request[1024];
+    int length = snprintf(request, sizeof(request),
+                          "GET %s HTTP/1.1\r\nHost: %s\r\nAccept-Encoding: %s\r\n"
+                          "User-Agent: oim-http-bench\r\n\r\n",
+                          argv[3], argv[1], accept_encoding);
+    if (length < 0 || (size_t)length >= sizeof(request)) {
+        fprintf(stderr, "path too long\n");
+        return 2;
+    }
+
+    BenchTarget target = {
+        .host = argv[1],
+        .port = argv[2],
+        .request = request,
+        .request_length = (size_t)length
+    };
+
+    printf("{\"benchmark\":\"http\",\"path\":\"%s\",\"accept_encoding\":\"%s\","
+           "\"duration\":%.1f,\"results\":[", argv[3], accept_encoding, duration);
+
+    const char *cursor = concurrency;
+    bool first = true;
+    while (*cursor) {
+        int clients = atoi(cursor);
+        bench_run(&target, clients < 1 ? 1 : clients, duration, first);
+        first = false;
+
+        cursor += strcspn(cursor, ",");
+        if (*cursor == ',') {
+            cursor++;
+        }
+    }
+
+    printf("]}\n");
+    return 0;
+}
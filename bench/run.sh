@@ -0,0 +1,119 @@
+#!/bin/sh
+# Runs the benchmark suite and writes one JSON document combining the
+# tree description, scan timings and HTTP results. Invoked by `make bench`;
+# every BENCH_* variable below can be overridden from the make command line.
+set -eu
+
+BENCH_BUILD=${BENCH_BUILD:-build/bench}
+SERVER=${SERVER:-build/openimagemirror}
+BENCH_WORK=${BENCH_WORK:-$BENCH_BUILD/work}
+BENCH_OUTPUT=${BENCH_OUTPUT:-$BENCH_BUILD/results-$(date +%Y%m%d-%H%M%S).json}
+
+BENCH_DEPTH=${BENCH_DEPTH:-2}
+BENCH_FANOUT=${BENCH_FANOUT:-8}
+BENCH_FILES=${BENCH_FILES:-10000}
+BENCH_MIN_SIZE=${BENCH_MIN_SIZE:-1M}
+BENCH_MAX_SIZE=${BENCH_MAX_SIZE:-4G}
+BENCH_DOWNLOAD_SIZE=${BENCH_DOWNLOAD_SIZE:-256M}
+BENCH_SCAN_THREADS=${BENCH_SCAN_THREADS:-1,2,4,8}
+BENCH_SCAN_ITERATIONS=${BENCH_SCAN_ITERATIONS:-5}
+BENCH_CONCURRENCY=${BENCH_CONCURRENCY:-1,8,32,128}
+BENCH_DURATION=${BENCH_DURATION:-5}
+BENCH_PORT=${BENCH_PORT:-18080}
+
+tree="$BENCH_WORK/tree"
+server_dir="$BENCH_WORK/server"
+server_pid=
+
+cleanup() {
+    if [ -n "$server_pid" ]; then
+        kill "$server_pid" 2>/dev/null || true
+        wait "$server_pid" 2>/dev/null || true
+    fi
+}
+trap cleanup EXIT INT TERM
+
+rm -rf "$BENCH_WORK"
+mkdir -p "$BENCH_WORK" "$server_dir/config" "$(dirname "$BENCH_OUTPUT")"
+
+echo "Generating mirror tree in $tree" >&2
+tree_json=$("$BENCH_BUILD/gen_tree" "$tree" \
+    --depth "$BENCH_DEPTH" --fanout "$BENCH_FANOUT" --files "$BENCH_FILES" \
+    --min-size "$BENCH_MIN_SIZE" --max-size "$BENCH_MAX_SIZE")
+
+# A fixed-size file so download throughput is comparable between runs.
+truncate -s "$BENCH_DOWNLOAD_SIZE" "$tree/category-00/bench-download.iso"
+
+echo "Timing full scans" >&2
+scan_json=$("$BENCH_BUILD/scan_bench" "$tree" \
+    --threads "$BENCH_SCAN_THREADS" --iterations "$BENCH_SCAN_ITERATIONS")
+
+abs_tree=$(cd "$tree" && pwd)
+abs_server_dir=$(cd "$server_dir" && pwd)
+
+cat > "$server_dir/config/config.json" <<EOF
+{
+    "api_port": $BENCH_PORT,
+    "thread_pool_size": 0,
+    "use_epoll": true,
+    "mirror_directory": "$abs_tree",
+    "cache_db_path": "$abs_server_dir/cache/cache.db",
+    "cache_expiry_time": 3600,
+    "snapshot_path": "",
+    "scan_interval": 0,
+    "watch_mode": false,
+    "scan_threads": 0,
+    "checksum_threads": 0,
+    "enable_logging": true,
+    "log_file_path": "$abs_server_dir/server.log",
+    "debug_mode": false
+}
+EOF
+
+echo "Starting server on port $BENCH_PORT" >&2
+server_bin=$(cd "$(dirname "$SERVER")" && pwd)/$(basename "$SERVER")
+(cd "$server_dir" && exec "$server_bin") >"$server_dir/stdout.log" 2>&1 &
+server_pid=$!
+
+waited=0
+until "$BENCH_BUILD/http_bench" 127.0.0.1 "$BENCH_PORT" /api/categories \
+        --concurrency 1 --duration 0.1 2>/dev/null | grep -q '"errors":0'; do
+    waited=$((waited + 1))
+    if [ "$waited" -gt 100 ] || ! kill -0 "$server_pid" 2>/dev/null; then
+        echo "Server did not come up; see $server_dir/stdout.log" >&2
+        exit 1
+    fi
+    sleep 0.2
+done
+
+http_run() {
+    echo "Load: $1 ($2)" >&2
+    "$BENCH_BUILD/http_bench" 127.0.0.1 "$BENCH_PORT" "$1" \
+        --concurrency "$BENCH_CONCURRENCY" --duration "$BENCH_DURATION" \
+        --accept-encoding "$2"
+}
+
+listing=$(http_run /api/mirror identity)
+listing_gzip=$(http_run /api/mirror gzip)
+page=$(http_run "/api/mirror?sort=modified&order=desc&limit=100" identity)
+download=$(http_run /download/category-00/bench-download.iso identity)
+
+commit=$(git rev-parse --short HEAD 2>/dev/null || echo unknown)
+
+cat > "$BENCH_OUTPUT" <<EOF
+{
+  "commit": "$commit",
+  "timestamp": "$(date -u +%Y-%m-%dT%H:%M:%SZ)",
+  "host": {"cpus": $(getconf _NPROCESSORS_ONLN), "kernel": "$(uname -r)"},
+  "tree": $tree_json,
+  "scan": $scan_json,
+  "http": [
+    $listing,
+    $listing_gzip,
+    $page,
+    $download
+  ]
+}
+EOF
+
+echo "Results written to $BENCH_OUTPUT" >&2
@@ -0,0 +1,122 @@
+/*
+ * Times oim_rescan_mirror_directory over a tree built by gen_tree.
+ *
+ * Usage: scan_bench <root> [--threads 1,2,4] [--iterations N]
+ *
+ * Each thread count gets a fresh Mirror manager whose initial scan
+ * serves as warm-up; the page cache is warm for every timed run. The
+ * full cost is measured, including building and publishing the snapshot.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "config.h"
+#include "imgMgr.h"
+
+static double now_ms() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (double)now.tv_sec * 1e3 + (double)now.tv_nsec / 1e6;
+}
+
+static int compare_doubles(const void *a, const void *b) {
+    double x = *(const double *)a;
+    double y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+int main(int argc, char **argv) {
+    const char *threads = "1,2,4,8";
+    int iterations = 5;
+
+    if (argc < 2) {
+        fprintf(stderr, "usage: %s <root> [--threads 1,2,4] [--iterations N]\n", argv[0]);
+        return 2;
+    }
+
+    for (int i = 2; i + 1 < argc; i += 2) {
+        if (strcmp(argv[i], "--threads") == 0) {
+            threads = argv[i + 1];
+        } else if (strcmp(argv[i], "--iterations") == 0) {
+            iterations = atoi(argv[i + 1]);
+        } else {
+            fprintf(stderr, "unknown option: %s\n", argv[i]);
+            return 2;
+        }
+    }
+
+    if (iterations < 1) {
+        iterations = 1;
+    }
+
+    double *samples = calloc((size_t)iterations, sizeof(double));
+    if (samples == NULL) {
+        return 1;
+    }
+
+    OIMConfig config;
+    memset(&config, 0, sizeof(config));
+    config.mirror_directory = argv[1];
+    config.recursive_scan = true;
+    config.scan_interval = 0;
+
+    printf("{\"benchmark\":\"scan\",\"root\":\"%s\",\"iterations\":%d,\"results\":[",
+           argv[1], iterations);
+
+    const char *cursor = threads;
+    bool first = true;
+
+    while (*cursor) {
+        config.scan_threads = atoi(cursor);
+        if (config.scan_threads < 1) {
+            config.scan_threads = 1;
+        }
+
+        if (oim_init_mirror_manager(&config) != 0) {
+            fprintf(stderr, "failed to scan %s\n", argv[1]);
+            return 1;
+        }
+
+        size_t entries = 0;
+        OIMMirrorSnapshot *snapshot = oim_get_mirror_snapshot();
+        if (snapshot) {
+            entries = snapshot->entry_count;
+            oim_snapshot_release(snapshot);
+        }
+
+        double total = 0;
+        for (int i = 0; i < iterations; i++) {
+            double started = now_ms();
+            if (oim_rescan_mirror_directory() != 0) {
+                fprintf(stderr, "rescan failed\n");
+                return 1;
+            }
+            samples[i] = now_ms() - started;
+            total += samples[i];
+        }
+
+        oim_cleanup_mirror_manager();
+
+        qsort(samples, (size_t)iterations, sizeof(double), compare_doubles);
+        double median = samples[iterations / 2];
+
+        printf("%s{\"threads\":%d,\"entries\":%zu,\"min_ms\":%.3f,\"median_ms\":%.3f,"
+               "\"mean_ms\":%.3f,\"max_ms\":%.3f,\"entries_per_sec\":%.0f}",
+               first ? "" : ",", config.scan_threads, entries,
+               samples[0], median, total / iterations, samples[iterations - 1],
+               median > 0 ? (double)entries / (median / 1e3) : 0.0);
+        fflush(stdout);
+        first = false;
+
+        cursor += strcspn(cursor, ",");
+        if (*cursor == ',') {
+            cursor++;
+        }
+    }
+
+    printf("]}\n");
+    free(samples);
+    return 0;
+}
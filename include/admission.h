@@ -0,0 +1,61 @@
+#ifndef OIM_ADMISSION_H
+#define OIM_ADMISSION_H
+
+#include <microhttpd.h>
+#include <arpa/inet.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* A limit of 0 disables it. */
+typedef struct {
+    int max_downloads;
+    int max_client_downloads;
+    int queue_length;
+    int queue_timeout;
+    int retry_after;
+} OIMAdmissionConfig;
+
+typedef enum {
+    OIM_ADMISSION_ADMITTED,
+    OIM_ADMISSION_QUEUED,
+    OIM_ADMISSION_REJECTED
+} OIMAdmissionResult;
+
+typedef enum {
+    OIM_TICKET_NEW,
+    OIM_TICKET_QUEUED,
+    OIM_TICKET_ADMITTED,
+    OIM_TICKET_EXPIRED,
+    OIM_TICKET_DONE
+} OIMTicketState;
+
+/* Lives with the request, from the first handler call until it completes. */
+typedef struct OIMAdmissionTicket {
+    struct MHD_Connection *connection;
+    char client_ip[INET6_ADDRSTRLEN];
+    OIMTicketState state;
+    uint64_t queued_ns;
+    struct OIMAdmissionTicket *next;
+} OIMAdmissionTicket;
+
+int oim_admission_init(const OIMAdmissionConfig *config);
+void oim_admission_stop();
+
+/*
+ * Called from the access handler for each download. QUEUED means the
+ * connection has been suspended; MHD calls the handler again once it is
+ * resumed, and the ticket then says whether it was admitted or expired.
+ */
+OIMAdmissionResult oim_admission_enter(
+    OIMAdmissionTicket *ticket,
+    struct MHD_Connection *connection,
+    const char *client_ip
+);
+
+/* Releases the ticket's slot, if any, and admits the next queued download. */
+void oim_admission_leave(OIMAdmissionTicket *ticket);
+
+int oim_admission_retry_after();
+void oim_admission_counts(size_t *downloads, size_t *queued, uint64_t *rejected);
+
+#endif
@@ -3,8 +3,10 @@
 
 #include <microhttpd.h>
 #include <stdbool.h>
+#include <stdint.h>
 
 #include "config.h"
+#include "snapshot.h"
 
 typedef enum MHD_Result (*OIMAPIRequestHandler)(
     void *cls, 
@@ -19,6 +21,27 @@ typedef enum MHD_Result (*OIMAPIRequestHandler)(
 
 typedef struct {
     int port;
+    int thread_pool_size;
+    bool use_epoll;
+    int connection_limit;
+    int per_ip_connection_limit;
+    int connection_timeout;
+    uint64_t download_rate_limit;
+    uint64_t client_rate_limit;
+    bool public_transfers;
+    int max_downloads;
+    int max_client_downloads;
+    int download_queue_length;
+    int download_queue_timeout;
+    int retry_after;
+    bool use_io_uring;
+    int io_uring_queue_depth;
+    int io_uring_buffers;
+    int io_uring_buffer_size;
+    int fd_cache_size;
+    int event_keepalive;
+    int max_event_subscribers;
+    int long_poll_timeout;
 } OIMAPIServerConfig;
 
 
@@ -46,4 +69,13 @@ int send_oim_json_response(
     int status_code
 );
 
+/* Takes ownership of the caller's snapshot reference. */
+int send_oim_snapshot_response(
+    struct MHD_Connection *connection,
+    OIMMirrorSnapshot *snapshot,
+    const OIMSnapshotBody *body,
+    OIMContentEncoding encoding,
+    int status_code
+);
+
 #endif
\ No newline at end of file
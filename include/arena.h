@@ -0,0 +1,24 @@
+#ifndef OIM_ARENA_H
+#define OIM_ARENA_H
+
+#include <stddef.h>
+
+typedef struct OIMArenaChunk OIMArenaChunk;
+
+/*
+ * Bump allocator for data that lives exactly as long as one catalog
+ * generation. Nothing is freed individually; the whole arena goes at once.
+ */
+typedef struct {
+    OIMArenaChunk *head;
+    size_t chunk_size;
+    size_t bytes_used;
+} OIMArena;
+
+void oim_arena_init(OIMArena *arena, size_t chunk_size);
+void* oim_arena_alloc(OIMArena *arena, size_t size);
+char* oim_arena_strndup(OIMArena *arena, const char *str, size_t length);
+void oim_arena_adopt(OIMArena *arena, OIMArena *other);
+void oim_arena_free(OIMArena *arena);
+
+#endif
@@ -0,0 +1,24 @@
+#ifndef OIM_BUFFER_H
+#define OIM_BUFFER_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+typedef struct {
+    char *data;
+    size_t length;
+    size_t capacity;
+    bool failed;
+} OIMBuffer;
+
+void oim_buffer_init(OIMBuffer *buffer, size_t initial_capacity);
+void oim_buffer_free(OIMBuffer *buffer);
+char* oim_buffer_detach(OIMBuffer *buffer, size_t *length);
+
+void oim_buffer_append(OIMBuffer *buffer, const char *data, size_t length);
+void oim_buffer_append_str(OIMBuffer *buffer, const char *str);
+void oim_buffer_appendf(OIMBuffer *buffer, const char *format, ...)
+    __attribute__((format(printf, 2, 3)));
+void oim_buffer_append_json_string(OIMBuffer *buffer, const char *str);
+
+#endif
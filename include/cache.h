@@ -3,9 +3,11 @@
 
 #include <sqlite3.h>
 #include <stdbool.h>
-#include <json-c/json.h>
 #include <time.h>
 
+#include "catalog.h"
+#include "checksum.h"
+
 typedef struct {
     char *db_path;          
     int cache_expiry_time;  
@@ -19,12 +21,27 @@ typedef struct {
 int oim_init_cache(OIMMirrorCacheConfig *config);
 void oim_close_cache();
 
-int oim_cache_store_mirror_list(json_object *mirror_list);
-json_object* oim_cache_get_mirror_list();
+int oim_cache_store_mirror_catalog(
+    const OIMMirrorCatalog *previous,
+    const OIMMirrorCatalog *current
+);
+OIMMirrorCatalog* oim_cache_get_mirror_catalog(
+    const OIMCatalogRoot *roots,
+    size_t root_count
+);
+OIMMirrorCatalog* oim_cache_load_mirror_catalog(
+    const OIMCatalogRoot *roots,
+    size_t root_count
+);
 bool oim_is_cache_valid();
 
+typedef void (*OIMDigestsLoadCallback)(void *ctx, const OIMFileDigests *digests);
+
+int oim_cache_store_digests(const OIMFileDigests *digests);
+int oim_cache_load_digests(OIMDigestsLoadCallback callback, void *ctx);
+int oim_cache_prune_digests();
+
 int oim_create_cache_schema(sqlite3 *db);
 int64_t oim_get_current_timestamp();
-void oim_cleanup_old_cache_entries();
 
 #endif 
\ No newline at end of file
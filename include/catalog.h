@@ -0,0 +1,154 @@
+#ifndef OIM_CATALOG_H
+#define OIM_CATALOG_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+#include <json-c/json.h>
+
+#include "arena.h"
+#include "buffer.h"
+
+/*
+ * A directory whose files appear in the catalog under prefix, which is
+ * empty or a relative path without leading or trailing slashes. Roots
+ * must not overlap.
+ */
+typedef struct {
+    const char *directory;
+    const char *prefix;
+    size_t directory_length;
+    size_t prefix_length;
+} OIMCatalogRoot;
+
+/*
+ * All strings point into the owning catalog's arena. path is the file's
+ * location on disk; relative_path is the catalog path clients see, i.e.
+ * the root's prefix followed by the part of path below the root.
+ */
+typedef struct {
+    const char *filename;
+    const char *path;
+    const char *relative_path;
+    const char *category;
+    uint32_t category_id;
+    uint32_t root_id;
+    uint32_t relative_offset;
+    long long file_size;
+    time_t modified_time;
+    uint64_t inode;
+    uint64_t device;
+
+    /* Hex digests, NULL until the checksum engine has hashed the file. */
+    const char *sha256;
+    const char *sha512;
+    const char *md5;
+} OIMMirrorEntry;
+
+typedef enum {
+    OIM_CATALOG_SORT_PATH,
+    OIM_CATALOG_SORT_NAME,
+    OIM_CATALOG_SORT_SIZE,
+    OIM_CATALOG_SORT_MODIFIED,
+    OIM_CATALOG_SORT_COUNT
+} OIMCatalogSort;
+
+typedef struct {
+    uint32_t start;
+    uint32_t count;
+    long long total_size;
+} OIMCategoryIndex;
+
+/*
+ * One scan generation of the catalog: a contiguous, path-sorted entry
+ * array plus interned category names, all backed by a single arena.
+ */
+typedef struct {
+    OIMArena arena;
+
+    /* Directories and prefixes are normalized copies in the arena. */
+    OIMCatalogRoot *roots;
+    size_t root_count;
+
+    /* The roots as one string, equal for catalogs of the same configuration. */
+    const char *layout;
+    size_t layout_length;
+
+    OIMMirrorEntry *entries;
+    size_t count;
+    size_t capacity;
+
+    const char **categories;
+    size_t category_count;
+
+    /* Read-only file mapping that borrowed entry paths point into, if any. */
+    void *mapping;
+    size_t mapping_size;
+
+    /*
+     * Entry indexes per sort key, built by oim_catalog_finalize. The
+     * category_order arrays group the same orderings by category, with
+     * category_index[id] giving each category's slice and totals.
+     * category_by_name holds category ids sorted by name.
+     */
+    uint32_t *order[OIM_CATALOG_SORT_COUNT];
+    uint32_t *category_order[OIM_CATALOG_SORT_COUNT];
+    OIMCategoryIndex *category_index;
+    uint32_t *category_by_name;
+
+    /*
+     * Open-addressed relative path lookup, also built by finalize: each
+     * slot holds the path hash in the high half and entry index + 1 in
+     * the low half, 0 when empty. path_index_mask is slots - 1.
+     */
+    uint64_t *path_index;
+    size_t path_index_mask;
+} OIMMirrorCatalog;
+
+OIMMirrorCatalog* oim_catalog_create(const OIMCatalogRoot *roots, size_t root_count);
+void oim_catalog_free(OIMMirrorCatalog *catalog);
+
+int oim_catalog_add(
+    OIMMirrorCatalog *catalog,
+    const char *full_path,
+    long long file_size,
+    time_t modified_time,
+    uint64_t inode,
+    uint64_t device
+);
+int oim_catalog_add_borrowed(
+    OIMMirrorCatalog *catalog,
+    const char *path,
+    long long file_size,
+    time_t modified_time,
+    uint64_t inode,
+    uint64_t device
+);
+int oim_catalog_merge(OIMMirrorCatalog *catalog, OIMMirrorCatalog *other);
+int oim_catalog_finalize(OIMMirrorCatalog *catalog);
+
+/* Whether path lies under one of the catalog's roots. */
+bool oim_catalog_has_root_for(const OIMMirrorCatalog *catalog, const char *path);
+
+const char* oim_catalog_relative_path(const OIMMirrorEntry *entry);
+const char* oim_catalog_root_path(const OIMMirrorEntry *entry);
+
+const OIMMirrorEntry* oim_catalog_find(
+    const OIMMirrorCatalog *catalog,
+    const char *relative_path
+);
+
+int oim_catalog_find_category(const OIMMirrorCatalog *catalog, const char *name);
+
+void oim_catalog_append_entry_json(OIMBuffer *buffer, const OIMMirrorEntry *entry);
+char* oim_catalog_serialize(const OIMMirrorCatalog *catalog, size_t *length);
+char* oim_catalog_serialize_category(
+    const OIMMirrorCatalog *catalog,
+    uint32_t category_id,
+    size_t *length
+);
+char* oim_catalog_serialize_categories(const OIMMirrorCatalog *catalog, size_t *length);
+json_object* oim_catalog_to_json(const OIMMirrorCatalog *catalog);
+
+#endif
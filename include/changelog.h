@@ -0,0 +1,44 @@
+#ifndef OIM_CHANGELOG_H
+#define OIM_CHANGELOG_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "catalog.h"
+
+/*
+ * Bounded in-memory log of the per-generation differences between
+ * published catalogs, served by /api/changes. Generations only
+ * count up within one process; epoch tells clients that the server
+ * restarted and their cursor belongs to an older numbering.
+ */
+
+/* capacity is the number of changes retained across all generations; 0 disables the log. */
+int oim_changelog_init(size_t capacity);
+void oim_changelog_cleanup();
+
+/*
+ * Records the changes from previous to current as generation. A NULL
+ * previous, or a delta larger than the whole log, starts the log over
+ * at generation.
+ */
+void oim_changelog_record(
+    const OIMMirrorCatalog *previous,
+    const OIMMirrorCatalog *current,
+    uint64_t generation
+);
+
+uint64_t oim_changelog_epoch();
+
+/*
+ * Builds the JSON body answering since, or NULL on allocation failure.
+ * Clients whose cursor the log no longer reaches, or whose epoch is not
+ * this process's, are told to resync from the full listing.
+ */
+char* oim_changelog_since(
+    uint64_t since,
+    const uint64_t *epoch,
+    size_t *length
+);
+
+#endif
@@ -0,0 +1,59 @@
+#ifndef OIM_CHECKSUM_H
+#define OIM_CHECKSUM_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "catalog.h"
+
+typedef enum {
+    OIM_DIGEST_SHA256,
+    OIM_DIGEST_SHA512,
+    OIM_DIGEST_MD5,
+    OIM_DIGEST_COUNT
+} OIMDigestAlgorithm;
+
+/* Long enough for a hex SHA-512 and its terminator. */
+#define OIM_DIGEST_HEX_MAX 129
+
+/* A file version: any change to these four means the digests are stale. */
+typedef struct {
+    uint64_t device;
+    uint64_t inode;
+    long long size;
+    time_t modified;
+} OIMFileKey;
+
+typedef struct {
+    OIMFileKey key;
+    /* Empty strings for algorithms that have not been computed. */
+    char hex[OIM_DIGEST_COUNT][OIM_DIGEST_HEX_MAX];
+} OIMFileDigests;
+
+typedef struct {
+    int thread_count;
+    unsigned int algorithms;
+} OIMChecksumConfig;
+
+typedef int (*OIMDigestsReadyCallback)(void);
+
+const char* oim_digest_name(OIMDigestAlgorithm algorithm);
+const char* oim_digest_sums_name(OIMDigestAlgorithm algorithm);
+unsigned int oim_parse_digest_algorithms(const char *list);
+
+int oim_checksum_init(const OIMChecksumConfig *config);
+int oim_checksum_start(OIMDigestsReadyCallback on_ready);
+void oim_checksum_stop();
+unsigned int oim_checksum_algorithms();
+
+void oim_checksum_annotate(OIMMirrorCatalog *catalog);
+
+char* oim_checksum_sums(
+    const OIMMirrorCatalog *catalog,
+    uint32_t category_id,
+    OIMDigestAlgorithm algorithm,
+    size_t *length
+);
+
+#endif
@@ -0,0 +1,27 @@
+#ifndef OIM_COMPRESS_H
+#define OIM_COMPRESS_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+typedef enum {
+    OIM_ENCODING_IDENTITY,
+    OIM_ENCODING_GZIP,
+    OIM_ENCODING_ZSTD,
+    OIM_ENCODING_BROTLI,
+    OIM_ENCODING_COUNT
+} OIMContentEncoding;
+
+const char* oim_encoding_name(OIMContentEncoding encoding);
+const char* oim_encoding_etag_suffix(OIMContentEncoding encoding);
+bool oim_encoding_supported(OIMContentEncoding encoding);
+
+int oim_compress_buffer(
+    OIMContentEncoding encoding,
+    const char *input,
+    size_t input_size,
+    char **output,
+    size_t *output_size
+);
+
+#endif
@@ -4,19 +4,59 @@
 #include <stdbool.h>
 #include <json-c/json.h>
 
+/* An additional directory served alongside mirror_directory. */
+typedef struct {
+    char *path;
+    char *prefix;
+    bool recursive;
+    int scan_interval;
+} OIMMirrorRootConfig;
+
 typedef struct {
 
     int api_port;           
     char *mirror_directory;    
+    OIMMirrorRootConfig *mirror_roots;
+    int mirror_root_count;
+
+    int thread_pool_size;
+    bool use_epoll;
+    int connection_limit;
+    int per_ip_connection_limit;
+    int connection_timeout;
+    int download_rate_limit;
+    int client_rate_limit;
+    bool public_transfers;
+    int max_downloads;
+    int max_client_downloads;
+    int download_queue_length;
+    int download_queue_timeout;
+    int retry_after;
+    bool use_io_uring;
+    int io_uring_queue_depth;
+    int io_uring_buffers;
+    int io_uring_buffer_size;
+    int fd_cache_size;
+    int event_keepalive;
+    int max_event_subscribers;
+    int long_poll_timeout;
 
     char *cache_db_path;    
     int cache_expiry_time;  
+    char *snapshot_path;
+    int change_log_size;
 
     int scan_interval;      
     bool recursive_scan;    
+    bool watch_mode;
+    int scan_threads;
+
+    int checksum_threads;
+    char *checksum_algorithms;
 
     bool enable_logging;    
     char *log_file_path;    
+    char *log_overflow_policy;
 
     bool debug_mode;        
 } OIMConfig;
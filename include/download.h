@@ -0,0 +1,37 @@
+#ifndef OIM_DOWNLOAD_H
+#define OIM_DOWNLOAD_H
+
+#include <microhttpd.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+
+#define OIM_MAX_BYTE_RANGES 16
+
+typedef struct {
+    uint64_t start;
+    uint64_t length;
+} OIMByteRange;
+
+typedef enum {
+    OIM_RANGE_NONE,
+    OIM_RANGE_SATISFIABLE,
+    OIM_RANGE_UNSATISFIABLE
+} OIMRangeResult;
+
+OIMRangeResult oim_parse_range_header(
+    const char *header,
+    uint64_t file_size,
+    OIMByteRange *ranges,
+    int *range_count
+);
+
+/* file_path is relative to the mirror and must be in the current catalog. */
+enum MHD_Result oim_send_download_response(
+    struct MHD_Connection *connection,
+    const char *file_path,
+    const char *client_ip,
+    uint64_t *body_length
+);
+
+#endif
@@ -0,0 +1,75 @@
+#ifndef OIM_EVENTS_H
+#define OIM_EVENTS_H
+
+#include <microhttpd.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* A limit of 0 disables it. */
+typedef struct {
+    int keepalive_interval;
+    int max_subscribers;
+    int max_wait;
+} OIMEventsConfig;
+
+typedef enum {
+    OIM_WAIT_NEW,
+    OIM_WAIT_SUSPENDED,
+    OIM_WAIT_DONE
+} OIMWaitState;
+
+typedef enum {
+    OIM_WAIT_READY,
+    OIM_WAIT_QUEUED,
+    OIM_WAIT_REJECTED
+} OIMWaitResult;
+
+/* A long-poll request parked until a newer generation or its deadline. */
+typedef struct OIMEventWaiter {
+    struct MHD_Connection *connection;
+    OIMWaitState state;
+    uint64_t since;
+    uint64_t deadline_ns;
+    struct OIMEventWaiter *prev;
+    struct OIMEventWaiter *next;
+} OIMEventWaiter;
+
+int oim_events_init(const OIMEventsConfig *config);
+void oim_events_stop();
+
+/*
+ * Called by the mirror manager once a generation is visible. Serializes
+ * one event that every stream subscriber is sent from, and wakes the
+ * subscribers and long-poll requests waiting for it.
+ */
+void oim_events_publish(uint64_t generation, size_t entries);
+
+/*
+ * Called from the access handler for a long-poll listing. QUEUED means the
+ * connection has been suspended until a generation after since is
+ * published or wait_seconds (capped by max_wait) pass; MHD then calls the
+ * handler again, which gets READY and answers.
+ */
+OIMWaitResult oim_events_wait(
+    OIMEventWaiter *waiter,
+    struct MHD_Connection *connection,
+    uint64_t since,
+    uint64_t wait_seconds
+);
+
+void oim_events_cancel_wait(OIMEventWaiter *waiter);
+
+/*
+ * Builds a text/event-stream response that starts with the current
+ * generation unless last_event_id already names it. NULL when the
+ * subscriber limit is reached or streaming is stopped.
+ */
+struct MHD_Response* oim_events_create_stream(
+    struct MHD_Connection *connection,
+    const char *last_event_id
+);
+
+void oim_events_counts(size_t *subscribers, size_t *waiters);
+
+#endif
@@ -0,0 +1,67 @@
+#ifndef OIM_FDCACHE_H
+#define OIM_FDCACHE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "catalog.h"
+
+/*
+ * An open, read-only descriptor for one mirror file, shared by every
+ * response serving it. Responses read with explicit offsets (pread or
+ * sendfile on a dup), so the shared file position is never used.
+ * The identity fields are those of the fd at open time.
+ */
+typedef struct OIMCachedFile {
+    int fd;
+    uint64_t device;
+    uint64_t inode;
+    uint64_t size;
+    time_t modified;
+
+    int refcount;
+    bool cached;
+    uint64_t generation;
+    char *path;
+
+    struct OIMCachedFile *hash_next;
+    struct OIMCachedFile *lru_prev;
+    struct OIMCachedFile *lru_next;
+} OIMCachedFile;
+
+/*
+ * Files are opened beneath the mirror root their catalog entry came
+ * from, held as a directory fd, with openat2 RESOLVE_BENEATH where the
+ * kernel supports it. capacity is the number of files kept open; 0
+ * opens every download afresh.
+ */
+int oim_fdcache_init(const OIMCatalogRoot *roots, size_t root_count, size_t capacity);
+void oim_fdcache_cleanup();
+
+/*
+ * Returns a referenced descriptor for the catalog entry served as
+ * relative_path, or NULL with errno set. A cached descriptor is reused
+ * while it still matches the file (fstat) and, once the snapshot
+ * generation has moved on, the catalog entry; otherwise it is dropped
+ * and the file reopened.
+ * A file that no longer matches its entry is opened but not cached.
+ */
+OIMCachedFile* oim_fdcache_open(
+    const char *relative_path,
+    const OIMMirrorEntry *entry,
+    uint64_t generation
+);
+
+/*
+ * Called when generation is published: closes cached files the catalog
+ * no longer lists, or lists with a different identity, so a deleted or
+ * replaced file does not stay open until its path is requested again.
+ */
+void oim_fdcache_invalidate(const OIMMirrorCatalog *catalog, uint64_t generation);
+
+OIMCachedFile* oim_fdcache_retain(OIMCachedFile *file);
+void oim_fdcache_release(OIMCachedFile *file);
+
+#endif
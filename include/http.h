@@ -0,0 +1,59 @@
+#ifndef OIM_HTTP_H
+#define OIM_HTTP_H
+
+#include <microhttpd.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "compress.h"
+
+#define OIM_ETAG_MAX_LEN 64
+#define OIM_HTTP_DATE_MAX_LEN 32
+
+#define OIM_LISTING_CACHE_CONTROL "public, no-cache"
+#define OIM_DOWNLOAD_CACHE_CONTROL "public, max-age=3600"
+
+time_t oim_parse_http_date(const char *value);
+void oim_format_http_date(time_t value, char *buffer, size_t buffer_size);
+
+void oim_format_file_etag(
+    uint64_t inode,
+    uint64_t size,
+    time_t modified,
+    char *buffer,
+    size_t buffer_size
+);
+
+OIMContentEncoding oim_negotiate_encoding(
+    const char *accept_encoding,
+    unsigned int available_mask
+);
+
+bool oim_etag_list_matches(const char *header, const char *etag);
+
+bool oim_request_not_modified(
+    struct MHD_Connection *connection,
+    const char *etag,
+    time_t last_modified
+);
+
+/* Whether the request carries If-None-Match or If-Modified-Since. */
+bool oim_request_conditional(struct MHD_Connection *connection);
+
+void oim_add_validator_headers(
+    struct MHD_Response *response,
+    const char *etag,
+    time_t last_modified,
+    const char *cache_control
+);
+
+enum MHD_Result oim_send_not_modified(
+    struct MHD_Connection *connection,
+    const char *etag,
+    time_t last_modified,
+    const char *cache_control
+);
+
+#endif
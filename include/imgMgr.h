@@ -2,37 +2,66 @@
 #define OIM_MIRROR_MANAGER_H
 
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
 #include <json-c/json.h>
 #include "config.h"
+#include "snapshot.h"
+
+typedef enum {
+    OIM_MIRROR_CHANGE_UPSERT,
+    OIM_MIRROR_CHANGE_REMOVE,
+    OIM_MIRROR_CHANGE_REMOVE_TREE
+} OIMMirrorChangeType;
+
+typedef struct {
+    OIMMirrorChangeType type;
+    char *path;
+} OIMMirrorChange;
 
 typedef struct {
-    char *filename;         
-    char *path;             
-    char *category;         
-    char *subcategory;      
-    long long file_size;    
-    time_t modified_time;   
-} OIMMirrorEntry;
+    char *directory;
+    char *prefix;
+    bool recursive;
+    int scan_interval;
+    uint64_t device;
+    size_t group;
+    time_t last_scan;
+} OIMMirrorRoot;
 
+/* roots[0] is mirror_directory; catalog_roots mirrors roots for catalog creation. */
 typedef struct {
-    char *base_directory;   
-    bool recursive_scan;    
-    int scan_interval;      
+    OIMMirrorRoot *roots;
+    OIMCatalogRoot *catalog_roots;
+    size_t root_count;
+    int scan_threads;
+    bool watch_mode;
+    char *snapshot_path;
 } OIMMirrorManagerConfig;
 
 int oim_init_mirror_manager(OIMConfig *config);
 void oim_cleanup_mirror_manager();
 
 json_object* oim_get_mirror_list();
+OIMMirrorSnapshot* oim_get_mirror_snapshot();
+const OIMCatalogRoot* oim_get_mirror_roots(size_t *count);
 int oim_rescan_mirror_directory();
 
+int oim_start_mirror_scanner();
+void oim_request_mirror_rescan();
+void oim_stop_mirror_scanner();
+
+int oim_apply_mirror_changes(const OIMMirrorChange *changes, size_t count);
+int oim_refresh_mirror_digests();
+bool oim_is_mirror_image(const char *filename);
+
 void oim_free_mirror_entries();
-char* oim_generate_category_from_path(const char *full_path, const char *base_dir);
 
 int oim_scan_directory(
     const char *directory, 
-    const char *base_directory, 
-    json_object *mirror_list
+    bool recursive, 
+    OIMMirrorCatalog *catalog
 );
 
 #endif 
\ No newline at end of file
@@ -16,8 +16,21 @@ typedef enum {
     LOG_ERROR
 } LogLevel;
 
-int init_logging(const char *log_file_path, LogLevel level, bool enable_logging);
+/* What log_message does when the writer thread has fallen a full buffer behind. */
+typedef enum {
+    LOG_OVERFLOW_DROP,
+    LOG_OVERFLOW_BLOCK
+} LogOverflowPolicy;
+
+int init_logging(
+    const char *log_file_path,
+    LogLevel level,
+    bool enable_logging,
+    LogOverflowPolicy overflow_policy
+);
 void log_message(LogLevel level, const char *format, ...);
 void close_logging(void);
 
-#endif
\ No newline at end of file
+LogOverflowPolicy parse_log_overflow_policy(const char *name);
+
+#endif
@@ -0,0 +1,47 @@
+#ifndef OIM_METRICS_H
+#define OIM_METRICS_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+typedef enum {
+    OIM_ROUTE_MIRROR,
+    OIM_ROUTE_CATEGORIES,
+    OIM_ROUTE_CATEGORY,
+    OIM_ROUTE_CHECKSUMS,
+    OIM_ROUTE_DOWNLOAD,
+    OIM_ROUTE_METRICS,
+    OIM_ROUTE_TRANSFERS,
+    OIM_ROUTE_CHANGES,
+    OIM_ROUTE_EVENTS,
+    OIM_ROUTE_OTHER,
+    OIM_ROUTE_COUNT
+} OIMRoute;
+
+/* Where oim_get_mirror_snapshot found the listing it returned. */
+typedef enum {
+    OIM_LIST_LOOKUP_SNAPSHOT,
+    OIM_LIST_LOOKUP_CACHE,
+    OIM_LIST_LOOKUP_SCAN,
+    OIM_LIST_LOOKUP_COUNT
+} OIMListLookup;
+
+uint64_t oim_metrics_now_ns();
+
+/*
+ * Hot-path recorders. Each thread writes only to its own shard, so these
+ * never contend; shards are summed when /metrics is scraped.
+ */
+void oim_metrics_record_request(OIMRoute route, uint64_t elapsed_ns);
+void oim_metrics_record_download(uint64_t bytes, uint64_t elapsed_ns, bool completed);
+void oim_metrics_record_list_lookup(OIMListLookup source);
+void oim_metrics_connection_opened();
+void oim_metrics_connection_closed();
+
+void oim_metrics_record_scan(uint64_t elapsed_ns, size_t entries);
+void oim_metrics_set_snapshot(uint64_t generation, size_t entries);
+
+char* oim_metrics_render(size_t *length);
+
+#endif
@@ -0,0 +1,46 @@
+#ifndef OIM_QUERY_H
+#define OIM_QUERY_H
+
+#include <microhttpd.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "catalog.h"
+#include "snapshot.h"
+
+#define OIM_QUERY_DEFAULT_LIMIT 100
+#define OIM_QUERY_MAX_LIMIT 10000
+
+typedef struct {
+    const char *category;
+    const char *prefix;
+    long long min_size;     /* -1 when unset */
+    long long max_size;     /* -1 when unset */
+    OIMCatalogSort sort;
+    bool descending;
+    size_t limit;
+    size_t offset;
+} OIMMirrorQuery;
+
+bool oim_mirror_query_present(struct MHD_Connection *connection);
+
+int oim_mirror_query_parse(
+    struct MHD_Connection *connection,
+    OIMMirrorQuery *query,
+    const char **error
+);
+
+char* oim_mirror_query_execute(
+    const OIMMirrorSnapshot *snapshot,
+    const OIMMirrorQuery *query,
+    size_t *length
+);
+
+void oim_mirror_query_etag(
+    const OIMMirrorSnapshot *snapshot,
+    const OIMMirrorQuery *query,
+    char *buffer,
+    size_t buffer_size
+);
+
+#endif
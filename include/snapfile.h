@@ -0,0 +1,50 @@
+#ifndef OIM_SNAPFILE_H
+#define OIM_SNAPFILE_H
+
+#include <stdint.h>
+
+#include "catalog.h"
+
+#define OIM_SNAPFILE_MAGIC "OIMSNAP\0"
+#define OIM_SNAPFILE_VERSION 2
+#define OIM_SNAPFILE_BYTE_ORDER 0x01020304u
+
+/*
+ * On-disk layout, host byte order:
+ *
+ *   OIMSnapfileHeader
+ *   OIMSnapfileRecord[entry_count]    path-sorted, fixed size
+ *   string table                      catalog layout, then NUL-terminated paths
+ *
+ * checksum is the CRC-32 of everything after the header.
+ */
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t record_size;
+    uint32_t byte_order;
+    uint32_t base_length;
+    uint64_t entry_count;
+    uint64_t strings_size;
+    int64_t created;
+    uint32_t checksum;
+    uint32_t reserved;
+} OIMSnapfileHeader;
+
+typedef struct {
+    uint32_t path_offset;
+    uint32_t path_length;
+    int64_t file_size;
+    int64_t modified_time;
+    uint64_t inode;
+    uint64_t device;
+} OIMSnapfileRecord;
+
+int oim_snapfile_write(const char *path, const OIMMirrorCatalog *catalog);
+OIMMirrorCatalog* oim_snapfile_load(
+    const char *path,
+    const OIMCatalogRoot *roots,
+    size_t root_count
+);
+
+#endif
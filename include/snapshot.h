@@ -0,0 +1,87 @@
+#ifndef OIM_SNAPSHOT_H
+#define OIM_SNAPSHOT_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "catalog.h"
+#include "compress.h"
+
+/* Compressed bytes, shared by consecutive generations whose body did not change. */
+typedef struct {
+    int refcount;
+    char data[];
+} OIMSnapshotBlob;
+
+typedef struct {
+    char *data;
+    size_t size;
+    char etag[72];
+
+    /* Owns data for compressed variants; NULL for identity, which owns data itself. */
+    OIMSnapshotBlob *blob;
+} OIMSnapshotVariant;
+
+/* One response body, indexed by OIMContentEncoding; data is NULL for unavailable codecs. */
+typedef struct {
+    OIMSnapshotVariant variants[OIM_ENCODING_COUNT];
+} OIMSnapshotBody;
+
+/*
+ * Immutable, pre-serialized view of one catalog generation.
+ * Built once by the scanner and shared by every request that
+ * serves it; the bytes are freed when the last reference drops.
+ */
+typedef struct {
+    int refcount;
+    uint64_t generation;
+    time_t created;
+    size_t entry_count;
+
+    /* False for a warm start, which serves identity bodies until the next publish. */
+    bool compressed;
+
+    OIMSnapshotBody listing;
+    OIMSnapshotBody categories;
+
+    /* Indexed by category_id; each holds that category's slice of the listing. */
+    OIMSnapshotBody *category_bodies;
+
+    /* Owned; entries are sorted by relative path for lookups. */
+    OIMMirrorCatalog *catalog;
+} OIMMirrorSnapshot;
+
+/*
+ * previous, if not NULL, is the generation being replaced; bodies whose
+ * content is unchanged from it reuse its compressed variants. Without
+ * compress only identity bodies are built.
+ */
+OIMMirrorSnapshot* oim_snapshot_create(
+    OIMMirrorCatalog *catalog,
+    uint64_t generation,
+    const OIMMirrorSnapshot *previous,
+    bool compress
+);
+OIMMirrorSnapshot* oim_snapshot_acquire(OIMMirrorSnapshot *snapshot);
+void oim_snapshot_release(OIMMirrorSnapshot *snapshot);
+
+const OIMSnapshotVariant* oim_snapshot_variant(
+    const OIMSnapshotBody *body,
+    OIMContentEncoding encoding
+);
+
+unsigned int oim_snapshot_encodings(const OIMSnapshotBody *body);
+
+const OIMSnapshotBody* oim_snapshot_category_body(
+    const OIMMirrorSnapshot *snapshot,
+    const char *category
+);
+
+const OIMMirrorEntry* oim_snapshot_find_file(
+    const OIMMirrorSnapshot *snapshot,
+    const char *relative_path
+);
+
+#endif
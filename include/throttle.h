@@ -0,0 +1,43 @@
+#ifndef OIM_THROTTLE_H
+#define OIM_THROTTLE_H
+
+#include <microhttpd.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* Limits are in bytes per second; 0 leaves that bucket unlimited. */
+typedef struct {
+    uint64_t global_rate;
+    uint64_t client_rate;
+} OIMThrottleLimits;
+
+int oim_throttle_init(const OIMThrottleLimits *limits);
+void oim_throttle_stop();
+
+/* Takes effect immediately for every shaped transfer, including ones in progress. */
+void oim_throttle_set_limits(const OIMThrottleLimits *limits);
+bool oim_throttle_enabled();
+
+/*
+ * Wraps a content reader in a response whose sends are paced by the
+ * global and per-client token buckets. When a bucket runs dry the
+ * connection is suspended until the pacer thread has refilled enough,
+ * so waiting costs no CPU. free_callback runs once, on the inner cls.
+ */
+struct MHD_Response* oim_throttle_create_response(
+    struct MHD_Connection *connection,
+    const char *client_ip,
+    const char *file_path,
+    uint64_t size,
+    MHD_ContentReaderCallback reader,
+    void *reader_cls,
+    MHD_ContentReaderFreeCallback free_callback
+);
+
+void oim_throttle_counts(size_t *active, size_t *throttled);
+
+/* JSON description of the limits and every shaped transfer. */
+char* oim_throttle_to_json(size_t *length);
+
+#endif
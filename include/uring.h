@@ -0,0 +1,32 @@
+#ifndef OIM_URING_H
+#define OIM_URING_H
+
+#include <microhttpd.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+typedef struct {
+    int queue_depth;
+    int buffer_count;
+    size_t buffer_size;
+} OIMUringConfig;
+
+/*
+ * Optional io_uring read path for downloads (build with WITH_URING=1).
+ * Reads are issued ahead of the client from a shared buffer pool; a
+ * request whose next block is still in flight has its connection
+ * suspended and resumed on completion, so MHD threads never wait on disk.
+ * Returns -1 when io_uring is not compiled in or cannot be set up.
+ */
+int oim_uring_init(const OIMUringConfig *config);
+void oim_uring_stop();
+bool oim_uring_enabled();
+
+/* Takes ownership of fd on success; returns NULL to fall back to another path. */
+void* oim_uring_open(struct MHD_Connection *connection, int fd, uint64_t offset, uint64_t length);
+ssize_t oim_uring_reader(void *cls, uint64_t pos, char *buf, size_t max);
+void oim_uring_close(void *cls);
+
+#endif
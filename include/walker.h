@@ -0,0 +1,43 @@
+#ifndef OIM_WALKER_H
+#define OIM_WALKER_H
+
+#include <stdbool.h>
+#include <sys/stat.h>
+
+typedef bool (*OIMWalkFilter)(const char *name);
+
+typedef void (*OIMWalkCallback)(
+    void *ctx,
+    int worker,
+    const char *full_path,
+    const char *name,
+    const struct stat *file_stat
+);
+
+typedef struct {
+    const char *root;
+    bool recursive;
+    int thread_count;
+    OIMWalkFilter filter;
+    OIMWalkCallback callback;
+    void *ctx;
+} OIMWalkOptions;
+
+typedef struct {
+    long directories;
+    long entries;
+    long stat_calls;
+    long matches;
+} OIMWalkStats;
+
+int oim_walk_directory(const OIMWalkOptions *options, OIMWalkStats *stats);
+
+/*
+ * Stats relative_path under root_fd, following symlinks only while they
+ * stay beneath it (RESOLVE_BENEATH), the same rule downloads are opened
+ * with. Kernels without openat2 follow symlinks anywhere, as downloads
+ * do there too.
+ */
+int oim_walk_stat_beneath(int root_fd, const char *relative_path, struct stat *file_stat);
+
+#endif
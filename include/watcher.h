@@ -0,0 +1,9 @@
+#ifndef OIM_WATCHER_H
+#define OIM_WATCHER_H
+
+#include <stdbool.h>
+
+int oim_start_mirror_watcher(const char *base_directory, bool recursive);
+void oim_stop_mirror_watcher();
+
+#endif
@@ -0,0 +1,344 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <time.h>
+#include <pthread.h>
+#include <microhttpd.h>
+
+#include "admission.h"
+#include "metrics.h"
+#include "logging.h"
+
+#define OIM_ADMISSION_CLIENT_SLOTS 64
+#define OIM_ADMISSION_RESUME_BATCH 64
+
+/* Downloads a client has admitted or queued. */
+typedef struct OIMClientCount {
+    char ip[INET6_ADDRSTRLEN];
+    int downloads;
+    struct OIMClientCount *next;
+} OIMClientCount;
+
+static OIMAdmissionConfig admission_config;
+static pthread_mutex_t admission_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t admission_cond;
+static pthread_t expiry_thread;
+static bool expiry_started = false;
+static bool admission_running = false;
+
+static OIMClientCount *clients[OIM_ADMISSION_CLIENT_SLOTS];
+static OIMAdmissionTicket *queue_head = NULL;
+static OIMAdmissionTicket *queue_tail = NULL;
+static size_t queued_count = 0;
+static size_t in_flight = 0;
+static uint64_t rejected_total = 0;
+
+static unsigned int oim_admission_slot(const char *ip) {
+    unsigned int hash = 2166136261u;
+    for (const char *p = ip; *p; p++) {
+        hash = (hash ^ (unsigned char)*p) * 16777619u;
+    }
+    return hash % OIM_ADMISSION_CLIENT_SLOTS;
+}
+
+static OIMClientCount* oim_admission_client(const char *ip, bool create) {
+    unsigned int slot = oim_admission_slot(ip);
+
+    for (OIMClientCount *client = clients[slot]; client; client = client->next) {
+        if (strcmp(client->ip, ip) == 0) {
+            return client;
+        }
+    }
+
+    if (!create) {
+        return NULL;
+    }
+
+    OIMClientCount *client = calloc(1, sizeof(OIMClientCount));
+    if (client == NULL) {
+        return NULL;
+    }
+
+    snprintf(client->ip, sizeof(client->ip), "%s", ip);
+    client->next = clients[slot];
+    clients[slot] = client;
+    return client;
+}
+
+static void oim_admission_client_release(const char *ip) {
+    OIMClientCount **link = &clients[oim_admission_slot(ip)];
+
+    while (*link && strcmp((*link)->ip, ip) != 0) {
+        link = &(*link)->next;
+    }
+
+    OIMClientCount *client = *link;
+    if (client && --client->downloads <= 0) {
+        *link = client->next;
+        free(client);
+    }
+}
+
+static void oim_admission_unqueue(OIMAdmissionTicket *ticket) {
+    OIMAdmissionTicket **link = &queue_head;
+    OIMAdmissionTicket *previous = NULL;
+
+    while (*link && *link != ticket) {
+        previous = *link;
+        link = &(*link)->next;
+    }
+
+    if (*link == NULL) {
+        return;
+    }
+
+    *link = ticket->next;
+    if (queue_tail == ticket) {
+        queue_tail = previous;
+    }
+    ticket->next = NULL;
+    queued_count--;
+}
+
+/* Hands free slots to the head of the queue. Called with admission_lock held. */
+static size_t oim_admission_promote(struct MHD_Connection **resume) {
+    size_t count = 0;
+
+    while (queue_head && count < OIM_ADMISSION_RESUME_BATCH &&
+           (admission_config.max_downloads <= 0 ||
+            in_flight < (size_t)admission_config.max_downloads)) {
+        OIMAdmissionTicket *ticket = queue_head;
+        oim_admission_unqueue(ticket);
+        ticket->state = OIM_TICKET_ADMITTED;
+        in_flight++;
+        resume[count++] = ticket->connection;
+    }
+
+    return count;
+}
+
+/* Expires queued tickets that have waited since before `cutoff`, oldest first. */
+static size_t oim_admission_expire(uint64_t cutoff, struct MHD_Connection **resume) {
+    size_t count = 0;
+
+    while (queue_head && queue_head->queued_ns <= cutoff &&
+           count < OIM_ADMISSION_RESUME_BATCH) {
+        OIMAdmissionTicket *ticket = queue_head;
+        oim_admission_unqueue(ticket);
+        ticket->state = OIM_TICKET_EXPIRED;
+        oim_admission_client_release(ticket->client_ip);
+        resume[count++] = ticket->connection;
+    }
+
+    return count;
+}
+
+OIMAdmissionResult oim_admission_enter(
+    OIMAdmissionTicket *ticket,
+    struct MHD_Connection *connection,
+    const char *client_ip
+) {
+    pthread_mutex_lock(&admission_lock);
+
+    switch (ticket->state) {
+        case OIM_TICKET_ADMITTED:
+            pthread_mutex_unlock(&admission_lock);
+            return OIM_ADMISSION_ADMITTED;
+
+        case OIM_TICKET_QUEUED:
+            pthread_mutex_unlock(&admission_lock);
+            return OIM_ADMISSION_QUEUED;
+
+        case OIM_TICKET_EXPIRED:
+        case OIM_TICKET_DONE:
+            ticket->state = OIM_TICKET_DONE;
+            rejected_total++;
+            pthread_mutex_unlock(&admission_lock);
+            return OIM_ADMISSION_REJECTED;
+
+        case OIM_TICKET_NEW:
+            break;
+    }
+
+    ticket->connection = connection;
+    snprintf(ticket->client_ip, sizeof(ticket->client_ip), "%s", client_ip);
+
+    OIMClientCount *client = oim_admission_client(client_ip, false);
+    if (!admission_running ||
+        (client && admission_config.max_client_downloads > 0 &&
+         client->downloads >= admission_config.max_client_downloads)) {
+        goto reject;
+    }
+
+    bool admit = admission_config.max_downloads <= 0 ||
+        (queue_head == NULL && in_flight < (size_t)admission_config.max_downloads);
+
+    if (!admit && queued_count >= (size_t)(admission_config.queue_length > 0 ?
+                                           admission_config.queue_length : 0)) {
+        goto reject;
+    }
+
+    if (client == NULL && (client = oim_admission_client(client_ip, true)) == NULL) {
+        goto reject;
+    }
+    client->downloads++;
+
+    if (admit) {
+        ticket->state = OIM_TICKET_ADMITTED;
+        in_flight++;
+        pthread_mutex_unlock(&admission_lock);
+        return OIM_ADMISSION_ADMITTED;
+    }
+
+    ticket->state = OIM_TICKET_QUEUED;
+    ticket->queued_ns = oim_metrics_now_ns();
+    ticket->next = NULL;
+    if (queue_tail) {
+        queue_tail->next = ticket;
+    } else {
+        queue_head = ticket;
+    }
+    queue_tail = ticket;
+    queued_count++;
+
+    /* Suspending under the lock keeps a releasing download from resuming it first. */
+    MHD_suspend_connection(connection);
+    pthread_cond_signal(&admission_cond);
+    pthread_mutex_unlock(&admission_lock);
+    return OIM_ADMISSION_QUEUED;
+
+reject:
+    ticket->state = OIM_TICKET_DONE;
+    rejected_total++;
+    pthread_mutex_unlock(&admission_lock);
+    return OIM_ADMISSION_REJECTED;
+}
+
+void oim_admission_leave(OIMAdmissionTicket *ticket) {
+    struct MHD_Connection *resume[OIM_ADMISSION_RESUME_BATCH];
+    size_t count = 0;
+
+    pthread_mutex_lock(&admission_lock);
+
+    if (ticket->state == OIM_TICKET_ADMITTED) {
+        in_flight--;
+        oim_admission_client_release(ticket->client_ip);
+        count = oim_admission_promote(resume);
+    } else if (ticket->state == OIM_TICKET_QUEUED) {
+        oim_admission_unqueue(ticket);
+        oim_admission_client_release(ticket->client_ip);
+    }
+    ticket->state = OIM_TICKET_DONE;
+
+    pthread_mutex_unlock(&admission_lock);
+
+    for (size_t i = 0; i < count; i++) {
+        MHD_resume_connection(resume[i]);
+    }
+}
+
+static void* oim_admission_expiry_main(void *arg __attribute__((unused))) {
+    struct MHD_Connection *resume[OIM_ADMISSION_RESUME_BATCH];
+    uint64_t timeout_ns = (uint64_t)admission_config.queue_timeout * 1000000000ULL;
+
+    pthread_mutex_lock(&admission_lock);
+
+    while (admission_running) {
+        uint64_t now = oim_metrics_now_ns();
+        size_t count = now >= timeout_ns ? oim_admission_expire(now - timeout_ns, resume) : 0;
+
+        if (count > 0) {
+            pthread_mutex_unlock(&admission_lock);
+            LOG_WARN("Download queue timeout, rejecting %zu waiting request(s)", count);
+            for (size_t i = 0; i < count; i++) {
+                MHD_resume_connection(resume[i]);
+            }
+            pthread_mutex_lock(&admission_lock);
+            continue;
+        }
+
+        if (queue_head == NULL) {
+            pthread_cond_wait(&admission_cond, &admission_lock);
+        } else {
+            uint64_t wake = queue_head->queued_ns + timeout_ns;
+            struct timespec deadline = {
+                .tv_sec = (time_t)(wake / 1000000000ULL),
+                .tv_nsec = (long)(wake % 1000000000ULL)
+            };
+            pthread_cond_timedwait(&admission_cond, &admission_lock, &deadline);
+        }
+    }
+
+    pthread_mutex_unlock(&admission_lock);
+    return NULL;
+}
+
+int oim_admission_init(const OIMAdmissionConfig *config) {
+    admission_config = *config;
+    if (admission_config.retry_after <= 0) {
+        admission_config.retry_after = 1;
+    }
+
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&admission_cond, &attr);
+    pthread_condattr_destroy(&attr);
+
+    admission_running = true;
+
+    /* Queued downloads only need a timer when they can time out. */
+    if (config->max_downloads > 0 && config->queue_length > 0 && config->queue_timeout > 0) {
+        if (pthread_create(&expiry_thread, NULL, oim_admission_expiry_main, NULL) != 0) {
+            LOG_ERROR("Failed to start download queue timer");
+            admission_running = false;
+            return -1;
+        }
+        expiry_started = true;
+    }
+
+    if (config->max_downloads > 0 || config->max_client_downloads > 0) {
+        LOG_INFO("Download admission: %d in flight, %d per client, queue of %d for %d s",
+                 config->max_downloads, config->max_client_downloads,
+                 config->queue_length, config->queue_timeout);
+    }
+
+    return 0;
+}
+
+/* Queued connections are suspended and must be resumed before MHD_stop_daemon. */
+void oim_admission_stop() {
+    struct MHD_Connection *resume[OIM_ADMISSION_RESUME_BATCH];
+    size_t count;
+
+    pthread_mutex_lock(&admission_lock);
+    admission_running = false;
+    pthread_cond_broadcast(&admission_cond);
+
+    while ((count = oim_admission_expire(UINT64_MAX, resume)) > 0) {
+        pthread_mutex_unlock(&admission_lock);
+        for (size_t i = 0; i < count; i++) {
+            MHD_resume_connection(resume[i]);
+        }
+        pthread_mutex_lock(&admission_lock);
+    }
+    pthread_mutex_unlock(&admission_lock);
+
+    if (expiry_started) {
+        pthread_join(expiry_thread, NULL);
+        expiry_started = false;
+    }
+}
+
+int oim_admission_retry_after() {
+    return admission_config.retry_after;
+}
+
+void oim_admission_counts(size_t *downloads, size_t *queued, uint64_t *rejected) {
+    pthread_mutex_lock(&admission_lock);
+    *downloads = in_flight;
+    *queued = queued_count;
+    *rejected = rejected_total;
+    pthread_mutex_unlock(&admission_lock);
+}
@@ -21,10 +21,23 @@
 #include "api.h"
 #include "config.h"
 #include "imgMgr.h"
+#include "snapshot.h"
+#include "download.h"
+#include "query.h"
+#include "checksum.h"
+#include "metrics.h"
+#include "throttle.h"
+#include "admission.h"
+#include "uring.h"
+#include "fdcache.h"
+#include "changelog.h"
+#include "events.h"
+#include "http.h"
 #include "logging.h"
 
 static struct MHD_Daemon *oim_api_server = NULL;
 static OIMConfig *global_config = NULL;
+static bool public_transfers = false;
 
 static int is_safe_path(const char *path) {
     if (strstr(path, "..") != NULL) {
@@ -38,11 +51,6 @@ static int is_safe_path(const char *path) {
     return 1;
 }
 
-static char* oim_safe_basename(const char* path) {
-    char* base = strrchr(path, '/');
-    return base ? base + 1 : (char*)path;
-}
-
 int send_oim_json_response(
     struct MHD_Connection *connection, 
     const char *json_str, 
@@ -68,52 +76,584 @@ int send_oim_json_response(
     return ret;
 }
 
-enum MHD_Result oim_api_request_handler(
-    void *cls __attribute__((unused)), 
-    struct MHD_Connection *connection, 
-    const char *url, 
-    const char *method __attribute__((unused)), 
-    const char *version __attribute__((unused)), 
-    const char *upload_data __attribute__((unused)), 
-    size_t *upload_data_size __attribute__((unused)), 
-    void **ptr __attribute__((unused))
+static void oim_release_snapshot_response(void *cls) {
+    oim_snapshot_release((OIMMirrorSnapshot *)cls);
+}
+
+int send_oim_snapshot_response(
+    struct MHD_Connection *connection,
+    OIMMirrorSnapshot *snapshot,
+    const OIMSnapshotBody *body,
+    OIMContentEncoding encoding,
+    int status_code
 ) {
-    const union MHD_ConnectionInfo *conn_info = 
-    MHD_get_connection_info(connection, MHD_CONNECTION_INFO_CLIENT_ADDRESS);
-    
-    char client_ip[INET6_ADDRSTRLEN] = "Unknown";
-    if (conn_info && conn_info->client_addr) {
-        inet_ntop(conn_info->client_addr->sa_family, 
-                  conn_info->client_addr, 
-                  client_ip, 
-                  sizeof(client_ip));
+    struct MHD_Response *response;
+    int ret;
+
+    const OIMSnapshotVariant *variant = oim_snapshot_variant(body, encoding);
+    bool has_body = status_code != MHD_HTTP_NOT_MODIFIED;
+
+    if (has_body) {
+        response = MHD_create_response_from_buffer_with_free_callback_cls(
+            variant->size,
+            variant->data,
+            oim_release_snapshot_response,
+            snapshot
+        );
+    } else {
+        response = MHD_create_response_from_buffer(0, "", MHD_RESPMEM_PERSISTENT);
+    }
+
+    if (response == NULL) {
+        oim_snapshot_release(snapshot);
+        return MHD_NO;
+    }
+
+    MHD_add_response_header(response, "Content-Type", "application/json");
+    MHD_add_response_header(response, "Access-Control-Allow-Origin", "*");
+    MHD_add_response_header(response, "Access-Control-Allow-Methods", "GET");
+    MHD_add_response_header(response, MHD_HTTP_HEADER_VARY, "Accept-Encoding");
+    if (variant != &body->variants[OIM_ENCODING_IDENTITY]) {
+        MHD_add_response_header(response, MHD_HTTP_HEADER_CONTENT_ENCODING,
+                                oim_encoding_name(encoding));
+    }
+    oim_add_validator_headers(response, variant->etag, snapshot->created,
+                              OIM_LISTING_CACHE_CONTROL);
+
+    /* Cursor for /api/changes after a full fetch. */
+    char generation[48];
+    snprintf(generation, sizeof(generation), "%llu", (unsigned long long)snapshot->generation);
+    MHD_add_response_header(response, "X-Mirror-Generation", generation);
+    snprintf(generation, sizeof(generation), "%llu", (unsigned long long)oim_changelog_epoch());
+    MHD_add_response_header(response, "X-Mirror-Epoch", generation);
+
+    if (!has_body) {
+        oim_snapshot_release(snapshot);
+    }
+
+    ret = MHD_queue_response(connection, status_code, response);
+
+    MHD_destroy_response(response);
+
+    return ret;
+}
+
+/*
+ * Negotiates an encoding for one of the snapshot's bodies and answers 200
+ * or 304. unchanged forces a 304, for a long poll that timed out.
+ */
+static enum MHD_Result oim_send_snapshot_body(
+    struct MHD_Connection *connection,
+    OIMMirrorSnapshot *snapshot,
+    const OIMSnapshotBody *body,
+    bool unchanged
+) {
+    OIMContentEncoding encoding = oim_negotiate_encoding(
+        MHD_lookup_connection_value(connection, MHD_HEADER_KIND,
+                                    MHD_HTTP_HEADER_ACCEPT_ENCODING),
+        oim_snapshot_encodings(body));
+
+    const OIMSnapshotVariant *variant = oim_snapshot_variant(body, encoding);
+    int status_code = MHD_HTTP_OK;
+
+    if (unchanged || oim_request_not_modified(connection, variant->etag, snapshot->created)) {
+        status_code = MHD_HTTP_NOT_MODIFIED;
+    }
+
+    return send_oim_snapshot_response(connection, snapshot, body, encoding, status_code);
+}
+
+static enum MHD_Result oim_send_mirror_query_response(
+    struct MHD_Connection *connection,
+    OIMMirrorSnapshot *snapshot,
+    const char *category,
+    const char *client_ip,
+    bool unchanged
+) {
+    OIMMirrorQuery query;
+    const char *error = NULL;
+    char etag[OIM_ETAG_MAX_LEN + 16];
+    char body[256];
+
+    if (oim_mirror_query_parse(connection, &query, &error) != 0) {
+        LOG_WARN("Invalid Mirror list query from IP: %s (%s)", client_ip, error);
+        oim_snapshot_release(snapshot);
+        snprintf(body, sizeof(body), "{\"error\": \"%s\"}", error);
+        return send_oim_json_response(connection, body, MHD_HTTP_BAD_REQUEST);
+    }
+
+    if (category) {
+        query.category = category;
+    }
+
+    oim_mirror_query_etag(snapshot, &query, etag, sizeof(etag));
+
+    if (unchanged || oim_request_not_modified(connection, etag, snapshot->created)) {
+        time_t created = snapshot->created;
+        oim_snapshot_release(snapshot);
+        return oim_send_not_modified(connection, etag, created, OIM_LISTING_CACHE_CONTROL);
+    }
+
+    size_t length = 0;
+    char *page = oim_mirror_query_execute(snapshot, &query, &length);
+    time_t created = snapshot->created;
+    oim_snapshot_release(snapshot);
+
+    if (page == NULL) {
+        return send_oim_json_response(connection, 
+            "{\"error\": \"Failed to build mirror list page\"}", 
+            MHD_HTTP_INTERNAL_SERVER_ERROR);
+    }
+
+    struct MHD_Response *response = MHD_create_response_from_buffer(
+        length, page, MHD_RESPMEM_MUST_FREE);
+    if (response == NULL) {
+        free(page);
+        return MHD_NO;
+    }
+
+    MHD_add_response_header(response, "Content-Type", "application/json");
+    MHD_add_response_header(response, "Access-Control-Allow-Origin", "*");
+    MHD_add_response_header(response, "Access-Control-Allow-Methods", "GET");
+    oim_add_validator_headers(response, etag, created, OIM_LISTING_CACHE_CONTROL);
+
+    enum MHD_Result ret = MHD_queue_response(connection, MHD_HTTP_OK, response);
+    MHD_destroy_response(response);
+
+    return ret;
+}
+
+/* Serves <category>/SHA256SUMS and friends as a plain-text manifest. */
+static enum MHD_Result oim_send_checksum_sums(
+    struct MHD_Connection *connection,
+    OIMMirrorSnapshot *snapshot,
+    const char *category,
+    size_t category_length,
+    const char *sums_name
+) {
+    char name[PATH_MAX];
+    int algorithm = -1;
+
+    for (int a = 0; a < OIM_DIGEST_COUNT; a++) {
+        if ((oim_checksum_algorithms() & (1u << a)) &&
+            strcmp(sums_name, oim_digest_sums_name(a)) == 0) {
+            algorithm = a;
+        }
+    }
+
+    snprintf(name, sizeof(name), "%.*s", (int)category_length, category);
+    int category_id = oim_catalog_find_category(snapshot->catalog, name);
+
+    if (algorithm < 0 || category_id < 0) {
+        oim_snapshot_release(snapshot);
+        return send_oim_json_response(connection, 
+            "{\"error\": \"Not found\"}", 
+            MHD_HTTP_NOT_FOUND);
+    }
+
+    /* The category body carries the digests, so its tag changes whenever the manifest does. */
+    const char *identity = snapshot->category_bodies[category_id]
+                               .variants[OIM_ENCODING_IDENTITY].etag;
+    char etag[OIM_ETAG_MAX_LEN + 16];
+    snprintf(etag, sizeof(etag), "%.*s-%s\"",
+             (int)strlen(identity) - 1, identity, oim_digest_name(algorithm));
+
+    time_t created = snapshot->created;
+
+    if (oim_request_not_modified(connection, etag, created)) {
+        oim_snapshot_release(snapshot);
+        return oim_send_not_modified(connection, etag, created, OIM_LISTING_CACHE_CONTROL);
+    }
+
+    size_t length = 0;
+    char *sums = oim_checksum_sums(snapshot->catalog, (uint32_t)category_id,
+                                   algorithm, &length);
+    oim_snapshot_release(snapshot);
+
+    if (sums == NULL) {
+        return send_oim_json_response(connection, 
+            "{\"error\": \"Failed to build checksum list\"}", 
+            MHD_HTTP_INTERNAL_SERVER_ERROR);
+    }
+
+    struct MHD_Response *response = MHD_create_response_from_buffer(
+        length, sums, MHD_RESPMEM_MUST_FREE);
+    if (response == NULL) {
+        free(sums);
+        return MHD_NO;
+    }
+
+    MHD_add_response_header(response, "Content-Type", "text/plain; charset=utf-8");
+    MHD_add_response_header(response, "Access-Control-Allow-Origin", "*");
+    oim_add_validator_headers(response, etag, created, OIM_LISTING_CACHE_CONTROL);
+
+    enum MHD_Result ret = MHD_queue_response(connection, MHD_HTTP_OK, response);
+    MHD_destroy_response(response);
+
+    return ret;
+}
+
+/*
+ * Attached to a download or long-poll request on its first handler call.
+ * A download's admission ticket lasts across a queued wait, and the
+ * transfer is timed once admitted; a long poll keeps its waiter and the
+ * generation it waits to pass. Time spent in the handler over all of the
+ * request's calls is recorded once, when it completes.
+ */
+typedef struct {
+    OIMRoute route;
+    uint64_t handler_ns;
+    uint64_t started_ns;
+    uint64_t body_length;
+    OIMAdmissionTicket ticket;
+    OIMEventWaiter waiter;
+    uint64_t since;
+} OIMRequestContext;
+
+static enum MHD_Result oim_send_overloaded(struct MHD_Connection *connection) {
+    static const char body[] = "{\"error\": \"Server busy, retry later\"}";
+    char retry_after[16];
+
+    struct MHD_Response *response = MHD_create_response_from_buffer(
+        sizeof(body) - 1, (void *)body, MHD_RESPMEM_PERSISTENT);
+    if (response == NULL) {
+        return MHD_NO;
+    }
+
+    snprintf(retry_after, sizeof(retry_after), "%d", oim_admission_retry_after());
+    MHD_add_response_header(response, "Content-Type", "application/json");
+    MHD_add_response_header(response, "Access-Control-Allow-Origin", "*");
+    MHD_add_response_header(response, MHD_HTTP_HEADER_RETRY_AFTER, retry_after);
+    MHD_add_response_header(response, "Cache-Control", "no-store");
+
+    enum MHD_Result ret = MHD_queue_response(connection, MHD_HTTP_SERVICE_UNAVAILABLE, response);
+    MHD_destroy_response(response);
+
+    return ret;
+}
+
+static enum MHD_Result oim_send_metrics_response(struct MHD_Connection *connection) {
+    size_t length = 0;
+    char *text = oim_metrics_render(&length);
+    if (text == NULL) {
+        return send_oim_json_response(connection, 
+            "{\"error\": \"Failed to render metrics\"}", 
+            MHD_HTTP_INTERNAL_SERVER_ERROR);
+    }
+
+    struct MHD_Response *response = MHD_create_response_from_buffer(
+        length, text, MHD_RESPMEM_MUST_FREE);
+    if (response == NULL) {
+        free(text);
+        return MHD_NO;
+    }
+
+    MHD_add_response_header(response, "Content-Type", "text/plain; version=0.0.4; charset=utf-8");
+    MHD_add_response_header(response, "Cache-Control", "no-store");
+
+    enum MHD_Result ret = MHD_queue_response(connection, MHD_HTTP_OK, response);
+    MHD_destroy_response(response);
+
+    return ret;
+}
+
+static enum MHD_Result oim_send_transfers_response(struct MHD_Connection *connection) {
+    size_t length = 0;
+    char *json = oim_throttle_to_json(&length);
+    if (json == NULL) {
+        return send_oim_json_response(connection, 
+            "{\"error\": \"Failed to list transfers\"}", 
+            MHD_HTTP_INTERNAL_SERVER_ERROR);
+    }
+
+    struct MHD_Response *response = MHD_create_response_from_buffer(
+        length, json, MHD_RESPMEM_MUST_FREE);
+    if (response == NULL) {
+        free(json);
+        return MHD_NO;
+    }
+
+    MHD_add_response_header(response, "Content-Type", "application/json");
+    MHD_add_response_header(response, "Access-Control-Allow-Origin", "*");
+    MHD_add_response_header(response, "Cache-Control", "no-store");
+
+    enum MHD_Result ret = MHD_queue_response(connection, MHD_HTTP_OK, response);
+    MHD_destroy_response(response);
+
+    return ret;
+}
+
+static bool oim_client_is_loopback(const char *client_ip) {
+    return strncmp(client_ip, "127.", 4) == 0 ||
+           strncmp(client_ip, "::ffff:127.", 11) == 0 ||
+           strcmp(client_ip, "::1") == 0;
+}
+
+/* Parses a whole decimal query value; false if absent or malformed. */
+static bool oim_query_uint64(
+    struct MHD_Connection *connection,
+    const char *key,
+    uint64_t *value
+) {
+    const char *text = MHD_lookup_connection_value(connection, MHD_GET_ARGUMENT_KIND, key);
+    if (text == NULL || *text < '0' || *text > '9') {
+        return false;
+    }
+
+    char *end = NULL;
+    errno = 0;
+    unsigned long long parsed = strtoull(text, &end, 10);
+    if (errno != 0 || *end != '\0') {
+        return false;
+    }
+
+    *value = (uint64_t)parsed;
+    return true;
+}
+
+static enum MHD_Result oim_send_changes_response(
+    struct MHD_Connection *connection,
+    const char *client_ip
+) {
+    uint64_t since = 0;
+    uint64_t epoch = 0;
+
+    if (!oim_query_uint64(connection, "since", &since)) {
+        return send_oim_json_response(connection, 
+            "{\"error\": \"since must be a generation number\"}", 
+            MHD_HTTP_BAD_REQUEST);
+    }
+
+    bool has_epoch = MHD_lookup_connection_value(connection, MHD_GET_ARGUMENT_KIND, "epoch") != NULL;
+    if (has_epoch && !oim_query_uint64(connection, "epoch", &epoch)) {
+        return send_oim_json_response(connection, 
+            "{\"error\": \"epoch must be a number\"}", 
+            MHD_HTTP_BAD_REQUEST);
+    }
+
+    /* Makes sure a first generation exists before the log is consulted. */
+    OIMMirrorSnapshot *snapshot = oim_get_mirror_snapshot();
+    if (snapshot == NULL) {
+        LOG_ERROR("Failed to retrieve mirror list for IP: %s", client_ip);
+        return send_oim_json_response(connection, 
+            "{\"error\": \"Failed to retrieve mirror list\"}", 
+            MHD_HTTP_INTERNAL_SERVER_ERROR);
+    }
+    oim_snapshot_release(snapshot);
+
+    size_t length = 0;
+    char *json = oim_changelog_since(since, has_epoch ? &epoch : NULL, &length);
+    if (json == NULL) {
+        return send_oim_json_response(connection, 
+            "{\"error\": \"Failed to list changes\"}", 
+            MHD_HTTP_INTERNAL_SERVER_ERROR);
+    }
+
+    struct MHD_Response *response = MHD_create_response_from_buffer(
+        length, json, MHD_RESPMEM_MUST_FREE);
+    if (response == NULL) {
+        free(json);
+        return MHD_NO;
+    }
+
+    MHD_add_response_header(response, "Content-Type", "application/json");
+    MHD_add_response_header(response, "Access-Control-Allow-Origin", "*");
+    MHD_add_response_header(response, "Cache-Control", "no-store");
+
+    enum MHD_Result ret = MHD_queue_response(connection, MHD_HTTP_OK, response);
+    MHD_destroy_response(response);
+
+    return ret;
+}
+
+static enum MHD_Result oim_send_event_stream(
+    struct MHD_Connection *connection,
+    const char *client_ip
+) {
+    /* Makes sure a first generation exists to start the stream with. */
+    OIMMirrorSnapshot *snapshot = oim_get_mirror_snapshot();
+    oim_snapshot_release(snapshot);
+
+    struct MHD_Response *response = oim_events_create_stream(
+        connection,
+        MHD_lookup_connection_value(connection, MHD_HEADER_KIND, "Last-Event-ID"));
+
+    if (response == NULL) {
+        LOG_WARN("Catalog event stream refused, too many subscribers, for IP: %s", client_ip);
+        return oim_send_overloaded(connection);
+    }
+
+    MHD_add_response_header(response, "Content-Type", "text/event-stream");
+    MHD_add_response_header(response, "Access-Control-Allow-Origin", "*");
+    MHD_add_response_header(response, "Cache-Control", "no-store");
+    MHD_add_response_header(response, "X-Accel-Buffering", "no");
+
+    enum MHD_Result ret = MHD_queue_response(connection, MHD_HTTP_OK, response);
+    MHD_destroy_response(response);
+
+    return ret;
+}
+
+static enum MHD_Result oim_dispatch_request(
+    struct MHD_Connection *connection,
+    const char *url,
+    const char *client_ip,
+    OIMRoute *route,
+    void **ptr
+) {
+    if (strcmp(url, "/metrics") == 0) {
+        *route = OIM_ROUTE_METRICS;
+        return oim_send_metrics_response(connection);
+    }
+
+    /* Lists client addresses and files, so it is for local operators only by default. */
+    if (strcmp(url, "/api/transfers") == 0 &&
+        (public_transfers || oim_client_is_loopback(client_ip))) {
+        *route = OIM_ROUTE_TRANSFERS;
+        return oim_send_transfers_response(connection);
     }
 
     if (strcmp(url, "/api/mirror") == 0) {
-        LOG_INFO("Mirror list request from IP: %s", client_ip);
+        *route = OIM_ROUTE_MIRROR;
+        OIMRequestContext *poll = *ptr;
+        if (poll == NULL) {
+            LOG_INFO("Mirror list request from IP: %s", client_ip);
+        }
 
-        json_object *mirror_list = oim_get_mirror_list();
+        uint64_t wait = 0;
+        bool long_poll = MHD_lookup_connection_value(connection, MHD_GET_ARGUMENT_KIND,
+                                                     "wait") != NULL;
+        if (long_poll && !oim_query_uint64(connection, "wait", &wait)) {
+            return send_oim_json_response(connection, 
+                "{\"error\": \"wait must be a number of seconds\"}", 
+                MHD_HTTP_BAD_REQUEST);
+        }
+
+        OIMMirrorSnapshot *snapshot = oim_get_mirror_snapshot();
         
-        if (mirror_list == NULL) {
+        if (snapshot == NULL) {
             LOG_ERROR("Failed to retrieve mirror list for IP: %s", client_ip);
             return send_oim_json_response(connection, 
                 "{\"error\": \"Failed to retrieve mirror list\"}", 
                 MHD_HTTP_INTERNAL_SERVER_ERROR);
         }
 
-        const char *json_str = json_object_to_json_string(mirror_list);
-        
-        int ret = send_oim_json_response(connection, json_str, MHD_HTTP_OK);
-        
-        json_object_put(mirror_list);
-        
-        return ret;
+        /* A long poll without since waits for the generation after the current one. */
+        bool unchanged = false;
+        if (long_poll) {
+            if (poll == NULL) {
+                poll = calloc(1, sizeof(OIMRequestContext));
+                if (poll == NULL) {
+                    oim_snapshot_release(snapshot);
+                    return oim_send_overloaded(connection);
+                }
+                if (!oim_query_uint64(connection, "since", &poll->since)) {
+                    poll->since = snapshot->generation;
+                }
+                *ptr = poll;
+            }
+
+            switch (oim_events_wait(&poll->waiter, connection, poll->since, wait)) {
+                case OIM_WAIT_QUEUED:
+                    oim_snapshot_release(snapshot);
+                    return MHD_YES;
+
+                case OIM_WAIT_REJECTED:
+                    LOG_WARN("Long poll rejected, too many waiting, for IP: %s", client_ip);
+                    oim_snapshot_release(snapshot);
+                    return oim_send_overloaded(connection);
+
+                case OIM_WAIT_READY:
+                    break;
+            }
+
+            /* A 304 only answers a conditional request; others get the current listing. */
+            unchanged = snapshot->generation <= poll->since &&
+                        oim_request_conditional(connection);
+        }
+
+        if (oim_mirror_query_present(connection)) {
+            return oim_send_mirror_query_response(connection, snapshot, NULL,
+                                                  client_ip, unchanged);
+        }
+
+        return oim_send_snapshot_body(connection, snapshot, &snapshot->listing, unchanged);
+    }
+
+    if (strcmp(url, "/api/events") == 0) {
+        *route = OIM_ROUTE_EVENTS;
+        LOG_INFO("Catalog event stream opened by IP: %s", client_ip);
+        return oim_send_event_stream(connection, client_ip);
+    }
+
+    if (strcmp(url, "/api/categories") == 0) {
+        *route = OIM_ROUTE_CATEGORIES;
+        LOG_INFO("Category list request from IP: %s", client_ip);
+
+        OIMMirrorSnapshot *snapshot = oim_get_mirror_snapshot();
+
+        if (snapshot == NULL) {
+            LOG_ERROR("Failed to retrieve category list for IP: %s", client_ip);
+            return send_oim_json_response(connection, 
+                "{\"error\": \"Failed to retrieve category list\"}", 
+                MHD_HTTP_INTERNAL_SERVER_ERROR);
+        }
+
+        return oim_send_snapshot_body(connection, snapshot, &snapshot->categories, false);
+    }
+
+    if (strcmp(url, "/api/changes") == 0) {
+        *route = OIM_ROUTE_CHANGES;
+        LOG_INFO("Mirror changes request from IP: %s", client_ip);
+        return oim_send_changes_response(connection, client_ip);
+    }
+
+    if (strncmp(url, "/api/mirror/", 12) == 0) {
+        const char *category = url + 12;
+        *route = OIM_ROUTE_CATEGORY;
+
+        LOG_INFO("Mirror category request from IP: %s for category: %s", client_ip, category);
+
+        OIMMirrorSnapshot *snapshot = oim_get_mirror_snapshot();
+
+        if (snapshot == NULL) {
+            LOG_ERROR("Failed to retrieve mirror list for IP: %s", client_ip);
+            return send_oim_json_response(connection, 
+                "{\"error\": \"Failed to retrieve mirror list\"}", 
+                MHD_HTTP_INTERNAL_SERVER_ERROR);
+        }
+
+        const char *slash = strchr(category, '/');
+        if (slash) {
+            *route = OIM_ROUTE_CHECKSUMS;
+            return oim_send_checksum_sums(connection, snapshot, category,
+                                          (size_t)(slash - category), slash + 1);
+        }
+
+        const OIMSnapshotBody *body = oim_snapshot_category_body(snapshot, category);
+        if (body == NULL) {
+            oim_snapshot_release(snapshot);
+            return send_oim_json_response(connection, 
+                "{\"error\": \"Category not found\"}", 
+                MHD_HTTP_NOT_FOUND);
+        }
+
+        if (oim_mirror_query_present(connection)) {
+            return oim_send_mirror_query_response(connection, snapshot, category,
+                                                  client_ip, false);
+        }
+
+        return oim_send_snapshot_body(connection, snapshot, body, false);
     }
 
     if (strncmp(url, "/download/", 10) == 0) {
         const char *file_path = url + 10;
+        *route = OIM_ROUTE_DOWNLOAD;
 
-        LOG_INFO("Download request from IP: %s for file: %s", client_ip, file_path);
+        OIMRequestContext *download = *ptr;
+        if (download == NULL) {
+            LOG_INFO("Download request from IP: %s for file: %s", client_ip, file_path);
+        }
 
         if (global_config == NULL) {
             LOG_ERROR("Server configuration not loaded for download request from IP: %s", client_ip);
@@ -129,50 +669,32 @@ enum MHD_Result oim_api_request_handler(
                 MHD_HTTP_BAD_REQUEST);
         }
         
-        char full_path[PATH_MAX];
-        snprintf(full_path, sizeof(full_path), "%s/%s", 
-                 global_config->mirror_directory,  
-                 file_path);
-
-        int fd = open(full_path, O_RDONLY);
-        if (fd == -1) {
-            LOG_ERROR("Failed to open file for download from IP: %s, File: %s, Error: %s", 
-                      client_ip, full_path, strerror(errno));
-            
-            return send_oim_json_response(connection, 
-                "{\"error\": \"File not found\"}", 
-                MHD_HTTP_NOT_FOUND);
+        if (download == NULL) {
+            download = calloc(1, sizeof(OIMRequestContext));
+            if (download == NULL) {
+                return oim_send_overloaded(connection);
+            }
+            *ptr = download;
         }
 
-        off_t file_size = lseek(fd, 0, SEEK_END);
-        lseek(fd, 0, SEEK_SET);
+        /* Listings never come through here, so they stay fast while downloads queue. */
+        switch (oim_admission_enter(&download->ticket, connection, client_ip)) {
+            case OIM_ADMISSION_QUEUED:
+                LOG_INFO("Download queued for IP: %s, File: %s", client_ip, file_path);
+                return MHD_YES;
 
-        struct MHD_Response *response;
-        response = MHD_create_response_from_fd(file_size, fd);
-        
-        if (response == NULL) {
-            close(fd);
-            return send_oim_json_response(connection, 
-                "{\"error\": \"Failed to create response\"}", 
-                MHD_HTTP_INTERNAL_SERVER_ERROR);
-        }
+            case OIM_ADMISSION_REJECTED:
+                LOG_WARN("Download rejected, server busy, for IP: %s, File: %s",
+                         client_ip, file_path);
+                return oim_send_overloaded(connection);
 
-        char content_disposition[256];
-        snprintf(content_disposition, sizeof(content_disposition), 
-                 "attachment; filename=\"%s\"", oim_safe_basename(file_path));
-        
-        MHD_add_response_header(response, "Content-Type", "application/octet-stream");
-        MHD_add_response_header(response, "Content-Disposition", content_disposition);
-        
-        char content_length[32];
-        snprintf(content_length, sizeof(content_length), "%ld", (long)file_size);
-        MHD_add_response_header(response, "Content-Length", content_length);
+            case OIM_ADMISSION_ADMITTED:
+                break;
+        }
 
-        enum MHD_Result ret = MHD_queue_response(connection, MHD_HTTP_OK, response);
-        
-        MHD_destroy_response(response);
-        
-        return ret;
+        download->started_ns = oim_metrics_now_ns();
+        return oim_send_download_response(connection, file_path,
+                                          client_ip, &download->body_length);
     }
 
     return send_oim_json_response(connection, 
@@ -180,36 +702,244 @@ enum MHD_Result oim_api_request_handler(
         MHD_HTTP_NOT_FOUND);
 }
 
+/*
+ * Formats just the address, without the port, so that every connection
+ * from one client shares the per-IP download and rate limits.
+ */
+static void oim_format_client_ip(
+    const struct sockaddr *addr,
+    char *client_ip,
+    size_t size
+) {
+    const void *address = NULL;
+
+    if (addr->sa_family == AF_INET) {
+        address = &((const struct sockaddr_in *)addr)->sin_addr;
+    } else if (addr->sa_family == AF_INET6) {
+        address = &((const struct sockaddr_in6 *)addr)->sin6_addr;
+    }
+
+    if (address == NULL || inet_ntop(addr->sa_family, address, client_ip, size) == NULL) {
+        snprintf(client_ip, size, "Unknown");
+    }
+}
+
+enum MHD_Result oim_api_request_handler(
+    void *cls __attribute__((unused)), 
+    struct MHD_Connection *connection, 
+    const char *url, 
+    const char *method __attribute__((unused)), 
+    const char *version __attribute__((unused)), 
+    const char *upload_data __attribute__((unused)), 
+    size_t *upload_data_size __attribute__((unused)), 
+    void **ptr
+) {
+    uint64_t started_ns = oim_metrics_now_ns();
+
+    const union MHD_ConnectionInfo *conn_info = 
+    MHD_get_connection_info(connection, MHD_CONNECTION_INFO_CLIENT_ADDRESS);
+    
+    char client_ip[INET6_ADDRSTRLEN] = "Unknown";
+    if (conn_info && conn_info->client_addr) {
+        oim_format_client_ip(conn_info->client_addr, client_ip, sizeof(client_ip));
+    }
+
+    OIMRoute route = OIM_ROUTE_OTHER;
+    enum MHD_Result ret = oim_dispatch_request(connection, url, client_ip, &route, ptr);
+
+    uint64_t elapsed_ns = oim_metrics_now_ns() - started_ns;
+    OIMRequestContext *context = *ptr;
+    if (context) {
+        context->route = route;
+        context->handler_ns += elapsed_ns;
+    } else {
+        oim_metrics_record_request(route, elapsed_ns);
+    }
+    return ret;
+}
+
+static void oim_request_completed(
+    void *cls __attribute__((unused)),
+    struct MHD_Connection *connection __attribute__((unused)),
+    void **ptr,
+    enum MHD_RequestTerminationCode code
+) {
+    OIMRequestContext *download = *ptr;
+    if (download == NULL) {
+        return;
+    }
+
+    oim_metrics_record_request(download->route, download->handler_ns);
+    oim_admission_leave(&download->ticket);
+    oim_events_cancel_wait(&download->waiter);
+
+    if (download->body_length > 0) {
+        oim_metrics_record_download(download->body_length,
+                                    oim_metrics_now_ns() - download->started_ns,
+                                    code == MHD_REQUEST_TERMINATED_COMPLETED_OK);
+    }
+    free(download);
+    *ptr = NULL;
+}
+
+static void oim_connection_notify(
+    void *cls __attribute__((unused)),
+    struct MHD_Connection *connection __attribute__((unused)),
+    void **socket_context __attribute__((unused)),
+    enum MHD_ConnectionNotificationCode code
+) {
+    if (code == MHD_CONNECTION_NOTIFY_STARTED) {
+        oim_metrics_connection_opened();
+    } else if (code == MHD_CONNECTION_NOTIFY_CLOSED) {
+        oim_metrics_connection_closed();
+    }
+}
+
 struct MHD_Daemon *start_oim_api_server(OIMAPIServerConfig *config, OIMConfig *oim_config) {
     global_config = oim_config;
+    public_transfers = config->public_transfers;
 
     if (oim_api_server != NULL) {
         fprintf(stderr, "API server already running\n");
         return oim_api_server;
     }
     
+    /* Shaped downloads suspend their connection while they wait for tokens. */
+    unsigned int flags = MHD_USE_INTERNAL_POLLING_THREAD | MHD_ALLOW_SUSPEND_RESUME;
+    if (config->use_epoll) {
+        flags |= MHD_USE_EPOLL;
+    }
+
+    struct MHD_OptionItem options[7];
+    int option_count = 0;
+
+    options[option_count++] = (struct MHD_OptionItem) {
+        MHD_OPTION_NOTIFY_COMPLETED, (intptr_t)oim_request_completed, NULL
+    };
+    options[option_count++] = (struct MHD_OptionItem) {
+        MHD_OPTION_NOTIFY_CONNECTION, (intptr_t)oim_connection_notify, NULL
+    };
+
+    if (config->thread_pool_size > 1) {
+        options[option_count++] = (struct MHD_OptionItem) {
+            MHD_OPTION_THREAD_POOL_SIZE, config->thread_pool_size, NULL
+        };
+    }
+    if (config->connection_limit > 0) {
+        options[option_count++] = (struct MHD_OptionItem) {
+            MHD_OPTION_CONNECTION_LIMIT, config->connection_limit, NULL
+        };
+    }
+    if (config->per_ip_connection_limit > 0) {
+        options[option_count++] = (struct MHD_OptionItem) {
+            MHD_OPTION_PER_IP_CONNECTION_LIMIT, config->per_ip_connection_limit, NULL
+        };
+    }
+    if (config->connection_timeout > 0) {
+        options[option_count++] = (struct MHD_OptionItem) {
+            MHD_OPTION_CONNECTION_TIMEOUT, config->connection_timeout, NULL
+        };
+    }
+    options[option_count] = (struct MHD_OptionItem) { MHD_OPTION_END, 0, NULL };
+
+    OIMThrottleLimits limits = {
+        .global_rate = config->download_rate_limit,
+        .client_rate = config->client_rate_limit
+    };
+
+    if (oim_throttle_init(&limits) != 0) {
+        fprintf(stderr, "Failed to start download shaping\n");
+        return NULL;
+    }
+
+    OIMAdmissionConfig admission = {
+        .max_downloads = config->max_downloads,
+        .max_client_downloads = config->max_client_downloads,
+        .queue_length = config->download_queue_length,
+        .queue_timeout = config->download_queue_timeout,
+        .retry_after = config->retry_after
+    };
+
+    if (oim_admission_init(&admission) != 0) {
+        fprintf(stderr, "Failed to start download admission control\n");
+        oim_throttle_stop();
+        return NULL;
+    }
+
+    size_t root_count = 0;
+    const OIMCatalogRoot *roots = oim_get_mirror_roots(&root_count);
+
+    if (oim_fdcache_init(roots, root_count,
+                         (size_t)(config->fd_cache_size > 0 ? config->fd_cache_size : 0)) != 0) {
+        fprintf(stderr, "Failed to set up download file access\n");
+        oim_admission_stop();
+        oim_throttle_stop();
+        return NULL;
+    }
+
+    OIMEventsConfig events = {
+        .keepalive_interval = config->event_keepalive,
+        .max_subscribers = config->max_event_subscribers,
+        .max_wait = config->long_poll_timeout
+    };
+
+    if (oim_events_init(&events) != 0) {
+        fprintf(stderr, "Failed to start catalog events\n");
+        oim_fdcache_cleanup();
+        oim_admission_stop();
+        oim_throttle_stop();
+        return NULL;
+    }
+
+    if (config->use_io_uring) {
+        OIMUringConfig uring = {
+            .queue_depth = config->io_uring_queue_depth,
+            .buffer_count = config->io_uring_buffers,
+            .buffer_size = (size_t)(config->io_uring_buffer_size > 0 ?
+                                    config->io_uring_buffer_size : 0) * 1024
+        };
+        oim_uring_init(&uring);
+    }
+
     oim_api_server = MHD_start_daemon(
-        MHD_USE_INTERNAL_POLLING_THREAD,
+        flags,
         config->port,
         NULL, 
         NULL,
         (MHD_AccessHandlerCallback)oim_api_request_handler, 
         NULL, 
+        MHD_OPTION_ARRAY, options,
         MHD_OPTION_END
     );
     
     if (oim_api_server == NULL) {
         fprintf(stderr, "Failed to start API server\n");
+        oim_events_stop();
+        oim_uring_stop();
+        oim_admission_stop();
+        oim_throttle_stop();
+        oim_fdcache_cleanup();
         return NULL;
     }
     
-    printf("API server started on port %d\n", config->port);
+    printf("API server started on port %d (%d threads, %s)\n", 
+           config->port, 
+           config->thread_pool_size > 1 ? config->thread_pool_size : 1,
+           config->use_epoll ? "epoll" : "select");
+    if (oim_uring_enabled()) {
+        printf("Downloads read through io_uring\n");
+    }
     return oim_api_server;
 }
 
 void stop_oim_api_server(void) {
     if (oim_api_server != NULL) {
+        oim_events_stop();
+        oim_throttle_stop();
+        oim_admission_stop();
+        oim_uring_stop();
         MHD_stop_daemon(oim_api_server);
+        oim_fdcache_cleanup();
         oim_api_server = NULL;
         global_config = NULL;
         printf("API server stopped\n");
@@ -0,0 +1,87 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "arena.h"
+
+#define OIM_ARENA_DEFAULT_CHUNK (256 * 1024)
+#define OIM_ARENA_ALIGN 8
+
+struct OIMArenaChunk {
+    OIMArenaChunk *next;
+    size_t used;
+    size_t capacity;
+    char data[];
+};
+
+void oim_arena_init(OIMArena *arena, size_t chunk_size) {
+    arena->head = NULL;
+    arena->chunk_size = chunk_size ? chunk_size : OIM_ARENA_DEFAULT_CHUNK;
+    arena->bytes_used = 0;
+}
+
+void* oim_arena_alloc(OIMArena *arena, size_t size) {
+    size = (size + OIM_ARENA_ALIGN - 1) & ~(size_t)(OIM_ARENA_ALIGN - 1);
+
+    OIMArenaChunk *chunk = arena->head;
+    if (chunk == NULL || chunk->capacity - chunk->used < size) {
+        size_t capacity = size > arena->chunk_size ? size : arena->chunk_size;
+        chunk = malloc(sizeof(OIMArenaChunk) + capacity);
+        if (chunk == NULL) {
+            return NULL;
+        }
+        chunk->used = 0;
+        chunk->capacity = capacity;
+        chunk->next = arena->head;
+        arena->head = chunk;
+    }
+
+    void *result = chunk->data + chunk->used;
+    chunk->used += size;
+    arena->bytes_used += size;
+
+    return result;
+}
+
+char* oim_arena_strndup(OIMArena *arena, const char *str, size_t length) {
+    char *copy = oim_arena_alloc(arena, length + 1);
+    if (copy) {
+        memcpy(copy, str, length);
+        copy[length] = '\0';
+    }
+    return copy;
+}
+
+/* Moves every chunk of other into arena, leaving other empty. */
+void oim_arena_adopt(OIMArena *arena, OIMArena *other) {
+    if (other->head == NULL) {
+        return;
+    }
+
+    OIMArenaChunk *tail = other->head;
+    while (tail->next) {
+        tail = tail->next;
+    }
+
+    /* Keep the current head so the partially used chunk stays first. */
+    if (arena->head) {
+        tail->next = arena->head->next;
+        arena->head->next = other->head;
+    } else {
+        arena->head = other->head;
+    }
+
+    arena->bytes_used += other->bytes_used;
+    other->head = NULL;
+    other->bytes_used = 0;
+}
+
+void oim_arena_free(OIMArena *arena) {
+    OIMArenaChunk *chunk = arena->head;
+    while (chunk) {
+        OIMArenaChunk *next = chunk->next;
+        free(chunk);
+        chunk = next;
+    }
+    arena->head = NULL;
+    arena->bytes_used = 0;
+}
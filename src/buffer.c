@@ -0,0 +1,133 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+
+#include "buffer.h"
+
+void oim_buffer_init(OIMBuffer *buffer, size_t initial_capacity) {
+    buffer->capacity = initial_capacity ? initial_capacity : 256;
+    buffer->data = malloc(buffer->capacity);
+    buffer->length = 0;
+    buffer->failed = buffer->data == NULL;
+    if (buffer->data) {
+        buffer->data[0] = '\0';
+    }
+}
+
+void oim_buffer_free(OIMBuffer *buffer) {
+    free(buffer->data);
+    buffer->data = NULL;
+    buffer->length = 0;
+    buffer->capacity = 0;
+}
+
+/* Hands the NUL-terminated contents to the caller; NULL if any append failed. */
+char* oim_buffer_detach(OIMBuffer *buffer, size_t *length) {
+    if (buffer->failed) {
+        oim_buffer_free(buffer);
+        return NULL;
+    }
+
+    char *data = buffer->data;
+    if (length) {
+        *length = buffer->length;
+    }
+
+    buffer->data = NULL;
+    buffer->length = 0;
+    buffer->capacity = 0;
+
+    return data;
+}
+
+static bool oim_buffer_reserve(OIMBuffer *buffer, size_t extra) {
+    if (buffer->failed) {
+        return false;
+    }
+
+    if (buffer->length + extra + 1 <= buffer->capacity) {
+        return true;
+    }
+
+    size_t capacity = buffer->capacity;
+    while (buffer->length + extra + 1 > capacity) {
+        capacity *= 2;
+    }
+
+    char *grown = realloc(buffer->data, capacity);
+    if (grown == NULL) {
+        buffer->failed = true;
+        return false;
+    }
+
+    buffer->data = grown;
+    buffer->capacity = capacity;
+    return true;
+}
+
+void oim_buffer_append(OIMBuffer *buffer, const char *data, size_t length) {
+    if (!oim_buffer_reserve(buffer, length)) {
+        return;
+    }
+
+    memcpy(buffer->data + buffer->length, data, length);
+    buffer->length += length;
+    buffer->data[buffer->length] = '\0';
+}
+
+void oim_buffer_append_str(OIMBuffer *buffer, const char *str) {
+    oim_buffer_append(buffer, str, strlen(str));
+}
+
+void oim_buffer_appendf(OIMBuffer *buffer, const char *format, ...) {
+    va_list args;
+
+    va_start(args, format);
+    int needed = vsnprintf(NULL, 0, format, args);
+    va_end(args);
+
+    if (needed < 0 || !oim_buffer_reserve(buffer, (size_t)needed)) {
+        buffer->failed = true;
+        return;
+    }
+
+    va_start(args, format);
+    vsnprintf(buffer->data + buffer->length, (size_t)needed + 1, format, args);
+    va_end(args);
+
+    buffer->length += (size_t)needed;
+}
+
+void oim_buffer_append_json_string(OIMBuffer *buffer, const char *str) {
+    static const char hex[] = "0123456789abcdef";
+
+    oim_buffer_append(buffer, "\"", 1);
+
+    const char *run = str;
+    for (const char *p = str; *p; p++) {
+        unsigned char c = (unsigned char)*p;
+        if (c >= 0x20 && c != '"' && c != '\\') {
+            continue;
+        }
+
+        oim_buffer_append(buffer, run, (size_t)(p - run));
+        run = p + 1;
+
+        switch (c) {
+            case '"':  oim_buffer_append(buffer, "\\\"", 2); break;
+            case '\\': oim_buffer_append(buffer, "\\\\", 2); break;
+            case '\n': oim_buffer_append(buffer, "\\n", 2); break;
+            case '\r': oim_buffer_append(buffer, "\\r", 2); break;
+            case '\t': oim_buffer_append(buffer, "\\t", 2); break;
+            default: {
+                char escaped[6] = { '\\', 'u', '0', '0', hex[c >> 4], hex[c & 0xf] };
+                oim_buffer_append(buffer, escaped, sizeof(escaped));
+                break;
+            }
+        }
+    }
+
+    oim_buffer_append(buffer, run, strlen(run));
+    oim_buffer_append(buffer, "\"", 1);
+}
@@ -3,10 +3,10 @@
 #include <stdlib.h>
 #include <string.h>
 #include <sqlite3.h>
-#include <json-c/json.h>
 #include <time.h>
 #include <sys/stat.h>
 #include <errno.h>
+#include <pthread.h>
 
 #include "cache.h"
 #include "config.h"
@@ -133,16 +133,151 @@ int oim_init_cache(OIMMirrorCacheConfig *config) {
 }
 
 
+/*
+ * Statements are prepared once in oim_init_cache and reused for the life
+ * of the connection. Every public entry point takes oim_cache_lock before
+ * stepping them, so they are never used concurrently.
+ */
+enum {
+    OIM_CACHE_STMT_BEGIN,
+    OIM_CACHE_STMT_COMMIT,
+    OIM_CACHE_STMT_ROLLBACK,
+    OIM_CACHE_STMT_UPSERT,
+    OIM_CACHE_STMT_DELETE,
+    OIM_CACHE_STMT_SELECT_ALL,
+    OIM_CACHE_STMT_SET_UPDATED,
+    OIM_CACHE_STMT_GET_UPDATED,
+    OIM_CACHE_STMT_STORE_DIGESTS,
+    OIM_CACHE_STMT_SELECT_DIGESTS,
+    OIM_CACHE_STMT_PRUNE_DIGESTS,
+    OIM_CACHE_STMT_COUNT
+};
+
+static const char *oim_cache_statement_sql[OIM_CACHE_STMT_COUNT] = {
+    "BEGIN IMMEDIATE",
+    "COMMIT",
+    "ROLLBACK",
+    "INSERT INTO mirror_files (path, category, size, modified, inode, device) "
+    "VALUES (?, ?, ?, ?, ?, ?) "
+    "ON CONFLICT(path) DO UPDATE SET category = excluded.category, "
+    "size = excluded.size, modified = excluded.modified, "
+    "inode = excluded.inode, device = excluded.device",
+    "DELETE FROM mirror_files WHERE path = ?",
+    "SELECT path, size, modified, inode, device FROM mirror_files ORDER BY path",
+    "INSERT OR REPLACE INTO mirror_cache_state (id, updated) VALUES (1, ?)",
+    "SELECT updated FROM mirror_cache_state WHERE id = 1",
+    "INSERT OR REPLACE INTO mirror_digests "
+    "(device, inode, size, modified, sha256, sha512, md5) VALUES (?, ?, ?, ?, ?, ?, ?)",
+    "SELECT device, inode, size, modified, sha256, sha512, md5 FROM mirror_digests",
+    "DELETE FROM mirror_digests WHERE NOT EXISTS ("
+    "SELECT 1 FROM mirror_files f WHERE f.device = mirror_digests.device "
+    "AND f.inode = mirror_digests.inode AND f.size = mirror_digests.size "
+    "AND f.modified = mirror_digests.modified)"
+};
+
+/*
+ * Scan publishes and checksum workers share the connection; the lock keeps
+ * a worker's digest write from landing inside a publish transaction.
+ */
+static pthread_mutex_t oim_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static sqlite3_stmt *oim_cache_statements[OIM_CACHE_STMT_COUNT];
+
+/* Set when a write failed, so the next store diffs against the table itself. */
+static bool oim_cache_needs_resync = false;
+
+static OIMMirrorCatalog* oim_cache_read_mirror_catalog(
+    const OIMCatalogRoot *roots,
+    size_t root_count
+);
+
+static int oim_prepare_cache_statements(sqlite3 *db) {
+    for (int i = 0; i < OIM_CACHE_STMT_COUNT; i++) {
+        int rc = sqlite3_prepare_v3(db, oim_cache_statement_sql[i], -1,
+                                    SQLITE_PREPARE_PERSISTENT,
+                                    &oim_cache_statements[i], NULL);
+        if (rc != SQLITE_OK) {
+            LOG_ERROR("Failed to prepare cache statement: %s", sqlite3_errmsg(db));
+            return rc;
+        }
+    }
+    return SQLITE_OK;
+}
+
+static void oim_finalize_cache_statements() {
+    for (int i = 0; i < OIM_CACHE_STMT_COUNT; i++) {
+        sqlite3_finalize(oim_cache_statements[i]);
+        oim_cache_statements[i] = NULL;
+    }
+}
+
+static int oim_cache_step(int index) {
+    sqlite3_stmt *stmt = oim_cache_statements[index];
+    int rc = sqlite3_step(stmt);
+    sqlite3_reset(stmt);
+    sqlite3_clear_bindings(stmt);
+    return rc;
+}
+
+#define OIM_CACHE_SCHEMA_VERSION 2
+
+static int oim_get_schema_version(sqlite3 *db) {
+    sqlite3_stmt *stmt;
+    int version = 0;
+
+    if (sqlite3_prepare_v2(db, "PRAGMA user_version", -1, &stmt, 0) == SQLITE_OK) {
+        if (sqlite3_step(stmt) == SQLITE_ROW) {
+            version = sqlite3_column_int(stmt, 0);
+        }
+        sqlite3_finalize(stmt);
+    }
+
+    return version;
+}
+
 int oim_create_cache_schema(sqlite3 *db) {
+    /* mirror_files only caches the filesystem, so older layouts are rebuilt by the next scan. */
+    const char *migrate_sql = 
+        "DROP TABLE IF EXISTS mirror_cache;"
+        "DROP TABLE IF EXISTS mirror_files;";
+
     const char *create_table_sql = 
-        "CREATE TABLE IF NOT EXISTS mirror_cache ("
-        "   id INTEGER PRIMARY KEY AUTOINCREMENT,"
-        "   mirror_list TEXT,"
-        "   timestamp INTEGER"
-        ");";
+        "PRAGMA journal_mode = WAL;"
+        "PRAGMA synchronous = NORMAL;"
+        "CREATE TABLE IF NOT EXISTS mirror_files ("
+        "   path TEXT PRIMARY KEY,"
+        "   category TEXT NOT NULL,"
+        "   size INTEGER NOT NULL,"
+        "   modified INTEGER NOT NULL,"
+        "   inode INTEGER NOT NULL,"
+        "   device INTEGER NOT NULL"
+        ") WITHOUT ROWID;"
+        "CREATE TABLE IF NOT EXISTS mirror_cache_state ("
+        "   id INTEGER PRIMARY KEY CHECK (id = 1),"
+        "   updated INTEGER NOT NULL"
+        ");"
+        "CREATE TABLE IF NOT EXISTS mirror_digests ("
+        "   device INTEGER NOT NULL,"
+        "   inode INTEGER NOT NULL,"
+        "   size INTEGER NOT NULL,"
+        "   modified INTEGER NOT NULL,"
+        "   sha256 TEXT,"
+        "   sha512 TEXT,"
+        "   md5 TEXT,"
+        "   PRIMARY KEY (device, inode, size, modified)"
+        ") WITHOUT ROWID;"
+        "PRAGMA user_version = 2;";
 
     char *err_msg = 0;
-    int rc = sqlite3_exec(db, create_table_sql, 0, 0, &err_msg);
+    int rc = SQLITE_OK;
+
+    if (oim_get_schema_version(db) < OIM_CACHE_SCHEMA_VERSION) {
+        rc = sqlite3_exec(db, migrate_sql, 0, 0, &err_msg);
+    }
+
+    if (rc == SQLITE_OK) {
+        rc = sqlite3_exec(db, create_table_sql, 0, 0, &err_msg);
+    }
     
     if (rc != SQLITE_OK) {
         fprintf(stderr, "SQL error: %s\n", err_msg);
@@ -150,63 +285,269 @@ int oim_create_cache_schema(sqlite3 *db) {
         return rc;
     }
 
-    return SQLITE_OK;
+    return oim_prepare_cache_statements(db);
+}
+
+static bool oim_cache_entry_changed(const OIMMirrorEntry *a, const OIMMirrorEntry *b) {
+    return a->file_size != b->file_size ||
+           a->modified_time != b->modified_time ||
+           a->inode != b->inode ||
+           a->device != b->device;
 }
 
-int oim_cache_store_mirror_list(json_object *mirror_list) {
-    if (oim_cache_db == NULL || mirror_list == NULL) {
+static int oim_cache_upsert(const OIMMirrorEntry *entry) {
+    sqlite3_stmt *stmt = oim_cache_statements[OIM_CACHE_STMT_UPSERT];
+
+    sqlite3_bind_text(stmt, 1, entry->path, -1, SQLITE_STATIC);
+    sqlite3_bind_text(stmt, 2, entry->category, -1, SQLITE_STATIC);
+    sqlite3_bind_int64(stmt, 3, entry->file_size);
+    sqlite3_bind_int64(stmt, 4, (int64_t)entry->modified_time);
+    sqlite3_bind_int64(stmt, 5, (int64_t)entry->inode);
+    sqlite3_bind_int64(stmt, 6, (int64_t)entry->device);
+
+    return oim_cache_step(OIM_CACHE_STMT_UPSERT) == SQLITE_DONE ? 0 : -1;
+}
+
+static int oim_cache_delete_path(const char *path) {
+    sqlite3_stmt *stmt = oim_cache_statements[OIM_CACHE_STMT_DELETE];
+
+    sqlite3_bind_text(stmt, 1, path, -1, SQLITE_STATIC);
+
+    return oim_cache_step(OIM_CACHE_STMT_DELETE) == SQLITE_DONE ? 0 : -1;
+}
+
+static int oim_cache_delete(const OIMMirrorEntry *entry) {
+    return oim_cache_delete_path(entry->path);
+}
+
+/*
+ * Deletes rows under no root of catalog, such as those of a root that
+ * was removed from the configuration. The filtered baseline read never
+ * sees them, so the diff alone would keep them forever. Caller holds
+ * oim_cache_lock inside a transaction.
+ */
+static int oim_cache_prune_foreign_rows(const OIMMirrorCatalog *catalog, size_t *deleted) {
+    sqlite3_stmt *stmt = oim_cache_statements[OIM_CACHE_STMT_SELECT_ALL];
+    char **paths = NULL;
+    size_t count = 0;
+    size_t capacity = 0;
+    int result = 0;
+    int rc;
+
+    while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+        const char *path = (const char *)sqlite3_column_text(stmt, 0);
+        if (path == NULL || oim_catalog_has_root_for(catalog, path)) {
+            continue;
+        }
+
+        if (count == capacity) {
+            capacity = capacity ? capacity * 2 : 64;
+            char **grown = realloc(paths, capacity * sizeof(char *));
+            if (grown == NULL) {
+                result = -1;
+                break;
+            }
+            paths = grown;
+        }
+
+        if ((paths[count] = strdup(path)) == NULL) {
+            result = -1;
+            break;
+        }
+        count++;
+    }
+
+    sqlite3_reset(stmt);
+    if (result == 0 && rc != SQLITE_DONE) {
+        result = -1;
+    }
+
+    for (size_t i = 0; i < count; i++) {
+        if (result == 0) {
+            result = oim_cache_delete_path(paths[i]);
+        }
+        free(paths[i]);
+    }
+    free(paths);
+
+    if (result == 0) {
+        *deleted += count;
+    }
+    return result;
+}
+
+/*
+ * Writes the difference between two path-sorted catalogs in a single
+ * transaction. When previous is NULL (first store, or after a failed
+ * write) the rows already in the table are used as the baseline, and
+ * rows outside every current root are deleted.
+ */
+int oim_cache_store_mirror_catalog(
+    const OIMMirrorCatalog *previous,
+    const OIMMirrorCatalog *current
+) {
+    if (oim_cache_db == NULL || current == NULL) {
         return -1;
     }
 
-    const char *mirror_list_str = json_object_to_json_string(mirror_list);
-    int64_t current_time = oim_get_current_timestamp();
+    pthread_mutex_lock(&oim_cache_lock);
 
-    sqlite3_stmt *stmt;
-    const char *sql = "INSERT INTO mirror_cache (mirror_list, timestamp) VALUES (?, ?)";
-    
-    int rc = sqlite3_prepare_v2(oim_cache_db, sql, -1, &stmt, 0);
-    if (rc != SQLITE_OK) {
-        fprintf(stderr, "Failed to prepare statement\n");
+    OIMMirrorCatalog *baseline = NULL;
+    if (previous == NULL || oim_cache_needs_resync) {
+        baseline = oim_cache_read_mirror_catalog(current->roots, current->root_count);
+        if (baseline == NULL) {
+            pthread_mutex_unlock(&oim_cache_lock);
+            return -1;
+        }
+        previous = baseline;
+    }
+
+    if (oim_cache_step(OIM_CACHE_STMT_BEGIN) != SQLITE_DONE) {
+        LOG_ERROR("Failed to begin cache transaction: %s", sqlite3_errmsg(oim_cache_db));
+        pthread_mutex_unlock(&oim_cache_lock);
+        oim_catalog_free(baseline);
         return -1;
     }
 
-    sqlite3_bind_text(stmt, 1, mirror_list_str, -1, SQLITE_STATIC);
-    sqlite3_bind_int64(stmt, 2, current_time);
+    size_t i = 0;
+    size_t j = 0;
+    size_t upserts = 0;
+    size_t deletes = 0;
+    int result = baseline ? oim_cache_prune_foreign_rows(current, &deletes) : 0;
+
+    while (result == 0 && (i < previous->count || j < current->count)) {
+        const OIMMirrorEntry *old_entry = i < previous->count ? &previous->entries[i] : NULL;
+        const OIMMirrorEntry *new_entry = j < current->count ? &current->entries[j] : NULL;
+        int cmp;
+
+        if (old_entry == NULL) {
+            cmp = 1;
+        } else if (new_entry == NULL) {
+            cmp = -1;
+        } else {
+            cmp = strcmp(oim_catalog_relative_path(old_entry),
+                         oim_catalog_relative_path(new_entry));
+        }
+
+        if (cmp < 0) {
+            result = oim_cache_delete(old_entry);
+            deletes++;
+            i++;
+        } else if (cmp > 0) {
+            result = oim_cache_upsert(new_entry);
+            upserts++;
+            j++;
+        } else if (strcmp(old_entry->path, new_entry->path) != 0) {
+            /* Served from another root now; rows are keyed by the path on disk. */
+            result = oim_cache_delete(old_entry);
+            if (result == 0) {
+                result = oim_cache_upsert(new_entry);
+            }
+            deletes++;
+            upserts++;
+            i++;
+            j++;
+        } else {
+            if (oim_cache_entry_changed(old_entry, new_entry)) {
+                result = oim_cache_upsert(new_entry);
+                upserts++;
+            }
+            i++;
+            j++;
+        }
+    }
+
+    if (result == 0) {
+        sqlite3_bind_int64(oim_cache_statements[OIM_CACHE_STMT_SET_UPDATED], 1,
+                           oim_get_current_timestamp());
+        if (oim_cache_step(OIM_CACHE_STMT_SET_UPDATED) != SQLITE_DONE) {
+            result = -1;
+        }
+    }
 
-    rc = sqlite3_step(stmt);
-    sqlite3_finalize(stmt);
+    if (result == 0 && oim_cache_step(OIM_CACHE_STMT_COMMIT) != SQLITE_DONE) {
+        result = -1;
+    }
 
-    oim_cleanup_old_cache_entries();
+    if (result != 0) {
+        LOG_ERROR("Failed to write Mirror cache: %s", sqlite3_errmsg(oim_cache_db));
+        oim_cache_step(OIM_CACHE_STMT_ROLLBACK);
+        oim_cache_needs_resync = true;
+    } else {
+        oim_cache_needs_resync = false;
+        LOG_INFO("Mirror cache updated: %zu upserted, %zu deleted", upserts, deletes);
+    }
 
-    return (rc == SQLITE_DONE) ? 0 : -1;
+    pthread_mutex_unlock(&oim_cache_lock);
+    oim_catalog_free(baseline);
+    return result;
 }
 
-json_object* oim_cache_get_mirror_list() {
-    if (oim_cache_db == NULL || !oim_is_cache_valid()) {
+/* Caller holds oim_cache_lock. Rows outside every root are left out. */
+static OIMMirrorCatalog* oim_cache_read_mirror_catalog(
+    const OIMCatalogRoot *roots,
+    size_t root_count
+) {
+    OIMMirrorCatalog *catalog = oim_catalog_create(roots, root_count);
+    if (catalog == NULL) {
         return NULL;
     }
 
-    sqlite3_stmt *stmt;
-    const char *sql = "SELECT mirror_list FROM mirror_cache ORDER BY timestamp DESC LIMIT 1";
-    
-    int rc = sqlite3_prepare_v2(oim_cache_db, sql, -1, &stmt, 0);
-    if (rc != SQLITE_OK) {
-        fprintf(stderr, "Failed to prepare statement\n");
+    sqlite3_stmt *stmt = oim_cache_statements[OIM_CACHE_STMT_SELECT_ALL];
+    int rc;
+
+    while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+        const unsigned char *path = sqlite3_column_text(stmt, 0);
+        if (path == NULL) {
+            continue;
+        }
+
+        if (oim_catalog_add(catalog, (const char *)path,
+                            sqlite3_column_int64(stmt, 1),
+                            (time_t)sqlite3_column_int64(stmt, 2),
+                            (uint64_t)sqlite3_column_int64(stmt, 3),
+                            (uint64_t)sqlite3_column_int64(stmt, 4)) != 0) {
+            rc = SQLITE_NOMEM;
+            break;
+        }
+    }
+
+    sqlite3_reset(stmt);
+
+    if (rc != SQLITE_DONE || oim_catalog_finalize(catalog) != 0) {
+        LOG_ERROR("Failed to read Mirror cache: %s", sqlite3_errmsg(oim_cache_db));
+        oim_catalog_free(catalog);
         return NULL;
     }
 
-    rc = sqlite3_step(stmt);
-    json_object *mirror_list = NULL;
+    return catalog;
+}
 
-    if (rc == SQLITE_ROW) {
-        const unsigned char *json_str = sqlite3_column_text(stmt, 0);
-        if (json_str ) {
-            mirror_list = json_tokener_parse((const char *)json_str);
-        }
+/* Reads every cached row, whether or not the cache has expired. */
+OIMMirrorCatalog* oim_cache_load_mirror_catalog(
+    const OIMCatalogRoot *roots,
+    size_t root_count
+) {
+    if (oim_cache_db == NULL) {
+        return NULL;
     }
 
-    sqlite3_finalize(stmt);
-    return mirror_list;
+    pthread_mutex_lock(&oim_cache_lock);
+    OIMMirrorCatalog *catalog = oim_cache_read_mirror_catalog(roots, root_count);
+    pthread_mutex_unlock(&oim_cache_lock);
+
+    return catalog;
+}
+
+OIMMirrorCatalog* oim_cache_get_mirror_catalog(
+    const OIMCatalogRoot *roots,
+    size_t root_count
+) {
+    if (oim_cache_db == NULL || !oim_is_cache_valid()) {
+        return NULL;
+    }
+
+    return oim_cache_load_mirror_catalog(roots, root_count);
 }
 
 bool oim_is_cache_valid() {
@@ -214,55 +555,123 @@ bool oim_is_cache_valid() {
         return false;
     }
 
-    sqlite3_stmt *stmt;
-    const char *sql = "SELECT timestamp FROM mirror_cache ORDER BY timestamp DESC LIMIT 1";
-    
-    int rc = sqlite3_prepare_v2(oim_cache_db, sql, -1, &stmt, 0);
-    if (rc != SQLITE_OK) {
-        return false;
-    }
+    pthread_mutex_lock(&oim_cache_lock);
 
-    rc = sqlite3_step(stmt);
+    sqlite3_stmt *stmt = oim_cache_statements[OIM_CACHE_STMT_GET_UPDATED];
     bool is_valid = false;
 
-    if (rc == SQLITE_ROW) {
+    if (sqlite3_step(stmt) == SQLITE_ROW) {
         int64_t last_timestamp = sqlite3_column_int64(stmt, 0);
         int64_t current_time = oim_get_current_timestamp();
         
         is_valid = (current_time - last_timestamp) <= current_config->cache_expiry_time;
     }
 
-    sqlite3_finalize(stmt);
+    sqlite3_reset(stmt);
+    pthread_mutex_unlock(&oim_cache_lock);
     return is_valid;
 }
 
-int64_t oim_get_current_timestamp() {
-    return (int64_t)time(NULL);
+static void oim_cache_bind_digest(sqlite3_stmt *stmt, int index, const char *hex) {
+    if (hex[0] == '\0') {
+        sqlite3_bind_null(stmt, index);
+    } else {
+        sqlite3_bind_text(stmt, index, hex, -1, SQLITE_STATIC);
+    }
 }
 
-void oim_cleanup_old_cache_entries() {
-    if (oim_cache_db == NULL || current_config == NULL) {
-        return;
+int oim_cache_store_digests(const OIMFileDigests *digests) {
+    if (oim_cache_db == NULL || digests == NULL) {
+        return -1;
     }
 
-    int64_t current_time = oim_get_current_timestamp();
-    sqlite3_stmt *stmt;
+    pthread_mutex_lock(&oim_cache_lock);
 
-    const char *sql = "DELETE FROM mirror_cache WHERE timestamp < ?";
-    
-    int rc = sqlite3_prepare_v2(oim_cache_db, sql, -1, &stmt, 0);
-    if (rc != SQLITE_OK) {
-        fprintf(stderr, "Failed to prepare cleanup statement\n");
-        return;
+    sqlite3_stmt *stmt = oim_cache_statements[OIM_CACHE_STMT_STORE_DIGESTS];
+    sqlite3_bind_int64(stmt, 1, (int64_t)digests->key.device);
+    sqlite3_bind_int64(stmt, 2, (int64_t)digests->key.inode);
+    sqlite3_bind_int64(stmt, 3, digests->key.size);
+    sqlite3_bind_int64(stmt, 4, (int64_t)digests->key.modified);
+    oim_cache_bind_digest(stmt, 5, digests->hex[OIM_DIGEST_SHA256]);
+    oim_cache_bind_digest(stmt, 6, digests->hex[OIM_DIGEST_SHA512]);
+    oim_cache_bind_digest(stmt, 7, digests->hex[OIM_DIGEST_MD5]);
+
+    int result = oim_cache_step(OIM_CACHE_STMT_STORE_DIGESTS) == SQLITE_DONE ? 0 : -1;
+    if (result != 0) {
+        LOG_WARN("Failed to store file digests: %s", sqlite3_errmsg(oim_cache_db));
+    }
+
+    pthread_mutex_unlock(&oim_cache_lock);
+    return result;
+}
+
+int oim_cache_load_digests(OIMDigestsLoadCallback callback, void *ctx) {
+    if (oim_cache_db == NULL || callback == NULL) {
+        return -1;
+    }
+
+    pthread_mutex_lock(&oim_cache_lock);
+
+    sqlite3_stmt *stmt = oim_cache_statements[OIM_CACHE_STMT_SELECT_DIGESTS];
+    OIMFileDigests digests;
+    int rc;
+
+    while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+        memset(&digests, 0, sizeof(digests));
+        digests.key.device = (uint64_t)sqlite3_column_int64(stmt, 0);
+        digests.key.inode = (uint64_t)sqlite3_column_int64(stmt, 1);
+        digests.key.size = sqlite3_column_int64(stmt, 2);
+        digests.key.modified = (time_t)sqlite3_column_int64(stmt, 3);
+
+        for (int algorithm = 0; algorithm < OIM_DIGEST_COUNT; algorithm++) {
+            const unsigned char *hex = sqlite3_column_text(stmt, 4 + algorithm);
+            if (hex) {
+                snprintf(digests.hex[algorithm], sizeof(digests.hex[algorithm]),
+                         "%s", (const char *)hex);
+            }
+        }
+
+        callback(ctx, &digests);
+    }
+
+    sqlite3_reset(stmt);
+    pthread_mutex_unlock(&oim_cache_lock);
+
+    if (rc != SQLITE_DONE) {
+        LOG_ERROR("Failed to read file digests: %s", sqlite3_errmsg(oim_cache_db));
+        return -1;
     }
 
-    sqlite3_bind_int64(stmt, 1, current_time - current_config->cache_expiry_time);
+    return 0;
+}
+
+/* Drops digests for file versions no longer present in mirror_files. */
+int oim_cache_prune_digests() {
+    if (oim_cache_db == NULL) {
+        return -1;
+    }
+
+    pthread_mutex_lock(&oim_cache_lock);
+
+    int result = oim_cache_step(OIM_CACHE_STMT_PRUNE_DIGESTS) == SQLITE_DONE ? 0 : -1;
+    int pruned = sqlite3_changes(oim_cache_db);
 
-    sqlite3_step(stmt);
-    sqlite3_finalize(stmt);
+    pthread_mutex_unlock(&oim_cache_lock);
+
+    if (result == 0 && pruned > 0) {
+        LOG_INFO("Pruned %d stale file digest%s", pruned, pruned == 1 ? "" : "s");
+    }
+
+    return result;
+}
+
+int64_t oim_get_current_timestamp() {
+    return (int64_t)time(NULL);
 }
 
 void oim_close_cache() {
+    oim_finalize_cache_statements();
+
     if (oim_cache_db) {
         sqlite3_close(oim_cache_db);
         oim_cache_db = NULL;
@@ -0,0 +1,742 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <json-c/json.h>
+
+#include "catalog.h"
+#include "buffer.h"
+#include "logging.h"
+
+#define OIM_CATALOG_INITIAL_CAPACITY 256
+
+static int oim_catalog_add_root(OIMMirrorCatalog *catalog, const OIMCatalogRoot *root) {
+    const char *directory = root && root->directory ? root->directory : "";
+    const char *prefix = root && root->prefix ? root->prefix : "";
+
+    size_t directory_length = strlen(directory);
+    while (directory_length > 1 && directory[directory_length - 1] == '/') {
+        directory_length--;
+    }
+
+    while (*prefix == '/') {
+        prefix++;
+    }
+    size_t prefix_length = strlen(prefix);
+    while (prefix_length > 0 && prefix[prefix_length - 1] == '/') {
+        prefix_length--;
+    }
+
+    OIMCatalogRoot *copy = &catalog->roots[catalog->root_count];
+    copy->directory = oim_arena_strndup(&catalog->arena, directory, directory_length);
+    copy->prefix = oim_arena_strndup(&catalog->arena, prefix, prefix_length);
+    copy->directory_length = directory_length;
+    copy->prefix_length = prefix_length;
+
+    if (copy->directory == NULL || copy->prefix == NULL) {
+        return -1;
+    }
+
+    catalog->root_count++;
+    return 0;
+}
+
+/* A single unprefixed root's layout is just its directory. */
+static int oim_catalog_build_layout(OIMMirrorCatalog *catalog) {
+    OIMBuffer layout;
+    oim_buffer_init(&layout, 256);
+
+    for (size_t i = 0; i < catalog->root_count; i++) {
+        const OIMCatalogRoot *root = &catalog->roots[i];
+        if (i > 0) {
+            oim_buffer_append(&layout, "\n", 1);
+        }
+        oim_buffer_append(&layout, root->directory, root->directory_length);
+        if (root->prefix_length > 0) {
+            oim_buffer_append(&layout, "\t", 1);
+            oim_buffer_append(&layout, root->prefix, root->prefix_length);
+        }
+    }
+
+    catalog->layout = layout.failed ? NULL
+        : oim_arena_strndup(&catalog->arena, layout.data ? layout.data : "", layout.length);
+    catalog->layout_length = layout.length;
+    oim_buffer_free(&layout);
+
+    return catalog->layout ? 0 : -1;
+}
+
+OIMMirrorCatalog* oim_catalog_create(const OIMCatalogRoot *roots, size_t root_count) {
+    OIMMirrorCatalog *catalog = calloc(1, sizeof(OIMMirrorCatalog));
+    if (catalog == NULL) {
+        return NULL;
+    }
+
+    oim_arena_init(&catalog->arena, 0);
+
+    /* Without roots, paths are kept relative to the filesystem root. */
+    size_t slots = root_count > 0 ? root_count : 1;
+    catalog->roots = oim_arena_alloc(&catalog->arena, slots * sizeof(OIMCatalogRoot));
+
+    int result = catalog->roots ? 0 : -1;
+    for (size_t i = 0; result == 0 && i < slots; i++) {
+        result = oim_catalog_add_root(catalog, root_count > 0 ? &roots[i] : NULL);
+    }
+
+    if (result != 0 || oim_catalog_build_layout(catalog) != 0) {
+        oim_catalog_free(catalog);
+        return NULL;
+    }
+
+    return catalog;
+}
+
+void oim_catalog_free(OIMMirrorCatalog *catalog) {
+    if (catalog == NULL) {
+        return;
+    }
+
+    free(catalog->entries);
+    free(catalog->categories);
+    for (int sort = 0; sort < OIM_CATALOG_SORT_COUNT; sort++) {
+        free(catalog->order[sort]);
+        free(catalog->category_order[sort]);
+    }
+    free(catalog->category_index);
+    free(catalog->category_by_name);
+    free(catalog->path_index);
+    oim_arena_free(&catalog->arena);
+    if (catalog->mapping) {
+        munmap(catalog->mapping, catalog->mapping_size);
+    }
+    free(catalog);
+}
+
+static int oim_catalog_reserve(OIMMirrorCatalog *catalog, size_t extra) {
+    if (catalog->count + extra <= catalog->capacity) {
+        return 0;
+    }
+
+    size_t capacity = catalog->capacity ? catalog->capacity : OIM_CATALOG_INITIAL_CAPACITY;
+    while (capacity < catalog->count + extra) {
+        capacity *= 2;
+    }
+
+    OIMMirrorEntry *grown = realloc(catalog->entries, capacity * sizeof(OIMMirrorEntry));
+    if (grown == NULL) {
+        return -1;
+    }
+
+    catalog->entries = grown;
+    catalog->capacity = capacity;
+    return 0;
+}
+
+/* The longest root directory containing path, or -1. */
+static int oim_catalog_match_root(const OIMMirrorCatalog *catalog, const char *path) {
+    int match = -1;
+
+    for (size_t i = 0; i < catalog->root_count; i++) {
+        const OIMCatalogRoot *root = &catalog->roots[i];
+        size_t length = root->directory_length;
+
+        if (strncmp(path, root->directory, length) != 0 ||
+            (length > 0 && path[length] != '/' && root->directory[length - 1] != '/')) {
+            continue;
+        }
+
+        if (match < 0 || length > catalog->roots[match].directory_length) {
+            match = (int)i;
+        }
+    }
+
+    return match;
+}
+
+bool oim_catalog_has_root_for(const OIMMirrorCatalog *catalog, const char *path) {
+    return oim_catalog_match_root(catalog, path) >= 0;
+}
+
+/*
+ * Like oim_catalog_add, but path is not copied and must outlive the
+ * catalog. Paths outside every root are skipped.
+ */
+int oim_catalog_add_borrowed(
+    OIMMirrorCatalog *catalog,
+    const char *path,
+    long long file_size,
+    time_t modified_time,
+    uint64_t inode,
+    uint64_t device
+) {
+    int root_id = oim_catalog_match_root(catalog, path);
+    if (root_id < 0) {
+        return 0;
+    }
+
+    if (oim_catalog_reserve(catalog, 1) != 0) {
+        return -1;
+    }
+
+    const OIMCatalogRoot *root = &catalog->roots[root_id];
+    size_t relative_offset = root->directory_length;
+    while (path[relative_offset] == '/') {
+        relative_offset++;
+    }
+
+    const char *relative_path = path + relative_offset;
+    if (root->prefix_length > 0) {
+        size_t length = strlen(relative_path);
+        char *prefixed = oim_arena_alloc(&catalog->arena, root->prefix_length + 1 + length + 1);
+        if (prefixed == NULL) {
+            return -1;
+        }
+        memcpy(prefixed, root->prefix, root->prefix_length);
+        prefixed[root->prefix_length] = '/';
+        memcpy(prefixed + root->prefix_length + 1, relative_path, length + 1);
+        relative_path = prefixed;
+    }
+
+    const char *slash = strrchr(path, '/');
+
+    OIMMirrorEntry *entry = &catalog->entries[catalog->count++];
+    entry->filename = slash ? slash + 1 : path;
+    entry->path = path;
+    entry->relative_path = relative_path;
+    entry->category = NULL;
+    entry->category_id = 0;
+    entry->root_id = (uint32_t)root_id;
+    entry->relative_offset = (uint32_t)relative_offset;
+    entry->file_size = file_size;
+    entry->modified_time = modified_time;
+    entry->inode = inode;
+    entry->device = device;
+    entry->sha256 = NULL;
+    entry->sha512 = NULL;
+    entry->md5 = NULL;
+
+    return 0;
+}
+
+int oim_catalog_add(
+    OIMMirrorCatalog *catalog,
+    const char *full_path,
+    long long file_size,
+    time_t modified_time,
+    uint64_t inode,
+    uint64_t device
+) {
+    char *path = oim_arena_strndup(&catalog->arena, full_path, strlen(full_path));
+    if (path == NULL) {
+        return -1;
+    }
+
+    return oim_catalog_add_borrowed(catalog, path, file_size, modified_time, inode, device);
+}
+
+/* Moves all entries (and the arena holding their strings) out of other. */
+int oim_catalog_merge(OIMMirrorCatalog *catalog, OIMMirrorCatalog *other) {
+    if (other->count > 0) {
+        if (oim_catalog_reserve(catalog, other->count) != 0) {
+            return -1;
+        }
+
+        memcpy(catalog->entries + catalog->count, other->entries,
+               other->count * sizeof(OIMMirrorEntry));
+        catalog->count += other->count;
+        other->count = 0;
+    }
+
+    oim_arena_adopt(&catalog->arena, &other->arena);
+    return 0;
+}
+
+const char* oim_catalog_relative_path(const OIMMirrorEntry *entry) {
+    return entry->relative_path;
+}
+
+/* The entry's path below its root directory. */
+const char* oim_catalog_root_path(const OIMMirrorEntry *entry) {
+    return entry->path + entry->relative_offset;
+}
+
+/* Equal catalog paths from different roots order by root, so the first root wins. */
+static int oim_compare_catalog_entries(const void *a, const void *b) {
+    const OIMMirrorEntry *ea = a;
+    const OIMMirrorEntry *eb = b;
+    int cmp = strcmp(ea->relative_path, eb->relative_path);
+    return cmp ? cmp : (ea->root_id > eb->root_id) - (ea->root_id < eb->root_id);
+}
+
+static uint32_t oim_hash_bytes(const char *data, size_t length) {
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < length; i++) {
+        hash ^= (unsigned char)data[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+static int oim_catalog_intern_categories(OIMMirrorCatalog *catalog) {
+    size_t slots = 64;
+    uint32_t *table = NULL;
+    size_t category_capacity = 16;
+
+    free(catalog->categories);
+    catalog->categories = malloc(category_capacity * sizeof(char *));
+    catalog->category_count = 0;
+
+    /* Slots hold category_id + 1 so that zero marks an empty slot. */
+    table = calloc(slots, sizeof(uint32_t));
+    if (catalog->categories == NULL || table == NULL) {
+        free(table);
+        return -1;
+    }
+
+    for (size_t i = 0; i < catalog->count; i++) {
+        OIMMirrorEntry *entry = &catalog->entries[i];
+        const char *relative = oim_catalog_relative_path(entry);
+        const char *slash = strchr(relative, '/');
+        size_t length = slash ? (size_t)(slash - relative) : strlen(relative);
+
+        if (length == 0) {
+            relative = "Uncategorized";
+            length = strlen(relative);
+        }
+
+        uint32_t hash = oim_hash_bytes(relative, length);
+        size_t slot = hash & (slots - 1);
+
+        while (table[slot] != 0) {
+            const char *candidate = catalog->categories[table[slot] - 1];
+            if (strncmp(candidate, relative, length) == 0 && candidate[length] == '\0') {
+                break;
+            }
+            slot = (slot + 1) & (slots - 1);
+        }
+
+        if (table[slot] == 0) {
+            if (catalog->category_count == category_capacity) {
+                category_capacity *= 2;
+                const char **grown = realloc(catalog->categories,
+                                             category_capacity * sizeof(char *));
+                if (grown == NULL) {
+                    free(table);
+                    return -1;
+                }
+                catalog->categories = grown;
+            }
+
+            const char *name = oim_arena_strndup(&catalog->arena, relative, length);
+            if (name == NULL) {
+                free(table);
+                return -1;
+            }
+
+            catalog->categories[catalog->category_count++] = name;
+            table[slot] = (uint32_t)catalog->category_count;
+
+            if (catalog->category_count * 2 > slots) {
+                size_t new_slots = slots * 2;
+                uint32_t *rehashed = calloc(new_slots, sizeof(uint32_t));
+                if (rehashed == NULL) {
+                    free(table);
+                    return -1;
+                }
+                for (size_t c = 0; c < catalog->category_count; c++) {
+                    const char *existing = catalog->categories[c];
+                    size_t s = oim_hash_bytes(existing, strlen(existing)) & (new_slots - 1);
+                    while (rehashed[s] != 0) {
+                        s = (s + 1) & (new_slots - 1);
+                    }
+                    rehashed[s] = (uint32_t)(c + 1);
+                }
+                free(table);
+                table = rehashed;
+                slots = new_slots;
+            }
+
+            entry->category_id = (uint32_t)(catalog->category_count - 1);
+        } else {
+            entry->category_id = table[slot] - 1;
+        }
+
+        entry->category = catalog->categories[entry->category_id];
+    }
+
+    free(table);
+    return 0;
+}
+
+/* Ties fall back to the entry index, i.e. path order, so every index is total. */
+static int oim_compare_index_by_name(const void *a, const void *b, void *ctx) {
+    const OIMMirrorEntry *entries = ctx;
+    uint32_t ia = *(const uint32_t *)a;
+    uint32_t ib = *(const uint32_t *)b;
+    int cmp = strcmp(entries[ia].filename, entries[ib].filename);
+    return cmp ? cmp : (ia > ib) - (ia < ib);
+}
+
+static int oim_compare_index_by_size(const void *a, const void *b, void *ctx) {
+    const OIMMirrorEntry *entries = ctx;
+    uint32_t ia = *(const uint32_t *)a;
+    uint32_t ib = *(const uint32_t *)b;
+    if (entries[ia].file_size != entries[ib].file_size) {
+        return entries[ia].file_size < entries[ib].file_size ? -1 : 1;
+    }
+    return (ia > ib) - (ia < ib);
+}
+
+static int oim_compare_index_by_modified(const void *a, const void *b, void *ctx) {
+    const OIMMirrorEntry *entries = ctx;
+    uint32_t ia = *(const uint32_t *)a;
+    uint32_t ib = *(const uint32_t *)b;
+    if (entries[ia].modified_time != entries[ib].modified_time) {
+        return entries[ia].modified_time < entries[ib].modified_time ? -1 : 1;
+    }
+    return (ia > ib) - (ia < ib);
+}
+
+static int oim_compare_category_names(const void *a, const void *b, void *ctx) {
+    const char **categories = ctx;
+    return strcmp(categories[*(const uint32_t *)a], categories[*(const uint32_t *)b]);
+}
+
+static int oim_catalog_build_indexes(OIMMirrorCatalog *catalog) {
+    size_t count = catalog->count;
+    size_t bytes = (count ? count : 1) * sizeof(uint32_t);
+
+    for (int sort = 0; sort < OIM_CATALOG_SORT_COUNT; sort++) {
+        free(catalog->order[sort]);
+        free(catalog->category_order[sort]);
+        catalog->order[sort] = malloc(bytes);
+        catalog->category_order[sort] = malloc(bytes);
+        if (catalog->order[sort] == NULL || catalog->category_order[sort] == NULL) {
+            return -1;
+        }
+        for (size_t i = 0; i < count; i++) {
+            catalog->order[sort][i] = (uint32_t)i;
+        }
+    }
+
+    qsort_r(catalog->order[OIM_CATALOG_SORT_NAME], count, sizeof(uint32_t),
+            oim_compare_index_by_name, catalog->entries);
+    qsort_r(catalog->order[OIM_CATALOG_SORT_SIZE], count, sizeof(uint32_t),
+            oim_compare_index_by_size, catalog->entries);
+    qsort_r(catalog->order[OIM_CATALOG_SORT_MODIFIED], count, sizeof(uint32_t),
+            oim_compare_index_by_modified, catalog->entries);
+
+    size_t category_slots = catalog->category_count ? catalog->category_count : 1;
+
+    free(catalog->category_index);
+    free(catalog->category_by_name);
+    catalog->category_index = calloc(category_slots, sizeof(OIMCategoryIndex));
+    catalog->category_by_name = malloc(category_slots * sizeof(uint32_t));
+    uint32_t *cursor = calloc(category_slots, sizeof(uint32_t));
+    if (catalog->category_index == NULL || catalog->category_by_name == NULL || cursor == NULL) {
+        free(cursor);
+        return -1;
+    }
+
+    for (size_t i = 0; i < count; i++) {
+        OIMCategoryIndex *index = &catalog->category_index[catalog->entries[i].category_id];
+        index->count++;
+        index->total_size += catalog->entries[i].file_size;
+    }
+
+    uint32_t start = 0;
+    for (size_t c = 0; c < catalog->category_count; c++) {
+        catalog->category_index[c].start = start;
+        start += catalog->category_index[c].count;
+        catalog->category_by_name[c] = (uint32_t)c;
+    }
+
+    qsort_r(catalog->category_by_name, catalog->category_count, sizeof(uint32_t),
+            oim_compare_category_names, catalog->categories);
+
+    /* A stable counting sort keeps each global ordering within a category. */
+    for (int sort = 0; sort < OIM_CATALOG_SORT_COUNT; sort++) {
+        for (size_t c = 0; c < catalog->category_count; c++) {
+            cursor[c] = catalog->category_index[c].start;
+        }
+        for (size_t i = 0; i < count; i++) {
+            uint32_t index = catalog->order[sort][i];
+            uint32_t category_id = catalog->entries[index].category_id;
+            catalog->category_order[sort][cursor[category_id]++] = index;
+        }
+    }
+
+    free(cursor);
+    return 0;
+}
+
+static int oim_catalog_build_path_index(OIMMirrorCatalog *catalog) {
+    size_t slots = 16;
+    while (slots < catalog->count * 2) {
+        slots *= 2;
+    }
+
+    free(catalog->path_index);
+    catalog->path_index = calloc(slots, sizeof(uint64_t));
+    if (catalog->path_index == NULL) {
+        return -1;
+    }
+    catalog->path_index_mask = slots - 1;
+
+    for (size_t i = 0; i < catalog->count; i++) {
+        const char *relative = oim_catalog_relative_path(&catalog->entries[i]);
+        uint32_t hash = oim_hash_bytes(relative, strlen(relative));
+        size_t slot = hash & catalog->path_index_mask;
+
+        while (catalog->path_index[slot] != 0) {
+            slot = (slot + 1) & catalog->path_index_mask;
+        }
+        catalog->path_index[slot] = ((uint64_t)hash << 32) | (uint64_t)(i + 1);
+    }
+
+    return 0;
+}
+
+static bool oim_catalog_is_sorted(const OIMMirrorCatalog *catalog) {
+    for (size_t i = 1; i < catalog->count; i++) {
+        if (oim_compare_catalog_entries(&catalog->entries[i - 1], &catalog->entries[i]) > 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/* Keeps the first of each run of equal catalog paths. Entries must be sorted. */
+static void oim_catalog_drop_duplicates(OIMMirrorCatalog *catalog) {
+    size_t kept = catalog->count > 0 ? 1 : 0;
+
+    for (size_t i = 1; i < catalog->count; i++) {
+        if (strcmp(catalog->entries[i].relative_path,
+                   catalog->entries[kept - 1].relative_path) != 0) {
+            catalog->entries[kept++] = catalog->entries[i];
+        }
+    }
+
+    if (kept < catalog->count) {
+        LOG_WARN("Ignoring %zu file(s) whose catalog path an earlier root already serves",
+                 catalog->count - kept);
+    }
+    catalog->count = kept;
+}
+
+int oim_catalog_finalize(OIMMirrorCatalog *catalog) {
+    /* Cache and snapshot-file loads arrive already in path order. */
+    if (!oim_catalog_is_sorted(catalog)) {
+        qsort(catalog->entries, catalog->count, sizeof(OIMMirrorEntry),
+              oim_compare_catalog_entries);
+    }
+
+    if (catalog->root_count > 1) {
+        oim_catalog_drop_duplicates(catalog);
+    }
+
+    if (oim_catalog_intern_categories(catalog) != 0) {
+        LOG_ERROR("Failed to intern catalog categories");
+        return -1;
+    }
+
+    if (oim_catalog_build_indexes(catalog) != 0 ||
+        oim_catalog_build_path_index(catalog) != 0) {
+        LOG_ERROR("Failed to build catalog indexes");
+        return -1;
+    }
+
+    return 0;
+}
+
+int oim_catalog_find_category(const OIMMirrorCatalog *catalog, const char *name) {
+    size_t low = 0;
+    size_t high = catalog->category_count;
+
+    while (low < high) {
+        size_t mid = low + (high - low) / 2;
+        uint32_t category_id = catalog->category_by_name[mid];
+        int cmp = strcmp(name, catalog->categories[category_id]);
+        if (cmp == 0) {
+            return (int)category_id;
+        }
+        if (cmp < 0) {
+            high = mid;
+        } else {
+            low = mid + 1;
+        }
+    }
+
+    return -1;
+}
+
+const OIMMirrorEntry* oim_catalog_find(
+    const OIMMirrorCatalog *catalog,
+    const char *relative_path
+) {
+    if (catalog == NULL || relative_path == NULL) {
+        return NULL;
+    }
+
+    if (catalog->path_index) {
+        uint32_t hash = oim_hash_bytes(relative_path, strlen(relative_path));
+        size_t slot = hash & catalog->path_index_mask;
+
+        for (uint64_t value; (value = catalog->path_index[slot]) != 0;
+             slot = (slot + 1) & catalog->path_index_mask) {
+            const OIMMirrorEntry *entry = &catalog->entries[(uint32_t)value - 1];
+            if ((uint32_t)(value >> 32) == hash &&
+                strcmp(relative_path, oim_catalog_relative_path(entry)) == 0) {
+                return entry;
+            }
+        }
+        return NULL;
+    }
+
+    /* Not finalized yet: entries may still be in path order. */
+    size_t low = 0;
+    size_t high = catalog->count;
+
+    while (low < high) {
+        size_t mid = low + (high - low) / 2;
+        int cmp = strcmp(relative_path, oim_catalog_relative_path(&catalog->entries[mid]));
+        if (cmp == 0) {
+            return &catalog->entries[mid];
+        }
+        if (cmp < 0) {
+            high = mid;
+        } else {
+            low = mid + 1;
+        }
+    }
+
+    return NULL;
+}
+
+void oim_catalog_append_entry_json(OIMBuffer *buffer, const OIMMirrorEntry *entry) {
+    oim_buffer_append_str(buffer, "{\"filename\":");
+    oim_buffer_append_json_string(buffer, entry->filename);
+    oim_buffer_append_str(buffer, ",\"path\":");
+    oim_buffer_append_json_string(buffer, entry->path);
+    oim_buffer_append_str(buffer, ",\"relative_path\":");
+    oim_buffer_append_json_string(buffer, oim_catalog_relative_path(entry));
+    oim_buffer_append_str(buffer, ",\"category\":");
+    oim_buffer_append_json_string(buffer, entry->category);
+    oim_buffer_appendf(buffer, ",\"size\":%lld,\"modified\":%lld",
+                       entry->file_size,
+                       (long long)entry->modified_time);
+    if (entry->sha256) {
+        oim_buffer_appendf(buffer, ",\"sha256\":\"%s\"", entry->sha256);
+    }
+    if (entry->sha512) {
+        oim_buffer_appendf(buffer, ",\"sha512\":\"%s\"", entry->sha512);
+    }
+    if (entry->md5) {
+        oim_buffer_appendf(buffer, ",\"md5\":\"%s\"", entry->md5);
+    }
+    oim_buffer_append(buffer, "}", 1);
+}
+
+char* oim_catalog_serialize(const OIMMirrorCatalog *catalog, size_t *length) {
+    OIMBuffer buffer;
+    oim_buffer_init(&buffer, catalog->count * 192 + 2);
+
+    oim_buffer_append(&buffer, "[", 1);
+    for (size_t i = 0; i < catalog->count; i++) {
+        if (i > 0) {
+            oim_buffer_append(&buffer, ",", 1);
+        }
+        oim_catalog_append_entry_json(&buffer, &catalog->entries[i]);
+    }
+    oim_buffer_append(&buffer, "]", 1);
+
+    return oim_buffer_detach(&buffer, length);
+}
+
+/* Same shape as the full listing, restricted to one category in path order. */
+char* oim_catalog_serialize_category(
+    const OIMMirrorCatalog *catalog,
+    uint32_t category_id,
+    size_t *length
+) {
+    const OIMCategoryIndex *index = &catalog->category_index[category_id];
+    const uint32_t *order = catalog->category_order[OIM_CATALOG_SORT_PATH] + index->start;
+
+    OIMBuffer buffer;
+    oim_buffer_init(&buffer, index->count * 192 + 2);
+
+    oim_buffer_append(&buffer, "[", 1);
+    for (uint32_t i = 0; i < index->count; i++) {
+        if (i > 0) {
+            oim_buffer_append(&buffer, ",", 1);
+        }
+        oim_catalog_append_entry_json(&buffer, &catalog->entries[order[i]]);
+    }
+    oim_buffer_append(&buffer, "]", 1);
+
+    return oim_buffer_detach(&buffer, length);
+}
+
+char* oim_catalog_serialize_categories(const OIMMirrorCatalog *catalog, size_t *length) {
+    OIMBuffer buffer;
+    oim_buffer_init(&buffer, catalog->category_count * 64 + 2);
+
+    oim_buffer_append(&buffer, "[", 1);
+    for (size_t i = 0; i < catalog->category_count; i++) {
+        uint32_t category_id = catalog->category_by_name[i];
+        const OIMCategoryIndex *index = &catalog->category_index[category_id];
+
+        if (i > 0) {
+            oim_buffer_append(&buffer, ",", 1);
+        }
+        oim_buffer_append_str(&buffer, "{\"name\":");
+        oim_buffer_append_json_string(&buffer, catalog->categories[category_id]);
+        oim_buffer_appendf(&buffer, ",\"count\":%u,\"size\":%lld}",
+                           index->count, index->total_size);
+    }
+    oim_buffer_append(&buffer, "]", 1);
+
+    return oim_buffer_detach(&buffer, length);
+}
+
+json_object* oim_catalog_to_json(const OIMMirrorCatalog *catalog) {
+    json_object *mirror_list = json_object_new_array();
+    if (mirror_list == NULL) {
+        return NULL;
+    }
+
+    for (size_t i = 0; i < catalog->count; i++) {
+        const OIMMirrorEntry *entry = &catalog->entries[i];
+        json_object *mirror_entry = json_object_new_object();
+
+        json_object_object_add(mirror_entry, "filename", 
+            json_object_new_string(entry->filename));
+        json_object_object_add(mirror_entry, "path", 
+            json_object_new_string(entry->path));
+        json_object_object_add(mirror_entry, "relative_path",
+            json_object_new_string(oim_catalog_relative_path(entry)));
+        json_object_object_add(mirror_entry, "category", 
+            json_object_new_string(entry->category));
+        json_object_object_add(mirror_entry, "size", 
+            json_object_new_int64(entry->file_size));
+        json_object_object_add(mirror_entry, "modified", 
+            json_object_new_int64(entry->modified_time));
+        if (entry->sha256) {
+            json_object_object_add(mirror_entry, "sha256",
+                json_object_new_string(entry->sha256));
+        }
+        if (entry->sha512) {
+            json_object_object_add(mirror_entry, "sha512",
+                json_object_new_string(entry->sha512));
+        }
+        if (entry->md5) {
+            json_object_object_add(mirror_entry, "md5",
+                json_object_new_string(entry->md5));
+        }
+
+        json_object_array_add(mirror_list, mirror_entry);
+    }
+
+    return mirror_list;
+}
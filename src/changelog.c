@@ -0,0 +1,243 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "changelog.h"
+#include "buffer.h"
+#include "logging.h"
+
+/* One generation's changes, pre-serialized as comma-separated JSON objects. */
+typedef struct {
+    uint64_t generation;
+    size_t count;
+    char *data;
+    size_t size;
+} OIMChangeSet;
+
+static pthread_mutex_t changelog_lock = PTHREAD_MUTEX_INITIALIZER;
+static OIMChangeSet *change_sets = NULL;
+static size_t change_set_count = 0;
+static size_t change_set_capacity = 0;
+static size_t change_count = 0;
+static size_t changelog_capacity = 0;
+static uint64_t changelog_epoch = 0;
+
+/* Clients at base_generation or later can be answered from the log. */
+static uint64_t base_generation = 0;
+static uint64_t latest_generation = 0;
+
+static bool oim_digest_equal(const char *a, const char *b) {
+    return a == b || (a && b && strcmp(a, b) == 0);
+}
+
+static bool oim_entry_changed(const OIMMirrorEntry *a, const OIMMirrorEntry *b) {
+    return a->file_size != b->file_size ||
+           a->modified_time != b->modified_time ||
+           a->inode != b->inode ||
+           a->device != b->device ||
+           strcmp(a->path, b->path) != 0 ||
+           !oim_digest_equal(a->sha256, b->sha256) ||
+           !oim_digest_equal(a->sha512, b->sha512) ||
+           !oim_digest_equal(a->md5, b->md5);
+}
+
+static void oim_append_change(
+    OIMBuffer *buffer,
+    size_t *count,
+    uint64_t generation,
+    const char *change,
+    const OIMMirrorEntry *entry
+) {
+    if (*count > 0) {
+        oim_buffer_append(buffer, ",", 1);
+    }
+    oim_buffer_appendf(buffer, "{\"generation\":%llu,\"change\":\"%s\",\"entry\":",
+                       (unsigned long long)generation, change);
+    oim_catalog_append_entry_json(buffer, entry);
+    oim_buffer_append(buffer, "}", 1);
+    (*count)++;
+}
+
+static void oim_changelog_drop_oldest() {
+    OIMChangeSet *oldest = &change_sets[0];
+
+    change_count -= oldest->count;
+    base_generation = oldest->generation;
+    free(oldest->data);
+
+    memmove(change_sets, change_sets + 1, (change_set_count - 1) * sizeof(OIMChangeSet));
+    change_set_count--;
+}
+
+/* Called with changelog_lock held. */
+static void oim_changelog_reset(uint64_t generation) {
+    while (change_set_count > 0) {
+        oim_changelog_drop_oldest();
+    }
+    base_generation = generation;
+    latest_generation = generation;
+}
+
+int oim_changelog_init(size_t capacity) {
+    pthread_mutex_lock(&changelog_lock);
+    changelog_capacity = capacity;
+    changelog_epoch = (uint64_t)time(NULL);
+    pthread_mutex_unlock(&changelog_lock);
+
+    if (capacity > 0) {
+        LOG_INFO("Keeping up to %zu catalog changes for /api/changes", capacity);
+    }
+    return 0;
+}
+
+void oim_changelog_cleanup() {
+    pthread_mutex_lock(&changelog_lock);
+    oim_changelog_reset(0);
+    free(change_sets);
+    change_sets = NULL;
+    change_set_capacity = 0;
+    pthread_mutex_unlock(&changelog_lock);
+}
+
+uint64_t oim_changelog_epoch() {
+    return changelog_epoch;
+}
+
+/* Both catalogs are sorted by relative path, so one merge walk finds every change. */
+void oim_changelog_record(
+    const OIMMirrorCatalog *previous,
+    const OIMMirrorCatalog *current,
+    uint64_t generation
+) {
+    if (changelog_capacity == 0 || previous == NULL) {
+        pthread_mutex_lock(&changelog_lock);
+        oim_changelog_reset(generation);
+        pthread_mutex_unlock(&changelog_lock);
+        return;
+    }
+
+    OIMBuffer buffer;
+    oim_buffer_init(&buffer, 4096);
+    size_t count = 0;
+    size_t i = 0;
+    size_t j = 0;
+
+    while ((i < previous->count || j < current->count) && count <= changelog_capacity) {
+        const OIMMirrorEntry *old_entry = i < previous->count ? &previous->entries[i] : NULL;
+        const OIMMirrorEntry *new_entry = j < current->count ? &current->entries[j] : NULL;
+
+        int cmp = old_entry == NULL ? 1
+                : new_entry == NULL ? -1
+                : strcmp(old_entry->relative_path, new_entry->relative_path);
+
+        if (cmp < 0) {
+            oim_append_change(&buffer, &count, generation, "removed", old_entry);
+            i++;
+        } else if (cmp > 0) {
+            oim_append_change(&buffer, &count, generation, "added", new_entry);
+            j++;
+        } else {
+            if (oim_entry_changed(old_entry, new_entry)) {
+                oim_append_change(&buffer, &count, generation, "modified", new_entry);
+            }
+            i++;
+            j++;
+        }
+    }
+
+    pthread_mutex_lock(&changelog_lock);
+
+    if (buffer.failed || count > changelog_capacity) {
+        /* Too big to keep; every client starts over from this generation. */
+        LOG_INFO("Catalog change log restarted at generation %llu",
+                 (unsigned long long)generation);
+        oim_changelog_reset(generation);
+        pthread_mutex_unlock(&changelog_lock);
+        oim_buffer_free(&buffer);
+        return;
+    }
+
+    while (change_set_count > 0 && change_count + count > changelog_capacity) {
+        oim_changelog_drop_oldest();
+    }
+
+    if (change_set_count == change_set_capacity) {
+        size_t capacity = change_set_capacity ? change_set_capacity * 2 : 16;
+        OIMChangeSet *sets = realloc(change_sets, capacity * sizeof(OIMChangeSet));
+        if (sets == NULL) {
+            oim_changelog_reset(generation);
+            pthread_mutex_unlock(&changelog_lock);
+            oim_buffer_free(&buffer);
+            return;
+        }
+        change_sets = sets;
+        change_set_capacity = capacity;
+    }
+
+    OIMChangeSet *set = &change_sets[change_set_count++];
+    set->generation = generation;
+    set->count = count;
+    set->data = NULL;
+    set->size = 0;
+    if (count > 0) {
+        set->data = oim_buffer_detach(&buffer, &set->size);
+    } else {
+        oim_buffer_free(&buffer);
+    }
+    change_count += count;
+    latest_generation = generation;
+
+    pthread_mutex_unlock(&changelog_lock);
+}
+
+char* oim_changelog_since(
+    uint64_t since,
+    const uint64_t *epoch,
+    size_t *length
+) {
+    OIMBuffer buffer;
+
+    pthread_mutex_lock(&changelog_lock);
+
+    bool resync = changelog_capacity == 0 ||
+                  latest_generation == 0 ||
+                  (epoch && *epoch != changelog_epoch) ||
+                  since < base_generation ||
+                  since > latest_generation;
+
+    size_t size = 128;
+    for (size_t i = 0; !resync && i < change_set_count; i++) {
+        size += change_sets[i].size + 1;
+    }
+
+    oim_buffer_init(&buffer, size);
+    oim_buffer_appendf(&buffer, "{\"epoch\":%llu,\"generation\":%llu,\"resync\":%s",
+                       (unsigned long long)changelog_epoch,
+                       (unsigned long long)latest_generation,
+                       resync ? "true" : "false");
+
+    if (!resync) {
+        bool first = true;
+        oim_buffer_append_str(&buffer, ",\"changes\":[");
+        for (size_t i = 0; i < change_set_count; i++) {
+            const OIMChangeSet *set = &change_sets[i];
+            if (set->generation <= since || set->count == 0) {
+                continue;
+            }
+            if (!first) {
+                oim_buffer_append(&buffer, ",", 1);
+            }
+            oim_buffer_append(&buffer, set->data, set->size);
+            first = false;
+        }
+        oim_buffer_append(&buffer, "]", 1);
+    }
+
+    pthread_mutex_unlock(&changelog_lock);
+
+    oim_buffer_append(&buffer, "}", 1);
+    return oim_buffer_detach(&buffer, length);
+}
@@ -0,0 +1,637 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <openssl/evp.h>
+
+#include "checksum.h"
+#include "cache.h"
+#include "logging.h"
+
+#define OIM_CHECKSUM_MAX_THREADS 16
+#define OIM_CHECKSUM_READ_SIZE (1024 * 1024)
+
+/*
+ * Publish finished digests at least this often while a backlog drains.
+ * Every publish is a new generation that every event stream and long
+ * poll hears about, so a first hashing run of a large mirror should not
+ * produce one every few seconds.
+ */
+#define OIM_CHECKSUM_PUBLISH_INTERVAL 300
+
+/* ioprio_set(2) has no glibc wrapper. */
+#define OIM_IOPRIO_WHO_PROCESS 1
+#define OIM_IOPRIO_CLASS_IDLE 3
+#define OIM_IOPRIO_CLASS_SHIFT 13
+
+typedef struct {
+    OIMFileDigests digests;
+    bool used;
+    bool queued;
+    uint64_t seen;
+} OIMDigestRecord;
+
+typedef struct {
+    OIMFileKey key;
+    char *path;
+} OIMChecksumJob;
+
+static unsigned int checksum_algorithms = 0;
+static int checksum_thread_count = 0;
+
+/* Known digests, open-addressed by file key. Guarded by checksum_lock. */
+static OIMDigestRecord *records = NULL;
+static size_t record_capacity = 0;
+static size_t record_count = 0;
+static uint64_t annotate_generation = 0;
+
+static OIMChecksumJob *jobs = NULL;
+static size_t job_begin = 0;
+static size_t job_end = 0;
+static size_t job_capacity = 0;
+static int jobs_running = 0;
+static size_t results_pending = 0;
+static time_t last_publish = 0;
+
+static pthread_mutex_t checksum_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t checksum_cond = PTHREAD_COND_INITIALIZER;
+static pthread_t checksum_threads[OIM_CHECKSUM_MAX_THREADS];
+static int checksum_threads_started = 0;
+static volatile int checksum_running = 0;
+static OIMDigestsReadyCallback digests_ready = NULL;
+
+static const char *digest_names[OIM_DIGEST_COUNT] = { "sha256", "sha512", "md5" };
+static const char *digest_sums_names[OIM_DIGEST_COUNT] = { "SHA256SUMS", "SHA512SUMS", "MD5SUMS" };
+
+const char* oim_digest_name(OIMDigestAlgorithm algorithm) {
+    return algorithm < OIM_DIGEST_COUNT ? digest_names[algorithm] : "unknown";
+}
+
+const char* oim_digest_sums_name(OIMDigestAlgorithm algorithm) {
+    return algorithm < OIM_DIGEST_COUNT ? digest_sums_names[algorithm] : "unknown";
+}
+
+static const EVP_MD* oim_digest_md(OIMDigestAlgorithm algorithm) {
+    switch (algorithm) {
+        case OIM_DIGEST_SHA256: return EVP_sha256();
+        case OIM_DIGEST_SHA512: return EVP_sha512();
+        case OIM_DIGEST_MD5: return EVP_md5();
+        default: return NULL;
+    }
+}
+
+/* Parses a comma-separated list such as "sha256,md5" into a bitmask. */
+unsigned int oim_parse_digest_algorithms(const char *list) {
+    unsigned int mask = 0;
+
+    if (list == NULL) {
+        return 0;
+    }
+
+    const char *p = list;
+    while (*p) {
+        while (*p == ',' || *p == ' ') {
+            p++;
+        }
+
+        size_t length = strcspn(p, ", ");
+        if (length == 0) {
+            break;
+        }
+
+        bool known = false;
+        for (int algorithm = 0; algorithm < OIM_DIGEST_COUNT; algorithm++) {
+            if (strlen(digest_names[algorithm]) == length &&
+                strncasecmp(p, digest_names[algorithm], length) == 0) {
+                mask |= 1u << algorithm;
+                known = true;
+            }
+        }
+
+        if (!known) {
+            LOG_WARN("Ignoring unknown checksum algorithm: %.*s", (int)length, p);
+        }
+
+        p += length;
+    }
+
+    return mask;
+}
+
+unsigned int oim_checksum_algorithms() {
+    return checksum_algorithms;
+}
+
+static uint64_t oim_file_key_hash(const OIMFileKey *key) {
+    uint64_t hash = key->inode * 0x9e3779b97f4a7c15ULL;
+    hash ^= key->device + 0x7f4a7c159e3779b9ULL + (hash << 6) + (hash >> 2);
+    hash ^= (uint64_t)key->size + (hash << 6) + (hash >> 2);
+    hash ^= (uint64_t)key->modified + (hash << 6) + (hash >> 2);
+    return hash;
+}
+
+static bool oim_file_key_equal(const OIMFileKey *a, const OIMFileKey *b) {
+    return a->device == b->device && a->inode == b->inode &&
+           a->size == b->size && a->modified == b->modified;
+}
+
+static OIMDigestRecord* oim_record_slot(
+    OIMDigestRecord *table,
+    size_t capacity,
+    const OIMFileKey *key
+) {
+    size_t slot = oim_file_key_hash(key) & (capacity - 1);
+    while (table[slot].used && !oim_file_key_equal(&table[slot].digests.key, key)) {
+        slot = (slot + 1) & (capacity - 1);
+    }
+    return &table[slot];
+}
+
+/* Rebuilds the table at the given size, dropping records not marked since min_seen. */
+static int oim_records_rebuild(size_t capacity, uint64_t min_seen) {
+    OIMDigestRecord *table = calloc(capacity, sizeof(OIMDigestRecord));
+    if (table == NULL) {
+        return -1;
+    }
+
+    size_t count = 0;
+    for (size_t i = 0; i < record_capacity; i++) {
+        if (records[i].used && (records[i].seen >= min_seen || records[i].queued)) {
+            *oim_record_slot(table, capacity, &records[i].digests.key) = records[i];
+            count++;
+        }
+    }
+
+    free(records);
+    records = table;
+    record_capacity = capacity;
+    record_count = count;
+    return 0;
+}
+
+/* Caller holds checksum_lock. */
+static OIMDigestRecord* oim_record_lookup(const OIMFileKey *key, bool create) {
+    if (record_capacity == 0) {
+        if (!create || oim_records_rebuild(1024, 0) != 0) {
+            return NULL;
+        }
+    }
+
+    OIMDigestRecord *record = oim_record_slot(records, record_capacity, key);
+    if (record->used || !create) {
+        return record->used ? record : NULL;
+    }
+
+    if ((record_count + 1) * 10 > record_capacity * 7) {
+        if (oim_records_rebuild(record_capacity * 2, 0) != 0) {
+            return NULL;
+        }
+        record = oim_record_slot(records, record_capacity, key);
+    }
+
+    memset(record, 0, sizeof(*record));
+    record->used = true;
+    record->digests.key = *key;
+    record_count++;
+    return record;
+}
+
+static bool oim_record_complete(const OIMDigestRecord *record) {
+    for (int algorithm = 0; algorithm < OIM_DIGEST_COUNT; algorithm++) {
+        if ((checksum_algorithms & (1u << algorithm)) &&
+            record->digests.hex[algorithm][0] == '\0') {
+            return false;
+        }
+    }
+    return true;
+}
+
+static void oim_checksum_load_record(void *ctx __attribute__((unused)), const OIMFileDigests *digests) {
+    OIMDigestRecord *record = oim_record_lookup(&digests->key, true);
+    if (record) {
+        record->digests = *digests;
+    }
+}
+
+int oim_checksum_init(const OIMChecksumConfig *config) {
+    if (config == NULL) {
+        return -1;
+    }
+
+    checksum_algorithms = config->algorithms;
+    checksum_thread_count = config->thread_count;
+    if (checksum_thread_count > OIM_CHECKSUM_MAX_THREADS) {
+        checksum_thread_count = OIM_CHECKSUM_MAX_THREADS;
+    }
+
+    if (checksum_algorithms == 0 || checksum_thread_count < 1) {
+        LOG_INFO("Checksum engine disabled");
+        checksum_algorithms = 0;
+        return 0;
+    }
+
+    /* mirror_files still describes the last scan, so anything it no longer lists is stale. */
+    oim_cache_prune_digests();
+
+    pthread_mutex_lock(&checksum_lock);
+    oim_cache_load_digests(oim_checksum_load_record, NULL);
+    size_t loaded = record_count;
+    pthread_mutex_unlock(&checksum_lock);
+
+    LOG_INFO("Checksum engine loaded %zu stored digest record%s",
+             loaded, loaded == 1 ? "" : "s");
+    return 0;
+}
+
+/* Caller holds checksum_lock. */
+static int oim_checksum_enqueue(const OIMFileKey *key, const char *path) {
+    if (job_end == job_capacity) {
+        if (job_begin > 0) {
+            memmove(jobs, jobs + job_begin, (job_end - job_begin) * sizeof(OIMChecksumJob));
+            job_end -= job_begin;
+            job_begin = 0;
+        } else {
+            size_t capacity = job_capacity ? job_capacity * 2 : 256;
+            OIMChecksumJob *grown = realloc(jobs, capacity * sizeof(OIMChecksumJob));
+            if (grown == NULL) {
+                return -1;
+            }
+            jobs = grown;
+            job_capacity = capacity;
+        }
+    }
+
+    char *copy = strdup(path);
+    if (copy == NULL) {
+        return -1;
+    }
+
+    jobs[job_end].key = *key;
+    jobs[job_end].path = copy;
+    job_end++;
+    return 0;
+}
+
+/*
+ * Copies every known digest into the catalog's arena and queues the
+ * files that still need hashing. Called on each catalog before it is
+ * published, with the catalog not yet shared.
+ */
+void oim_checksum_annotate(OIMMirrorCatalog *catalog) {
+    if (catalog == NULL || checksum_algorithms == 0) {
+        return;
+    }
+
+    size_t queued = 0;
+
+    pthread_mutex_lock(&checksum_lock);
+    annotate_generation++;
+
+    for (size_t i = 0; i < catalog->count; i++) {
+        OIMMirrorEntry *entry = &catalog->entries[i];
+        OIMFileKey key = {
+            .device = entry->device,
+            .inode = entry->inode,
+            .size = entry->file_size,
+            .modified = entry->modified_time
+        };
+
+        OIMDigestRecord *record = oim_record_lookup(&key, true);
+        if (record == NULL) {
+            continue;
+        }
+        record->seen = annotate_generation;
+
+        const char **fields[OIM_DIGEST_COUNT] = { &entry->sha256, &entry->sha512, &entry->md5 };
+        for (int algorithm = 0; algorithm < OIM_DIGEST_COUNT; algorithm++) {
+            const char *hex = record->digests.hex[algorithm];
+            if ((checksum_algorithms & (1u << algorithm)) && hex[0] != '\0') {
+                *fields[algorithm] = oim_arena_strndup(&catalog->arena, hex, strlen(hex));
+            }
+        }
+
+        if (!record->queued && !oim_record_complete(record)) {
+            if (oim_checksum_enqueue(&key, entry->path) == 0) {
+                record->queued = true;
+                queued++;
+            }
+        }
+    }
+
+    /* Forget file versions that have left the catalog once they dominate the table. */
+    if (record_count > 1024 && record_count > catalog->count * 2) {
+        oim_records_rebuild(record_capacity, annotate_generation);
+    }
+
+    if (queued > 0) {
+        pthread_cond_broadcast(&checksum_cond);
+    }
+    pthread_mutex_unlock(&checksum_lock);
+
+    if (queued > 0) {
+        LOG_INFO("Queued %zu file%s for checksumming", queued, queued == 1 ? "" : "s");
+    }
+}
+
+static void oim_checksum_lower_priority() {
+    pid_t tid = (pid_t)syscall(SYS_gettid);
+
+    /* On Linux, nice values are per thread. */
+    if (setpriority(PRIO_PROCESS, (id_t)tid, 19) != 0) {
+        LOG_WARN("Failed to lower checksum worker CPU priority: %s", strerror(errno));
+    }
+
+#ifdef SYS_ioprio_set
+    int ioprio = OIM_IOPRIO_CLASS_IDLE << OIM_IOPRIO_CLASS_SHIFT;
+    if (syscall(SYS_ioprio_set, OIM_IOPRIO_WHO_PROCESS, tid, ioprio) != 0) {
+        LOG_WARN("Failed to set idle I/O priority for checksum worker: %s", strerror(errno));
+    }
+#endif
+}
+
+static void oim_hex_encode(const unsigned char *bytes, unsigned int length, char *out) {
+    static const char hex[] = "0123456789abcdef";
+    for (unsigned int i = 0; i < length; i++) {
+        out[i * 2] = hex[bytes[i] >> 4];
+        out[i * 2 + 1] = hex[bytes[i] & 0x0f];
+    }
+    out[length * 2] = '\0';
+}
+
+/*
+ * Hashes one file with every configured algorithm in a single pass.
+ * Returns 1 if the file no longer matches the job's key, so the next
+ * scan will queue the new version instead.
+ */
+static int oim_checksum_file(const OIMChecksumJob *job, unsigned char *buffer, OIMFileDigests *out) {
+    int fd = open(job->path, O_RDONLY | O_CLOEXEC | O_NOATIME);
+    if (fd == -1 && errno == EPERM) {
+        fd = open(job->path, O_RDONLY | O_CLOEXEC);
+    }
+    if (fd == -1) {
+        return errno == ENOENT ? 1 : -1;
+    }
+
+    struct stat file_stat;
+    if (fstat(fd, &file_stat) != 0 ||
+        (uint64_t)file_stat.st_dev != job->key.device ||
+        (uint64_t)file_stat.st_ino != job->key.inode ||
+        file_stat.st_size != job->key.size ||
+        file_stat.st_mtime != job->key.modified) {
+        close(fd);
+        return 1;
+    }
+
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+    EVP_MD_CTX *contexts[OIM_DIGEST_COUNT] = { NULL };
+    int result = 0;
+
+    for (int algorithm = 0; algorithm < OIM_DIGEST_COUNT && result == 0; algorithm++) {
+        if (!(checksum_algorithms & (1u << algorithm))) {
+            continue;
+        }
+        contexts[algorithm] = EVP_MD_CTX_new();
+        if (contexts[algorithm] == NULL ||
+            EVP_DigestInit_ex(contexts[algorithm], oim_digest_md(algorithm), NULL) != 1) {
+            result = -1;
+        }
+    }
+
+    off_t offset = 0;
+    while (result == 0 && checksum_running) {
+        ssize_t n = read(fd, buffer, OIM_CHECKSUM_READ_SIZE);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            result = -1;
+            break;
+        }
+        if (n == 0) {
+            break;
+        }
+
+        for (int algorithm = 0; algorithm < OIM_DIGEST_COUNT; algorithm++) {
+            if (contexts[algorithm]) {
+                EVP_DigestUpdate(contexts[algorithm], buffer, (size_t)n);
+            }
+        }
+
+        /* Hashed pages are not worth keeping; leave the cache to downloads. */
+        posix_fadvise(fd, offset, n, POSIX_FADV_DONTNEED);
+        offset += n;
+    }
+
+    if (result == 0 && (!checksum_running || offset != job->key.size)) {
+        result = checksum_running ? 1 : -1;
+    }
+
+    memset(out, 0, sizeof(*out));
+    out->key = job->key;
+
+    for (int algorithm = 0; algorithm < OIM_DIGEST_COUNT; algorithm++) {
+        if (contexts[algorithm] == NULL) {
+            continue;
+        }
+        if (result == 0) {
+            unsigned char digest[EVP_MAX_MD_SIZE];
+            unsigned int length = 0;
+            if (EVP_DigestFinal_ex(contexts[algorithm], digest, &length) == 1) {
+                oim_hex_encode(digest, length, out->hex[algorithm]);
+            } else {
+                result = -1;
+            }
+        }
+        EVP_MD_CTX_free(contexts[algorithm]);
+    }
+
+    close(fd);
+    return result;
+}
+
+static void* oim_checksum_worker_main(void *arg __attribute__((unused))) {
+    unsigned char *buffer = malloc(OIM_CHECKSUM_READ_SIZE);
+    if (buffer == NULL) {
+        LOG_ERROR("Failed to allocate checksum read buffer");
+        return NULL;
+    }
+
+    oim_checksum_lower_priority();
+
+    pthread_mutex_lock(&checksum_lock);
+
+    while (checksum_running) {
+        if (job_begin == job_end) {
+            pthread_cond_wait(&checksum_cond, &checksum_lock);
+            continue;
+        }
+
+        OIMChecksumJob job = jobs[job_begin++];
+        if (job_begin == job_end) {
+            job_begin = job_end = 0;
+        }
+        jobs_running++;
+        pthread_mutex_unlock(&checksum_lock);
+
+        OIMFileDigests digests;
+        int result = oim_checksum_file(&job, buffer, &digests);
+
+        if (result < 0 && checksum_running) {
+            LOG_WARN("Failed to checksum %s: %s", job.path, strerror(errno));
+        }
+
+        pthread_mutex_lock(&checksum_lock);
+        jobs_running--;
+
+        OIMDigestRecord *record = oim_record_lookup(&job.key, result == 0);
+        if (record) {
+            record->queued = false;
+            if (result == 0) {
+                /* Keep digests stored for algorithms that are no longer configured. */
+                for (int algorithm = 0; algorithm < OIM_DIGEST_COUNT; algorithm++) {
+                    if (digests.hex[algorithm][0] != '\0') {
+                        memcpy(record->digests.hex[algorithm], digests.hex[algorithm],
+                               sizeof(digests.hex[algorithm]));
+                    }
+                }
+                digests = record->digests;
+                results_pending++;
+            }
+        }
+        free(job.path);
+
+        if (result == 0) {
+            pthread_mutex_unlock(&checksum_lock);
+            oim_cache_store_digests(&digests);
+            pthread_mutex_lock(&checksum_lock);
+        }
+
+        time_t now = time(NULL);
+        bool drained = job_begin == job_end && jobs_running == 0;
+        bool publish = results_pending > 0 && checksum_running &&
+                       (drained || now - last_publish >= OIM_CHECKSUM_PUBLISH_INTERVAL);
+
+        if (publish) {
+            size_t published = results_pending;
+            results_pending = 0;
+            last_publish = now;
+            pthread_mutex_unlock(&checksum_lock);
+
+            LOG_INFO("Publishing %zu new file digest%s", published, published == 1 ? "" : "s");
+            if (digests_ready) {
+                digests_ready();
+            }
+
+            pthread_mutex_lock(&checksum_lock);
+        }
+    }
+
+    pthread_mutex_unlock(&checksum_lock);
+    free(buffer);
+    return NULL;
+}
+
+int oim_checksum_start(OIMDigestsReadyCallback on_ready) {
+    if (checksum_algorithms == 0 || checksum_threads_started > 0) {
+        return 0;
+    }
+
+    digests_ready = on_ready;
+    last_publish = time(NULL);
+    checksum_running = 1;
+
+    for (int i = 0; i < checksum_thread_count; i++) {
+        if (pthread_create(&checksum_threads[i], NULL, oim_checksum_worker_main, NULL) != 0) {
+            LOG_WARN("Failed to start checksum worker %d, continuing with %d",
+                     i, checksum_threads_started);
+            break;
+        }
+        checksum_threads_started++;
+    }
+
+    if (checksum_threads_started == 0) {
+        checksum_running = 0;
+        LOG_ERROR("Failed to start checksum workers");
+        return -1;
+    }
+
+    LOG_INFO("Checksum engine started with %d worker%s",
+             checksum_threads_started, checksum_threads_started == 1 ? "" : "s");
+    return 0;
+}
+
+void oim_checksum_stop() {
+    pthread_mutex_lock(&checksum_lock);
+    checksum_running = 0;
+    pthread_cond_broadcast(&checksum_cond);
+    pthread_mutex_unlock(&checksum_lock);
+
+    for (int i = 0; i < checksum_threads_started; i++) {
+        pthread_join(checksum_threads[i], NULL);
+    }
+    checksum_threads_started = 0;
+
+    for (size_t i = job_begin; i < job_end; i++) {
+        free(jobs[i].path);
+    }
+    free(jobs);
+    jobs = NULL;
+    job_begin = job_end = job_capacity = 0;
+
+    free(records);
+    records = NULL;
+    record_capacity = record_count = 0;
+}
+
+/*
+ * Renders a sha256sum-style manifest for one category, with paths
+ * relative to the category directory. Files without a digest yet are
+ * left out.
+ */
+char* oim_checksum_sums(
+    const OIMMirrorCatalog *catalog,
+    uint32_t category_id,
+    OIMDigestAlgorithm algorithm,
+    size_t *length
+) {
+    if (catalog == NULL || category_id >= catalog->category_count ||
+        algorithm >= OIM_DIGEST_COUNT) {
+        return NULL;
+    }
+
+    const OIMCategoryIndex *index = &catalog->category_index[category_id];
+    const uint32_t *order = catalog->category_order[OIM_CATALOG_SORT_PATH] + index->start;
+
+    OIMBuffer buffer;
+    oim_buffer_init(&buffer, index->count * 96 + 1);
+
+    for (uint32_t i = 0; i < index->count; i++) {
+        const OIMMirrorEntry *entry = &catalog->entries[order[i]];
+        const char *hex = algorithm == OIM_DIGEST_SHA256 ? entry->sha256
+                        : algorithm == OIM_DIGEST_SHA512 ? entry->sha512
+                        : entry->md5;
+        if (hex == NULL) {
+            continue;
+        }
+
+        const char *relative = oim_catalog_relative_path(entry);
+        const char *slash = strchr(relative, '/');
+        if (slash) {
+            relative = slash + 1;
+        }
+
+        oim_buffer_appendf(&buffer, "%s  %s\n", hex, relative);
+    }
+
+    return oim_buffer_detach(&buffer, length);
+}
@@ -0,0 +1,182 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <zlib.h>
+
+#ifdef OIM_WITH_ZSTD
+#include <zstd.h>
+#endif
+
+#ifdef OIM_WITH_BROTLI
+#include <brotli/encode.h>
+#endif
+
+#include "compress.h"
+#include "logging.h"
+
+/*
+ * Request threads never compress, but every publish does, under the
+ * scan lock, and watch batches and digest updates publish often. These
+ * levels keep a large listing to well under a second per codec.
+ */
+#define OIM_GZIP_LEVEL 6
+#define OIM_ZSTD_LEVEL 3
+#define OIM_BROTLI_QUALITY 5
+
+const char* oim_encoding_name(OIMContentEncoding encoding) {
+    switch (encoding) {
+        case OIM_ENCODING_GZIP:   return "gzip";
+        case OIM_ENCODING_ZSTD:   return "zstd";
+        case OIM_ENCODING_BROTLI: return "br";
+        default:                  return "identity";
+    }
+}
+
+const char* oim_encoding_etag_suffix(OIMContentEncoding encoding) {
+    switch (encoding) {
+        case OIM_ENCODING_GZIP:   return "-gz";
+        case OIM_ENCODING_ZSTD:   return "-zst";
+        case OIM_ENCODING_BROTLI: return "-br";
+        default:                  return "";
+    }
+}
+
+bool oim_encoding_supported(OIMContentEncoding encoding) {
+    switch (encoding) {
+        case OIM_ENCODING_IDENTITY:
+        case OIM_ENCODING_GZIP:
+            return true;
+#ifdef OIM_WITH_ZSTD
+        case OIM_ENCODING_ZSTD:
+            return true;
+#endif
+#ifdef OIM_WITH_BROTLI
+        case OIM_ENCODING_BROTLI:
+            return true;
+#endif
+        default:
+            return false;
+    }
+}
+
+static int oim_compress_gzip(
+    const char *input,
+    size_t input_size,
+    char **output,
+    size_t *output_size
+) {
+    z_stream stream;
+    memset(&stream, 0, sizeof(stream));
+
+    if (deflateInit2(&stream, OIM_GZIP_LEVEL, Z_DEFLATED, 15 + 16, 9,
+                     Z_DEFAULT_STRATEGY) != Z_OK) {
+        return -1;
+    }
+
+    uLong bound = deflateBound(&stream, (uLong)input_size);
+    char *buffer = malloc(bound);
+    if (buffer == NULL) {
+        deflateEnd(&stream);
+        return -1;
+    }
+
+    stream.next_in = (Bytef *)input;
+    stream.avail_in = (uInt)input_size;
+    stream.next_out = (Bytef *)buffer;
+    stream.avail_out = (uInt)bound;
+
+    if (deflate(&stream, Z_FINISH) != Z_STREAM_END) {
+        deflateEnd(&stream);
+        free(buffer);
+        return -1;
+    }
+
+    *output = buffer;
+    *output_size = stream.total_out;
+    deflateEnd(&stream);
+
+    return 0;
+}
+
+#ifdef OIM_WITH_ZSTD
+static int oim_compress_zstd(
+    const char *input,
+    size_t input_size,
+    char **output,
+    size_t *output_size
+) {
+    size_t bound = ZSTD_compressBound(input_size);
+    char *buffer = malloc(bound);
+    if (buffer == NULL) {
+        return -1;
+    }
+
+    size_t result = ZSTD_compress(buffer, bound, input, input_size, OIM_ZSTD_LEVEL);
+    if (ZSTD_isError(result)) {
+        LOG_ERROR("zstd compression failed: %s", ZSTD_getErrorName(result));
+        free(buffer);
+        return -1;
+    }
+
+    *output = buffer;
+    *output_size = result;
+    return 0;
+}
+#endif
+
+#ifdef OIM_WITH_BROTLI
+static int oim_compress_brotli(
+    const char *input,
+    size_t input_size,
+    char **output,
+    size_t *output_size
+) {
+    size_t encoded_size = BrotliEncoderMaxCompressedSize(input_size);
+    if (encoded_size == 0) {
+        return -1;
+    }
+
+    char *buffer = malloc(encoded_size);
+    if (buffer == NULL) {
+        return -1;
+    }
+
+    if (!BrotliEncoderCompress(OIM_BROTLI_QUALITY, BROTLI_DEFAULT_WINDOW,
+                               BROTLI_MODE_TEXT, input_size,
+                               (const uint8_t *)input, &encoded_size,
+                               (uint8_t *)buffer)) {
+        free(buffer);
+        return -1;
+    }
+
+    *output = buffer;
+    *output_size = encoded_size;
+    return 0;
+}
+#endif
+
+int oim_compress_buffer(
+    OIMContentEncoding encoding,
+    const char *input,
+    size_t input_size,
+    char **output,
+    size_t *output_size
+) {
+    *output = NULL;
+    *output_size = 0;
+
+    switch (encoding) {
+        case OIM_ENCODING_GZIP:
+            return oim_compress_gzip(input, input_size, output, output_size);
+#ifdef OIM_WITH_ZSTD
+        case OIM_ENCODING_ZSTD:
+            return oim_compress_zstd(input, input_size, output, output_size);
+#endif
+#ifdef OIM_WITH_BROTLI
+        case OIM_ENCODING_BROTLI:
+            return oim_compress_brotli(input, input_size, output, output_size);
+#endif
+        default:
+            return -1;
+    }
+}
@@ -6,6 +6,58 @@
 #include <json-c/json.h>
 
 #include "config.h"
+#include "utils.h"
+
+/*
+ * Reads the optional "mirror_roots" array. Each root takes its recursion
+ * and scan interval from the top-level settings unless it sets its own.
+ */
+static int oim_load_mirror_roots(json_object *json_config, OIMConfig *config) {
+    json_object *roots;
+    if (!json_object_object_get_ex(json_config, "mirror_roots", &roots)) {
+        return 0;
+    }
+
+    if (!json_object_is_type(roots, json_type_array)) {
+        return -1;
+    }
+
+    size_t count = json_object_array_length(roots);
+    if (count == 0) {
+        return 0;
+    }
+
+    config->mirror_roots = calloc(count, sizeof(OIMMirrorRootConfig));
+    if (config->mirror_roots == NULL) {
+        return -1;
+    }
+
+    for (size_t i = 0; i < count; i++) {
+        json_object *item = json_object_array_get_idx(roots, i);
+        json_object *path;
+
+        if (!json_object_is_type(item, json_type_object) ||
+            !json_object_object_get_ex(item, "path", &path)) {
+            return -1;
+        }
+
+        OIMMirrorRootConfig *root = &config->mirror_roots[config->mirror_root_count++];
+        root->path = strdup(json_object_get_string(path));
+        root->prefix = oim_get_string_value(item, "prefix", "");
+        root->recursive = oim_get_bool_value(item, "recursive", config->recursive_scan);
+        root->scan_interval = oim_get_int_value(item, "scan_interval", config->scan_interval);
+
+        if (root->path == NULL || root->prefix == NULL) {
+            return -1;
+        }
+
+        fprintf(stderr, "Mirror Root: %s (prefix \"%s\", %s, every %d seconds)\n",
+                root->path, root->prefix,
+                root->recursive ? "recursive" : "top level only", root->scan_interval);
+    }
+
+    return 0;
+}
 
 OIMConfig* oim_load_config(const char *config_path) {
 
@@ -53,7 +105,7 @@ OIMConfig* oim_load_config(const char *config_path) {
         return NULL;
     }
 
-    OIMConfig *config = malloc(sizeof(OIMConfig));
+    OIMConfig *config = calloc(1, sizeof(OIMConfig));
     if (config == NULL) {
         fprintf(stderr, "Memory allocation error for config structure\n");
         json_object_put(json_config);
@@ -63,6 +115,162 @@ OIMConfig* oim_load_config(const char *config_path) {
     config->api_port = oim_get_int_value(json_config, "api_port", 8080);
     fprintf(stderr, "API Port: %d\n", config->api_port);
 
+    config->thread_pool_size = oim_get_int_value(
+        json_config, 
+        "thread_pool_size", 
+        0
+    );
+    if (config->thread_pool_size <= 0) {
+        config->thread_pool_size = get_cpu_count();
+    }
+    if (config->thread_pool_size <= 0) {
+        config->thread_pool_size = 1;
+    }
+    fprintf(stderr, "Thread Pool Size: %d\n", config->thread_pool_size);
+
+    config->use_epoll = oim_get_bool_value(
+        json_config, 
+        "use_epoll", 
+        true
+    );
+    fprintf(stderr, "Epoll: %s\n", 
+            config->use_epoll ? "Enabled" : "Disabled");
+
+    config->connection_limit = oim_get_int_value(
+        json_config, 
+        "connection_limit", 
+        0
+    );
+    fprintf(stderr, "Connection Limit: %d\n", config->connection_limit);
+
+    config->per_ip_connection_limit = oim_get_int_value(
+        json_config, 
+        "per_ip_connection_limit", 
+        0
+    );
+    fprintf(stderr, "Per-IP Connection Limit: %d\n", config->per_ip_connection_limit);
+
+    config->connection_timeout = oim_get_int_value(
+        json_config, 
+        "connection_timeout", 
+        30
+    );
+    fprintf(stderr, "Connection Timeout: %d seconds\n", config->connection_timeout);
+
+    config->download_rate_limit = oim_get_int_value(
+        json_config, 
+        "download_rate_limit", 
+        0
+    );
+    fprintf(stderr, "Download Rate Limit: %d KiB/s\n", config->download_rate_limit);
+
+    config->client_rate_limit = oim_get_int_value(
+        json_config, 
+        "client_rate_limit", 
+        0
+    );
+    fprintf(stderr, "Per-Client Rate Limit: %d KiB/s\n", config->client_rate_limit);
+
+    config->public_transfers = oim_get_bool_value(
+        json_config, 
+        "public_transfers", 
+        false
+    );
+    fprintf(stderr, "Transfer List: %s\n", 
+            config->public_transfers ? "Public" : "Local Only");
+
+    config->max_downloads = oim_get_int_value(
+        json_config, 
+        "max_downloads", 
+        0
+    );
+    fprintf(stderr, "Max Downloads: %d\n", config->max_downloads);
+
+    config->max_client_downloads = oim_get_int_value(
+        json_config, 
+        "max_client_downloads", 
+        0
+    );
+    fprintf(stderr, "Max Downloads Per Client: %d\n", config->max_client_downloads);
+
+    config->download_queue_length = oim_get_int_value(
+        json_config, 
+        "download_queue_length", 
+        0
+    );
+    fprintf(stderr, "Download Queue Length: %d\n", config->download_queue_length);
+
+    config->download_queue_timeout = oim_get_int_value(
+        json_config, 
+        "download_queue_timeout", 
+        10
+    );
+    fprintf(stderr, "Download Queue Timeout: %d seconds\n", config->download_queue_timeout);
+
+    config->retry_after = oim_get_int_value(
+        json_config, 
+        "retry_after", 
+        5
+    );
+    fprintf(stderr, "Retry-After: %d seconds\n", config->retry_after);
+
+    config->use_io_uring = oim_get_bool_value(
+        json_config, 
+        "use_io_uring", 
+        false
+    );
+    fprintf(stderr, "io_uring Downloads: %s\n", 
+            config->use_io_uring ? "Enabled" : "Disabled");
+
+    config->io_uring_queue_depth = oim_get_int_value(
+        json_config, 
+        "io_uring_queue_depth", 
+        64
+    );
+    fprintf(stderr, "io_uring Queue Depth: %d\n", config->io_uring_queue_depth);
+
+    config->io_uring_buffers = oim_get_int_value(
+        json_config, 
+        "io_uring_buffers", 
+        256
+    );
+    fprintf(stderr, "io_uring Buffers: %d\n", config->io_uring_buffers);
+
+    config->io_uring_buffer_size = oim_get_int_value(
+        json_config, 
+        "io_uring_buffer_size", 
+        256
+    );
+    fprintf(stderr, "io_uring Buffer Size: %d KiB\n", config->io_uring_buffer_size);
+
+    config->fd_cache_size = oim_get_int_value(
+        json_config, 
+        "fd_cache_size", 
+        256
+    );
+    fprintf(stderr, "Open File Cache: %d\n", config->fd_cache_size);
+
+    config->event_keepalive = oim_get_int_value(
+        json_config, 
+        "event_keepalive", 
+        15
+    );
+    fprintf(stderr, "Event Keepalive: %d seconds\n", config->event_keepalive);
+
+    config->max_event_subscribers = oim_get_int_value(
+        json_config, 
+        "max_event_subscribers", 
+        1024
+    );
+    fprintf(stderr, "Max Event Subscribers: %d\n", config->max_event_subscribers);
+
+    config->long_poll_timeout = oim_get_int_value(
+        json_config, 
+        "long_poll_timeout", 
+        60
+    );
+    fprintf(stderr, "Long Poll Timeout: %d seconds\n", config->long_poll_timeout);
+
     config->mirror_directory = oim_get_string_value(
         json_config, 
         "mirror_directory", 
@@ -92,6 +300,21 @@ OIMConfig* oim_load_config(const char *config_path) {
     );
     fprintf(stderr, "Cache Expiry Time: %d seconds\n", config->cache_expiry_time);
 
+    config->snapshot_path = oim_get_string_value(
+        json_config, 
+        "snapshot_path", 
+        "/var/cache/open_image_mirror/catalog.snap"
+    );
+    fprintf(stderr, "Snapshot Path: %s\n", 
+            config->snapshot_path && *config->snapshot_path ? config->snapshot_path : "Disabled");
+
+    config->change_log_size = oim_get_int_value(
+        json_config, 
+        "change_log_size", 
+        10000
+    );
+    fprintf(stderr, "Change Log Size: %d\n", config->change_log_size);
+
     config->scan_interval = oim_get_int_value(
         json_config, 
         "scan_interval", 
@@ -107,6 +330,48 @@ OIMConfig* oim_load_config(const char *config_path) {
     fprintf(stderr, "Recursive Scan: %s\n", 
             config->recursive_scan ? "Enabled" : "Disabled");
 
+    if (oim_load_mirror_roots(json_config, config) != 0) {
+        fprintf(stderr, "Error: mirror_roots must be an array of objects with a \"path\"\n");
+        json_object_put(json_config);
+        oim_free_config(config);
+        return NULL;
+    }
+
+    config->scan_threads = oim_get_int_value(
+        json_config, 
+        "scan_threads", 
+        0
+    );
+    if (config->scan_threads <= 0) {
+        config->scan_threads = get_cpu_count();
+    }
+    if (config->scan_threads <= 0) {
+        config->scan_threads = 1;
+    }
+    fprintf(stderr, "Scan Threads: %d\n", config->scan_threads);
+
+    config->watch_mode = oim_get_bool_value(
+        json_config, 
+        "watch_mode", 
+        false
+    );
+    fprintf(stderr, "Watch Mode: %s\n", 
+            config->watch_mode ? "Enabled" : "Disabled");
+
+    config->checksum_threads = oim_get_int_value(
+        json_config, 
+        "checksum_threads", 
+        1
+    );
+    fprintf(stderr, "Checksum Threads: %d\n", config->checksum_threads);
+
+    config->checksum_algorithms = oim_get_string_value(
+        json_config, 
+        "checksum_algorithms", 
+        "sha256"
+    );
+    fprintf(stderr, "Checksum Algorithms: %s\n", config->checksum_algorithms);
+
     config->enable_logging = oim_get_bool_value(
         json_config, 
         "enable_logging", 
@@ -122,6 +387,13 @@ OIMConfig* oim_load_config(const char *config_path) {
     );
     fprintf(stderr, "Log File Path: %s\n", config->log_file_path);
 
+    config->log_overflow_policy = oim_get_string_value(
+        json_config, 
+        "log_overflow_policy", 
+        "drop"
+    );
+    fprintf(stderr, "Log Overflow Policy: %s\n", config->log_overflow_policy);
+
     config->debug_mode = oim_get_bool_value(
         json_config, 
         "debug_mode", 
@@ -146,8 +418,16 @@ void oim_free_config(OIMConfig *config) {
     if (config == NULL) return;
 
     free(config->mirror_directory);
+    for (int i = 0; i < config->mirror_root_count; i++) {
+        free(config->mirror_roots[i].path);
+        free(config->mirror_roots[i].prefix);
+    }
+    free(config->mirror_roots);
     free(config->cache_db_path);
+    free(config->snapshot_path);
+    free(config->checksum_algorithms);
     free(config->log_file_path);
+    free(config->log_overflow_policy);
 
     free(config);
 }
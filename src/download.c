@@ -0,0 +1,656 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <time.h>
+#include <unistd.h>
+#include <errno.h>
+#include <microhttpd.h>
+
+#include "download.h"
+#include "http.h"
+#include "api.h"
+#include "imgMgr.h"
+#include "snapshot.h"
+#include "fdcache.h"
+#include "throttle.h"
+#include "uring.h"
+#include "logging.h"
+
+#define OIM_MULTIPART_BOUNDARY_LEN 32
+#define OIM_BODY_BLOCK_SIZE (64 * 1024)
+
+typedef struct {
+    char header[192];
+    size_t header_len;
+    uint64_t start;
+    uint64_t length;
+    uint64_t body_offset;
+} OIMMultipartPart;
+
+typedef struct {
+    OIMCachedFile *file;
+    int part_count;
+    char trailer[64];
+    size_t trailer_len;
+    uint64_t trailer_offset;
+    uint64_t total_size;
+    OIMMultipartPart parts[OIM_MAX_BYTE_RANGES];
+} OIMMultipartState;
+
+/* A file or one range of it, read through a callback so sends can be shaped. */
+typedef struct {
+    OIMCachedFile *file;
+    uint64_t offset;
+} OIMFileBodyState;
+
+static const char* oim_download_basename(const char *path) {
+    const char *base = strrchr(path, '/');
+    return base ? base + 1 : path;
+}
+
+static const char* oim_skip_spaces(const char *p) {
+    while (*p == ' ' || *p == '\t') {
+        p++;
+    }
+    return p;
+}
+
+static int oim_parse_uint64(const char **cursor, uint64_t *value) {
+    const char *p = *cursor;
+    uint64_t result = 0;
+
+    if (!isdigit((unsigned char)*p)) {
+        return -1;
+    }
+
+    while (isdigit((unsigned char)*p)) {
+        uint64_t digit = (uint64_t)(*p - '0');
+        if (result > (UINT64_MAX - digit) / 10) {
+            return -1;
+        }
+        result = result * 10 + digit;
+        p++;
+    }
+
+    *value = result;
+    *cursor = p;
+    return 0;
+}
+
+static int oim_compare_ranges(const void *a, const void *b) {
+    const OIMByteRange *ra = a;
+    const OIMByteRange *rb = b;
+
+    if (ra->start < rb->start) return -1;
+    if (ra->start > rb->start) return 1;
+    return 0;
+}
+
+OIMRangeResult oim_parse_range_header(
+    const char *header,
+    uint64_t file_size,
+    OIMByteRange *ranges,
+    int *range_count
+) {
+    *range_count = 0;
+
+    if (header == NULL || strncasecmp(header, "bytes=", 6) != 0) {
+        return OIM_RANGE_NONE;
+    }
+
+    const char *p = header + 6;
+    int spec_count = 0;
+
+    while (*p) {
+        p = oim_skip_spaces(p);
+
+        if (*p == ',') {
+            p++;
+            continue;
+        }
+
+        uint64_t first = 0;
+        uint64_t last = 0;
+        bool has_first = false;
+        bool has_last = false;
+
+        if (*p != '-') {
+            if (oim_parse_uint64(&p, &first) != 0) {
+                return OIM_RANGE_NONE;
+            }
+            has_first = true;
+        }
+
+        if (*p != '-') {
+            return OIM_RANGE_NONE;
+        }
+        p++;
+
+        if (isdigit((unsigned char)*p)) {
+            if (oim_parse_uint64(&p, &last) != 0) {
+                return OIM_RANGE_NONE;
+            }
+            has_last = true;
+        }
+
+        p = oim_skip_spaces(p);
+        if (*p != ',' && *p != '\0') {
+            return OIM_RANGE_NONE;
+        }
+
+        if (!has_first && !has_last) {
+            return OIM_RANGE_NONE;
+        }
+
+        if (has_first && has_last && last < first) {
+            return OIM_RANGE_NONE;
+        }
+
+        if (++spec_count > OIM_MAX_BYTE_RANGES) {
+            return OIM_RANGE_NONE;
+        }
+
+        OIMByteRange range;
+        if (!has_first) {
+            if (last == 0 || file_size == 0) {
+                continue;
+            }
+            range.length = last < file_size ? last : file_size;
+            range.start = file_size - range.length;
+        } else {
+            if (first >= file_size) {
+                continue;
+            }
+            if (!has_last || last >= file_size) {
+                last = file_size - 1;
+            }
+            range.start = first;
+            range.length = last - first + 1;
+        }
+
+        ranges[(*range_count)++] = range;
+    }
+
+    if (spec_count == 0) {
+        return OIM_RANGE_NONE;
+    }
+
+    if (*range_count == 0) {
+        return OIM_RANGE_UNSATISFIABLE;
+    }
+
+    qsort(ranges, *range_count, sizeof(OIMByteRange), oim_compare_ranges);
+
+    int merged = 0;
+    for (int i = 1; i < *range_count; i++) {
+        OIMByteRange *current = &ranges[merged];
+        uint64_t current_end = current->start + current->length;
+
+        if (ranges[i].start <= current_end) {
+            uint64_t end = ranges[i].start + ranges[i].length;
+            if (end > current_end) {
+                current->length = end - current->start;
+            }
+        } else {
+            ranges[++merged] = ranges[i];
+        }
+    }
+    *range_count = merged + 1;
+
+    return OIM_RANGE_SATISFIABLE;
+}
+
+static ssize_t oim_multipart_reader(void *cls, uint64_t pos, char *buf, size_t max) {
+    OIMMultipartState *state = cls;
+
+    if (pos >= state->total_size) {
+        return MHD_CONTENT_READER_END_OF_STREAM;
+    }
+
+    if (pos >= state->trailer_offset) {
+        size_t offset = (size_t)(pos - state->trailer_offset);
+        size_t count = state->trailer_len - offset;
+        if (count > max) {
+            count = max;
+        }
+        memcpy(buf, state->trailer + offset, count);
+        return (ssize_t)count;
+    }
+
+    for (int i = 0; i < state->part_count; i++) {
+        OIMMultipartPart *part = &state->parts[i];
+        uint64_t data_offset = part->body_offset + part->header_len;
+
+        if (pos >= data_offset + part->length) {
+            continue;
+        }
+
+        if (pos < data_offset) {
+            size_t offset = (size_t)(pos - part->body_offset);
+            size_t count = part->header_len - offset;
+            if (count > max) {
+                count = max;
+            }
+            memcpy(buf, part->header + offset, count);
+            return (ssize_t)count;
+        }
+
+        uint64_t remaining = data_offset + part->length - pos;
+        size_t count = remaining < max ? (size_t)remaining : max;
+        ssize_t read_bytes = pread(state->file->fd, buf, count,
+                                   (off_t)(part->start + (pos - data_offset)));
+        if (read_bytes <= 0) {
+            return MHD_CONTENT_READER_END_WITH_ERROR;
+        }
+        return read_bytes;
+    }
+
+    return MHD_CONTENT_READER_END_WITH_ERROR;
+}
+
+static void oim_multipart_free(void *cls) {
+    OIMMultipartState *state = cls;
+    oim_fdcache_release(state->file);
+    free(state);
+}
+
+static ssize_t oim_file_body_reader(void *cls, uint64_t pos, char *buf, size_t max) {
+    OIMFileBodyState *state = cls;
+
+    ssize_t read_bytes = pread(state->file->fd, buf, max, (off_t)(state->offset + pos));
+    if (read_bytes < 0) {
+        return MHD_CONTENT_READER_END_WITH_ERROR;
+    }
+    if (read_bytes == 0) {
+        return MHD_CONTENT_READER_END_OF_STREAM;
+    }
+    return read_bytes;
+}
+
+static void oim_file_body_free(void *cls) {
+    OIMFileBodyState *state = cls;
+    oim_fdcache_release(state->file);
+    free(state);
+}
+
+/* Callback bodies go through the download shaper whenever a limit is set. */
+static struct MHD_Response* oim_create_callback_response(
+    struct MHD_Connection *connection,
+    const char *client_ip,
+    const char *file_path,
+    uint64_t size,
+    MHD_ContentReaderCallback reader,
+    void *cls,
+    MHD_ContentReaderFreeCallback free_callback
+) {
+    if (oim_throttle_enabled()) {
+        return oim_throttle_create_response(connection, client_ip, file_path,
+                                            size, reader, cls, free_callback);
+    }
+
+    return MHD_create_response_from_callback(size, OIM_BODY_BLOCK_SIZE,
+                                             reader, cls, free_callback);
+}
+
+/* Reads through the io_uring engine on a duplicate of the shared fd. */
+static struct MHD_Response* oim_create_uring_response(
+    struct MHD_Connection *connection,
+    const char *client_ip,
+    const char *file_path,
+    int fd,
+    uint64_t offset,
+    uint64_t length
+) {
+    int body_fd = dup(fd);
+    if (body_fd == -1) {
+        return NULL;
+    }
+
+    void *transfer = oim_uring_open(connection, body_fd, offset, length);
+    if (transfer == NULL) {
+        close(body_fd);
+        return NULL;
+    }
+
+    struct MHD_Response *response = oim_create_callback_response(
+        connection, client_ip, file_path, length,
+        oim_uring_reader, transfer, oim_uring_close);
+
+    if (response == NULL) {
+        oim_uring_close(transfer);
+        return NULL;
+    }
+
+    return response;
+}
+
+/*
+ * A file or single range is read through io_uring when it is enabled.
+ * Otherwise, unshaped, it is sent straight from a dup of the shared fd,
+ * which lets MHD use sendfile; shaped, it is read through a pread
+ * callback holding its own reference. The caller keeps its reference.
+ */
+static struct MHD_Response* oim_create_file_response(
+    struct MHD_Connection *connection,
+    const char *client_ip,
+    const char *file_path,
+    OIMCachedFile *file,
+    uint64_t offset,
+    uint64_t length
+) {
+    if (oim_uring_enabled()) {
+        struct MHD_Response *response = oim_create_uring_response(
+            connection, client_ip, file_path, file->fd, offset, length);
+        if (response) {
+            return response;
+        }
+    }
+
+    if (!oim_throttle_enabled()) {
+        int body_fd = dup(file->fd);
+        if (body_fd == -1) {
+            return NULL;
+        }
+
+        struct MHD_Response *response = MHD_create_response_from_fd_at_offset64(
+            length, body_fd, offset);
+        if (response == NULL) {
+            close(body_fd);
+        }
+        return response;
+    }
+
+    OIMFileBodyState *state = malloc(sizeof(OIMFileBodyState));
+    if (state == NULL) {
+        return NULL;
+    }
+
+    state->file = oim_fdcache_retain(file);
+    state->offset = offset;
+
+    struct MHD_Response *response = oim_throttle_create_response(
+        connection, client_ip, file_path, length,
+        oim_file_body_reader, state, oim_file_body_free);
+
+    if (response == NULL) {
+        oim_fdcache_release(state->file);
+        free(state);
+    }
+
+    return response;
+}
+
+static struct MHD_Response* oim_create_multipart_response(
+    struct MHD_Connection *connection,
+    const char *client_ip,
+    const char *file_path,
+    OIMCachedFile *file,
+    const OIMByteRange *ranges,
+    int range_count,
+    char *content_type,
+    size_t content_type_size
+) {
+    OIMMultipartState *state = calloc(1, sizeof(OIMMultipartState));
+    if (state == NULL) {
+        return NULL;
+    }
+
+    char boundary[OIM_MULTIPART_BOUNDARY_LEN + 1];
+    snprintf(boundary, sizeof(boundary), "OIM%013llx%016llx",
+             (unsigned long long)file->inode & 0xfffffffffffffULL,
+             (unsigned long long)time(NULL) ^ (unsigned long long)(uintptr_t)state);
+
+    state->file = oim_fdcache_retain(file);
+    state->part_count = range_count;
+
+    uint64_t offset = 0;
+    for (int i = 0; i < range_count; i++) {
+        OIMMultipartPart *part = &state->parts[i];
+        int written = snprintf(part->header, sizeof(part->header),
+            "%s--%s\r\n"
+            "Content-Type: application/octet-stream\r\n"
+            "Content-Range: bytes %llu-%llu/%llu\r\n\r\n",
+            i == 0 ? "" : "\r\n",
+            boundary,
+            (unsigned long long)ranges[i].start,
+            (unsigned long long)(ranges[i].start + ranges[i].length - 1),
+            (unsigned long long)file->size);
+
+        part->header_len = (size_t)written;
+        part->start = ranges[i].start;
+        part->length = ranges[i].length;
+        part->body_offset = offset;
+
+        offset += part->header_len + part->length;
+    }
+
+    state->trailer_len = (size_t)snprintf(state->trailer, sizeof(state->trailer),
+                                          "\r\n--%s--\r\n", boundary);
+    state->trailer_offset = offset;
+    state->total_size = offset + state->trailer_len;
+
+    snprintf(content_type, content_type_size,
+             "multipart/byteranges; boundary=%s", boundary);
+
+    struct MHD_Response *response = oim_create_callback_response(
+        connection,
+        client_ip,
+        file_path,
+        state->total_size,
+        oim_multipart_reader,
+        state,
+        oim_multipart_free
+    );
+
+    if (response == NULL) {
+        oim_multipart_free(state);
+    }
+
+    return response;
+}
+
+static bool oim_if_range_matches(
+    const char *if_range,
+    const char *etag,
+    time_t modified
+) {
+    if (if_range == NULL) {
+        return true;
+    }
+
+    /* If-Range requires a strong comparison, so weak tags never match. */
+    if (if_range[0] == '"') {
+        return strcmp(if_range, etag) == 0;
+    }
+
+    if (strncmp(if_range, "W/", 2) == 0) {
+        return false;
+    }
+
+    time_t if_range_time = oim_parse_http_date(if_range);
+    if (if_range_time == (time_t)-1) {
+        return false;
+    }
+
+    return if_range_time == modified;
+}
+
+static bool oim_download_not_modified(
+    struct MHD_Connection *connection,
+    const OIMMirrorEntry *entry,
+    char *etag,
+    size_t etag_size,
+    time_t *last_modified
+) {
+    if (entry->inode == 0) {
+        return false;
+    }
+
+    oim_format_file_etag(entry->inode, (uint64_t)entry->file_size,
+                         entry->modified_time, etag, etag_size);
+    *last_modified = entry->modified_time;
+    return oim_request_not_modified(connection, etag, entry->modified_time);
+}
+
+enum MHD_Result oim_send_download_response(
+    struct MHD_Connection *connection,
+    const char *file_path,
+    const char *client_ip,
+    uint64_t *body_length
+) {
+    char etag[OIM_ETAG_MAX_LEN];
+    time_t last_modified = 0;
+
+    *body_length = 0;
+
+    OIMMirrorSnapshot *snapshot = oim_get_mirror_snapshot();
+    const OIMMirrorEntry *entry = oim_snapshot_find_file(snapshot, file_path);
+
+    /* Only catalogued files are served, so unknown paths never reach the disk. */
+    if (entry == NULL) {
+        oim_snapshot_release(snapshot);
+        LOG_WARN("Download of uncatalogued file from IP: %s, File: %s", client_ip, file_path);
+        return send_oim_json_response(connection,
+            "{\"error\": \"File not found\"}",
+            MHD_HTTP_NOT_FOUND);
+    }
+
+    if (oim_download_not_modified(connection, entry, etag, sizeof(etag), &last_modified)) {
+        oim_snapshot_release(snapshot);
+        LOG_INFO("Not modified: %s for IP: %s", file_path, client_ip);
+        return oim_send_not_modified(connection, etag, last_modified,
+                                     OIM_DOWNLOAD_CACHE_CONTROL);
+    }
+
+    OIMCachedFile *file = oim_fdcache_open(file_path, entry, snapshot->generation);
+    oim_snapshot_release(snapshot);
+
+    if (file == NULL) {
+        LOG_ERROR("Failed to open file for download from IP: %s, File: %s, Error: %s",
+                  client_ip, file_path, strerror(errno));
+
+        return send_oim_json_response(connection,
+            "{\"error\": \"File not found\"}",
+            MHD_HTTP_NOT_FOUND);
+    }
+
+    uint64_t file_size = file->size;
+    time_t modified = file->modified;
+
+    oim_format_file_etag(file->inode, file_size, modified, etag, sizeof(etag));
+
+    if (oim_request_not_modified(connection, etag, modified)) {
+        oim_fdcache_release(file);
+        return oim_send_not_modified(connection, etag, modified,
+                                     OIM_DOWNLOAD_CACHE_CONTROL);
+    }
+
+    OIMByteRange ranges[OIM_MAX_BYTE_RANGES];
+    int range_count = 0;
+    OIMRangeResult range_result = OIM_RANGE_NONE;
+
+    const char *range_header = MHD_lookup_connection_value(
+        connection, MHD_HEADER_KIND, MHD_HTTP_HEADER_RANGE);
+    const char *if_range = MHD_lookup_connection_value(
+        connection, MHD_HEADER_KIND, MHD_HTTP_HEADER_IF_RANGE);
+
+    if (range_header && oim_if_range_matches(if_range, etag, modified)) {
+        range_result = oim_parse_range_header(range_header, file_size, ranges, &range_count);
+    }
+
+    if (range_result == OIM_RANGE_UNSATISFIABLE) {
+        oim_fdcache_release(file);
+        LOG_INFO("Unsatisfiable range from IP: %s, File: %s, Range: %s",
+                 client_ip, file_path, range_header);
+
+        struct MHD_Response *response = MHD_create_response_from_buffer(
+            0, "", MHD_RESPMEM_PERSISTENT);
+        if (response == NULL) {
+            return MHD_NO;
+        }
+
+        char content_range[64];
+        snprintf(content_range, sizeof(content_range), "bytes */%llu",
+                 (unsigned long long)file_size);
+        MHD_add_response_header(response, MHD_HTTP_HEADER_CONTENT_RANGE, content_range);
+        MHD_add_response_header(response, MHD_HTTP_HEADER_ACCEPT_RANGES, "bytes");
+
+        enum MHD_Result ret = MHD_queue_response(connection,
+            MHD_HTTP_RANGE_NOT_SATISFIABLE, response);
+        MHD_destroy_response(response);
+        return ret;
+    }
+
+    struct MHD_Response *response = NULL;
+    unsigned int status_code = MHD_HTTP_OK;
+    uint64_t payload_length = file_size;
+    char content_type[96] = "application/octet-stream";
+    char content_range[96] = "";
+
+    switch (range_result) {
+        case OIM_RANGE_SATISFIABLE:
+            status_code = MHD_HTTP_PARTIAL_CONTENT;
+            payload_length = 0;
+            for (int i = 0; i < range_count; i++) {
+                payload_length += ranges[i].length;
+            }
+            if (range_count == 1) {
+                response = oim_create_file_response(connection, client_ip, file_path,
+                    file, ranges[0].start, ranges[0].length);
+                snprintf(content_range, sizeof(content_range), "bytes %llu-%llu/%llu",
+                         (unsigned long long)ranges[0].start,
+                         (unsigned long long)(ranges[0].start + ranges[0].length - 1),
+                         (unsigned long long)file_size);
+            } else {
+                response = oim_create_multipart_response(connection, client_ip,
+                    file_path, file, ranges, range_count,
+                    content_type, sizeof(content_type));
+            }
+            break;
+
+        default:
+            response = oim_create_file_response(connection, client_ip, file_path,
+                file, 0, file_size);
+            break;
+    }
+
+    /* Responses hold their own reference or descriptor. */
+    oim_fdcache_release(file);
+
+    if (response == NULL) {
+        return send_oim_json_response(connection,
+            "{\"error\": \"Failed to create response\"}",
+            MHD_HTTP_INTERNAL_SERVER_ERROR);
+    }
+
+    char content_disposition[256];
+    snprintf(content_disposition, sizeof(content_disposition),
+             "attachment; filename=\"%s\"", oim_download_basename(file_path));
+
+    MHD_add_response_header(response, MHD_HTTP_HEADER_CONTENT_TYPE, content_type);
+    MHD_add_response_header(response, "Content-Disposition", content_disposition);
+    MHD_add_response_header(response, MHD_HTTP_HEADER_ACCEPT_RANGES, "bytes");
+    oim_add_validator_headers(response, etag, modified,
+                              OIM_DOWNLOAD_CACHE_CONTROL);
+
+    if (content_range[0] != '\0') {
+        MHD_add_response_header(response, MHD_HTTP_HEADER_CONTENT_RANGE, content_range);
+    }
+
+    if (status_code == MHD_HTTP_PARTIAL_CONTENT) {
+        LOG_INFO("Serving %d range(s) of %s to IP: %s", range_count, file_path, client_ip);
+    }
+
+    enum MHD_Result ret = MHD_queue_response(connection, status_code, response);
+
+    MHD_destroy_response(response);
+
+    if (ret == MHD_YES) {
+        *body_length = payload_length;
+    }
+
+    return ret;
+}
@@ -0,0 +1,485 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <time.h>
+#include <pthread.h>
+#include <microhttpd.h>
+
+#include "events.h"
+#include "changelog.h"
+#include "metrics.h"
+#include "logging.h"
+
+#define OIM_EVENTS_RESUME_BATCH 64
+#define OIM_EVENTS_BLOCK_SIZE 1024
+
+static const char oim_keepalive_comment[] = ":\n\n";
+
+/* One serialized event, shared by every subscriber sending it. */
+typedef struct {
+    int refcount;
+    uint64_t generation;
+    size_t size;
+    char data[];
+} OIMEvent;
+
+typedef struct OIMEventSubscriber {
+    struct MHD_Connection *connection;
+
+    /* The event being sent, referenced until its last byte is out. */
+    OIMEvent *event;
+    size_t offset;
+    uint64_t generation;
+
+    uint64_t keepalive_ns;
+    bool keepalive_due;
+    bool waiting;
+
+    struct OIMEventSubscriber *prev;
+    struct OIMEventSubscriber *next;
+} OIMEventSubscriber;
+
+static OIMEventsConfig events_config;
+static pthread_mutex_t events_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t events_cond;
+static pthread_t events_thread;
+static bool events_started = false;
+static bool events_running = false;
+
+static OIMEvent *latest_event = NULL;
+static uint64_t latest_generation = 0;
+
+static OIMEventSubscriber *subscribers = NULL;
+static OIMEventWaiter *waiters = NULL;
+static size_t subscriber_count = 0;
+static size_t waiter_count = 0;
+
+static uint64_t oim_events_keepalive_ns() {
+    return (uint64_t)(events_config.keepalive_interval > 0 ?
+                      events_config.keepalive_interval : 0) * 1000000000ULL;
+}
+
+static void oim_event_release(OIMEvent *event) {
+    if (event && __atomic_sub_fetch(&event->refcount, 1, __ATOMIC_ACQ_REL) == 0) {
+        free(event);
+    }
+}
+
+static void oim_events_unlink_waiter(OIMEventWaiter *waiter) {
+    if (waiter->prev) {
+        waiter->prev->next = waiter->next;
+    } else {
+        waiters = waiter->next;
+    }
+    if (waiter->next) {
+        waiter->next->prev = waiter->prev;
+    }
+    waiter->prev = NULL;
+    waiter->next = NULL;
+    waiter_count--;
+}
+
+/*
+ * Collects up to a batch of suspended connections to resume: waiters
+ * whose generation arrived or deadline passed, and subscribers with an
+ * event to send or a keepalive due. With force set everything is due.
+ * Called with events_lock held; the caller resumes them after unlocking.
+ * They stay valid until then, because a suspended connection cannot
+ * complete.
+ */
+static size_t oim_events_collect_due(
+    uint64_t now,
+    bool force,
+    struct MHD_Connection **due,
+    uint64_t *next_wake
+) {
+    size_t count = 0;
+    *next_wake = UINT64_MAX;
+
+    OIMEventWaiter *waiter = waiters;
+    while (waiter && count < OIM_EVENTS_RESUME_BATCH) {
+        OIMEventWaiter *next = waiter->next;
+
+        if (force || latest_generation > waiter->since || waiter->deadline_ns <= now) {
+            oim_events_unlink_waiter(waiter);
+            waiter->state = OIM_WAIT_DONE;
+            due[count++] = waiter->connection;
+        } else if (waiter->deadline_ns < *next_wake) {
+            *next_wake = waiter->deadline_ns;
+        }
+        waiter = next;
+    }
+
+    /* Keepalives a little early are fine; it lets one wakeup cover many subscribers. */
+    uint64_t slack = oim_events_keepalive_ns() / 4;
+
+    for (OIMEventSubscriber *subscriber = subscribers;
+         subscriber && count < OIM_EVENTS_RESUME_BATCH;
+         subscriber = subscriber->next) {
+        if (!subscriber->waiting) {
+            continue;
+        }
+
+        bool keepalive = slack > 0 && subscriber->keepalive_ns <= now + slack;
+
+        if (force || latest_generation > subscriber->generation || keepalive) {
+            subscriber->waiting = false;
+            subscriber->keepalive_due = keepalive;
+            due[count++] = subscriber->connection;
+        } else if (slack > 0 && subscriber->keepalive_ns < *next_wake) {
+            *next_wake = subscriber->keepalive_ns;
+        }
+    }
+
+    /* A full batch may have left due connections behind. */
+    if (count == OIM_EVENTS_RESUME_BATCH) {
+        *next_wake = now;
+    }
+
+    return count;
+}
+
+static void oim_events_resume(struct MHD_Connection **due, size_t count) {
+    for (size_t i = 0; i < count; i++) {
+        MHD_resume_connection(due[i]);
+    }
+}
+
+static void* oim_events_main(void *arg __attribute__((unused))) {
+    struct MHD_Connection *due[OIM_EVENTS_RESUME_BATCH];
+
+    pthread_mutex_lock(&events_lock);
+
+    while (events_running) {
+        uint64_t next_wake;
+        size_t count = oim_events_collect_due(oim_metrics_now_ns(), false, due, &next_wake);
+
+        if (count > 0) {
+            pthread_mutex_unlock(&events_lock);
+            oim_events_resume(due, count);
+            pthread_mutex_lock(&events_lock);
+            continue;
+        }
+
+        if (next_wake == UINT64_MAX) {
+            pthread_cond_wait(&events_cond, &events_lock);
+        } else {
+            struct timespec deadline = {
+                .tv_sec = (time_t)(next_wake / 1000000000ULL),
+                .tv_nsec = (long)(next_wake % 1000000000ULL)
+            };
+            pthread_cond_timedwait(&events_cond, &events_lock, &deadline);
+        }
+    }
+
+    pthread_mutex_unlock(&events_lock);
+    return NULL;
+}
+
+void oim_events_publish(uint64_t generation, size_t entries) {
+    char data[256];
+    int length = snprintf(data, sizeof(data),
+                          "id: %llu-%llu\nevent: catalog\n"
+                          "data: {\"epoch\":%llu,\"generation\":%llu,\"entries\":%zu}\n\n",
+                          (unsigned long long)oim_changelog_epoch(),
+                          (unsigned long long)generation,
+                          (unsigned long long)oim_changelog_epoch(),
+                          (unsigned long long)generation,
+                          entries);
+
+    OIMEvent *event = malloc(sizeof(OIMEvent) + (size_t)length);
+    if (event == NULL) {
+        LOG_ERROR("Failed to allocate catalog event for generation %llu",
+                  (unsigned long long)generation);
+        return;
+    }
+    event->refcount = 1;
+    event->generation = generation;
+    event->size = (size_t)length;
+    memcpy(event->data, data, (size_t)length);
+
+    pthread_mutex_lock(&events_lock);
+    OIMEvent *previous = latest_event;
+    latest_event = event;
+    latest_generation = generation;
+
+    /* The worker resumes everyone now due, in batches. */
+    pthread_cond_signal(&events_cond);
+    pthread_mutex_unlock(&events_lock);
+
+    oim_event_release(previous);
+}
+
+OIMWaitResult oim_events_wait(
+    OIMEventWaiter *waiter,
+    struct MHD_Connection *connection,
+    uint64_t since,
+    uint64_t wait_seconds
+) {
+    pthread_mutex_lock(&events_lock);
+
+    switch (waiter->state) {
+        case OIM_WAIT_SUSPENDED:
+            pthread_mutex_unlock(&events_lock);
+            return OIM_WAIT_QUEUED;
+
+        case OIM_WAIT_DONE:
+            pthread_mutex_unlock(&events_lock);
+            return OIM_WAIT_READY;
+
+        case OIM_WAIT_NEW:
+            break;
+    }
+
+    if (!events_running || latest_generation > since || wait_seconds == 0) {
+        waiter->state = OIM_WAIT_DONE;
+        pthread_mutex_unlock(&events_lock);
+        return OIM_WAIT_READY;
+    }
+
+    if (events_config.max_subscribers > 0 &&
+        subscriber_count + waiter_count >= (size_t)events_config.max_subscribers) {
+        waiter->state = OIM_WAIT_DONE;
+        pthread_mutex_unlock(&events_lock);
+        return OIM_WAIT_REJECTED;
+    }
+
+    if (events_config.max_wait > 0 && wait_seconds > (uint64_t)events_config.max_wait) {
+        wait_seconds = (uint64_t)events_config.max_wait;
+    }
+
+    waiter->connection = connection;
+    waiter->since = since;
+    waiter->deadline_ns = oim_metrics_now_ns() + wait_seconds * 1000000000ULL;
+    waiter->state = OIM_WAIT_SUSPENDED;
+    waiter->prev = NULL;
+    waiter->next = waiters;
+    if (waiters) {
+        waiters->prev = waiter;
+    }
+    waiters = waiter;
+    waiter_count++;
+
+    /* Suspending under the lock keeps a publish from resuming it first. */
+    MHD_suspend_connection(connection);
+    pthread_cond_signal(&events_cond);
+    pthread_mutex_unlock(&events_lock);
+    return OIM_WAIT_QUEUED;
+}
+
+void oim_events_cancel_wait(OIMEventWaiter *waiter) {
+    pthread_mutex_lock(&events_lock);
+    if (waiter->state == OIM_WAIT_SUSPENDED) {
+        oim_events_unlink_waiter(waiter);
+    }
+    waiter->state = OIM_WAIT_DONE;
+    pthread_mutex_unlock(&events_lock);
+}
+
+static ssize_t oim_events_reader(
+    void *cls,
+    uint64_t pos __attribute__((unused)),
+    char *buf,
+    size_t max
+) {
+    OIMEventSubscriber *subscriber = cls;
+
+    pthread_mutex_lock(&events_lock);
+
+    if (!events_running) {
+        pthread_mutex_unlock(&events_lock);
+        return MHD_CONTENT_READER_END_OF_STREAM;
+    }
+
+    /* Subscribers that fell behind skip straight to the newest generation. */
+    if (subscriber->event == NULL && latest_event &&
+        latest_generation > subscriber->generation) {
+        subscriber->event = latest_event;
+        __atomic_add_fetch(&latest_event->refcount, 1, __ATOMIC_RELAXED);
+        subscriber->offset = 0;
+        subscriber->generation = latest_generation;
+    }
+
+    const char *data = NULL;
+    size_t size = 0;
+
+    if (subscriber->event) {
+        data = subscriber->event->data + subscriber->offset;
+        size = subscriber->event->size - subscriber->offset;
+    } else if (subscriber->keepalive_due) {
+        data = oim_keepalive_comment;
+        size = sizeof(oim_keepalive_comment) - 1;
+    }
+
+    if (data == NULL) {
+        subscriber->waiting = true;
+
+        /* Suspending under the lock keeps a publish from resuming it first. */
+        MHD_suspend_connection(subscriber->connection);
+        pthread_cond_signal(&events_cond);
+        pthread_mutex_unlock(&events_lock);
+        return 0;
+    }
+
+    if (size > max) {
+        size = max;
+    }
+    memcpy(buf, data, size);
+
+    if (subscriber->event) {
+        subscriber->offset += size;
+        if (subscriber->offset == subscriber->event->size) {
+            oim_event_release(subscriber->event);
+            subscriber->event = NULL;
+        }
+    } else {
+        subscriber->keepalive_due = false;
+    }
+    subscriber->keepalive_ns = oim_metrics_now_ns() + oim_events_keepalive_ns();
+
+    pthread_mutex_unlock(&events_lock);
+    return (ssize_t)size;
+}
+
+static void oim_events_free_subscriber(void *cls) {
+    OIMEventSubscriber *subscriber = cls;
+
+    pthread_mutex_lock(&events_lock);
+    if (subscriber->prev) {
+        subscriber->prev->next = subscriber->next;
+    } else {
+        subscribers = subscriber->next;
+    }
+    if (subscriber->next) {
+        subscriber->next->prev = subscriber->prev;
+    }
+    subscriber_count--;
+    pthread_mutex_unlock(&events_lock);
+
+    oim_event_release(subscriber->event);
+    free(subscriber);
+}
+
+/* Event ids are "<epoch>-<generation>"; ids from another server run mean nothing here. */
+static uint64_t oim_events_parse_id(const char *last_event_id) {
+    unsigned long long epoch = 0;
+    unsigned long long generation = 0;
+
+    if (last_event_id == NULL ||
+        sscanf(last_event_id, "%llu-%llu", &epoch, &generation) != 2 ||
+        epoch != oim_changelog_epoch()) {
+        return 0;
+    }
+    return (uint64_t)generation;
+}
+
+struct MHD_Response* oim_events_create_stream(
+    struct MHD_Connection *connection,
+    const char *last_event_id
+) {
+    OIMEventSubscriber *subscriber = calloc(1, sizeof(OIMEventSubscriber));
+    if (subscriber == NULL) {
+        return NULL;
+    }
+
+    subscriber->connection = connection;
+    subscriber->generation = oim_events_parse_id(last_event_id);
+    subscriber->keepalive_ns = oim_metrics_now_ns() + oim_events_keepalive_ns();
+
+    pthread_mutex_lock(&events_lock);
+
+    if (!events_running ||
+        (events_config.max_subscribers > 0 &&
+         subscriber_count + waiter_count >= (size_t)events_config.max_subscribers)) {
+        pthread_mutex_unlock(&events_lock);
+        free(subscriber);
+        return NULL;
+    }
+
+    if (subscriber->generation > latest_generation) {
+        subscriber->generation = 0;
+    }
+
+    subscriber->next = subscribers;
+    if (subscribers) {
+        subscribers->prev = subscriber;
+    }
+    subscribers = subscriber;
+    subscriber_count++;
+
+    pthread_mutex_unlock(&events_lock);
+
+    struct MHD_Response *response = MHD_create_response_from_callback(
+        MHD_SIZE_UNKNOWN,
+        OIM_EVENTS_BLOCK_SIZE,
+        oim_events_reader,
+        subscriber,
+        oim_events_free_subscriber
+    );
+
+    if (response == NULL) {
+        oim_events_free_subscriber(subscriber);
+    }
+
+    return response;
+}
+
+int oim_events_init(const OIMEventsConfig *config) {
+    events_config = *config;
+
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&events_cond, &attr);
+    pthread_condattr_destroy(&attr);
+
+    events_running = true;
+
+    if (pthread_create(&events_thread, NULL, oim_events_main, NULL) != 0) {
+        LOG_ERROR("Failed to start catalog event thread");
+        events_running = false;
+        return -1;
+    }
+    events_started = true;
+
+    LOG_INFO("Catalog events: %d subscriber(s), keepalive %d s, long-poll up to %d s",
+             config->max_subscribers, config->keepalive_interval, config->max_wait);
+    return 0;
+}
+
+/* Suspended streams and long-polls must all be resumed before MHD_stop_daemon. */
+void oim_events_stop() {
+    struct MHD_Connection *due[OIM_EVENTS_RESUME_BATCH];
+    uint64_t next_wake;
+    size_t count;
+
+    pthread_mutex_lock(&events_lock);
+    events_running = false;
+    pthread_cond_broadcast(&events_cond);
+
+    while ((count = oim_events_collect_due(0, true, due, &next_wake)) > 0) {
+        pthread_mutex_unlock(&events_lock);
+        oim_events_resume(due, count);
+        pthread_mutex_lock(&events_lock);
+    }
+
+    /* Streams still sending it hold their own reference. */
+    OIMEvent *event = latest_event;
+    latest_event = NULL;
+    pthread_mutex_unlock(&events_lock);
+
+    oim_event_release(event);
+
+    if (events_started) {
+        pthread_join(events_thread, NULL);
+        events_started = false;
+    }
+}
+
+void oim_events_counts(size_t *subscribers_out, size_t *waiters_out) {
+    pthread_mutex_lock(&events_lock);
+    *subscribers_out = subscriber_count;
+    *waiters_out = waiter_count;
+    pthread_mutex_unlock(&events_lock);
+}
@@ -0,0 +1,398 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#ifdef SYS_openat2
+#include <linux/openat2.h>
+#endif
+
+#include "fdcache.h"
+#include "logging.h"
+
+static pthread_mutex_t fdcache_lock = PTHREAD_MUTEX_INITIALIZER;
+static OIMCachedFile **fdcache_buckets = NULL;
+static size_t fdcache_bucket_count = 0;
+static size_t fdcache_capacity = 0;
+static size_t fdcache_count = 0;
+static OIMCatalogRoot *fdcache_roots = NULL;
+static int *root_fds = NULL;
+static size_t fdcache_root_count = 0;
+static bool openat2_supported = true;
+
+/* Newest generation swept by oim_fdcache_invalidate; older requests do not cache. */
+static uint64_t fdcache_generation = 0;
+
+/* Most recently used at the head. */
+static OIMCachedFile *lru_head = NULL;
+static OIMCachedFile *lru_tail = NULL;
+
+static size_t oim_fdcache_bucket(const char *path) {
+    uint64_t hash = 14695981039346656037ULL;
+    for (const char *p = path; *p; p++) {
+        hash = (hash ^ (unsigned char)*p) * 1099511628211ULL;
+    }
+    return (size_t)(hash & (fdcache_bucket_count - 1));
+}
+
+static void oim_fdcache_free(OIMCachedFile *file) {
+    close(file->fd);
+    free(file->path);
+    free(file);
+}
+
+static void oim_fdcache_lru_unlink(OIMCachedFile *file) {
+    if (file->lru_prev) {
+        file->lru_prev->lru_next = file->lru_next;
+    } else {
+        lru_head = file->lru_next;
+    }
+    if (file->lru_next) {
+        file->lru_next->lru_prev = file->lru_prev;
+    } else {
+        lru_tail = file->lru_prev;
+    }
+    file->lru_prev = NULL;
+    file->lru_next = NULL;
+}
+
+static void oim_fdcache_lru_push(OIMCachedFile *file) {
+    file->lru_prev = NULL;
+    file->lru_next = lru_head;
+    if (lru_head) {
+        lru_head->lru_prev = file;
+    } else {
+        lru_tail = file;
+    }
+    lru_head = file;
+}
+
+/*
+ * Drops the cache's reference. Downloads still holding the file keep
+ * the descriptor open until they finish. Called with fdcache_lock held.
+ */
+static void oim_fdcache_evict(OIMCachedFile *file) {
+    OIMCachedFile **link = &fdcache_buckets[oim_fdcache_bucket(file->path)];
+    while (*link && *link != file) {
+        link = &(*link)->hash_next;
+    }
+    if (*link) {
+        *link = file->hash_next;
+    }
+
+    oim_fdcache_lru_unlink(file);
+    file->hash_next = NULL;
+    file->cached = false;
+    fdcache_count--;
+
+    oim_fdcache_release(file);
+}
+
+static OIMCachedFile* oim_fdcache_lookup(const char *path) {
+    for (OIMCachedFile *file = fdcache_buckets[oim_fdcache_bucket(path)];
+         file; file = file->hash_next) {
+        if (strcmp(file->path, path) == 0) {
+            return file;
+        }
+    }
+    return NULL;
+}
+
+static bool oim_fdcache_matches_entry(const OIMCachedFile *file, const OIMMirrorEntry *entry) {
+    return entry != NULL &&
+           entry->inode == file->inode &&
+           entry->device == file->device &&
+           (uint64_t)entry->file_size == file->size &&
+           entry->modified_time == file->modified;
+}
+
+/* A cached fd is stale once the file behind it was rewritten in place. */
+static bool oim_fdcache_unchanged(const OIMCachedFile *file) {
+    struct stat file_stat;
+    return fstat(file->fd, &file_stat) == 0 &&
+           (uint64_t)file_stat.st_size == file->size &&
+           file_stat.st_mtime == file->modified;
+}
+
+/* Opened on first use, so a mirror mounted after startup is still served. */
+static int oim_fdcache_root_fd(size_t root) {
+    if (root >= fdcache_root_count) {
+        errno = ENOENT;
+        return -1;
+    }
+
+    int fd = __atomic_load_n(&root_fds[root], __ATOMIC_ACQUIRE);
+    if (fd != -1) {
+        return fd;
+    }
+
+    pthread_mutex_lock(&fdcache_lock);
+    if (root_fds[root] == -1) {
+        const char *directory = fdcache_roots[root].directory;
+        fd = open(*directory ? directory : "/", O_PATH | O_DIRECTORY | O_CLOEXEC);
+        if (fd == -1) {
+            LOG_ERROR("Failed to open mirror directory %s: %s", directory, strerror(errno));
+        }
+        __atomic_store_n(&root_fds[root], fd, __ATOMIC_RELEASE);
+    }
+    fd = root_fds[root];
+    pthread_mutex_unlock(&fdcache_lock);
+
+    if (fd == -1) {
+        errno = ENOENT;
+    }
+    return fd;
+}
+
+/*
+ * RESOLVE_BENEATH refuses "..", absolute paths and symlinks that leave
+ * the mirror in the kernel's path walk. Older kernels fall back to a
+ * plain openat; the path still had to be in the catalog to get here.
+ */
+static int oim_fdcache_open_beneath(size_t root, const char *relative_path) {
+    int dir_fd = oim_fdcache_root_fd(root);
+    if (dir_fd == -1) {
+        return -1;
+    }
+
+#ifdef SYS_openat2
+    if (__atomic_load_n(&openat2_supported, __ATOMIC_RELAXED)) {
+        struct open_how how = {
+            .flags = O_RDONLY | O_CLOEXEC,
+            .resolve = RESOLVE_BENEATH | RESOLVE_NO_MAGICLINKS
+        };
+
+        int fd = (int)syscall(SYS_openat2, dir_fd, relative_path, &how, sizeof(how));
+        if (fd != -1 || errno != ENOSYS) {
+            return fd;
+        }
+
+        if (__atomic_exchange_n(&openat2_supported, false, __ATOMIC_RELAXED)) {
+            LOG_WARN("openat2 is unavailable, downloads are opened without RESOLVE_BENEATH");
+        }
+    }
+#endif
+
+    return openat(dir_fd, relative_path, O_RDONLY | O_CLOEXEC);
+}
+
+static OIMCachedFile* oim_fdcache_open_file(
+    const char *relative_path,
+    const OIMMirrorEntry *entry
+) {
+    int fd = oim_fdcache_open_beneath(entry->root_id, oim_catalog_root_path(entry));
+    if (fd == -1) {
+        return NULL;
+    }
+
+    struct stat file_stat;
+    if (fstat(fd, &file_stat) == -1 || !S_ISREG(file_stat.st_mode)) {
+        close(fd);
+        errno = ENOENT;
+        return NULL;
+    }
+
+    OIMCachedFile *file = calloc(1, sizeof(OIMCachedFile));
+    if (file == NULL || (file->path = strdup(relative_path)) == NULL) {
+        free(file);
+        close(fd);
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    file->fd = fd;
+    file->device = (uint64_t)file_stat.st_dev;
+    file->inode = (uint64_t)file_stat.st_ino;
+    file->size = (uint64_t)file_stat.st_size;
+    file->modified = file_stat.st_mtime;
+    file->refcount = 1;
+    return file;
+}
+
+OIMCachedFile* oim_fdcache_open(
+    const char *relative_path,
+    const OIMMirrorEntry *entry,
+    uint64_t generation
+) {
+    if (entry == NULL) {
+        errno = ENOENT;
+        return NULL;
+    }
+
+    if (fdcache_capacity == 0) {
+        return oim_fdcache_open_file(relative_path, entry);
+    }
+
+    pthread_mutex_lock(&fdcache_lock);
+
+    OIMCachedFile *file = oim_fdcache_lookup(relative_path);
+    if (file) {
+        bool valid = (file->generation == generation ||
+                      oim_fdcache_matches_entry(file, entry)) &&
+                     oim_fdcache_unchanged(file);
+
+        if (valid) {
+            file->generation = generation;
+            oim_fdcache_retain(file);
+            oim_fdcache_lru_unlink(file);
+            oim_fdcache_lru_push(file);
+            pthread_mutex_unlock(&fdcache_lock);
+            return file;
+        }
+
+        oim_fdcache_evict(file);
+    }
+
+    pthread_mutex_unlock(&fdcache_lock);
+
+    file = oim_fdcache_open_file(relative_path, entry);
+
+    /* Only files the catalog agrees with are worth keeping open. */
+    if (file == NULL || !oim_fdcache_matches_entry(file, entry)) {
+        return file;
+    }
+
+    pthread_mutex_lock(&fdcache_lock);
+
+    OIMCachedFile *existing = oim_fdcache_lookup(relative_path);
+    if (existing || generation < fdcache_generation) {
+        /*
+         * Another request opened it meanwhile, or a newer generation was
+         * swept without it; ours is served uncached.
+         */
+        pthread_mutex_unlock(&fdcache_lock);
+        return file;
+    }
+
+    while (fdcache_count >= fdcache_capacity && lru_tail) {
+        oim_fdcache_evict(lru_tail);
+    }
+
+    size_t bucket = oim_fdcache_bucket(relative_path);
+    file->hash_next = fdcache_buckets[bucket];
+    fdcache_buckets[bucket] = file;
+    oim_fdcache_lru_push(file);
+    file->generation = generation;
+    file->cached = true;
+    file->refcount++;
+    fdcache_count++;
+
+    pthread_mutex_unlock(&fdcache_lock);
+    return file;
+}
+
+void oim_fdcache_invalidate(const OIMMirrorCatalog *catalog, uint64_t generation) {
+    size_t evicted = 0;
+
+    pthread_mutex_lock(&fdcache_lock);
+
+    fdcache_generation = generation;
+    for (OIMCachedFile *file = lru_head; file; ) {
+        OIMCachedFile *next = file->lru_next;
+
+        if (oim_fdcache_matches_entry(file, oim_catalog_find(catalog, file->path))) {
+            file->generation = generation;
+        } else {
+            oim_fdcache_evict(file);
+            evicted++;
+        }
+        file = next;
+    }
+
+    pthread_mutex_unlock(&fdcache_lock);
+
+    if (evicted > 0) {
+        LOG_DEBUG("Closed %zu cached download file(s) changed in generation %llu",
+                  evicted, (unsigned long long)generation);
+    }
+}
+
+OIMCachedFile* oim_fdcache_retain(OIMCachedFile *file) {
+    __atomic_add_fetch(&file->refcount, 1, __ATOMIC_RELAXED);
+    return file;
+}
+
+/* The cache holds its own reference, so only evicted or uncached files reach zero. */
+void oim_fdcache_release(OIMCachedFile *file) {
+    if (file && __atomic_sub_fetch(&file->refcount, 1, __ATOMIC_ACQ_REL) == 0) {
+        oim_fdcache_free(file);
+    }
+}
+
+int oim_fdcache_init(const OIMCatalogRoot *roots, size_t root_count, size_t capacity) {
+    fdcache_roots = calloc(root_count > 0 ? root_count : 1, sizeof(OIMCatalogRoot));
+    root_fds = calloc(root_count > 0 ? root_count : 1, sizeof(int));
+    if (fdcache_roots == NULL || root_fds == NULL) {
+        free(fdcache_roots);
+        free(root_fds);
+        fdcache_roots = NULL;
+        root_fds = NULL;
+        return -1;
+    }
+
+    for (size_t i = 0; i < root_count; i++) {
+        fdcache_roots[i].directory = strdup(roots[i].directory);
+        fdcache_roots[i].directory_length = roots[i].directory_length;
+        root_fds[i] = -1;
+        fdcache_root_count++;
+
+        if (fdcache_roots[i].directory == NULL) {
+            oim_fdcache_cleanup();
+            return -1;
+        }
+        oim_fdcache_root_fd(i);
+    }
+
+    fdcache_capacity = capacity;
+    if (capacity == 0) {
+        return 0;
+    }
+
+    fdcache_bucket_count = 16;
+    while (fdcache_bucket_count < capacity * 2) {
+        fdcache_bucket_count <<= 1;
+    }
+
+    fdcache_buckets = calloc(fdcache_bucket_count, sizeof(OIMCachedFile*));
+    if (fdcache_buckets == NULL) {
+        LOG_ERROR("Failed to allocate the open file cache");
+        fdcache_capacity = 0;
+        return -1;
+    }
+
+    LOG_INFO("Caching up to %zu open download file(s)", capacity);
+    return 0;
+}
+
+void oim_fdcache_cleanup() {
+    pthread_mutex_lock(&fdcache_lock);
+
+    while (lru_tail) {
+        oim_fdcache_evict(lru_tail);
+    }
+
+    free(fdcache_buckets);
+    fdcache_buckets = NULL;
+    fdcache_bucket_count = 0;
+    fdcache_capacity = 0;
+
+    for (size_t i = 0; i < fdcache_root_count; i++) {
+        if (root_fds[i] != -1) {
+            close(root_fds[i]);
+        }
+        free((char *)fdcache_roots[i].directory);
+    }
+    free(root_fds);
+    free(fdcache_roots);
+    root_fds = NULL;
+    fdcache_roots = NULL;
+    fdcache_root_count = 0;
+
+    pthread_mutex_unlock(&fdcache_lock);
+}
@@ -0,0 +1,279 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <microhttpd.h>
+
+#include "http.h"
+
+static const char* oim_http_skip_spaces(const char *p) {
+    while (*p == ' ' || *p == '\t') {
+        p++;
+    }
+    return p;
+}
+
+time_t oim_parse_http_date(const char *value) {
+    struct tm tm;
+
+    if (value == NULL) {
+        return (time_t)-1;
+    }
+
+    memset(&tm, 0, sizeof(tm));
+    const char *end = strptime(value, "%a, %d %b %Y %H:%M:%S GMT", &tm);
+    if (end == NULL || *oim_http_skip_spaces(end) != '\0') {
+        return (time_t)-1;
+    }
+
+    return timegm(&tm);
+}
+
+void oim_format_http_date(time_t value, char *buffer, size_t buffer_size) {
+    struct tm tm;
+    gmtime_r(&value, &tm);
+    strftime(buffer, buffer_size, "%a, %d %b %Y %H:%M:%S GMT", &tm);
+}
+
+void oim_format_file_etag(
+    uint64_t inode,
+    uint64_t size,
+    time_t modified,
+    char *buffer,
+    size_t buffer_size
+) {
+    snprintf(buffer, buffer_size, "\"%llx-%llx-%llx\"",
+             (unsigned long long)inode,
+             (unsigned long long)size,
+             (unsigned long long)modified);
+}
+
+static int oim_parse_qvalue(const char *p, const char *end) {
+    while (p < end && *p != ';') {
+        p++;
+    }
+
+    while (p < end) {
+        p++;
+        p = oim_http_skip_spaces(p);
+        if (end - p >= 2 && (p[0] == 'q' || p[0] == 'Q') && p[1] == '=') {
+            return (int)(strtod(p + 2, NULL) * 1000.0);
+        }
+        while (p < end && *p != ';') {
+            p++;
+        }
+    }
+
+    return 1000;
+}
+
+/*
+ * Picks the available encoding with the highest q-value; ties go to
+ * the codec with the best ratio. Identity is the fallback whenever no
+ * compressed variant is acceptable.
+ */
+OIMContentEncoding oim_negotiate_encoding(
+    const char *accept_encoding,
+    unsigned int available_mask
+) {
+    static const OIMContentEncoding preference[] = {
+        OIM_ENCODING_BROTLI,
+        OIM_ENCODING_ZSTD,
+        OIM_ENCODING_GZIP
+    };
+
+    if (accept_encoding == NULL) {
+        return OIM_ENCODING_IDENTITY;
+    }
+
+    int qvalues[OIM_ENCODING_COUNT];
+    int wildcard = -1;
+
+    for (int encoding = 0; encoding < OIM_ENCODING_COUNT; encoding++) {
+        qvalues[encoding] = -1;
+    }
+
+    const char *p = accept_encoding;
+    while (*p) {
+        p = oim_http_skip_spaces(p);
+
+        const char *end = strchr(p, ',');
+        if (end == NULL) {
+            end = p + strlen(p);
+        }
+
+        size_t name_len = 0;
+        while (p + name_len < end && p[name_len] != ';' &&
+               p[name_len] != ' ' && p[name_len] != '\t') {
+            name_len++;
+        }
+
+        int q = oim_parse_qvalue(p, end);
+
+        if (name_len == 1 && p[0] == '*') {
+            wildcard = q;
+        } else {
+            for (int encoding = OIM_ENCODING_GZIP; encoding < OIM_ENCODING_COUNT; encoding++) {
+                const char *name = oim_encoding_name(encoding);
+                if (strlen(name) == name_len && strncasecmp(p, name, name_len) == 0) {
+                    qvalues[encoding] = q;
+                }
+            }
+        }
+
+        p = *end ? end + 1 : end;
+    }
+
+    OIMContentEncoding best = OIM_ENCODING_IDENTITY;
+    int best_q = 0;
+
+    for (size_t i = 0; i < sizeof(preference) / sizeof(preference[0]); i++) {
+        OIMContentEncoding encoding = preference[i];
+        if (!(available_mask & (1u << encoding))) {
+            continue;
+        }
+
+        int q = qvalues[encoding];
+        if (q < 0) {
+            q = wildcard;
+        }
+
+        if (q > best_q) {
+            best = encoding;
+            best_q = q;
+        }
+    }
+
+    return best;
+}
+
+/*
+ * Weak comparison as required for If-None-Match: a W/ prefix on
+ * either side is ignored and "*" matches any current representation.
+ */
+bool oim_etag_list_matches(const char *header, const char *etag) {
+    if (header == NULL || etag == NULL) {
+        return false;
+    }
+
+    if (strncmp(etag, "W/", 2) == 0) {
+        etag += 2;
+    }
+    size_t etag_len = strlen(etag);
+
+    const char *p = header;
+    while (*p) {
+        p = oim_http_skip_spaces(p);
+
+        if (*p == ',') {
+            p++;
+            continue;
+        }
+
+        if (*p == '*') {
+            return true;
+        }
+
+        if (strncmp(p, "W/", 2) == 0) {
+            p += 2;
+        }
+
+        const char *end = p;
+        if (*end == '"') {
+            end = strchr(end + 1, '"');
+            if (end == NULL) {
+                return false;
+            }
+            end++;
+        } else {
+            while (*end && *end != ',') {
+                end++;
+            }
+        }
+
+        if ((size_t)(end - p) == etag_len && strncmp(p, etag, etag_len) == 0) {
+            return true;
+        }
+
+        p = end;
+        while (*p && *p != ',') {
+            p++;
+        }
+    }
+
+    return false;
+}
+
+bool oim_request_not_modified(
+    struct MHD_Connection *connection,
+    const char *etag,
+    time_t last_modified
+) {
+    const char *if_none_match = MHD_lookup_connection_value(
+        connection, MHD_HEADER_KIND, MHD_HTTP_HEADER_IF_NONE_MATCH);
+
+    if (if_none_match != NULL) {
+        return oim_etag_list_matches(if_none_match, etag);
+    }
+
+    const char *if_modified_since = MHD_lookup_connection_value(
+        connection, MHD_HEADER_KIND, MHD_HTTP_HEADER_IF_MODIFIED_SINCE);
+
+    if (if_modified_since != NULL) {
+        time_t since = oim_parse_http_date(if_modified_since);
+        return since != (time_t)-1 && last_modified <= since;
+    }
+
+    return false;
+}
+
+bool oim_request_conditional(struct MHD_Connection *connection) {
+    return MHD_lookup_connection_value(connection, MHD_HEADER_KIND,
+                                       MHD_HTTP_HEADER_IF_NONE_MATCH) != NULL ||
+           MHD_lookup_connection_value(connection, MHD_HEADER_KIND,
+                                       MHD_HTTP_HEADER_IF_MODIFIED_SINCE) != NULL;
+}
+
+void oim_add_validator_headers(
+    struct MHD_Response *response,
+    const char *etag,
+    time_t last_modified,
+    const char *cache_control
+) {
+    char date[OIM_HTTP_DATE_MAX_LEN];
+
+    if (etag) {
+        MHD_add_response_header(response, MHD_HTTP_HEADER_ETAG, etag);
+    }
+
+    if (last_modified > 0) {
+        oim_format_http_date(last_modified, date, sizeof(date));
+        MHD_add_response_header(response, MHD_HTTP_HEADER_LAST_MODIFIED, date);
+    }
+
+    if (cache_control) {
+        MHD_add_response_header(response, MHD_HTTP_HEADER_CACHE_CONTROL, cache_control);
+    }
+}
+
+enum MHD_Result oim_send_not_modified(
+    struct MHD_Connection *connection,
+    const char *etag,
+    time_t last_modified,
+    const char *cache_control
+) {
+    struct MHD_Response *response = MHD_create_response_from_buffer(
+        0, "", MHD_RESPMEM_PERSISTENT);
+    if (response == NULL) {
+        return MHD_NO;
+    }
+
+    oim_add_validator_headers(response, etag, last_modified, cache_control);
+
+    enum MHD_Result ret = MHD_queue_response(connection, MHD_HTTP_NOT_MODIFIED, response);
+    MHD_destroy_response(response);
+
+    return ret;
+}
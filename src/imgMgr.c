@@ -1,20 +1,265 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
 #include <sys/stat.h>
 #include <limits.h>
 #include <json-c/json.h>
 #include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
 
 #include "imgMgr.h"
 #include "config.h"
 #include "cache.h"
+#include "checksum.h"
+#include "fdcache.h"
+#include "metrics.h"
+#include "snapshot.h"
+#include "snapfile.h"
+#include "changelog.h"
+#include "events.h"
+#include "walker.h"
 #include "logging.h"
 
+/* Seconds before a root whose scan failed is tried again, at most its scan interval. */
+#define OIM_SCAN_RETRY_DELAY 60
+
 static OIMMirrorManagerConfig *manager_config = NULL;
-static json_object *cached_mirror_list = NULL;
-static time_t last_scan_time = 0;
+
+/* Set when startup served the snapshot file and a catch-up scan is owed. */
+static bool warm_start_pending = false;
+
+/* Whether the published generation matches the SQLite cache's rows. */
+static bool cache_in_sync = false;
+
+/*
+ * The published snapshot is read without locks: readers announce
+ * themselves in the snapshot_readers slot named by snapshot_epoch for
+ * the few instructions it takes to load the pointer and take a
+ * reference. The publisher swaps the pointer, flips the epoch and waits
+ * for the old slot to drain before dropping its reference to the old
+ * snapshot. Readers arriving meanwhile use the other slot, so a steady
+ * stream of them cannot hold the publisher back.
+ */
+static OIMMirrorSnapshot *current_snapshot = NULL;
+static unsigned int snapshot_epoch = 0;
+static int snapshot_readers[2] = { 0, 0 };
+static uint64_t mirror_generation = 0;
+
+/* Serializes every publish of a new generation. */
+static pthread_mutex_t scan_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * Roots on the same device are scanned one after another by one group,
+ * so they never compete for the same disk; groups scan concurrently and
+ * each publishes as soon as its own roots are done. A group's lock is
+ * held from the start of a scan until it is published, and is always
+ * taken before scan_lock.
+ */
+typedef struct {
+    size_t *roots;
+    size_t root_count;
+    pthread_mutex_t lock;
+    pthread_t thread;
+    bool thread_started;
+    bool rescan_requested;
+} OIMScanGroup;
+
+static OIMScanGroup *scan_groups = NULL;
+static size_t scan_group_count = 0;
+
+static bool scanner_running = false;
+static pthread_mutex_t scanner_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t scanner_cond = PTHREAD_COND_INITIALIZER;
+
+static void oim_swap_mirror_snapshot(OIMMirrorSnapshot *snapshot) {
+    OIMMirrorSnapshot *previous = __atomic_exchange_n(
+        &current_snapshot, snapshot, __ATOMIC_SEQ_CST);
+
+    /* Publishers are serialized, so only this thread flips the epoch. */
+    unsigned int slot = __atomic_fetch_add(&snapshot_epoch, 1, __ATOMIC_SEQ_CST) & 1;
+
+    while (__atomic_load_n(&snapshot_readers[slot], __ATOMIC_SEQ_CST) != 0) {
+        sched_yield();
+    }
+
+    oim_snapshot_release(previous);
+}
+
+/*
+ * Takes ownership of catalog. Must be called with scan_lock held. store
+ * writes the cache; snapfile rewrites the snapshot file, which only full
+ * scans ask for so that watch batches do not rewrite it every debounce;
+ * compress builds the encoded bodies.
+ */
+static int oim_publish_mirror_snapshot(
+    OIMMirrorCatalog *catalog,
+    bool store,
+    bool snapfile,
+    bool compress
+) {
+    oim_checksum_annotate(catalog);
+
+    /* Publishers hold scan_lock, so the current generation stays put. */
+    OIMMirrorSnapshot *snapshot = oim_snapshot_create(
+        catalog, mirror_generation + 1, __atomic_load_n(&current_snapshot, __ATOMIC_SEQ_CST),
+        compress);
+    if (snapshot == NULL) {
+        LOG_ERROR("Failed to build Mirror snapshot, keeping previous generation");
+        return -1;
+    }
+
+    const OIMSnapshotVariant *identity = &snapshot->listing.variants[OIM_ENCODING_IDENTITY];
+
+    LOG_INFO("Publishing Mirror snapshot generation %llu (%zu entries, %zu bytes, %zu arena bytes)",
+             (unsigned long long)snapshot->generation, snapshot->entry_count,
+             identity->size, catalog->arena.bytes_used);
+
+    if (store) {
+        /* Publishers hold scan_lock, so the previous generation stays put. */
+        OIMMirrorSnapshot *previous = __atomic_load_n(&current_snapshot, __ATOMIC_SEQ_CST);
+        oim_cache_store_mirror_catalog(
+            previous && cache_in_sync ? previous->catalog : NULL, catalog);
+        cache_in_sync = true;
+
+    }
+
+    if (snapfile && manager_config->snapshot_path && *manager_config->snapshot_path) {
+        oim_snapfile_write(manager_config->snapshot_path, catalog);
+    }
+
+    /* Recorded once the new generation is visible, so no change points past the listing. */
+    OIMMirrorSnapshot *previous = oim_snapshot_acquire(
+        __atomic_load_n(&current_snapshot, __ATOMIC_SEQ_CST));
+
+    mirror_generation = snapshot->generation;
+    oim_metrics_set_snapshot(snapshot->generation, snapshot->entry_count);
+    oim_swap_mirror_snapshot(snapshot);
+    oim_fdcache_invalidate(catalog, snapshot->generation);
+
+    oim_changelog_record(previous ? previous->catalog : NULL, catalog, snapshot->generation);
+    oim_snapshot_release(previous);
+
+    oim_events_publish(snapshot->generation, snapshot->entry_count);
+    return 0;
+}
+
+static OIMMirrorSnapshot* oim_acquire_current_snapshot() {
+    unsigned int slot = __atomic_load_n(&snapshot_epoch, __ATOMIC_SEQ_CST) & 1;
+
+    __atomic_add_fetch(&snapshot_readers[slot], 1, __ATOMIC_SEQ_CST);
+    OIMMirrorSnapshot *snapshot = oim_snapshot_acquire(
+        __atomic_load_n(&current_snapshot, __ATOMIC_SEQ_CST));
+    __atomic_sub_fetch(&snapshot_readers[slot], 1, __ATOMIC_SEQ_CST);
+    return snapshot;
+}
+
+static OIMMirrorCatalog* oim_create_mirror_catalog() {
+    return oim_catalog_create(manager_config->catalog_roots, manager_config->root_count);
+}
+
+const OIMCatalogRoot* oim_get_mirror_roots(size_t *count) {
+    *count = manager_config ? manager_config->root_count : 0;
+    return manager_config ? manager_config->catalog_roots : NULL;
+}
+
+static int oim_add_mirror_root(
+    const char *directory,
+    const char *prefix,
+    bool recursive,
+    int scan_interval
+) {
+    OIMMirrorRoot *root = &manager_config->roots[manager_config->root_count];
+
+    root->directory = strdup(directory);
+    root->prefix = strdup(prefix ? prefix : "");
+    root->recursive = recursive;
+    root->scan_interval = scan_interval;
+
+    if (root->directory == NULL || root->prefix == NULL) {
+        free(root->directory);
+        free(root->prefix);
+        return -1;
+    }
+
+    /* Unreadable roots get a device of their own and are retried on every scan. */
+    struct stat root_stat;
+    if (stat(root->directory, &root_stat) == 0) {
+        root->device = (uint64_t)root_stat.st_dev;
+    } else {
+        LOG_WARN("Cannot stat Mirror root: %s (Error: %s)", root->directory, strerror(errno));
+        root->device = UINT64_MAX - manager_config->root_count;
+    }
+
+    OIMCatalogRoot *catalog_root = &manager_config->catalog_roots[manager_config->root_count];
+    catalog_root->directory = root->directory;
+    catalog_root->prefix = root->prefix;
+
+    manager_config->root_count++;
+    return 0;
+}
+
+static int oim_group_mirror_roots() {
+    scan_groups = calloc(manager_config->root_count, sizeof(OIMScanGroup));
+    if (scan_groups == NULL) {
+        return -1;
+    }
+
+    for (size_t i = 0; i < manager_config->root_count; i++) {
+        OIMMirrorRoot *root = &manager_config->roots[i];
+        size_t g = 0;
+
+        while (g < scan_group_count &&
+               manager_config->roots[scan_groups[g].roots[0]].device != root->device) {
+            g++;
+        }
+
+        OIMScanGroup *group = &scan_groups[g];
+        if (g == scan_group_count) {
+            group->roots = calloc(manager_config->root_count, sizeof(size_t));
+            if (group->roots == NULL) {
+                return -1;
+            }
+            pthread_mutex_init(&group->lock, NULL);
+            scan_group_count++;
+        }
+
+        group->roots[group->root_count++] = i;
+        root->group = g;
+    }
+
+    for (size_t g = 0; g < scan_group_count; g++) {
+        LOG_INFO("Scan group %zu: %zu root(s) on device %llu", g, scan_groups[g].root_count,
+                 (unsigned long long)manager_config->roots[scan_groups[g].roots[0]].device);
+    }
+
+    return 0;
+}
+
+static void oim_free_mirror_manager_config() {
+    for (size_t g = 0; g < scan_group_count; g++) {
+        pthread_mutex_destroy(&scan_groups[g].lock);
+        free(scan_groups[g].roots);
+    }
+    free(scan_groups);
+    scan_groups = NULL;
+    scan_group_count = 0;
+
+    for (size_t i = 0; i < manager_config->root_count; i++) {
+        free(manager_config->roots[i].directory);
+        free(manager_config->roots[i].prefix);
+    }
+    free(manager_config->roots);
+    free(manager_config->catalog_roots);
+    free(manager_config->snapshot_path);
+    free(manager_config);
+    manager_config = NULL;
+}
 
 int oim_init_mirror_manager(OIMConfig *config) {
 
@@ -34,217 +279,826 @@ int oim_init_mirror_manager(OIMConfig *config) {
 
     DIR *dir = opendir(config->mirror_directory);
     if (dir == NULL) {
-        LOG_ERROR("Cannot open Mirror directory: %s (Error: %s)", 
+        LOG_ERROR("Cannot open Mirror directory: %s (Error: %s)",
                   config->mirror_directory, strerror(errno));
         return -1;
     }
     closedir(dir);
 
-    manager_config = malloc(sizeof(OIMMirrorManagerConfig));
+    manager_config = calloc(1, sizeof(OIMMirrorManagerConfig));
     if (manager_config == NULL) {
         LOG_ERROR("Failed to allocate Mirror manager configuration");
         return -1;
     }
 
-    manager_config->base_directory = strdup(config->mirror_directory);
-    manager_config->recursive_scan = config->recursive_scan;
-    manager_config->scan_interval = config->scan_interval;
+    size_t root_slots = 1 + (size_t)(config->mirror_root_count > 0 ? config->mirror_root_count : 0);
+    manager_config->roots = calloc(root_slots, sizeof(OIMMirrorRoot));
+    manager_config->catalog_roots = calloc(root_slots, sizeof(OIMCatalogRoot));
+    manager_config->scan_threads = config->scan_threads;
+    manager_config->watch_mode = config->watch_mode;
+    oim_changelog_init((size_t)(config->change_log_size > 0 ? config->change_log_size : 0));
+    manager_config->snapshot_path = config->snapshot_path ? strdup(config->snapshot_path) : NULL;
+
+    int result = manager_config->roots && manager_config->catalog_roots ? 0 : -1;
+
+    if (result == 0) {
+        result = oim_add_mirror_root(config->mirror_directory, "",
+                                     config->recursive_scan, config->scan_interval);
+    }
+    for (int i = 0; result == 0 && i < config->mirror_root_count; i++) {
+        const OIMMirrorRootConfig *root = &config->mirror_roots[i];
+        LOG_INFO("Mirror Root: %s as \"%s\"", root->path, root->prefix);
+        result = oim_add_mirror_root(root->path, root->prefix,
+                                     root->recursive, root->scan_interval);
+    }
+    if (result == 0) {
+        result = oim_group_mirror_roots();
+    }
+
+    if (result != 0) {
+        LOG_ERROR("Failed to set up Mirror roots");
+        oim_free_mirror_manager_config();
+        return -1;
+    }
 
     LOG_INFO("Mirror Manager initialized successfully");
 
+    /*
+     * With a background scanner to catch up on every root, serve the last
+     * snapshot file straight away instead of blocking startup on a full scan.
+     */
+    bool scanner_covers_all = true;
+    for (size_t i = 0; i < manager_config->root_count; i++) {
+        scanner_covers_all = scanner_covers_all && manager_config->roots[i].scan_interval > 0;
+    }
+
+    if (scanner_covers_all &&
+        manager_config->snapshot_path && *manager_config->snapshot_path) {
+        OIMMirrorCatalog *catalog = oim_snapfile_load(manager_config->snapshot_path,
+                                                      manager_config->catalog_roots,
+                                                      manager_config->root_count);
+
+        if (catalog) {
+            pthread_mutex_lock(&scan_lock);
+            /* Compressing can wait for the catch-up scan; get the listing out first. */
+            int published = oim_publish_mirror_snapshot(catalog, false, false, false);
+            cache_in_sync = false;
+            pthread_mutex_unlock(&scan_lock);
+
+            if (published == 0) {
+                warm_start_pending = true;
+                return 0;
+            }
+        }
+    }
+
     return oim_rescan_mirror_directory();
 }
 
 void oim_cleanup_mirror_manager() {
+    oim_stop_mirror_scanner();
+
     if (manager_config) {
-        free(manager_config->base_directory);
-        free(manager_config);
-        manager_config = NULL;
+        oim_free_mirror_manager_config();
     }
 
-    if (cached_mirror_list) {
-        json_object_put(cached_mirror_list);
-        cached_mirror_list = NULL;
+    oim_swap_mirror_snapshot(NULL);
+    oim_changelog_cleanup();
+}
+
+/*
+ * Walks the group's roots into catalog: every root when force is set,
+ * otherwise those whose scan interval has elapsed. scanned[root] is set
+ * for each root walked successfully; a root that fails keeps its entries
+ * from the current generation and is retried after OIM_SCAN_RETRY_DELAY.
+ * Returns the number of roots walked.
+ */
+static size_t oim_scan_group_roots(
+    OIMScanGroup *group,
+    OIMMirrorCatalog *catalog,
+    bool *scanned,
+    bool force
+) {
+    time_t now = time(NULL);
+    size_t walked = 0;
+
+    for (size_t i = 0; i < group->root_count; i++) {
+        size_t index = group->roots[i];
+        OIMMirrorRoot *root = &manager_config->roots[index];
+
+        pthread_mutex_lock(&scanner_lock);
+        bool due = force || (root->scan_interval > 0 &&
+                             now - root->last_scan >= root->scan_interval);
+        pthread_mutex_unlock(&scanner_lock);
+
+        if (!due) {
+            continue;
+        }
+
+        size_t before = catalog->count;
+        time_t last_scan = now;
+
+        if (oim_scan_directory(root->directory, root->recursive, catalog) == 0) {
+            LOG_INFO("Scanned Mirror root %s: %zu files", root->directory,
+                     catalog->count - before);
+            scanned[index] = true;
+            walked++;
+        } else {
+            LOG_ERROR("Scan of Mirror root %s failed, keeping its previous entries",
+                      root->directory);
+            if (root->scan_interval > OIM_SCAN_RETRY_DELAY) {
+                last_scan = now - root->scan_interval + OIM_SCAN_RETRY_DELAY;
+            }
+        }
+
+        /* The group lock keeps other scans of this root out until now. */
+        pthread_mutex_lock(&scanner_lock);
+        root->last_scan = last_scan;
+        pthread_mutex_unlock(&scanner_lock);
     }
+
+    return walked;
 }
 
-int oim_rescan_mirror_directory() {
-    time_t current_time = time(NULL);
+/*
+ * Completes catalog with the current generation's entries for every root
+ * not in scanned, then publishes it. Takes ownership of catalog.
+ */
+static int oim_publish_scanned_roots(OIMMirrorCatalog *catalog, const bool *scanned) {
+    pthread_mutex_lock(&scan_lock);
+
+    OIMMirrorSnapshot *previous = __atomic_load_n(&current_snapshot, __ATOMIC_SEQ_CST);
+    int result = 0;
+
+    for (size_t i = 0; previous && result == 0 && i < previous->catalog->count; i++) {
+        const OIMMirrorEntry *entry = &previous->catalog->entries[i];
+        if (entry->root_id < manager_config->root_count && scanned[entry->root_id]) {
+            continue;
+        }
+        result = oim_catalog_add(catalog, entry->path, entry->file_size,
+                                 entry->modified_time, entry->inode, entry->device);
+    }
+
+    /* Workers finish in arbitrary order; finalizing sorts by path so the ETag is stable. */
+    if (result == 0) {
+        result = oim_catalog_finalize(catalog);
+    }
+
+    if (result == 0) {
+        LOG_INFO("Found %zu Mirror files in %zu categories",
+                 catalog->count, catalog->category_count);
+        result = oim_publish_mirror_snapshot(catalog, true, true, true);
+    } else {
+        LOG_ERROR("Failed to merge scanned Mirror roots");
+        oim_catalog_free(catalog);
+    }
+
+    pthread_mutex_unlock(&scan_lock);
+    return result;
+}
+
+/* Background scan of one group; its fresh roots are published on their own. */
+static int oim_rescan_scan_group(OIMScanGroup *group, bool force) {
+    pthread_mutex_lock(&group->lock);
 
-    LOG_INFO("Rescan Configuration:");
-    LOG_INFO("Base Directory: %s", 
-             manager_config ? manager_config->base_directory : "NULL");
-    LOG_INFO("Recursive Scan: %s", 
-             manager_config && manager_config->recursive_scan ? "Yes" : "No");
+    bool *scanned = calloc(manager_config->root_count, sizeof(bool));
+    OIMMirrorCatalog *catalog = scanned ? oim_create_mirror_catalog() : NULL;
+    int result = -1;
 
+    if (catalog) {
+        uint64_t started_ns = oim_metrics_now_ns();
+
+        if (oim_scan_group_roots(group, catalog, scanned, force) > 0) {
+            oim_metrics_record_scan(oim_metrics_now_ns() - started_ns, catalog->count);
+            result = oim_publish_scanned_roots(catalog, scanned);
+        } else {
+            oim_catalog_free(catalog);
+            result = 0;
+        }
+    }
+
+    free(scanned);
+    pthread_mutex_unlock(&group->lock);
+    return result;
+}
+
+typedef struct {
+    OIMScanGroup *group;
+    OIMMirrorCatalog *catalog;
+    bool *scanned;
+} OIMGroupScanJob;
+
+static void* oim_group_scan_job_main(void *arg) {
+    OIMGroupScanJob *job = arg;
+    oim_scan_group_roots(job->group, job->catalog, job->scanned, true);
+    return NULL;
+}
+
+static bool oim_mirror_roots_fresh() {
+    time_t now = time(NULL);
+    bool fresh = true;
+
+    pthread_mutex_lock(&scanner_lock);
+    for (size_t i = 0; i < manager_config->root_count; i++) {
+        const OIMMirrorRoot *root = &manager_config->roots[i];
+        fresh = fresh && now - root->last_scan < root->scan_interval;
+    }
+    pthread_mutex_unlock(&scanner_lock);
+
+    return fresh;
+}
+
+/*
+ * Scans every root, one thread per device group, and publishes them
+ * together as one generation. Unless force is set, a current generation
+ * whose roots are all within their scan interval is kept.
+ */
+static int oim_rescan_all_roots(bool force) {
     if (manager_config == NULL) {
         LOG_ERROR("Mirror Manager Configuration is NULL");
         return -1;
     }
 
-    if (manager_config->base_directory == NULL) {
-        LOG_ERROR("Base Mirror directory is not set");
-        return -1;
+    for (size_t g = 0; g < scan_group_count; g++) {
+        pthread_mutex_lock(&scan_groups[g].lock);
     }
 
-    DIR *dir = opendir(manager_config->base_directory);
-    if (dir == NULL) {
-        LOG_ERROR("Cannot open Mirror directory: %s (Error: %s)", 
-                  manager_config->base_directory, strerror(errno));
-        return -1;
-    }
-    closedir(dir);
+    int result = 0;
 
-    if (current_time - last_scan_time < manager_config->scan_interval && cached_mirror_list) {
+    if (!force && oim_mirror_roots_fresh() &&
+        __atomic_load_n(&current_snapshot, __ATOMIC_SEQ_CST)) {
         LOG_INFO("Using existing cached Mirror list");
-        return 0;
+        goto unlock;
     }
 
-    json_object *mirror_list = json_object_new_array();
-    if (mirror_list == NULL) {
-        LOG_ERROR("Failed to create Mirror list array");
-        return -1;
+    OIMGroupScanJob *jobs = calloc(scan_group_count, sizeof(OIMGroupScanJob));
+    pthread_t *threads = calloc(scan_group_count, sizeof(pthread_t));
+    bool *started = calloc(scan_group_count, sizeof(bool));
+    bool *scanned = calloc(manager_config->root_count, sizeof(bool));
+    OIMMirrorCatalog *catalog = oim_create_mirror_catalog();
+
+    result = jobs && threads && started && scanned && catalog ? 0 : -1;
+    uint64_t started_ns = oim_metrics_now_ns();
+
+    for (size_t g = 0; result == 0 && g < scan_group_count; g++) {
+        jobs[g].group = &scan_groups[g];
+        jobs[g].scanned = scanned;
+        jobs[g].catalog = oim_create_mirror_catalog();
+        if (jobs[g].catalog == NULL) {
+            result = -1;
+        }
     }
 
-    int result = oim_scan_directory(
-        manager_config->base_directory, 
-        manager_config->base_directory, 
-        mirror_list
-    );
+    /* The last group is walked on this thread. */
+    for (size_t g = 0; result == 0 && g + 1 < scan_group_count; g++) {
+        started[g] = pthread_create(&threads[g], NULL, oim_group_scan_job_main, &jobs[g]) == 0;
+        if (!started[g]) {
+            oim_group_scan_job_main(&jobs[g]);
+        }
+    }
+    if (result == 0 && scan_group_count > 0) {
+        oim_group_scan_job_main(&jobs[scan_group_count - 1]);
+    }
 
-    if (result != 0) {
+    size_t walked = 0;
+    for (size_t g = 0; jobs && g < scan_group_count; g++) {
+        if (started[g]) {
+            pthread_join(threads[g], NULL);
+        }
+        if (jobs[g].catalog == NULL) {
+            continue;
+        }
+        if (result == 0 && oim_catalog_merge(catalog, jobs[g].catalog) != 0) {
+            result = -1;
+        }
+        oim_catalog_free(jobs[g].catalog);
+    }
+
+    for (size_t i = 0; scanned && i < manager_config->root_count; i++) {
+        walked += scanned[i] ? 1 : 0;
+    }
+
+    if (result == 0 && walked == 0) {
         LOG_ERROR("Directory scanning failed");
-        json_object_put(mirror_list);
-        return -1;
+        result = -1;
     }
 
-    LOG_INFO("Found %d Mirror files", json_object_array_length(mirror_list));
+    if (result == 0) {
+        oim_metrics_record_scan(oim_metrics_now_ns() - started_ns, catalog->count);
+        result = oim_publish_scanned_roots(catalog, scanned);
+        catalog = NULL;
+    }
 
-    if (cached_mirror_list) {
-        json_object_put(cached_mirror_list);
+    oim_catalog_free(catalog);
+    free(scanned);
+    free(started);
+    free(threads);
+    free(jobs);
+
+unlock:
+    for (size_t g = scan_group_count; g > 0; g--) {
+        pthread_mutex_unlock(&scan_groups[g - 1].lock);
     }
-    cached_mirror_list = mirror_list;
-    last_scan_time = current_time;
+    return result;
+}
 
-    oim_cache_store_mirror_list(cached_mirror_list);
+int oim_rescan_mirror_directory() {
+    return oim_rescan_all_roots(false);
+}
 
-    return 0;
+bool oim_is_mirror_image(const char *filename) {
+    const char *ext = strrchr(filename, '.');
+    return ext && (
+        strcasecmp(ext, ".iso") == 0 || 
+        strcasecmp(ext, ".img") == 0
+    );
 }
 
-int oim_scan_directory(
-    const char *directory, 
-    const char *base_directory, 
-    json_object *mirror_list
+static int oim_compare_paths(const void *a, const void *b) {
+    return strcmp(*(const char * const *)a, *(const char * const *)b);
+}
+
+static bool oim_path_in_tree(const char *path, const char *tree) {
+    size_t tree_len = strlen(tree);
+    return strncmp(path, tree, tree_len) == 0 && path[tree_len] == '/';
+}
+
+/*
+ * Applies a batch of filesystem changes to the current catalog and
+ * publishes the result as a new generation. The final state of every
+ * touched path is taken from the filesystem itself, so the order of
+ * changes within a batch does not matter.
+ */
+/* Stats a watched path the way the walker does, refusing links that leave the root. */
+static int oim_stat_watched_path(
+    int root_fd,
+    const char *root,
+    const char *path,
+    struct stat *file_stat
 ) {
-    DIR *dir;
-    struct dirent *entry;
-    char full_path[PATH_MAX];
-    struct stat file_stat;
+    size_t root_len = strlen(root);
+    while (root_len > 1 && root[root_len - 1] == '/') {
+        root_len--;
+    }
 
-    dir = opendir(directory);
-    if (dir == NULL) {
-        fprintf(stderr, "Cannot open directory: %s\n", directory);
+    if (strncmp(path, root, root_len) != 0 || path[root_len] != '/') {
         return -1;
     }
 
-    while ((entry = readdir(dir)) != NULL) {
+    const char *relative_path = path + root_len;
+    while (*relative_path == '/') {
+        relative_path++;
+    }
+
+    return oim_walk_stat_beneath(root_fd, relative_path, file_stat);
+}
+
+int oim_apply_mirror_changes(const OIMMirrorChange *changes, size_t count) {
+    if (count == 0) {
+        return 0;
+    }
+
+    const char **touched = malloc(count * sizeof(char *));
+    const char **trees = malloc(count * sizeof(char *));
+    if (touched == NULL || trees == NULL) {
+        free(touched);
+        free(trees);
+        return -1;
+    }
+
+    size_t touched_count = 0;
+    size_t tree_count = 0;
+
+    for (size_t i = 0; i < count; i++) {
+        if (changes[i].type == OIM_MIRROR_CHANGE_REMOVE_TREE) {
+            trees[tree_count++] = changes[i].path;
+        } else {
+            touched[touched_count++] = changes[i].path;
+        }
+    }
+
+    qsort(touched, touched_count, sizeof(char *), oim_compare_paths);
+
+    /* The watcher only covers mirror_directory, the first root. */
+    OIMScanGroup *group = manager_config && scan_group_count > 0
+        ? &scan_groups[manager_config->roots[0].group]
+        : NULL;
+    if (group) {
+        pthread_mutex_lock(&group->lock);
+    }
+    pthread_mutex_lock(&scan_lock);
+
+    /* Publishers hold scan_lock, so current_snapshot cannot change under us. */
+    OIMMirrorSnapshot *previous = __atomic_load_n(&current_snapshot, __ATOMIC_SEQ_CST);
+    OIMMirrorCatalog *catalog = NULL;
+
+    if (previous == NULL || manager_config == NULL ||
+        (catalog = oim_create_mirror_catalog()) == NULL) {
+        pthread_mutex_unlock(&scan_lock);
+        if (group) {
+            pthread_mutex_unlock(&group->lock);
+        }
+        free(touched);
+        free(trees);
+        oim_request_mirror_rescan();
+        return -1;
+    }
+
+    const OIMMirrorCatalog *old_catalog = previous->catalog;
+    size_t removed = 0;
+    int result = 0;
+
+    for (size_t i = 0; i < old_catalog->count; i++) {
+        const OIMMirrorEntry *entry = &old_catalog->entries[i];
+        const char *path = entry->path;
+
+        bool drop = bsearch(&path, touched, touched_count, sizeof(char *),
+                            oim_compare_paths) != NULL;
 
-        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
+        for (size_t t = 0; !drop && t < tree_count; t++) {
+            drop = oim_path_in_tree(path, trees[t]);
+        }
+
+        if (drop) {
+            removed++;
             continue;
         }
 
-        snprintf(full_path, sizeof(full_path), "%s/%s", directory, entry->d_name);
+        if (oim_catalog_add(catalog, entry->path, entry->file_size,
+                            entry->modified_time, entry->inode, entry->device) != 0) {
+            result = -1;
+            break;
+        }
+    }
+
+    size_t added = 0;
+    const char *root = manager_config->roots[0].directory;
+    int root_fd = -1;
 
-        if (stat(full_path, &file_stat) == -1) {
+    if (result == 0 && touched_count > 0) {
+        root_fd = open(root, O_PATH | O_DIRECTORY | O_CLOEXEC);
+        if (root_fd == -1) {
+            LOG_ERROR("Cannot open directory: %s (Error: %s)", root, strerror(errno));
+            result = -1;
+        }
+    }
+
+    for (size_t i = 0; result == 0 && i < touched_count; i++) {
+        if (i > 0 && strcmp(touched[i], touched[i - 1]) == 0) {
             continue;
         }
 
-        if (S_ISDIR(file_stat.st_mode)) {
-            if (manager_config->recursive_scan) {
-                oim_scan_directory(full_path, base_directory, mirror_list);
-            }
+        const char *filename = strrchr(touched[i], '/');
+        filename = filename ? filename + 1 : touched[i];
+
+        struct stat file_stat;
+        if (!oim_is_mirror_image(filename) ||
+            oim_stat_watched_path(root_fd, root, touched[i], &file_stat) == -1 ||
+            !S_ISREG(file_stat.st_mode)) {
             continue;
         }
 
-        const char *ext = strrchr(entry->d_name, '.');
-        if (ext && (
-            strcasecmp(ext, ".iso") == 0 || 
-            strcasecmp(ext, ".img") == 0
-        )) {
+        if (oim_catalog_add(catalog, touched[i], file_stat.st_size,
+                            file_stat.st_mtime, file_stat.st_ino, file_stat.st_dev) != 0) {
+            result = -1;
+            break;
+        }
+        added++;
+    }
+
+    if (root_fd != -1) {
+        close(root_fd);
+    }
+
+    if (result == 0) {
+        result = oim_catalog_finalize(catalog);
+    }
 
-            json_object *mirror_entry = json_object_new_object();
+    if (result == 0) {
+        LOG_INFO("Applied %zu filesystem change(s): %zu entries dropped, %zu (re)added",
+                 count, removed, added);
+        result = oim_publish_mirror_snapshot(catalog, true, false, true);
+    } else {
+        LOG_ERROR("Failed to apply filesystem changes, requesting a full rescan");
+        oim_catalog_free(catalog);
+        oim_request_mirror_rescan();
+    }
 
-            char *category = oim_generate_category_from_path(full_path, base_directory);
+    pthread_mutex_unlock(&scan_lock);
+    if (group) {
+        pthread_mutex_unlock(&group->lock);
+    }
 
-            json_object_object_add(mirror_entry, "filename", 
-                json_object_new_string(entry->d_name));
-            json_object_object_add(mirror_entry, "path", 
-                json_object_new_string(full_path));
-            json_object_object_add(mirror_entry, "category", 
-                json_object_new_string(category ? category : "Uncategorized"));
-            json_object_object_add(mirror_entry, "size", 
-                json_object_new_int64(file_stat.st_size));
-            json_object_object_add(mirror_entry, "modified", 
-                json_object_new_int64(file_stat.st_mtime));
+    free(touched);
+    free(trees);
+    return result;
+}
 
-            json_object_array_add(mirror_list, mirror_entry);
+/*
+ * Republishes the current file set so newly computed digests reach the
+ * listing. Nothing on disk changed, so the cache and snapshot file are
+ * left alone.
+ */
+int oim_refresh_mirror_digests() {
+    pthread_mutex_lock(&scan_lock);
 
-            free(category);
+    OIMMirrorSnapshot *previous = __atomic_load_n(&current_snapshot, __ATOMIC_SEQ_CST);
+    if (previous == NULL || manager_config == NULL) {
+        pthread_mutex_unlock(&scan_lock);
+        return -1;
+    }
+
+    const OIMMirrorCatalog *old_catalog = previous->catalog;
+    OIMMirrorCatalog *catalog = oim_create_mirror_catalog();
+    int result = catalog ? 0 : -1;
+
+    for (size_t i = 0; result == 0 && i < old_catalog->count; i++) {
+        const OIMMirrorEntry *entry = &old_catalog->entries[i];
+        result = oim_catalog_add(catalog, entry->path, entry->file_size,
+                                 entry->modified_time, entry->inode, entry->device);
+    }
+
+    if (result == 0) {
+        result = oim_catalog_finalize(catalog);
+    }
+
+    if (result == 0) {
+        result = oim_publish_mirror_snapshot(catalog, false, false, true);
+    } else {
+        LOG_ERROR("Failed to refresh Mirror digests");
+        oim_catalog_free(catalog);
+    }
+
+    pthread_mutex_unlock(&scan_lock);
+    return result;
+}
+
+typedef struct {
+    OIMMirrorCatalog **worker_catalogs;
+    long failed;
+} OIMScanContext;
+
+static void oim_collect_mirror_entry(
+    void *ctx,
+    int worker,
+    const char *full_path,
+    const char *name __attribute__((unused)),
+    const struct stat *file_stat
+) {
+    OIMScanContext *scan = ctx;
+    if (oim_catalog_add(scan->worker_catalogs[worker], full_path, file_stat->st_size,
+                        file_stat->st_mtime, file_stat->st_ino, file_stat->st_dev) != 0) {
+        __atomic_add_fetch(&scan->failed, 1, __ATOMIC_RELAXED);
+    }
+}
+
+int oim_scan_directory(
+    const char *directory, 
+    bool recursive, 
+    OIMMirrorCatalog *catalog
+) {
+    int thread_count = manager_config->scan_threads > 0 ? manager_config->scan_threads : 1;
+
+    /* Each worker fills its own catalog and arena, so adds never contend. */
+    OIMScanContext scan = {
+        .worker_catalogs = calloc(thread_count, sizeof(OIMMirrorCatalog *)),
+        .failed = 0
+    };
+    if (scan.worker_catalogs == NULL) {
+        return -1;
+    }
+
+    int result = 0;
+    for (int i = 0; i < thread_count; i++) {
+        scan.worker_catalogs[i] = oim_create_mirror_catalog();
+        if (scan.worker_catalogs[i] == NULL) {
+            result = -1;
         }
     }
 
-    closedir(dir);
-    return 0;
+    OIMWalkOptions options = {
+        .root = directory,
+        .recursive = recursive,
+        .thread_count = thread_count,
+        .filter = oim_is_mirror_image,
+        .callback = oim_collect_mirror_entry,
+        .ctx = &scan
+    };
+
+    OIMWalkStats stats = {0};
+    if (result == 0) {
+        result = oim_walk_directory(&options, &stats);
+    }
+
+    for (int i = 0; i < thread_count; i++) {
+        if (scan.worker_catalogs[i] == NULL) {
+            continue;
+        }
+        if (result == 0 && oim_catalog_merge(catalog, scan.worker_catalogs[i]) != 0) {
+            result = -1;
+        }
+        oim_catalog_free(scan.worker_catalogs[i]);
+    }
+    free(scan.worker_catalogs);
+
+    if (scan.failed > 0) {
+        LOG_ERROR("Failed to record %ld Mirror file(s) during scan", scan.failed);
+        result = -1;
+    }
+
+    LOG_INFO("Walked %ld directories and %ld entries with %d thread(s), %ld stat calls",
+             stats.directories, stats.entries, thread_count, stats.stat_calls);
+
+    return result;
 }
 
-char* oim_generate_category_from_path(const char *full_path, const char *base_dir) {
+OIMMirrorSnapshot* oim_get_mirror_snapshot() {
+    OIMMirrorSnapshot *snapshot = oim_acquire_current_snapshot();
+    if (snapshot) {
+        oim_metrics_record_list_lookup(OIM_LIST_LOOKUP_SNAPSHOT);
+        return snapshot;
+    }
 
-    const char *relative_path = full_path + strlen(base_dir);
+    /* Only reached before the first generation has been published. */
+    if (manager_config == NULL) {
+        return NULL;
+    }
 
-    if (relative_path[0] == '/') {
-        relative_path++;
+    pthread_mutex_lock(&scan_lock);
+
+    bool scan_needed = false;
+    if (__atomic_load_n(&current_snapshot, __ATOMIC_SEQ_CST) == NULL) {
+        OIMMirrorCatalog *catalog = oim_cache_get_mirror_catalog(manager_config->catalog_roots,
+                                                                 manager_config->root_count);
+
+        if (catalog) {
+            LOG_INFO("Retrieved Mirror list from cache");
+            oim_metrics_record_list_lookup(OIM_LIST_LOOKUP_CACHE);
+            oim_publish_mirror_snapshot(catalog, false, false, true);
+            cache_in_sync = true;
+        } else {
+            scan_needed = true;
+        }
     }
 
-    char *category = strdup(relative_path);
-    char *slash = strchr(category, '/');
+    pthread_mutex_unlock(&scan_lock);
 
-    if (slash) {
-        *slash = '\0';
+    /* Scans take the group locks, which rank above scan_lock. */
+    if (scan_needed) {
+        LOG_INFO("No cached list found. Attempting to rescan Mirror directory");
+        oim_metrics_record_list_lookup(OIM_LIST_LOOKUP_SCAN);
+        if (oim_rescan_mirror_directory() != 0) {
+            LOG_ERROR("Mirror directory rescan failed");
+        }
     }
 
-    return category;
+    return oim_acquire_current_snapshot();
 }
 
 json_object* oim_get_mirror_list() {
+    OIMMirrorSnapshot *snapshot = oim_get_mirror_snapshot();
+    if (snapshot == NULL) {
+        LOG_ERROR("Mirror list is unavailable");
+        return NULL;
+    }
+
+    json_object *mirror_list = oim_catalog_to_json(snapshot->catalog);
+    oim_snapshot_release(snapshot);
+    return mirror_list;
+}
 
-    LOG_INFO("Attempting to retrieve Mirror list");
+/* Earliest time one of the group's roots is due for its next scan. */
+static time_t oim_scan_group_deadline(const OIMScanGroup *group) {
+    time_t deadline = 0;
 
-    if (cached_mirror_list) {
-        LOG_INFO("Returning cached Mirror list");
-        return json_object_get(cached_mirror_list);
+    for (size_t i = 0; i < group->root_count; i++) {
+        const OIMMirrorRoot *root = &manager_config->roots[group->roots[i]];
+        if (root->scan_interval <= 0) {
+            continue;
+        }
+        time_t due = root->last_scan + root->scan_interval;
+        if (deadline == 0 || due < deadline) {
+            deadline = due;
+        }
     }
 
-    json_object *cached_list = oim_cache_get_mirror_list();
-    if (cached_list) {
-        LOG_INFO("Retrieved Mirror list from cache");
-        cached_mirror_list = cached_list;
-        return json_object_get(cached_mirror_list);
+    return deadline;
+}
+
+static void* oim_mirror_scanner_main(void *arg) {
+    OIMScanGroup *group = arg;
+
+    pthread_mutex_lock(&scanner_lock);
+
+    while (scanner_running) {
+        struct timespec deadline = { .tv_sec = oim_scan_group_deadline(group) };
+        bool forced;
+
+        /* Without a scan interval the group only scans when the watcher asks. */
+        while (scanner_running && !group->rescan_requested) {
+            if (deadline.tv_sec == 0) {
+                pthread_cond_wait(&scanner_cond, &scanner_lock);
+            } else if (pthread_cond_timedwait(&scanner_cond, &scanner_lock,
+                                              &deadline) == ETIMEDOUT) {
+                break;
+            }
+        }
+
+        if (!scanner_running) {
+            break;
+        }
+
+        forced = group->rescan_requested;
+        group->rescan_requested = false;
+        pthread_mutex_unlock(&scanner_lock);
+
+        LOG_INFO("Background rescan of scan group %zu starting", (size_t)(group - scan_groups));
+
+        if (oim_rescan_scan_group(group, forced) != 0) {
+            LOG_ERROR("Background rescan failed, keeping previous generation");
+        }
+
+        pthread_mutex_lock(&scanner_lock);
     }
 
-    LOG_INFO("No cached list found. Attempting to rescan Mirror directory");
-    int scan_result = oim_rescan_mirror_directory();
-    if (scan_result != 0) {
-        LOG_ERROR("Mirror directory rescan failed");
-        return NULL;
+    pthread_mutex_unlock(&scanner_lock);
+    return NULL;
+}
+
+int oim_start_mirror_scanner() {
+    if (manager_config == NULL) {
+        LOG_ERROR("Cannot start Mirror scanner before the Mirror manager is initialized");
+        return -1;
     }
 
-    if (cached_mirror_list == NULL) {
-        LOG_ERROR("Mirror list is still NULL after rescan");
-        return NULL;
+    pthread_mutex_lock(&scanner_lock);
+    if (scanner_running) {
+        pthread_mutex_unlock(&scanner_lock);
+        return 0;
+    }
+    scanner_running = true;
+
+    /* The watcher falls back to a full rescan of its group when it loses events. */
+    size_t watched_group = manager_config->watch_mode ? manager_config->roots[0].group : SIZE_MAX;
+
+    size_t started = 0;
+    for (size_t g = 0; g < scan_group_count; g++) {
+        OIMScanGroup *group = &scan_groups[g];
+        if (oim_scan_group_deadline(group) == 0 && g != watched_group) {
+            continue;
+        }
+
+        group->rescan_requested = warm_start_pending;
+        if (pthread_create(&group->thread, NULL, oim_mirror_scanner_main, group) != 0) {
+            LOG_ERROR("Failed to create Mirror scanner thread: %s", strerror(errno));
+            continue;
+        }
+        group->thread_started = true;
+        started++;
+    }
+    warm_start_pending = false;
+
+    if (started == 0) {
+        scanner_running = false;
     }
+    pthread_mutex_unlock(&scanner_lock);
 
-    LOG_INFO("Successfully retrieved Mirror list");
-    return json_object_get(cached_mirror_list);
+    if (started == 0) {
+        LOG_INFO("Scan interval disabled, background Mirror scanner not started");
+        return 0;
+    }
+
+    LOG_INFO("Background Mirror scanner started for %zu of %zu scan group(s)",
+             started, scan_group_count);
+    return 0;
+}
+
+void oim_request_mirror_rescan() {
+    pthread_mutex_lock(&scanner_lock);
+    for (size_t g = 0; g < scan_group_count; g++) {
+        scan_groups[g].rescan_requested = true;
+    }
+    pthread_cond_broadcast(&scanner_cond);
+    pthread_mutex_unlock(&scanner_lock);
+}
+
+void oim_stop_mirror_scanner() {
+    pthread_mutex_lock(&scanner_lock);
+    if (!scanner_running) {
+        pthread_mutex_unlock(&scanner_lock);
+        return;
+    }
+    scanner_running = false;
+    pthread_cond_broadcast(&scanner_cond);
+    pthread_mutex_unlock(&scanner_lock);
+
+    for (size_t g = 0; g < scan_group_count; g++) {
+        if (scan_groups[g].thread_started) {
+            pthread_join(scan_groups[g].thread, NULL);
+            scan_groups[g].thread_started = false;
+        }
+    }
+    LOG_INFO("Background Mirror scanner stopped");
 }
 
 void oim_free_mirror_entries() {
@@ -1,15 +1,70 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdarg.h>
+#include <stdint.h>
 #include <time.h>
 #include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
 
 #include "logging.h"
 
-static FILE *log_file = NULL;
+/*
+ * Log lines are formatted by the calling thread straight into a bounded
+ * multi-producer ring (one sequence number per slot, so producers only
+ * contend on a single compare-and-swap) and written out in batches by a
+ * dedicated writer thread. Callers never take a lock or make a syscall,
+ * except to wait for room when the ring is full under the block policy.
+ */
+#define LOG_RING_SLOTS 4096
+#define LOG_LINE_MAX 512
+#define LOG_BATCH_SIZE (64 * 1024)
+
+/* How long the writer sleeps when idle; bounds the delay before a line reaches disk. */
+#define LOG_WRITER_INTERVAL_MS 100
+
+typedef struct {
+    size_t sequence;
+    LogLevel level;
+    unsigned int length;
+    char text[LOG_LINE_MAX];
+} LogSlot;
+
+typedef struct {
+    int fd;
+    size_t length;
+    char data[LOG_BATCH_SIZE];
+} LogBatch;
+
+/* Static so that a late caller racing close_logging never touches freed memory. */
+static LogSlot log_ring[LOG_RING_SLOTS];
+static size_t log_tail = 0;
+static size_t log_head = 0;
+static unsigned long log_dropped = 0;
+
+static int log_fd = -1;
 static LogLevel current_log_level = LOG_INFO;
+static LogOverflowPolicy overflow_policy = LOG_OVERFLOW_DROP;
 static bool logging_enabled = false;
 
+static pthread_t writer_thread;
+static bool writer_started = false;
+static bool writer_stopping = false;
+static bool writer_idle = false;
+static pthread_mutex_t writer_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t writer_cond = PTHREAD_COND_INITIALIZER;
+
+/* Producers waiting for room under the block policy; signalled after each drain. */
+static pthread_cond_t space_cond = PTHREAD_COND_INITIALIZER;
+static int blocked_producers = 0;
+
+static __thread time_t cached_second = 0;
+static __thread char cached_timestamp[32];
+
 static const char* get_log_level_string(LogLevel level) {
     switch (level) {
         case LOG_DEBUG: return "DEBUG";
@@ -20,69 +75,339 @@ static const char* get_log_level_string(LogLevel level) {
     }
 }
 
-int init_logging(const char *log_file_path, LogLevel level, bool enable_logging) {
+LogOverflowPolicy parse_log_overflow_policy(const char *name) {
+    if (name && strcasecmp(name, "block") == 0) {
+        return LOG_OVERFLOW_BLOCK;
+    }
+    return LOG_OVERFLOW_DROP;
+}
 
-    close_logging();
+/* Reformatted at most once per second per thread; time() itself is a vDSO call. */
+static const char* log_timestamp() {
+    time_t now = time(NULL);
 
-    if (!enable_logging) {
-        logging_enabled = false;
-        return 0;
+    if (now != cached_second) {
+        struct tm timestamp;
+        localtime_r(&now, &timestamp);
+        strftime(cached_timestamp, sizeof(cached_timestamp), "%Y-%m-%d %H:%M:%S", &timestamp);
+        cached_second = now;
     }
 
-    if (log_file_path == NULL || strlen(log_file_path) == 0) {
-        fprintf(stderr, "Invalid log file path\n");
-        return -1;
+    return cached_timestamp;
+}
+
+static void log_wake_writer() {
+    if (__atomic_load_n(&writer_idle, __ATOMIC_RELAXED)) {
+        pthread_mutex_lock(&writer_lock);
+        pthread_cond_signal(&writer_cond);
+        pthread_mutex_unlock(&writer_lock);
     }
+}
 
-    log_file = fopen(log_file_path, "a");
-    if (log_file == NULL) {
-        fprintf(stderr, "Failed to open log file: %s\n", log_file_path);
-        return -1;
+/* Parks the caller until the writer has freed the slot at pos. */
+static void log_wait_for_space(LogSlot *slot, size_t pos) {
+    pthread_mutex_lock(&writer_lock);
+    __atomic_add_fetch(&blocked_producers, 1, __ATOMIC_SEQ_CST);
+    pthread_cond_signal(&writer_cond);
+
+    while ((intptr_t)__atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE) - (intptr_t)pos < 0) {
+        pthread_cond_wait(&space_cond, &writer_lock);
     }
 
-    logging_enabled = true;
-    current_log_level = level;
+    __atomic_sub_fetch(&blocked_producers, 1, __ATOMIC_SEQ_CST);
+    pthread_mutex_unlock(&writer_lock);
+}
 
-    return 0;
+/* Claims the next free slot, or returns NULL if the ring is full under the drop policy. */
+static LogSlot* log_claim_slot(size_t *position) {
+    size_t pos = __atomic_load_n(&log_tail, __ATOMIC_RELAXED);
+
+    for (;;) {
+        LogSlot *slot = &log_ring[pos & (LOG_RING_SLOTS - 1)];
+        size_t sequence = __atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE);
+        intptr_t diff = (intptr_t)sequence - (intptr_t)pos;
+
+        if (diff == 0) {
+            if (__atomic_compare_exchange_n(&log_tail, &pos, pos + 1, true,
+                                            __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                *position = pos;
+                return slot;
+            }
+        } else if (diff < 0) {
+            if (overflow_policy == LOG_OVERFLOW_DROP) {
+                __atomic_add_fetch(&log_dropped, 1, __ATOMIC_RELAXED);
+                log_wake_writer();
+                return NULL;
+            }
+            log_wait_for_space(slot, pos);
+            pos = __atomic_load_n(&log_tail, __ATOMIC_RELAXED);
+        } else {
+            pos = __atomic_load_n(&log_tail, __ATOMIC_RELAXED);
+        }
+    }
 }
 
 void log_message(LogLevel level, const char *format, ...) {
-    if (!logging_enabled || level < current_log_level) {
+    if (!__atomic_load_n(&logging_enabled, __ATOMIC_ACQUIRE) || level < current_log_level) {
         return;
     }
 
-    time_t now;
-    struct tm *timestamp;
-    char time_buffer[64];
+    size_t position;
+    LogSlot *slot = log_claim_slot(&position);
+    if (slot == NULL) {
+        return;
+    }
 
-    time(&now);
-    timestamp = localtime(&now);
-    strftime(time_buffer, sizeof(time_buffer), "%Y-%m-%d %H:%M:%S", timestamp);
+    /* Leave room for the newline that terminates every line. */
+    size_t room = sizeof(slot->text) - 1;
+    int length = snprintf(slot->text, room, "[%s] %s: ",
+                          log_timestamp(), get_log_level_string(level));
 
     va_list args;
     va_start(args, format);
+    int message_length = vsnprintf(slot->text + length, room - length, format, args);
+    va_end(args);
 
-    if (level >= LOG_WARN) {
-        FILE *output_stream = (level == LOG_ERROR) ? stderr : stdout;
-        fprintf(output_stream, "[%s] %s: ", time_buffer, get_log_level_string(level));
-        vfprintf(output_stream, format, args);
-        fprintf(output_stream, "\n");
+    if (message_length < 0) {
+        message_length = 0;
     }
 
-    if (log_file) {
-        fprintf(log_file, "[%s] %s: ", time_buffer, get_log_level_string(level));
-        vfprintf(log_file, format, args);
-        fprintf(log_file, "\n");
-        fflush(log_file);
+    size_t total = (size_t)length + (size_t)message_length;
+    if (total >= room) {
+        total = room - 1;
+        memcpy(slot->text + total - 3, "...", 3);
     }
+    slot->text[total++] = '\n';
 
-    va_end(args);
+    slot->level = level;
+    slot->length = (unsigned int)total;
+    __atomic_store_n(&slot->sequence, position + 1, __ATOMIC_RELEASE);
+
+    /* The writer polls; only wake it early when the backlog gets large or something failed. */
+    if (level == LOG_ERROR ||
+        position - __atomic_load_n(&log_head, __ATOMIC_RELAXED) >= LOG_RING_SLOTS / 2) {
+        log_wake_writer();
+    }
+
+    /* A shutdown drain, or a producer blocked on a full ring, is waiting for this slot. */
+    if (__atomic_load_n(&writer_stopping, __ATOMIC_SEQ_CST) ||
+        __atomic_load_n(&blocked_producers, __ATOMIC_SEQ_CST) > 0) {
+        pthread_mutex_lock(&writer_lock);
+        pthread_cond_signal(&writer_cond);
+        pthread_mutex_unlock(&writer_lock);
+    }
+}
+
+static void log_batch_flush(LogBatch *batch) {
+    size_t offset = 0;
+
+    while (offset < batch->length) {
+        ssize_t written = write(batch->fd, batch->data + offset, batch->length - offset);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+        offset += (size_t)written;
+    }
+
+    batch->length = 0;
+}
+
+static void log_batch_append(LogBatch *batch, const char *text, size_t length) {
+    if (batch->fd == -1) {
+        return;
+    }
+    if (batch->length + length > sizeof(batch->data)) {
+        log_batch_flush(batch);
+    }
+    memcpy(batch->data + batch->length, text, length);
+    batch->length += length;
+}
+
+/* Whether the oldest unwritten slot has been published. Only the writer calls this. */
+static bool log_head_ready() {
+    const LogSlot *slot = &log_ring[log_head & (LOG_RING_SLOTS - 1)];
+    return __atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE) == log_head + 1;
+}
+
+/* Moves every published line into the batches. Returns the number of lines taken. */
+static size_t log_drain(LogBatch *file, LogBatch *out, LogBatch *err) {
+    size_t drained = 0;
+
+    unsigned long dropped = __atomic_exchange_n(&log_dropped, 0, __ATOMIC_RELAXED);
+    if (dropped > 0) {
+        char notice[128];
+        int length = snprintf(notice, sizeof(notice),
+                              "[%s] WARN: Log buffer full, dropped %lu message%s\n",
+                              log_timestamp(), dropped, dropped == 1 ? "" : "s");
+        log_batch_append(file, notice, (size_t)length);
+        log_batch_append(out, notice, (size_t)length);
+    }
+
+    while (log_head_ready()) {
+        LogSlot *slot = &log_ring[log_head & (LOG_RING_SLOTS - 1)];
+
+        log_batch_append(file, slot->text, slot->length);
+        if (slot->level == LOG_ERROR) {
+            log_batch_append(err, slot->text, slot->length);
+        } else if (slot->level == LOG_WARN) {
+            log_batch_append(out, slot->text, slot->length);
+        }
+
+        __atomic_store_n(&slot->sequence, log_head + LOG_RING_SLOTS, __ATOMIC_RELEASE);
+        __atomic_store_n(&log_head, log_head + 1, __ATOMIC_RELAXED);
+        drained++;
+    }
+
+    /* Producers check for room under writer_lock, so the broadcast cannot be missed. */
+    if (drained > 0 && overflow_policy == LOG_OVERFLOW_BLOCK) {
+        pthread_mutex_lock(&writer_lock);
+        if (blocked_producers > 0) {
+            pthread_cond_broadcast(&space_cond);
+        }
+        pthread_mutex_unlock(&writer_lock);
+    }
+
+    log_batch_flush(file);
+    log_batch_flush(out);
+    log_batch_flush(err);
+    return drained;
 }
 
+static void* log_writer_main(void *arg __attribute__((unused))) {
+    static LogBatch file;
+    static LogBatch out;
+    static LogBatch err;
+
+    file.fd = log_fd;
+    out.fd = STDOUT_FILENO;
+    err.fd = STDERR_FILENO;
+
+    for (;;) {
+        if (log_drain(&file, &out, &err) > 0) {
+            continue;
+        }
+
+        pthread_mutex_lock(&writer_lock);
+        if (writer_stopping) {
+            pthread_mutex_unlock(&writer_lock);
+            break;
+        }
+        /* A producer blocked on a full ring may have signalled before this thread got here. */
+        if (blocked_producers > 0 && log_head_ready()) {
+            pthread_mutex_unlock(&writer_lock);
+            continue;
+        }
+
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_nsec += LOG_WRITER_INTERVAL_MS * 1000000L;
+        if (deadline.tv_nsec >= 1000000000L) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+
+        __atomic_store_n(&writer_idle, true, __ATOMIC_RELAXED);
+        pthread_cond_timedwait(&writer_cond, &writer_lock, &deadline);
+        __atomic_store_n(&writer_idle, false, __ATOMIC_RELAXED);
+        pthread_mutex_unlock(&writer_lock);
+    }
+
+    /*
+     * Producers that claimed a slot before logging was disabled are still
+     * filling it and signal writer_cond once it is published; the short
+     * timeout covers a signal sent just before this thread waits.
+     */
+    while (__atomic_load_n(&log_head, __ATOMIC_RELAXED) !=
+           __atomic_load_n(&log_tail, __ATOMIC_ACQUIRE)) {
+        if (log_drain(&file, &out, &err) > 0) {
+            continue;
+        }
+
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_nsec += 1000000L;
+        if (deadline.tv_nsec >= 1000000000L) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+
+        pthread_mutex_lock(&writer_lock);
+        pthread_cond_timedwait(&writer_cond, &writer_lock, &deadline);
+        pthread_mutex_unlock(&writer_lock);
+    }
+    log_drain(&file, &out, &err);
+
+    return NULL;
+}
+
+int init_logging(
+    const char *log_file_path,
+    LogLevel level,
+    bool enable_logging,
+    LogOverflowPolicy policy
+) {
+
+    close_logging();
+
+    if (!enable_logging) {
+        logging_enabled = false;
+        return 0;
+    }
+
+    if (log_file_path == NULL || strlen(log_file_path) == 0) {
+        fprintf(stderr, "Invalid log file path\n");
+        return -1;
+    }
+
+    log_fd = open(log_file_path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (log_fd == -1) {
+        fprintf(stderr, "Failed to open log file: %s\n", log_file_path);
+        return -1;
+    }
+
+    for (size_t i = 0; i < LOG_RING_SLOTS; i++) {
+        log_ring[i].sequence = i;
+    }
+    log_head = 0;
+    log_tail = 0;
+    log_dropped = 0;
+
+    current_log_level = level;
+    overflow_policy = policy;
+    writer_stopping = false;
+
+    if (pthread_create(&writer_thread, NULL, log_writer_main, NULL) != 0) {
+        fprintf(stderr, "Failed to start log writer thread\n");
+        close(log_fd);
+        log_fd = -1;
+        return -1;
+    }
+    writer_started = true;
+
+    __atomic_store_n(&logging_enabled, true, __ATOMIC_RELEASE);
+
+    return 0;
+}
+
+/* Flushes every queued line before returning. */
 void close_logging(void) {
-    if (log_file) {
-        fclose(log_file);
-        log_file = NULL;
+    __atomic_store_n(&logging_enabled, false, __ATOMIC_RELEASE);
+
+    if (writer_started) {
+        pthread_mutex_lock(&writer_lock);
+        __atomic_store_n(&writer_stopping, true, __ATOMIC_SEQ_CST);
+        pthread_cond_signal(&writer_cond);
+        pthread_mutex_unlock(&writer_lock);
+
+        pthread_join(writer_thread, NULL);
+        writer_started = false;
     }
-    logging_enabled = false;
-}
\ No newline at end of file
+
+    if (log_fd != -1) {
+        close(log_fd);
+        log_fd = -1;
+    }
+}
@@ -2,15 +2,23 @@
 #include <stdlib.h>
 #include <signal.h>
 #include <unistd.h>
+#include <pthread.h>
 
 #include "config.h"
 #include "api.h"
 #include "imgMgr.h"
 #include "cache.h"
+#include "checksum.h"
+#include "throttle.h"
+#include "watcher.h"
 #include "logging.h"
 
+#define OIM_CONFIG_PATH "config/config.json"
+
 OIMConfig *global_config = NULL;
 struct MHD_Daemon *global_daemon = NULL;
+static volatile sig_atomic_t reload_requested = 0;
+static volatile sig_atomic_t shutdown_signal = 0;
 
 void oim_cleanup_resources() {
     LOG_INFO("Performing cleanup of resources");
@@ -20,6 +28,10 @@ void oim_cleanup_resources() {
         global_daemon = NULL;
     }
 
+    oim_stop_mirror_watcher();
+    oim_checksum_stop();
+    oim_cleanup_mirror_manager();
+
     close_logging();
 
     if (global_config) {
@@ -30,39 +42,68 @@ void oim_cleanup_resources() {
     oim_close_cache();
 }
 
+/* Cleanup joins threads and takes locks, so it runs from the main loop, not here. */
 void oim_signal_handler(int signum) {
-    LOG_WARN("Received signal %d. Initiating shutdown...", signum);
+    shutdown_signal = signum;
+}
+
+void oim_reload_handler(int signum __attribute__((unused))) {
+    reload_requested = 1;
+}
+
+/* Re-reads the settings that can change without a restart: the download rate limits. */
+static void oim_reload_config() {
+    OIMConfig *config = oim_load_config(OIM_CONFIG_PATH);
+    if (config == NULL) {
+        LOG_ERROR("Reload failed, keeping the current configuration");
+        return;
+    }
+
+    OIMThrottleLimits limits = {
+        .global_rate = (uint64_t)(config->download_rate_limit > 0 ? config->download_rate_limit : 0) * 1024,
+        .client_rate = (uint64_t)(config->client_rate_limit > 0 ? config->client_rate_limit : 0) * 1024
+    };
+    oim_throttle_set_limits(&limits);
 
-    oim_cleanup_resources();
-    exit(0);
+    global_config->download_rate_limit = config->download_rate_limit;
+    global_config->client_rate_limit = config->client_rate_limit;
+    oim_free_config(config);
 }
 
 int main(void) {
 
     signal(SIGINT, oim_signal_handler);
     signal(SIGTERM, oim_signal_handler);
+    signal(SIGHUP, oim_reload_handler);
+
+    /*
+     * Every thread inherits this mask, so the signals stay pending until
+     * the main loop unblocks them and are only ever handled there.
+     */
+    sigset_t handled;
+    sigemptyset(&handled);
+    sigaddset(&handled, SIGINT);
+    sigaddset(&handled, SIGTERM);
+    sigaddset(&handled, SIGHUP);
+    pthread_sigmask(SIG_BLOCK, &handled, NULL);
 
     if (atexit(oim_cleanup_resources) != 0) {
         fprintf(stderr, "Failed to register exit handler\n");
         return 1;
     }
 
-    global_config = oim_load_config("config/config.json");
+    global_config = oim_load_config(OIM_CONFIG_PATH);
     if (global_config == NULL) {
         fprintf(stderr, "Failed to load configuration\n");
         LOG_ERROR("Configuration loading failed");
         return 1;
     }
 
-    if (oim_init_mirror_manager(global_config) != 0) {
-        LOG_ERROR("Failed to initialize Mirror manager");
-        return 1;
-    }
-
     if (init_logging(
         global_config->log_file_path, 
         global_config->debug_mode ? LOG_DEBUG : LOG_INFO, 
-        global_config->enable_logging
+        global_config->enable_logging,
+        parse_log_overflow_policy(global_config->log_overflow_policy)
     ) != 0) {
         fprintf(stderr, "Failed to initialize logging\n");
         return 1;
@@ -82,8 +123,47 @@ int main(void) {
 
     LOG_INFO("Cache initialized successfully");
 
+    /* Stored digests must be loaded before the first snapshot is published. */
+    OIMChecksumConfig checksum_config = {
+        .thread_count = global_config->checksum_threads,
+        .algorithms = oim_parse_digest_algorithms(global_config->checksum_algorithms)
+    };
+
+    if (oim_checksum_init(&checksum_config) != 0) {
+        LOG_ERROR("Failed to initialize checksum engine");
+        return 1;
+    }
+
+    if (oim_init_mirror_manager(global_config) != 0) {
+        LOG_ERROR("Failed to initialize Mirror manager");
+        return 1;
+    }
+
     OIMAPIServerConfig api_config = {
-        .port = global_config->api_port
+        .port = global_config->api_port,
+        .thread_pool_size = global_config->thread_pool_size,
+        .use_epoll = global_config->use_epoll,
+        .connection_limit = global_config->connection_limit,
+        .per_ip_connection_limit = global_config->per_ip_connection_limit,
+        .connection_timeout = global_config->connection_timeout,
+        .download_rate_limit = (uint64_t)(global_config->download_rate_limit > 0 ?
+                                          global_config->download_rate_limit : 0) * 1024,
+        .client_rate_limit = (uint64_t)(global_config->client_rate_limit > 0 ?
+                                        global_config->client_rate_limit : 0) * 1024,
+        .public_transfers = global_config->public_transfers,
+        .max_downloads = global_config->max_downloads,
+        .max_client_downloads = global_config->max_client_downloads,
+        .download_queue_length = global_config->download_queue_length,
+        .download_queue_timeout = global_config->download_queue_timeout,
+        .retry_after = global_config->retry_after,
+        .use_io_uring = global_config->use_io_uring,
+        .io_uring_queue_depth = global_config->io_uring_queue_depth,
+        .io_uring_buffers = global_config->io_uring_buffers,
+        .io_uring_buffer_size = global_config->io_uring_buffer_size,
+        .fd_cache_size = global_config->fd_cache_size,
+        .event_keepalive = global_config->event_keepalive,
+        .max_event_subscribers = global_config->max_event_subscribers,
+        .long_poll_timeout = global_config->long_poll_timeout
     };
 
     global_daemon = start_oim_api_server(&api_config, global_config);
@@ -94,10 +174,35 @@ int main(void) {
 
     LOG_INFO("API server started on port %d", global_config->api_port);
 
+    if (oim_start_mirror_scanner() != 0) {
+        LOG_ERROR("Failed to start background Mirror scanner");
+        return 1;
+    }
+
+    if (global_config->watch_mode &&
+        oim_start_mirror_watcher(global_config->mirror_directory, 
+                                 global_config->recursive_scan) != 0) {
+        LOG_WARN("Filesystem watch mode unavailable, relying on periodic rescans");
+    }
+
+    if (oim_checksum_start(oim_refresh_mirror_digests) != 0) {
+        LOG_WARN("Checksum engine unavailable, serving listings without digests");
+    }
+
     LOG_INFO("Server running. Waiting for requests...");
-    while (1) {
+    pthread_sigmask(SIG_UNBLOCK, &handled, NULL);
+
+    while (!shutdown_signal) {
         sleep(1);
+
+        if (reload_requested) {
+            reload_requested = 0;
+            LOG_INFO("Received SIGHUP, reloading configuration");
+            oim_reload_config();
+        }
     }
 
+    /* The atexit handler does the cleanup. */
+    LOG_WARN("Received signal %d. Initiating shutdown...", (int)shutdown_signal);
     return 0;
 }
\ No newline at end of file
@@ -0,0 +1,383 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "metrics.h"
+#include "throttle.h"
+#include "admission.h"
+#include "events.h"
+#include "buffer.h"
+
+/*
+ * Histogram buckets double from one unit; the last one is +Inf. Request
+ * handlers count in microseconds, so the top bucket is just over a
+ * minute. Downloads and scans count in milliseconds, which reaches about
+ * 18 hours, enough for a large image over a slow link.
+ */
+#define OIM_HISTOGRAM_BUCKETS 28
+#define OIM_REQUEST_UNIT_NS 1000ULL
+#define OIM_TRANSFER_UNIT_NS 1000000ULL
+
+typedef struct {
+    uint64_t buckets[OIM_HISTOGRAM_BUCKETS];
+    uint64_t count;
+    uint64_t sum_ns;
+} OIMHistogram;
+
+/* Per-thread counters. Only the owning thread writes; scrapes only read. */
+typedef struct OIMMetricsShard {
+    OIMHistogram request_latency[OIM_ROUTE_COUNT];
+    OIMHistogram download_duration;
+    uint64_t download_bytes;
+    uint64_t downloads_completed;
+    uint64_t downloads_aborted;
+    uint64_t list_lookups[OIM_LIST_LOOKUP_COUNT];
+    uint64_t connections_opened;
+    uint64_t connections_closed;
+
+    bool in_use;
+    struct OIMMetricsShard *next;
+} __attribute__((aligned(64))) OIMMetricsShard;
+
+static OIMMetricsShard *shards = NULL;
+static pthread_mutex_t shards_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t shard_key;
+static pthread_once_t shard_key_once = PTHREAD_ONCE_INIT;
+static __thread OIMMetricsShard *local_shard = NULL;
+
+/* Set by the scanner and publishers, which are already serialized. */
+static uint64_t scans_total = 0;
+static uint64_t last_scan_ns = 0;
+static uint64_t last_scan_entries = 0;
+static uint64_t snapshot_generation = 0;
+static uint64_t snapshot_entries = 0;
+static OIMHistogram scan_duration;
+static pthread_mutex_t scan_metrics_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static const char *route_names[OIM_ROUTE_COUNT] = {
+    "mirror", "categories", "category", "checksums", "download", "metrics", "transfers", "changes", "events", "other"
+};
+
+static const char *lookup_names[OIM_LIST_LOOKUP_COUNT] = {
+    "snapshot", "cache", "scan"
+};
+
+/* Single-writer increment: a plain load and store, never a locked instruction. */
+#define OIM_METRIC_ADD(field, value) \
+    __atomic_store_n(&(field), __atomic_load_n(&(field), __ATOMIC_RELAXED) + (value), \
+                     __ATOMIC_RELAXED)
+
+#define OIM_METRIC_READ(field) __atomic_load_n(&(field), __ATOMIC_RELAXED)
+
+uint64_t oim_metrics_now_ns() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000ULL + (uint64_t)now.tv_nsec;
+}
+
+/* Hands a finished thread's shard to the next thread that starts recording. */
+static void oim_metrics_release_shard(void *shard) {
+    __atomic_store_n(&((OIMMetricsShard *)shard)->in_use, false, __ATOMIC_RELEASE);
+}
+
+static void oim_metrics_create_key() {
+    pthread_key_create(&shard_key, oim_metrics_release_shard);
+}
+
+static OIMMetricsShard* oim_metrics_shard() {
+    if (local_shard) {
+        return local_shard;
+    }
+
+    pthread_once(&shard_key_once, oim_metrics_create_key);
+    pthread_mutex_lock(&shards_lock);
+
+    OIMMetricsShard *shard = shards;
+    while (shard && __atomic_load_n(&shard->in_use, __ATOMIC_ACQUIRE)) {
+        shard = shard->next;
+    }
+
+    if (shard == NULL) {
+        void *memory = NULL;
+        if (posix_memalign(&memory, 64, sizeof(OIMMetricsShard)) != 0) {
+            pthread_mutex_unlock(&shards_lock);
+            return NULL;
+        }
+        shard = memory;
+        memset(shard, 0, sizeof(*shard));
+        shard->next = shards;
+        __atomic_store_n(&shards, shard, __ATOMIC_RELEASE);
+    }
+
+    shard->in_use = true;
+    pthread_mutex_unlock(&shards_lock);
+
+    pthread_setspecific(shard_key, shard);
+    local_shard = shard;
+    return shard;
+}
+
+static void oim_histogram_observe(
+    OIMHistogram *histogram,
+    uint64_t elapsed_ns,
+    uint64_t unit_ns
+) {
+    uint64_t units = elapsed_ns / unit_ns;
+    int bucket = units == 0 ? 0 : 64 - __builtin_clzll(units);
+    if (bucket >= OIM_HISTOGRAM_BUCKETS) {
+        bucket = OIM_HISTOGRAM_BUCKETS - 1;
+    }
+
+    OIM_METRIC_ADD(histogram->buckets[bucket], 1);
+    OIM_METRIC_ADD(histogram->count, 1);
+    OIM_METRIC_ADD(histogram->sum_ns, elapsed_ns);
+}
+
+void oim_metrics_record_request(OIMRoute route, uint64_t elapsed_ns) {
+    OIMMetricsShard *shard = oim_metrics_shard();
+    if (shard && route < OIM_ROUTE_COUNT) {
+        oim_histogram_observe(&shard->request_latency[route], elapsed_ns, OIM_REQUEST_UNIT_NS);
+    }
+}
+
+void oim_metrics_record_download(uint64_t bytes, uint64_t elapsed_ns, bool completed) {
+    OIMMetricsShard *shard = oim_metrics_shard();
+    if (shard == NULL) {
+        return;
+    }
+
+    if (completed) {
+        OIM_METRIC_ADD(shard->downloads_completed, 1);
+        OIM_METRIC_ADD(shard->download_bytes, bytes);
+        oim_histogram_observe(&shard->download_duration, elapsed_ns, OIM_TRANSFER_UNIT_NS);
+    } else {
+        OIM_METRIC_ADD(shard->downloads_aborted, 1);
+    }
+}
+
+void oim_metrics_record_list_lookup(OIMListLookup source) {
+    OIMMetricsShard *shard = oim_metrics_shard();
+    if (shard && source < OIM_LIST_LOOKUP_COUNT) {
+        OIM_METRIC_ADD(shard->list_lookups[source], 1);
+    }
+}
+
+void oim_metrics_connection_opened() {
+    OIMMetricsShard *shard = oim_metrics_shard();
+    if (shard) {
+        OIM_METRIC_ADD(shard->connections_opened, 1);
+    }
+}
+
+void oim_metrics_connection_closed() {
+    OIMMetricsShard *shard = oim_metrics_shard();
+    if (shard) {
+        OIM_METRIC_ADD(shard->connections_closed, 1);
+    }
+}
+
+void oim_metrics_record_scan(uint64_t elapsed_ns, size_t entries) {
+    pthread_mutex_lock(&scan_metrics_lock);
+    scans_total++;
+    last_scan_ns = elapsed_ns;
+    last_scan_entries = entries;
+    oim_histogram_observe(&scan_duration, elapsed_ns, OIM_TRANSFER_UNIT_NS);
+    pthread_mutex_unlock(&scan_metrics_lock);
+}
+
+void oim_metrics_set_snapshot(uint64_t generation, size_t entries) {
+    pthread_mutex_lock(&scan_metrics_lock);
+    snapshot_generation = generation;
+    snapshot_entries = entries;
+    pthread_mutex_unlock(&scan_metrics_lock);
+}
+
+static void oim_histogram_merge(OIMHistogram *total, const OIMHistogram *shard) {
+    for (int i = 0; i < OIM_HISTOGRAM_BUCKETS; i++) {
+        total->buckets[i] += OIM_METRIC_READ(shard->buckets[i]);
+    }
+    total->count += OIM_METRIC_READ(shard->count);
+    total->sum_ns += OIM_METRIC_READ(shard->sum_ns);
+}
+
+static void oim_render_histogram(
+    OIMBuffer *buffer,
+    const char *name,
+    const char *labels,
+    const OIMHistogram *histogram,
+    uint64_t unit_ns
+) {
+    const char *separator = labels[0] ? "," : "";
+    uint64_t cumulative = 0;
+
+    /* Bucket counts are read one at a time, so clamp to keep the series monotonic. */
+    for (int i = 0; i < OIM_HISTOGRAM_BUCKETS - 1; i++) {
+        cumulative += histogram->buckets[i];
+        oim_buffer_appendf(buffer, "%s_bucket{%s%sle=\"%.9g\"} %llu\n",
+                           name, labels, separator, (double)(1ULL << i) * (double)unit_ns / 1e9,
+                           (unsigned long long)cumulative);
+    }
+    cumulative += histogram->buckets[OIM_HISTOGRAM_BUCKETS - 1];
+    if (cumulative < histogram->count) {
+        cumulative = histogram->count;
+    }
+
+    oim_buffer_appendf(buffer, "%s_bucket{%s%sle=\"+Inf\"} %llu\n",
+                       name, labels, separator, (unsigned long long)cumulative);
+    const char *label_open = labels[0] ? "{" : "";
+    const char *label_close = labels[0] ? "}" : "";
+    oim_buffer_appendf(buffer, "%s_sum%s%s%s %.9f\n",
+                       name, label_open, labels, label_close, (double)histogram->sum_ns / 1e9);
+    oim_buffer_appendf(buffer, "%s_count%s%s%s %llu\n",
+                       name, label_open, labels, label_close, (unsigned long long)cumulative);
+}
+
+/* Sums every shard and renders the Prometheus text exposition format. */
+char* oim_metrics_render(size_t *length) {
+    OIMMetricsShard total;
+    memset(&total, 0, sizeof(total));
+
+    for (OIMMetricsShard *shard = __atomic_load_n(&shards, __ATOMIC_ACQUIRE);
+         shard != NULL; shard = shard->next) {
+        for (int route = 0; route < OIM_ROUTE_COUNT; route++) {
+            oim_histogram_merge(&total.request_latency[route], &shard->request_latency[route]);
+        }
+        oim_histogram_merge(&total.download_duration, &shard->download_duration);
+        total.download_bytes += OIM_METRIC_READ(shard->download_bytes);
+        total.downloads_completed += OIM_METRIC_READ(shard->downloads_completed);
+        total.downloads_aborted += OIM_METRIC_READ(shard->downloads_aborted);
+        for (int source = 0; source < OIM_LIST_LOOKUP_COUNT; source++) {
+            total.list_lookups[source] += OIM_METRIC_READ(shard->list_lookups[source]);
+        }
+        total.connections_opened += OIM_METRIC_READ(shard->connections_opened);
+        total.connections_closed += OIM_METRIC_READ(shard->connections_closed);
+    }
+
+    pthread_mutex_lock(&scan_metrics_lock);
+    OIMHistogram scans = scan_duration;
+    uint64_t scan_count = scans_total;
+    uint64_t scan_ns = last_scan_ns;
+    uint64_t scan_entries = last_scan_entries;
+    uint64_t generation = snapshot_generation;
+    uint64_t entries = snapshot_entries;
+    pthread_mutex_unlock(&scan_metrics_lock);
+
+    OIMBuffer buffer;
+    oim_buffer_init(&buffer, 16 * 1024);
+    char labels[64];
+
+    oim_buffer_append_str(&buffer,
+        "# HELP oim_http_request_duration_seconds Time spent in the request handler.\n"
+        "# TYPE oim_http_request_duration_seconds histogram\n");
+    for (int route = 0; route < OIM_ROUTE_COUNT; route++) {
+        snprintf(labels, sizeof(labels), "route=\"%s\"", route_names[route]);
+        oim_render_histogram(&buffer, "oim_http_request_duration_seconds", labels,
+                             &total.request_latency[route], OIM_REQUEST_UNIT_NS);
+    }
+
+    int64_t active = (int64_t)(total.connections_opened - total.connections_closed);
+    oim_buffer_appendf(&buffer,
+        "# HELP oim_http_connections_active Open client connections.\n"
+        "# TYPE oim_http_connections_active gauge\n"
+        "oim_http_connections_active %lld\n"
+        "# HELP oim_http_connections_total Client connections accepted.\n"
+        "# TYPE oim_http_connections_total counter\n"
+        "oim_http_connections_total %llu\n",
+        (long long)(active < 0 ? 0 : active),
+        (unsigned long long)total.connections_opened);
+
+    oim_buffer_append_str(&buffer,
+        "# HELP oim_download_duration_seconds Time from request to last byte for completed downloads.\n"
+        "# TYPE oim_download_duration_seconds histogram\n");
+    oim_render_histogram(&buffer, "oim_download_duration_seconds", "", &total.download_duration,
+                         OIM_TRANSFER_UNIT_NS);
+
+    oim_buffer_appendf(&buffer,
+        "# HELP oim_download_bytes_total Body bytes of completed downloads.\n"
+        "# TYPE oim_download_bytes_total counter\n"
+        "oim_download_bytes_total %llu\n"
+        "# HELP oim_downloads_total Downloads by outcome.\n"
+        "# TYPE oim_downloads_total counter\n"
+        "oim_downloads_total{result=\"completed\"} %llu\n"
+        "oim_downloads_total{result=\"aborted\"} %llu\n",
+        (unsigned long long)total.download_bytes,
+        (unsigned long long)total.downloads_completed,
+        (unsigned long long)total.downloads_aborted);
+
+    size_t shaped = 0, throttled = 0;
+    oim_throttle_counts(&shaped, &throttled);
+    oim_buffer_appendf(&buffer,
+        "# HELP oim_download_shaped_transfers Downloads in progress under a rate limit.\n"
+        "# TYPE oim_download_shaped_transfers gauge\n"
+        "oim_download_shaped_transfers %zu\n"
+        "# HELP oim_download_throttled_transfers Shaped downloads suspended waiting for tokens.\n"
+        "# TYPE oim_download_throttled_transfers gauge\n"
+        "oim_download_throttled_transfers %zu\n",
+        shaped, throttled);
+
+    size_t in_flight = 0, queued = 0;
+    uint64_t rejected = 0;
+    oim_admission_counts(&in_flight, &queued, &rejected);
+    oim_buffer_appendf(&buffer,
+        "# HELP oim_downloads_in_flight Downloads admitted and not yet completed.\n"
+        "# TYPE oim_downloads_in_flight gauge\n"
+        "oim_downloads_in_flight %zu\n"
+        "# HELP oim_download_queue_length Downloads waiting for a free slot.\n"
+        "# TYPE oim_download_queue_length gauge\n"
+        "oim_download_queue_length %zu\n"
+        "# HELP oim_downloads_rejected_total Downloads answered 503 by admission control.\n"
+        "# TYPE oim_downloads_rejected_total counter\n"
+        "oim_downloads_rejected_total %llu\n",
+        in_flight, queued, (unsigned long long)rejected);
+
+    size_t subscribers = 0, waiters = 0;
+    oim_events_counts(&subscribers, &waiters);
+    oim_buffer_appendf(&buffer,
+        "# HELP oim_event_subscribers Open /api/events streams.\n"
+        "# TYPE oim_event_subscribers gauge\n"
+        "oim_event_subscribers %zu\n"
+        "# HELP oim_long_poll_waiters Listing requests waiting for a newer generation.\n"
+        "# TYPE oim_long_poll_waiters gauge\n"
+        "oim_long_poll_waiters %zu\n",
+        subscribers, waiters);
+
+    oim_buffer_append_str(&buffer,
+        "# HELP oim_mirror_list_lookups_total Mirror list lookups by source.\n"
+        "# TYPE oim_mirror_list_lookups_total counter\n");
+    for (int source = 0; source < OIM_LIST_LOOKUP_COUNT; source++) {
+        oim_buffer_appendf(&buffer, "oim_mirror_list_lookups_total{source=\"%s\"} %llu\n",
+                           lookup_names[source],
+                           (unsigned long long)total.list_lookups[source]);
+    }
+
+    oim_buffer_append_str(&buffer,
+        "# HELP oim_scan_duration_seconds Wall time of full directory scans.\n"
+        "# TYPE oim_scan_duration_seconds histogram\n");
+    oim_render_histogram(&buffer, "oim_scan_duration_seconds", "", &scans, OIM_TRANSFER_UNIT_NS);
+
+    oim_buffer_appendf(&buffer,
+        "# HELP oim_scans_total Full directory scans completed.\n"
+        "# TYPE oim_scans_total counter\n"
+        "oim_scans_total %llu\n"
+        "# HELP oim_last_scan_duration_seconds Wall time of the most recent full scan.\n"
+        "# TYPE oim_last_scan_duration_seconds gauge\n"
+        "oim_last_scan_duration_seconds %.6f\n"
+        "# HELP oim_last_scan_entries Files found by the most recent full scan.\n"
+        "# TYPE oim_last_scan_entries gauge\n"
+        "oim_last_scan_entries %llu\n"
+        "# HELP oim_snapshot_generation Generation of the published catalog snapshot.\n"
+        "# TYPE oim_snapshot_generation gauge\n"
+        "oim_snapshot_generation %llu\n"
+        "# HELP oim_snapshot_entries Files in the published catalog snapshot.\n"
+        "# TYPE oim_snapshot_entries gauge\n"
+        "oim_snapshot_entries %llu\n",
+        (unsigned long long)scan_count,
+        (double)scan_ns / 1e9,
+        (unsigned long long)scan_entries,
+        (unsigned long long)generation,
+        (unsigned long long)entries);
+
+    return oim_buffer_detach(&buffer, length);
+}
@@ -0,0 +1,312 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+
+#include "query.h"
+#include "buffer.h"
+#include "logging.h"
+
+static const char *oim_sort_names[OIM_CATALOG_SORT_COUNT] = {
+    "path", "name", "size", "modified"
+};
+
+/* wait and since ask for a long poll, not a page. */
+static enum MHD_Result oim_count_query_argument(
+    void *cls,
+    enum MHD_ValueKind kind __attribute__((unused)),
+    const char *key,
+    const char *value __attribute__((unused))
+) {
+    if (strcmp(key, "wait") != 0 && strcmp(key, "since") != 0) {
+        (*(int *)cls)++;
+    }
+    return MHD_YES;
+}
+
+bool oim_mirror_query_present(struct MHD_Connection *connection) {
+    int count = 0;
+    MHD_get_connection_values(connection, MHD_GET_ARGUMENT_KIND, oim_count_query_argument, &count);
+    return count > 0;
+}
+
+static int oim_parse_query_number(const char *value, long long *result) {
+    char *end;
+
+    errno = 0;
+    long long number = strtoll(value, &end, 10);
+    if (errno != 0 || end == value || *end != '\0' || number < 0) {
+        return -1;
+    }
+
+    *result = number;
+    return 0;
+}
+
+int oim_mirror_query_parse(
+    struct MHD_Connection *connection,
+    OIMMirrorQuery *query,
+    const char **error
+) {
+    const char *value;
+    long long number;
+
+    memset(query, 0, sizeof(*query));
+    query->min_size = -1;
+    query->max_size = -1;
+    query->sort = OIM_CATALOG_SORT_PATH;
+    query->limit = OIM_QUERY_DEFAULT_LIMIT;
+
+    value = MHD_lookup_connection_value(connection, MHD_GET_ARGUMENT_KIND, "category");
+    if (value && *value) {
+        query->category = value;
+    }
+
+    value = MHD_lookup_connection_value(connection, MHD_GET_ARGUMENT_KIND, "prefix");
+    if (value && *value) {
+        query->prefix = value;
+    }
+
+    value = MHD_lookup_connection_value(connection, MHD_GET_ARGUMENT_KIND, "min_size");
+    if (value) {
+        if (oim_parse_query_number(value, &query->min_size) != 0) {
+            *error = "Invalid min_size";
+            return -1;
+        }
+    }
+
+    value = MHD_lookup_connection_value(connection, MHD_GET_ARGUMENT_KIND, "max_size");
+    if (value) {
+        if (oim_parse_query_number(value, &query->max_size) != 0) {
+            *error = "Invalid max_size";
+            return -1;
+        }
+    }
+
+    value = MHD_lookup_connection_value(connection, MHD_GET_ARGUMENT_KIND, "sort");
+    if (value) {
+        int sort;
+        for (sort = 0; sort < OIM_CATALOG_SORT_COUNT; sort++) {
+            if (strcmp(value, oim_sort_names[sort]) == 0) {
+                break;
+            }
+        }
+        if (sort == OIM_CATALOG_SORT_COUNT) {
+            *error = "Invalid sort, expected path, name, size or modified";
+            return -1;
+        }
+        query->sort = sort;
+    }
+
+    value = MHD_lookup_connection_value(connection, MHD_GET_ARGUMENT_KIND, "order");
+    if (value) {
+        if (strcmp(value, "desc") == 0) {
+            query->descending = true;
+        } else if (strcmp(value, "asc") != 0) {
+            *error = "Invalid order, expected asc or desc";
+            return -1;
+        }
+    }
+
+    value = MHD_lookup_connection_value(connection, MHD_GET_ARGUMENT_KIND, "limit");
+    if (value) {
+        if (oim_parse_query_number(value, &number) != 0 ||
+            number == 0 || number > OIM_QUERY_MAX_LIMIT) {
+            *error = "Invalid limit";
+            return -1;
+        }
+        query->limit = (size_t)number;
+    }
+
+    value = MHD_lookup_connection_value(connection, MHD_GET_ARGUMENT_KIND, "offset");
+    if (value) {
+        if (oim_parse_query_number(value, &number) != 0) {
+            *error = "Invalid offset";
+            return -1;
+        }
+        query->offset = (size_t)number;
+    }
+
+    return 0;
+}
+
+static bool oim_has_prefix(const char *name, const char *prefix) {
+    return strncmp(name, prefix, strlen(prefix)) == 0;
+}
+
+/* First position in [low, high) whose key is not below the probe. */
+static size_t oim_lower_bound_name(
+    const OIMMirrorCatalog *catalog,
+    const uint32_t *order,
+    size_t low,
+    size_t high,
+    const char *prefix,
+    bool past_prefix
+) {
+    size_t prefix_len = strlen(prefix);
+
+    while (low < high) {
+        size_t mid = low + (high - low) / 2;
+        const char *name = catalog->entries[order[mid]].filename;
+        int cmp = past_prefix ? strncmp(name, prefix, prefix_len) : strcmp(name, prefix);
+
+        if (cmp < 0 || (past_prefix && cmp == 0)) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+
+    return low;
+}
+
+static size_t oim_lower_bound_size(
+    const OIMMirrorCatalog *catalog,
+    const uint32_t *order,
+    size_t low,
+    size_t high,
+    long long size
+) {
+    while (low < high) {
+        size_t mid = low + (high - low) / 2;
+        if (catalog->entries[order[mid]].file_size < size) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+
+    return low;
+}
+
+/*
+ * Picks the narrowest index slice for the query: the category's slice
+ * of the requested ordering, further cut down by binary search when the
+ * sort key is also the filter key. Whatever remains is filtered inline.
+ */
+char* oim_mirror_query_execute(
+    const OIMMirrorSnapshot *snapshot,
+    const OIMMirrorQuery *query,
+    size_t *length
+) {
+    const OIMMirrorCatalog *catalog = snapshot->catalog;
+    const uint32_t *order = catalog->order[query->sort];
+    size_t low = 0;
+    size_t high = catalog->count;
+
+    if (query->category) {
+        int category_id = oim_catalog_find_category(catalog, query->category);
+        if (category_id < 0) {
+            high = 0;
+        } else {
+            const OIMCategoryIndex *range = &catalog->category_index[category_id];
+            order = catalog->category_order[query->sort] + range->start;
+            high = range->count;
+        }
+    }
+
+    bool filter_prefix = query->prefix != NULL;
+    bool filter_size = query->min_size >= 0 || query->max_size >= 0;
+
+    if (filter_prefix && query->sort == OIM_CATALOG_SORT_NAME) {
+        low = oim_lower_bound_name(catalog, order, low, high, query->prefix, false);
+        high = oim_lower_bound_name(catalog, order, low, high, query->prefix, true);
+        filter_prefix = false;
+    }
+
+    if (filter_size && query->sort == OIM_CATALOG_SORT_SIZE) {
+        if (query->min_size >= 0) {
+            low = oim_lower_bound_size(catalog, order, low, high, query->min_size);
+        }
+        if (query->max_size >= 0 && query->max_size < LLONG_MAX) {
+            high = oim_lower_bound_size(catalog, order, low, high, query->max_size + 1);
+        }
+        filter_size = false;
+    }
+
+    size_t total = 0;
+    size_t emitted = 0;
+
+    OIMBuffer buffer;
+    oim_buffer_init(&buffer, 256 + query->limit * 192);
+    oim_buffer_appendf(&buffer, "{\"generation\":%llu,\"items\":[",
+                       (unsigned long long)snapshot->generation);
+
+    if (!filter_prefix && !filter_size) {
+        /* Every position in the slice matches, so jump straight to the page. */
+        total = high - low;
+        for (size_t i = query->offset; i < total && emitted < query->limit; i++) {
+            size_t position = query->descending ? high - 1 - i : low + i;
+            if (emitted > 0) {
+                oim_buffer_append(&buffer, ",", 1);
+            }
+            oim_catalog_append_entry_json(&buffer, &catalog->entries[order[position]]);
+            emitted++;
+        }
+    } else {
+        for (size_t i = 0; i < high - low; i++) {
+            size_t position = query->descending ? high - 1 - i : low + i;
+            const OIMMirrorEntry *entry = &catalog->entries[order[position]];
+
+            if (filter_prefix && !oim_has_prefix(entry->filename, query->prefix)) {
+                continue;
+            }
+            if (query->min_size >= 0 && entry->file_size < query->min_size) {
+                continue;
+            }
+            if (query->max_size >= 0 && entry->file_size > query->max_size) {
+                continue;
+            }
+
+            if (total >= query->offset && emitted < query->limit) {
+                if (emitted > 0) {
+                    oim_buffer_append(&buffer, ",", 1);
+                }
+                oim_catalog_append_entry_json(&buffer, entry);
+                emitted++;
+            }
+            total++;
+        }
+    }
+
+    oim_buffer_appendf(&buffer, "],\"total\":%zu,\"offset\":%zu,\"limit\":%zu,\"next_offset\":",
+                       total, query->offset, query->limit);
+    if (query->offset + emitted < total) {
+        oim_buffer_appendf(&buffer, "%zu}", query->offset + emitted);
+    } else {
+        oim_buffer_append_str(&buffer, "null}");
+    }
+
+    return oim_buffer_detach(&buffer, length);
+}
+
+/* The listing's own tag plus a hash of the normalized query. */
+void oim_mirror_query_etag(
+    const OIMMirrorSnapshot *snapshot,
+    const OIMMirrorQuery *query,
+    char *buffer,
+    size_t buffer_size
+) {
+    char normalized[1024];
+    const char *identity = snapshot->listing.variants[OIM_ENCODING_IDENTITY].etag;
+
+    int length = snprintf(normalized, sizeof(normalized), "%s|%s|%lld|%lld|%d|%d|%zu|%zu",
+                          query->category ? query->category : "",
+                          query->prefix ? query->prefix : "",
+                          query->min_size, query->max_size,
+                          (int)query->sort, (int)query->descending,
+                          query->limit, query->offset);
+    if (length < 0 || (size_t)length >= sizeof(normalized)) {
+        length = sizeof(normalized) - 1;
+    }
+
+    uint32_t hash = 2166136261u;
+    for (int i = 0; i < length; i++) {
+        hash ^= (unsigned char)normalized[i];
+        hash *= 16777619u;
+    }
+
+    snprintf(buffer, buffer_size, "%.*s-q%08x\"",
+             (int)strlen(identity) - 1, identity, hash);
+}
@@ -0,0 +1,270 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <limits.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <zlib.h>
+
+#include "snapfile.h"
+#include "buffer.h"
+#include "logging.h"
+
+static uint32_t oim_snapfile_checksum(const char *data, size_t size) {
+    uLong crc = crc32(0L, Z_NULL, 0);
+
+    /* crc32() takes a uInt length, so feed large files in slices. */
+    while (size > 0) {
+        uInt chunk = size > (1u << 30) ? (1u << 30) : (uInt)size;
+        crc = crc32(crc, (const Bytef *)data, chunk);
+        data += chunk;
+        size -= chunk;
+    }
+
+    return (uint32_t)crc;
+}
+
+static int oim_write_all(int fd, const char *data, size_t size) {
+    while (size > 0) {
+        ssize_t written = write(fd, data, size);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        data += written;
+        size -= (size_t)written;
+    }
+    return 0;
+}
+
+/* The rename only survives a crash once the directory entry is on disk too. */
+static void oim_snapfile_sync_directory(const char *path) {
+    char directory[PATH_MAX];
+    const char *slash = strrchr(path, '/');
+
+    if (slash == NULL) {
+        snprintf(directory, sizeof(directory), ".");
+    } else {
+        snprintf(directory, sizeof(directory), "%.*s",
+                 slash == path ? 1 : (int)(slash - path), path);
+    }
+
+    int fd = open(directory, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd == -1 || fsync(fd) != 0) {
+        LOG_WARN("Failed to sync snapshot directory: %s (Error: %s)", directory, strerror(errno));
+    }
+    if (fd != -1) {
+        close(fd);
+    }
+}
+
+/*
+ * Writes the catalog to a temporary file next to path and renames it
+ * into place, so readers only ever see a complete previous or new file.
+ */
+int oim_snapfile_write(const char *path, const OIMMirrorCatalog *catalog) {
+    size_t records_size = catalog->count * sizeof(OIMSnapfileRecord);
+
+    OIMBuffer payload;
+    oim_buffer_init(&payload, records_size + catalog->layout_length + 1 + catalog->count * 64);
+    if (payload.failed) {
+        return -1;
+    }
+
+    /* The record array is filled in place once each path's offset is known. */
+    payload.length = records_size;
+
+    oim_buffer_append(&payload, catalog->layout, catalog->layout_length + 1);
+
+    for (size_t i = 0; i < catalog->count; i++) {
+        const OIMMirrorEntry *entry = &catalog->entries[i];
+        size_t path_length = strlen(entry->path);
+        size_t offset = payload.length - records_size;
+
+        if (offset > UINT32_MAX) {
+            LOG_ERROR("Catalog string table too large for snapshot file");
+            oim_buffer_free(&payload);
+            return -1;
+        }
+
+        oim_buffer_append(&payload, entry->path, path_length + 1);
+        if (payload.failed) {
+            break;
+        }
+
+        OIMSnapfileRecord *record = (OIMSnapfileRecord *)payload.data + i;
+        record->path_offset = (uint32_t)offset;
+        record->path_length = (uint32_t)path_length;
+        record->file_size = entry->file_size;
+        record->modified_time = (int64_t)entry->modified_time;
+        record->inode = entry->inode;
+        record->device = entry->device;
+    }
+
+    if (payload.failed) {
+        LOG_ERROR("Failed to build snapshot file contents");
+        oim_buffer_free(&payload);
+        return -1;
+    }
+
+    OIMSnapfileHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, OIM_SNAPFILE_MAGIC, sizeof(header.magic));
+    header.version = OIM_SNAPFILE_VERSION;
+    header.record_size = sizeof(OIMSnapfileRecord);
+    header.byte_order = OIM_SNAPFILE_BYTE_ORDER;
+    header.base_length = (uint32_t)catalog->layout_length;
+    header.entry_count = catalog->count;
+    header.strings_size = payload.length - records_size;
+    header.created = (int64_t)time(NULL);
+    header.checksum = oim_snapfile_checksum(payload.data, payload.length);
+
+    char temp_path[PATH_MAX];
+    snprintf(temp_path, sizeof(temp_path), "%s.tmp", path);
+
+    int fd = open(temp_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd == -1) {
+        LOG_ERROR("Cannot create snapshot file: %s (Error: %s)", temp_path, strerror(errno));
+        oim_buffer_free(&payload);
+        return -1;
+    }
+
+    int result = 0;
+    if (oim_write_all(fd, (const char *)&header, sizeof(header)) != 0 ||
+        oim_write_all(fd, payload.data, payload.length) != 0 ||
+        fdatasync(fd) != 0) {
+        LOG_ERROR("Failed to write snapshot file: %s (Error: %s)", temp_path, strerror(errno));
+        result = -1;
+    }
+
+    close(fd);
+    oim_buffer_free(&payload);
+
+    if (result == 0 && rename(temp_path, path) != 0) {
+        LOG_ERROR("Failed to replace snapshot file: %s (Error: %s)", path, strerror(errno));
+        result = -1;
+    }
+
+    if (result == 0) {
+        oim_snapfile_sync_directory(path);
+    }
+
+    if (result != 0) {
+        unlink(temp_path);
+    }
+
+    return result;
+}
+
+/*
+ * Maps the file and builds a catalog whose entry paths point straight
+ * into the mapping: no parsing and no per-entry string copies.
+ */
+OIMMirrorCatalog* oim_snapfile_load(
+    const char *path,
+    const OIMCatalogRoot *roots,
+    size_t root_count
+) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        if (errno != ENOENT) {
+            LOG_WARN("Cannot open snapshot file: %s (Error: %s)", path, strerror(errno));
+        }
+        return NULL;
+    }
+
+    struct stat file_stat;
+    if (fstat(fd, &file_stat) != 0 || (size_t)file_stat.st_size < sizeof(OIMSnapfileHeader)) {
+        close(fd);
+        return NULL;
+    }
+
+    size_t size = (size_t)file_stat.st_size;
+    char *mapping = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+
+    if (mapping == MAP_FAILED) {
+        LOG_WARN("Cannot map snapshot file: %s (Error: %s)", path, strerror(errno));
+        return NULL;
+    }
+
+    const OIMSnapfileHeader *header = (const OIMSnapfileHeader *)mapping;
+    const char *payload = mapping + sizeof(OIMSnapfileHeader);
+    size_t payload_size = size - sizeof(OIMSnapfileHeader);
+    const char *reason = NULL;
+
+    if (memcmp(header->magic, OIM_SNAPFILE_MAGIC, sizeof(header->magic)) != 0 ||
+        header->byte_order != OIM_SNAPFILE_BYTE_ORDER) {
+        reason = "not a snapshot file for this host";
+    } else if (header->version != OIM_SNAPFILE_VERSION ||
+               header->record_size != sizeof(OIMSnapfileRecord)) {
+        reason = "unsupported version";
+    } else if (header->entry_count > payload_size / sizeof(OIMSnapfileRecord) ||
+               header->strings_size != payload_size - header->entry_count * sizeof(OIMSnapfileRecord) ||
+               header->strings_size < (uint64_t)header->base_length + 1) {
+        reason = "truncated";
+    } else if (oim_snapfile_checksum(payload, payload_size) != header->checksum) {
+        reason = "checksum mismatch";
+    }
+
+    if (reason) {
+        LOG_WARN("Ignoring snapshot file %s: %s", path, reason);
+        munmap(mapping, size);
+        return NULL;
+    }
+
+    OIMMirrorCatalog *catalog = oim_catalog_create(roots, root_count);
+    if (catalog == NULL) {
+        munmap(mapping, size);
+        return NULL;
+    }
+
+    catalog->mapping = mapping;
+    catalog->mapping_size = size;
+
+    const char *strings = payload + header->entry_count * sizeof(OIMSnapfileRecord);
+
+    if (header->base_length != catalog->layout_length ||
+        strcmp(strings, catalog->layout) != 0) {
+        LOG_WARN("Ignoring snapshot file %s: written for different Mirror roots", path);
+        oim_catalog_free(catalog);
+        return NULL;
+    }
+
+    const OIMSnapfileRecord *records = (const OIMSnapfileRecord *)payload;
+
+    for (uint64_t i = 0; i < header->entry_count; i++) {
+        const OIMSnapfileRecord *record = &records[i];
+
+        if ((uint64_t)record->path_offset + record->path_length >= header->strings_size ||
+            strings[record->path_offset + record->path_length] != '\0') {
+            LOG_WARN("Ignoring snapshot file %s: corrupt record %llu",
+                     path, (unsigned long long)i);
+            oim_catalog_free(catalog);
+            return NULL;
+        }
+
+        if (oim_catalog_add_borrowed(catalog, strings + record->path_offset,
+                                     record->file_size, (time_t)record->modified_time,
+                                     record->inode, record->device) != 0) {
+            oim_catalog_free(catalog);
+            return NULL;
+        }
+    }
+
+    if (oim_catalog_finalize(catalog) != 0) {
+        oim_catalog_free(catalog);
+        return NULL;
+    }
+
+    LOG_INFO("Loaded %zu entries from snapshot file %s (written %lld)",
+             catalog->count, path, (long long)header->created);
+
+    return catalog;
+}
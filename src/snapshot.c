@@ -0,0 +1,267 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+
+#include "snapshot.h"
+#include "logging.h"
+
+static uint64_t oim_fnv1a_64(const char *data, size_t size) {
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    for (size_t i = 0; i < size; i++) {
+        hash ^= (unsigned char)data[i];
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+static void oim_snapshot_blob_release(OIMSnapshotBlob *blob) {
+    if (blob && __atomic_sub_fetch(&blob->refcount, 1, __ATOMIC_ACQ_REL) == 0) {
+        free(blob);
+    }
+}
+
+/* Whether body's compressed variants can be taken over unchanged from previous. */
+static bool oim_snapshot_body_unchanged(
+    const OIMSnapshotBody *body,
+    const OIMSnapshotBody *previous
+) {
+    const OIMSnapshotVariant *identity = &body->variants[OIM_ENCODING_IDENTITY];
+    const OIMSnapshotVariant *old_identity = &previous->variants[OIM_ENCODING_IDENTITY];
+
+    return old_identity->data != NULL &&
+           old_identity->size == identity->size &&
+           strcmp(old_identity->etag, identity->etag) == 0 &&
+           memcmp(old_identity->data, identity->data, identity->size) == 0;
+}
+
+static void oim_snapshot_build_variants(
+    OIMSnapshotBody *body,
+    const OIMSnapshotBody *previous
+) {
+    const OIMSnapshotVariant *identity = &body->variants[OIM_ENCODING_IDENTITY];
+
+    if (previous && oim_snapshot_body_unchanged(body, previous)) {
+        for (int encoding = OIM_ENCODING_IDENTITY + 1; encoding < OIM_ENCODING_COUNT; encoding++) {
+            body->variants[encoding] = previous->variants[encoding];
+            if (body->variants[encoding].blob) {
+                __atomic_add_fetch(&body->variants[encoding].blob->refcount, 1, __ATOMIC_RELAXED);
+            }
+        }
+        return;
+    }
+
+    for (int encoding = OIM_ENCODING_IDENTITY + 1; encoding < OIM_ENCODING_COUNT; encoding++) {
+        if (!oim_encoding_supported(encoding)) {
+            continue;
+        }
+
+        char *data = NULL;
+        size_t size = 0;
+        if (oim_compress_buffer(encoding, identity->data, identity->size, &data, &size) != 0) {
+            LOG_WARN("Failed to build %s variant of Mirror snapshot",
+                     oim_encoding_name(encoding));
+            continue;
+        }
+
+        OIMSnapshotBlob *blob = size < identity->size ?
+                                malloc(sizeof(OIMSnapshotBlob) + size) : NULL;
+        if (blob) {
+            blob->refcount = 1;
+            memcpy(blob->data, data, size);
+        }
+        free(data);
+
+        if (blob == NULL) {
+            continue;
+        }
+
+        OIMSnapshotVariant *variant = &body->variants[encoding];
+        variant->blob = blob;
+        variant->data = blob->data;
+        variant->size = size;
+
+        /* Strip the closing quote of the identity tag and add a codec suffix. */
+        snprintf(variant->etag, sizeof(variant->etag), "%.*s%s\"",
+                 (int)strlen(identity->etag) - 1, identity->etag,
+                 oim_encoding_etag_suffix(encoding));
+    }
+}
+
+/* Takes ownership of data; returns -1 (having freed nothing) if data is NULL. */
+static int oim_snapshot_body_init(
+    OIMSnapshotBody *body,
+    char *data,
+    size_t size,
+    bool compress,
+    const OIMSnapshotBody *previous
+) {
+    if (data == NULL) {
+        return -1;
+    }
+
+    OIMSnapshotVariant *identity = &body->variants[OIM_ENCODING_IDENTITY];
+    identity->data = data;
+    identity->size = size;
+
+    /* Content hash rather than generation, so validators survive restarts. */
+    snprintf(identity->etag, sizeof(identity->etag), "\"%016llx\"",
+             (unsigned long long)oim_fnv1a_64(identity->data, identity->size));
+
+    if (compress) {
+        oim_snapshot_build_variants(body, previous);
+    }
+    return 0;
+}
+
+static void oim_snapshot_body_free(OIMSnapshotBody *body) {
+    free(body->variants[OIM_ENCODING_IDENTITY].data);
+    for (int encoding = OIM_ENCODING_IDENTITY + 1; encoding < OIM_ENCODING_COUNT; encoding++) {
+        oim_snapshot_blob_release(body->variants[encoding].blob);
+    }
+}
+
+static void oim_snapshot_free(OIMMirrorSnapshot *snapshot) {
+    oim_snapshot_body_free(&snapshot->listing);
+    oim_snapshot_body_free(&snapshot->categories);
+
+    if (snapshot->category_bodies) {
+        for (size_t c = 0; c < snapshot->catalog->category_count; c++) {
+            oim_snapshot_body_free(&snapshot->category_bodies[c]);
+        }
+        free(snapshot->category_bodies);
+    }
+
+    oim_catalog_free(snapshot->catalog);
+    free(snapshot);
+}
+
+/* Takes ownership of catalog, which must already be finalized. */
+OIMMirrorSnapshot* oim_snapshot_create(
+    OIMMirrorCatalog *catalog,
+    uint64_t generation,
+    const OIMMirrorSnapshot *previous,
+    bool compress
+) {
+    if (catalog == NULL) {
+        return NULL;
+    }
+
+    OIMMirrorSnapshot *snapshot = calloc(1, sizeof(OIMMirrorSnapshot));
+    if (snapshot == NULL) {
+        LOG_ERROR("Failed to allocate Mirror snapshot");
+        oim_catalog_free(catalog);
+        return NULL;
+    }
+
+    snapshot->refcount = 1;
+    snapshot->generation = generation;
+    snapshot->created = time(NULL);
+    snapshot->entry_count = catalog->count;
+    snapshot->catalog = catalog;
+    snapshot->compressed = compress;
+
+    /* An uncompressed generation has no variants to hand on. */
+    if (previous && !previous->compressed) {
+        previous = NULL;
+    }
+
+    size_t size = 0;
+    char *data = oim_catalog_serialize(catalog, &size);
+    if (oim_snapshot_body_init(&snapshot->listing, data, size, compress,
+                               previous ? &previous->listing : NULL) != 0) {
+        LOG_ERROR("Failed to serialize Mirror list for snapshot");
+        oim_snapshot_free(snapshot);
+        return NULL;
+    }
+
+    data = oim_catalog_serialize_categories(catalog, &size);
+    if (oim_snapshot_body_init(&snapshot->categories, data, size, compress,
+                               previous ? &previous->categories : NULL) != 0) {
+        LOG_ERROR("Failed to serialize Mirror categories for snapshot");
+        oim_snapshot_free(snapshot);
+        return NULL;
+    }
+
+    snapshot->category_bodies = calloc(catalog->category_count ? catalog->category_count : 1,
+                                       sizeof(OIMSnapshotBody));
+    if (snapshot->category_bodies == NULL) {
+        LOG_ERROR("Failed to allocate Mirror category bodies");
+        oim_snapshot_free(snapshot);
+        return NULL;
+    }
+
+    for (size_t c = 0; c < catalog->category_count; c++) {
+        /* Category ids shift as categories come and go, so match by name. */
+        int previous_id = previous ?
+            oim_catalog_find_category(previous->catalog, catalog->categories[c]) : -1;
+
+        data = oim_catalog_serialize_category(catalog, (uint32_t)c, &size);
+        if (oim_snapshot_body_init(&snapshot->category_bodies[c], data, size, compress,
+                                   previous_id >= 0 ?
+                                   &previous->category_bodies[previous_id] : NULL) != 0) {
+            LOG_ERROR("Failed to serialize Mirror category %s for snapshot",
+                      catalog->categories[c]);
+            oim_snapshot_free(snapshot);
+            return NULL;
+        }
+    }
+
+    return snapshot;
+}
+
+OIMMirrorSnapshot* oim_snapshot_acquire(OIMMirrorSnapshot *snapshot) {
+    if (snapshot) {
+        __atomic_add_fetch(&snapshot->refcount, 1, __ATOMIC_RELAXED);
+    }
+    return snapshot;
+}
+
+void oim_snapshot_release(OIMMirrorSnapshot *snapshot) {
+    if (snapshot == NULL) {
+        return;
+    }
+
+    if (__atomic_sub_fetch(&snapshot->refcount, 1, __ATOMIC_ACQ_REL) == 0) {
+        oim_snapshot_free(snapshot);
+    }
+}
+
+const OIMSnapshotVariant* oim_snapshot_variant(
+    const OIMSnapshotBody *body,
+    OIMContentEncoding encoding
+) {
+    if (encoding >= OIM_ENCODING_COUNT || body->variants[encoding].data == NULL) {
+        encoding = OIM_ENCODING_IDENTITY;
+    }
+    return &body->variants[encoding];
+}
+
+unsigned int oim_snapshot_encodings(const OIMSnapshotBody *body) {
+    unsigned int mask = 0;
+    for (int encoding = 0; encoding < OIM_ENCODING_COUNT; encoding++) {
+        if (body->variants[encoding].data) {
+            mask |= 1u << encoding;
+        }
+    }
+    return mask;
+}
+
+const OIMSnapshotBody* oim_snapshot_category_body(
+    const OIMMirrorSnapshot *snapshot,
+    const char *category
+) {
+    int category_id = oim_catalog_find_category(snapshot->catalog, category);
+    return category_id < 0 ? NULL : &snapshot->category_bodies[category_id];
+}
+
+const OIMMirrorEntry* oim_snapshot_find_file(
+    const OIMMirrorSnapshot *snapshot,
+    const char *relative_path
+) {
+    if (snapshot == NULL) {
+        return NULL;
+    }
+
+    return oim_catalog_find(snapshot->catalog, relative_path);
+}
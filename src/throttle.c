@@ -0,0 +1,573 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+#include <microhttpd.h>
+
+#include "throttle.h"
+#include "metrics.h"
+#include "buffer.h"
+#include "logging.h"
+
+/* A bucket holds at most this much of its rate, so an idle client can burst briefly. */
+#define OIM_THROTTLE_BURST_MS 250
+#define OIM_THROTTLE_MIN_BURST (16 * 1024)
+/* Smallest send worth waking up for; below this a transfer waits for more tokens. */
+#define OIM_THROTTLE_MIN_CHUNK 4096
+#define OIM_THROTTLE_BLOCK_SIZE (64 * 1024)
+#define OIM_THROTTLE_CLIENT_SLOTS 64
+#define OIM_THROTTLE_RESUME_BATCH 64
+
+/* Tokens are bytes. They go negative when a waiting transfer reserves its next send. */
+typedef struct {
+    double tokens;
+    uint64_t rate;
+    uint64_t refilled_ns;
+} OIMTokenBucket;
+
+typedef struct OIMClientBucket {
+    char ip[INET6_ADDRSTRLEN];
+    OIMTokenBucket bucket;
+    int transfers;
+    struct OIMClientBucket *next;
+} OIMClientBucket;
+
+typedef struct OIMShapedTransfer {
+    struct MHD_Connection *connection;
+    OIMClientBucket *client;
+    char *file_path;
+    uint64_t size;
+    uint64_t sent;
+    uint64_t started_ns;
+
+    /* Tokens taken before suspending, handed out on the first read after resuming. */
+    size_t reserved;
+    uint64_t wake_ns;
+    bool waiting;
+
+    MHD_ContentReaderCallback reader;
+    void *reader_cls;
+    MHD_ContentReaderFreeCallback free_callback;
+
+    struct OIMShapedTransfer *prev;
+    struct OIMShapedTransfer *next;
+} OIMShapedTransfer;
+
+static pthread_mutex_t throttle_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t throttle_cond;
+static pthread_t pacer_thread;
+static bool pacer_started = false;
+static bool throttle_running = false;
+
+static OIMTokenBucket global_bucket;
+static uint64_t client_rate = 0;
+static OIMClientBucket *clients[OIM_THROTTLE_CLIENT_SLOTS];
+static OIMShapedTransfer *transfers = NULL;
+static size_t active_count = 0;
+static size_t throttled_count = 0;
+
+static double oim_bucket_burst(uint64_t rate) {
+    double burst = (double)rate * OIM_THROTTLE_BURST_MS / 1000.0;
+    return burst < OIM_THROTTLE_MIN_BURST ? OIM_THROTTLE_MIN_BURST : burst;
+}
+
+static void oim_bucket_set_rate(OIMTokenBucket *bucket, uint64_t rate, uint64_t now) {
+    if (bucket->rate == 0) {
+        bucket->tokens = oim_bucket_burst(rate);
+    } else if (rate == 0) {
+        bucket->tokens = 0;
+    } else if (bucket->tokens > oim_bucket_burst(rate)) {
+        bucket->tokens = oim_bucket_burst(rate);
+    }
+    bucket->rate = rate;
+    bucket->refilled_ns = now;
+}
+
+static void oim_bucket_refill(OIMTokenBucket *bucket, uint64_t now) {
+    if (bucket->rate == 0 || now <= bucket->refilled_ns) {
+        return;
+    }
+
+    bucket->tokens += (double)bucket->rate * (double)(now - bucket->refilled_ns) / 1e9;
+    double burst = oim_bucket_burst(bucket->rate);
+    if (bucket->tokens > burst) {
+        bucket->tokens = burst;
+    }
+    bucket->refilled_ns = now;
+}
+
+/* Time until a bucket in debt is back to zero. */
+static uint64_t oim_bucket_debt_ns(const OIMTokenBucket *bucket) {
+    if (bucket->rate == 0 || bucket->tokens >= 0) {
+        return 0;
+    }
+    return (uint64_t)(-bucket->tokens * 1e9 / (double)bucket->rate);
+}
+
+static void oim_bucket_take(OIMTokenBucket *bucket, double amount) {
+    if (bucket->rate != 0) {
+        bucket->tokens -= amount;
+    }
+}
+
+static unsigned int oim_client_slot(const char *ip) {
+    unsigned int hash = 2166136261u;
+    for (const char *p = ip; *p; p++) {
+        hash = (hash ^ (unsigned char)*p) * 16777619u;
+    }
+    return hash % OIM_THROTTLE_CLIENT_SLOTS;
+}
+
+static OIMClientBucket* oim_client_acquire(const char *ip, uint64_t now) {
+    unsigned int slot = oim_client_slot(ip);
+
+    for (OIMClientBucket *client = clients[slot]; client; client = client->next) {
+        if (strcmp(client->ip, ip) == 0) {
+            client->transfers++;
+            return client;
+        }
+    }
+
+    OIMClientBucket *client = calloc(1, sizeof(OIMClientBucket));
+    if (client == NULL) {
+        return NULL;
+    }
+
+    snprintf(client->ip, sizeof(client->ip), "%s", ip);
+    oim_bucket_set_rate(&client->bucket, client_rate, now);
+    client->transfers = 1;
+    client->next = clients[slot];
+    clients[slot] = client;
+    return client;
+}
+
+static void oim_client_release(OIMClientBucket *client) {
+    if (--client->transfers > 0) {
+        return;
+    }
+
+    OIMClientBucket **link = &clients[oim_client_slot(client->ip)];
+    while (*link != client) {
+        link = &(*link)->next;
+    }
+    *link = client->next;
+    free(client);
+}
+
+static void oim_throttle_refund(OIMShapedTransfer *transfer, size_t unused) {
+    if (global_bucket.rate) {
+        global_bucket.tokens += (double)unused;
+    }
+    if (transfer->client->bucket.rate) {
+        transfer->client->bucket.tokens += (double)unused;
+    }
+}
+
+/*
+ * Decides how much of the next send a transfer may make. Each send is
+ * capped at a fair share of the bucket bursts, so active transfers take
+ * turns. If the buckets cannot cover even a small send, the transfer
+ * reserves its share now, which puts it in debt order behind everyone
+ * already waiting, and is suspended until the debt is repaid.
+ * Called with throttle_lock held; returns 0 when it suspended the connection.
+ */
+static size_t oim_throttle_acquire(OIMShapedTransfer *transfer, size_t max) {
+    if (!throttle_running || (global_bucket.rate == 0 && client_rate == 0)) {
+        transfer->reserved = 0;
+        return max;
+    }
+
+    if (transfer->reserved > 0) {
+        size_t grant = transfer->reserved < max ? transfer->reserved : max;
+        oim_throttle_refund(transfer, transfer->reserved - grant);
+        transfer->reserved = 0;
+        return grant;
+    }
+
+    uint64_t now = oim_metrics_now_ns();
+    OIMTokenBucket *client = &transfer->client->bucket;
+    oim_bucket_refill(&global_bucket, now);
+    oim_bucket_refill(client, now);
+
+    double want = (double)max;
+    double available = want;
+
+    if (global_bucket.rate) {
+        double share = oim_bucket_burst(global_bucket.rate) / (double)active_count;
+        want = share < want ? share : want;
+        available = global_bucket.tokens < available ? global_bucket.tokens : available;
+    }
+    if (client->rate) {
+        double share = oim_bucket_burst(client->rate) / (double)transfer->client->transfers;
+        want = share < want ? share : want;
+        available = client->tokens < available ? client->tokens : available;
+    }
+    if (want < OIM_THROTTLE_MIN_CHUNK) {
+        want = max < OIM_THROTTLE_MIN_CHUNK ? (double)max : OIM_THROTTLE_MIN_CHUNK;
+    }
+
+    double grant = 0;
+    if (available >= want) {
+        grant = want;
+    } else if (available >= OIM_THROTTLE_MIN_CHUNK) {
+        grant = available;
+    }
+
+    if (grant >= 1) {
+        size_t bytes = (size_t)grant;
+        oim_bucket_take(&global_bucket, (double)bytes);
+        oim_bucket_take(client, (double)bytes);
+        return bytes;
+    }
+
+    size_t bytes = (size_t)want;
+    oim_bucket_take(&global_bucket, (double)bytes);
+    oim_bucket_take(client, (double)bytes);
+
+    uint64_t wait_ns = oim_bucket_debt_ns(&global_bucket);
+    uint64_t client_wait_ns = oim_bucket_debt_ns(client);
+    if (client_wait_ns > wait_ns) {
+        wait_ns = client_wait_ns;
+    }
+
+    transfer->reserved = bytes;
+    transfer->wake_ns = now + wait_ns;
+    transfer->waiting = true;
+    throttled_count++;
+
+    /* Suspending under the lock keeps the pacer from resuming it first. */
+    MHD_suspend_connection(transfer->connection);
+    pthread_cond_signal(&throttle_cond);
+    return 0;
+}
+
+static ssize_t oim_throttle_reader(void *cls, uint64_t pos, char *buf, size_t max) {
+    OIMShapedTransfer *transfer = cls;
+
+    if (pos < transfer->size && transfer->size - pos < max) {
+        max = (size_t)(transfer->size - pos);
+    }
+    if (pos >= transfer->size || max == 0) {
+        return transfer->reader(transfer->reader_cls, pos, buf, max);
+    }
+
+    pthread_mutex_lock(&throttle_lock);
+    size_t grant = oim_throttle_acquire(transfer, max);
+    pthread_mutex_unlock(&throttle_lock);
+
+    if (grant == 0) {
+        return 0;
+    }
+
+    ssize_t count = transfer->reader(transfer->reader_cls, pos, buf, grant);
+
+    pthread_mutex_lock(&throttle_lock);
+    if (count > 0) {
+        transfer->sent += (uint64_t)count;
+    }
+    if (count < (ssize_t)grant) {
+        oim_throttle_refund(transfer, grant - (count > 0 ? (size_t)count : 0));
+    }
+    pthread_mutex_unlock(&throttle_lock);
+
+    return count;
+}
+
+static void oim_throttle_unlink(OIMShapedTransfer *transfer) {
+    pthread_mutex_lock(&throttle_lock);
+
+    if (transfer->prev) {
+        transfer->prev->next = transfer->next;
+    } else {
+        transfers = transfer->next;
+    }
+    if (transfer->next) {
+        transfer->next->prev = transfer->prev;
+    }
+
+    if (transfer->waiting) {
+        throttled_count--;
+    }
+    active_count--;
+    oim_client_release(transfer->client);
+
+    pthread_mutex_unlock(&throttle_lock);
+
+    free(transfer->file_path);
+    free(transfer);
+}
+
+static void oim_throttle_free(void *cls) {
+    OIMShapedTransfer *transfer = cls;
+    MHD_ContentReaderFreeCallback free_callback = transfer->free_callback;
+    void *reader_cls = transfer->reader_cls;
+
+    oim_throttle_unlink(transfer);
+
+    if (free_callback) {
+        free_callback(reader_cls);
+    }
+}
+
+struct MHD_Response* oim_throttle_create_response(
+    struct MHD_Connection *connection,
+    const char *client_ip,
+    const char *file_path,
+    uint64_t size,
+    MHD_ContentReaderCallback reader,
+    void *reader_cls,
+    MHD_ContentReaderFreeCallback free_callback
+) {
+    OIMShapedTransfer *transfer = calloc(1, sizeof(OIMShapedTransfer));
+    if (transfer == NULL) {
+        return NULL;
+    }
+
+    transfer->file_path = strdup(file_path);
+    if (transfer->file_path == NULL) {
+        free(transfer);
+        return NULL;
+    }
+
+    transfer->connection = connection;
+    transfer->size = size;
+    transfer->started_ns = oim_metrics_now_ns();
+    transfer->reader = reader;
+    transfer->reader_cls = reader_cls;
+    transfer->free_callback = free_callback;
+
+    pthread_mutex_lock(&throttle_lock);
+    transfer->client = oim_client_acquire(client_ip, transfer->started_ns);
+    if (transfer->client == NULL) {
+        pthread_mutex_unlock(&throttle_lock);
+        free(transfer->file_path);
+        free(transfer);
+        return NULL;
+    }
+
+    transfer->next = transfers;
+    if (transfers) {
+        transfers->prev = transfer;
+    }
+    transfers = transfer;
+    active_count++;
+    pthread_mutex_unlock(&throttle_lock);
+
+    struct MHD_Response *response = MHD_create_response_from_callback(
+        size,
+        OIM_THROTTLE_BLOCK_SIZE,
+        oim_throttle_reader,
+        transfer,
+        oim_throttle_free
+    );
+
+    /* On failure the caller still owns reader_cls. */
+    if (response == NULL) {
+        oim_throttle_unlink(transfer);
+    }
+
+    return response;
+}
+
+/*
+ * Collects up to a batch of transfers to resume. With force set every
+ * waiting transfer is due. Called with throttle_lock held; the caller
+ * resumes them after unlocking. They stay valid until then, because a
+ * suspended connection cannot complete.
+ */
+static size_t oim_throttle_collect_due(
+    uint64_t now,
+    bool force,
+    struct MHD_Connection **due,
+    uint64_t *next_wake
+) {
+    size_t count = 0;
+    *next_wake = UINT64_MAX;
+
+    for (OIMShapedTransfer *transfer = transfers; transfer; transfer = transfer->next) {
+        if (!transfer->waiting) {
+            continue;
+        }
+
+        if ((force || transfer->wake_ns <= now) && count < OIM_THROTTLE_RESUME_BATCH) {
+            transfer->waiting = false;
+            throttled_count--;
+            due[count++] = transfer->connection;
+        } else if (transfer->wake_ns < *next_wake) {
+            *next_wake = transfer->wake_ns;
+        }
+    }
+
+    /* A full batch may have left due transfers behind. */
+    if (count == OIM_THROTTLE_RESUME_BATCH) {
+        *next_wake = now;
+    }
+
+    return count;
+}
+
+static void* oim_throttle_pacer_main(void *arg __attribute__((unused))) {
+    struct MHD_Connection *due[OIM_THROTTLE_RESUME_BATCH];
+
+    pthread_mutex_lock(&throttle_lock);
+
+    while (throttle_running) {
+        uint64_t next_wake;
+        size_t count = oim_throttle_collect_due(oim_metrics_now_ns(), false, due, &next_wake);
+
+        if (count > 0) {
+            pthread_mutex_unlock(&throttle_lock);
+            for (size_t i = 0; i < count; i++) {
+                MHD_resume_connection(due[i]);
+            }
+            pthread_mutex_lock(&throttle_lock);
+            continue;
+        }
+
+        if (next_wake == UINT64_MAX) {
+            pthread_cond_wait(&throttle_cond, &throttle_lock);
+        } else {
+            struct timespec deadline = {
+                .tv_sec = (time_t)(next_wake / 1000000000ULL),
+                .tv_nsec = (long)(next_wake % 1000000000ULL)
+            };
+            pthread_cond_timedwait(&throttle_cond, &throttle_lock, &deadline);
+        }
+    }
+
+    pthread_mutex_unlock(&throttle_lock);
+    return NULL;
+}
+
+int oim_throttle_init(const OIMThrottleLimits *limits) {
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&throttle_cond, &attr);
+    pthread_condattr_destroy(&attr);
+
+    uint64_t now = oim_metrics_now_ns();
+    oim_bucket_set_rate(&global_bucket, limits->global_rate, now);
+    client_rate = limits->client_rate;
+    throttle_running = true;
+
+    if (pthread_create(&pacer_thread, NULL, oim_throttle_pacer_main, NULL) != 0) {
+        LOG_ERROR("Failed to start download pacer thread");
+        throttle_running = false;
+        return -1;
+    }
+    pacer_started = true;
+
+    if (limits->global_rate || limits->client_rate) {
+        LOG_INFO("Download shaping: %llu B/s total, %llu B/s per client",
+                 (unsigned long long)limits->global_rate,
+                 (unsigned long long)limits->client_rate);
+    }
+
+    return 0;
+}
+
+/* Suspended connections must all be resumed before MHD_stop_daemon. */
+void oim_throttle_stop() {
+    struct MHD_Connection *due[OIM_THROTTLE_RESUME_BATCH];
+    uint64_t next_wake;
+    size_t count;
+
+    pthread_mutex_lock(&throttle_lock);
+    throttle_running = false;
+    pthread_cond_broadcast(&throttle_cond);
+
+    while ((count = oim_throttle_collect_due(0, true, due, &next_wake)) > 0) {
+        pthread_mutex_unlock(&throttle_lock);
+        for (size_t i = 0; i < count; i++) {
+            MHD_resume_connection(due[i]);
+        }
+        pthread_mutex_lock(&throttle_lock);
+    }
+    pthread_mutex_unlock(&throttle_lock);
+
+    if (pacer_started) {
+        pthread_join(pacer_thread, NULL);
+        pacer_started = false;
+    }
+}
+
+void oim_throttle_set_limits(const OIMThrottleLimits *limits) {
+    pthread_mutex_lock(&throttle_lock);
+
+    uint64_t now = oim_metrics_now_ns();
+    oim_bucket_refill(&global_bucket, now);
+    oim_bucket_set_rate(&global_bucket, limits->global_rate, now);
+
+    client_rate = limits->client_rate;
+    for (int slot = 0; slot < OIM_THROTTLE_CLIENT_SLOTS; slot++) {
+        for (OIMClientBucket *client = clients[slot]; client; client = client->next) {
+            oim_bucket_refill(&client->bucket, now);
+            oim_bucket_set_rate(&client->bucket, client_rate, now);
+        }
+    }
+
+    /* Waiting transfers send their reservation now; later sends see the new rates. */
+    for (OIMShapedTransfer *transfer = transfers; transfer; transfer = transfer->next) {
+        if (transfer->waiting) {
+            transfer->wake_ns = now;
+        }
+    }
+    pthread_cond_signal(&throttle_cond);
+
+    pthread_mutex_unlock(&throttle_lock);
+
+    LOG_INFO("Download shaping limits set to %llu B/s total, %llu B/s per client",
+             (unsigned long long)limits->global_rate,
+             (unsigned long long)limits->client_rate);
+}
+
+bool oim_throttle_enabled() {
+    pthread_mutex_lock(&throttle_lock);
+    bool enabled = throttle_running && (global_bucket.rate != 0 || client_rate != 0);
+    pthread_mutex_unlock(&throttle_lock);
+    return enabled;
+}
+
+void oim_throttle_counts(size_t *active, size_t *throttled) {
+    pthread_mutex_lock(&throttle_lock);
+    *active = active_count;
+    *throttled = throttled_count;
+    pthread_mutex_unlock(&throttle_lock);
+}
+
+char* oim_throttle_to_json(size_t *length) {
+    OIMBuffer buffer;
+    oim_buffer_init(&buffer, 4096);
+
+    pthread_mutex_lock(&throttle_lock);
+
+    uint64_t now = oim_metrics_now_ns();
+    oim_buffer_appendf(&buffer,
+        "{\"global_rate\": %llu, \"client_rate\": %llu, \"active\": %zu, "
+        "\"throttled\": %zu, \"transfers\": [",
+        (unsigned long long)global_bucket.rate, (unsigned long long)client_rate,
+        active_count, throttled_count);
+
+    for (OIMShapedTransfer *transfer = transfers; transfer; transfer = transfer->next) {
+        double seconds = (double)(now - transfer->started_ns) / 1e9;
+
+        oim_buffer_append_str(&buffer, transfer == transfers ? "{\"client\": " : ", {\"client\": ");
+        oim_buffer_append_json_string(&buffer, transfer->client->ip);
+        oim_buffer_append_str(&buffer, ", \"file\": ");
+        oim_buffer_append_json_string(&buffer, transfer->file_path);
+        oim_buffer_appendf(&buffer,
+            ", \"size\": %llu, \"sent\": %llu, \"rate\": %.0f, \"throttled\": %s}",
+            (unsigned long long)transfer->size, (unsigned long long)transfer->sent,
+            seconds > 0 ? (double)transfer->sent / seconds : 0.0,
+            transfer->waiting ? "true" : "false");
+    }
+
+    pthread_mutex_unlock(&throttle_lock);
+
+    oim_buffer_append_str(&buffer, "]}");
+    return oim_buffer_detach(&buffer, length);
+}
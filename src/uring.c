@@ -0,0 +1,497 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <microhttpd.h>
+
+#ifdef OIM_WITH_URING
+#include <liburing.h>
+#endif
+
+#include "uring.h"
+#include "logging.h"
+
+#ifdef OIM_WITH_URING
+
+/* Reads kept in flight or buffered ahead of each client. */
+#define OIM_URING_READAHEAD 4
+
+typedef enum {
+    OIM_SLOT_EMPTY,
+    OIM_SLOT_READING,
+    OIM_SLOT_READY,
+    OIM_SLOT_FAILED
+} OIMSlotState;
+
+typedef struct OIMUringTransfer OIMUringTransfer;
+
+typedef struct {
+    OIMUringTransfer *transfer;
+    char *buffer;
+    uint64_t pos;
+    size_t length;
+    OIMSlotState state;
+} OIMUringSlot;
+
+/* Positions are relative to the start of the body, which is `offset` into the file. */
+struct OIMUringTransfer {
+    struct MHD_Connection *connection;
+    int fd;
+    uint64_t offset;
+    uint64_t length;
+    uint64_t next_read;
+    int inflight;
+    bool waiting;
+    bool closed;
+    OIMUringSlot slots[OIM_URING_READAHEAD];
+};
+
+static struct io_uring ring;
+static OIMUringConfig uring_config;
+static pthread_mutex_t uring_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_t completion_thread;
+static bool uring_running = false;
+static bool stop_requested = false;
+static int inflight_total = 0;
+
+static char *pool = NULL;
+static char **free_buffers = NULL;
+static int free_count = 0;
+static bool pool_orphaned = false;
+static struct MHD_Connection **resume_list = NULL;
+
+static char* oim_uring_take_buffer() {
+    return free_count > 0 ? free_buffers[--free_count] : NULL;
+}
+
+static void oim_uring_free_pool() {
+    free(pool);
+    free(free_buffers);
+    free(resume_list);
+    pool = NULL;
+    free_buffers = NULL;
+    resume_list = NULL;
+    pool_orphaned = false;
+}
+
+static void oim_uring_put_buffer(char *buffer) {
+    free_buffers[free_count++] = buffer;
+
+    /* Transfers that outlived the engine hand their buffers back one by one. */
+    if (pool_orphaned && free_count == uring_config.buffer_count) {
+        oim_uring_free_pool();
+    }
+}
+
+static void oim_uring_release_slot(OIMUringSlot *slot) {
+    if (slot->buffer) {
+        oim_uring_put_buffer(slot->buffer);
+        slot->buffer = NULL;
+    }
+    slot->state = OIM_SLOT_EMPTY;
+}
+
+/* Issues reads into the transfer's empty slots. Called with uring_lock held. */
+static void oim_uring_fill(OIMUringTransfer *transfer) {
+    bool submitted = false;
+
+    for (int i = 0; i < OIM_URING_READAHEAD; i++) {
+        OIMUringSlot *slot = &transfer->slots[i];
+
+        if (slot->state != OIM_SLOT_EMPTY) {
+            continue;
+        }
+        if (!uring_running || transfer->next_read >= transfer->length ||
+            inflight_total >= uring_config.queue_depth) {
+            break;
+        }
+
+        char *buffer = oim_uring_take_buffer();
+        if (buffer == NULL) {
+            break;
+        }
+
+        struct io_uring_sqe *sqe = io_uring_get_sqe(&ring);
+        if (sqe == NULL) {
+            oim_uring_put_buffer(buffer);
+            break;
+        }
+
+        uint64_t remaining = transfer->length - transfer->next_read;
+        size_t length = remaining < uring_config.buffer_size ?
+                        (size_t)remaining : uring_config.buffer_size;
+
+        io_uring_prep_read(sqe, transfer->fd, buffer, (unsigned int)length,
+                           transfer->offset + transfer->next_read);
+        io_uring_sqe_set_data(sqe, slot);
+
+        slot->transfer = transfer;
+        slot->buffer = buffer;
+        slot->pos = transfer->next_read;
+        slot->length = length;
+        slot->state = OIM_SLOT_READING;
+
+        transfer->next_read += length;
+        transfer->inflight++;
+        inflight_total++;
+        submitted = true;
+    }
+
+    if (submitted) {
+        io_uring_submit(&ring);
+    }
+}
+
+static bool oim_slot_covers(const OIMUringSlot *slot, uint64_t pos) {
+    return slot->state != OIM_SLOT_EMPTY && pos >= slot->pos && pos < slot->pos + slot->length;
+}
+
+static void oim_uring_destroy(OIMUringTransfer *transfer) {
+    close(transfer->fd);
+    free(transfer);
+}
+
+void* oim_uring_open(struct MHD_Connection *connection, int fd, uint64_t offset, uint64_t length) {
+    if (!oim_uring_enabled()) {
+        return NULL;
+    }
+
+    OIMUringTransfer *transfer = calloc(1, sizeof(OIMUringTransfer));
+    if (transfer == NULL) {
+        return NULL;
+    }
+
+    transfer->connection = connection;
+    transfer->fd = fd;
+    transfer->offset = offset;
+    transfer->length = length;
+
+    /* The first reads start before MHD asks for data. */
+    pthread_mutex_lock(&uring_lock);
+    oim_uring_fill(transfer);
+    pthread_mutex_unlock(&uring_lock);
+
+    return transfer;
+}
+
+ssize_t oim_uring_reader(void *cls, uint64_t pos, char *buf, size_t max) {
+    OIMUringTransfer *transfer = cls;
+
+    if (pos >= transfer->length) {
+        return MHD_CONTENT_READER_END_OF_STREAM;
+    }
+
+    pthread_mutex_lock(&uring_lock);
+
+    bool pending = false;
+    bool reading = false;
+
+    for (int i = 0; i < OIM_URING_READAHEAD; i++) {
+        OIMUringSlot *slot = &transfer->slots[i];
+        reading |= slot->state == OIM_SLOT_READING;
+
+        if (!oim_slot_covers(slot, pos)) {
+            continue;
+        }
+
+        if (slot->state == OIM_SLOT_FAILED) {
+            pthread_mutex_unlock(&uring_lock);
+            return MHD_CONTENT_READER_END_WITH_ERROR;
+        }
+
+        if (slot->state == OIM_SLOT_READING) {
+            pending = true;
+            continue;
+        }
+
+        size_t available = (size_t)(slot->pos + slot->length - pos);
+        size_t count = available < max ? available : max;
+        memcpy(buf, slot->buffer + (pos - slot->pos), count);
+
+        if (count == available) {
+            oim_uring_release_slot(slot);
+            oim_uring_fill(transfer);
+        }
+
+        pthread_mutex_unlock(&uring_lock);
+        return (ssize_t)count;
+    }
+
+    /* Nothing buffered or in flight at pos: drop stale blocks and read from here. */
+    if (!pending && !reading) {
+        for (int i = 0; i < OIM_URING_READAHEAD; i++) {
+            oim_uring_release_slot(&transfer->slots[i]);
+        }
+        transfer->next_read = pos;
+        oim_uring_fill(transfer);
+
+        for (int i = 0; i < OIM_URING_READAHEAD; i++) {
+            pending |= oim_slot_covers(&transfer->slots[i], pos);
+        }
+    }
+
+    if (pending || reading) {
+        transfer->waiting = true;
+        /* Suspending under the lock keeps the completion thread from resuming it first. */
+        MHD_suspend_connection(transfer->connection);
+        pthread_mutex_unlock(&uring_lock);
+        return 0;
+    }
+
+    pthread_mutex_unlock(&uring_lock);
+
+    /* Buffer pool or queue exhausted, or the engine stopped: read in place. */
+    uint64_t remaining = transfer->length - pos;
+    size_t count = remaining < max ? (size_t)remaining : max;
+    ssize_t read_bytes = pread(transfer->fd, buf, count, (off_t)(transfer->offset + pos));
+    if (read_bytes <= 0) {
+        return MHD_CONTENT_READER_END_WITH_ERROR;
+    }
+    return read_bytes;
+}
+
+void oim_uring_close(void *cls) {
+    OIMUringTransfer *transfer = cls;
+
+    pthread_mutex_lock(&uring_lock);
+
+    transfer->closed = true;
+    for (int i = 0; i < OIM_URING_READAHEAD; i++) {
+        if (transfer->slots[i].state != OIM_SLOT_READING) {
+            oim_uring_release_slot(&transfer->slots[i]);
+        }
+    }
+
+    /* Reads still in flight own the fd and buffers; the last completion frees them. */
+    bool idle = transfer->inflight == 0;
+    pthread_mutex_unlock(&uring_lock);
+
+    if (idle) {
+        oim_uring_destroy(transfer);
+    }
+}
+
+/* Records one completion. Returns a connection to resume, if any. */
+static struct MHD_Connection* oim_uring_complete(struct io_uring_cqe *cqe, OIMUringTransfer **destroy) {
+    OIMUringSlot *slot = io_uring_cqe_get_data(cqe);
+    *destroy = NULL;
+
+    if (slot == NULL) {
+        stop_requested = true;
+        return NULL;
+    }
+
+    OIMUringTransfer *transfer = slot->transfer;
+    inflight_total--;
+    transfer->inflight--;
+
+    if (cqe->res > 0) {
+        slot->length = (size_t)cqe->res;
+        slot->state = OIM_SLOT_READY;
+    } else {
+        slot->state = OIM_SLOT_FAILED;
+    }
+
+    if (transfer->closed) {
+        oim_uring_release_slot(slot);
+        if (transfer->inflight == 0) {
+            *destroy = transfer;
+        }
+        return NULL;
+    }
+
+    if (transfer->waiting) {
+        transfer->waiting = false;
+        return transfer->connection;
+    }
+
+    return NULL;
+}
+
+static void* oim_uring_completion_main(void *arg __attribute__((unused))) {
+    while (1) {
+        struct io_uring_cqe *cqe = NULL;
+        int ret = io_uring_wait_cqe(&ring, &cqe);
+        if (ret == -EINTR) {
+            continue;
+        }
+        if (ret < 0) {
+            LOG_ERROR("io_uring wait failed: %s", strerror(-ret));
+            break;
+        }
+
+        size_t resume_count = 0;
+        pthread_mutex_lock(&uring_lock);
+
+        while (cqe) {
+            OIMUringTransfer *destroy;
+            struct MHD_Connection *connection = oim_uring_complete(cqe, &destroy);
+            io_uring_cqe_seen(&ring, cqe);
+
+            if (connection) {
+                resume_list[resume_count++] = connection;
+            }
+            if (destroy) {
+                oim_uring_destroy(destroy);
+            }
+
+            if (io_uring_peek_cqe(&ring, &cqe) != 0) {
+                cqe = NULL;
+            }
+        }
+
+        bool done = stop_requested && inflight_total == 0;
+        pthread_mutex_unlock(&uring_lock);
+
+        for (size_t i = 0; i < resume_count; i++) {
+            MHD_resume_connection(resume_list[i]);
+        }
+
+        if (done) {
+            break;
+        }
+    }
+
+    return NULL;
+}
+
+int oim_uring_init(const OIMUringConfig *config) {
+    uring_config = *config;
+    if (uring_config.queue_depth <= 0) {
+        uring_config.queue_depth = 64;
+    }
+    if (uring_config.buffer_count <= 0) {
+        uring_config.buffer_count = 256;
+    }
+    if (uring_config.buffer_size < 4096) {
+        uring_config.buffer_size = 4096;
+    }
+
+    size_t pool_size = (size_t)uring_config.buffer_count * uring_config.buffer_size;
+    void *memory = NULL;
+    if (posix_memalign(&memory, 4096, pool_size) != 0) {
+        LOG_ERROR("Failed to allocate %zu byte io_uring buffer pool", pool_size);
+        return -1;
+    }
+
+    pool = memory;
+    free_buffers = malloc((size_t)uring_config.buffer_count * sizeof(char *));
+    /* Each in-flight read can wake at most one waiting transfer. */
+    resume_list = malloc((size_t)uring_config.queue_depth * sizeof(struct MHD_Connection *));
+    if (free_buffers == NULL || resume_list == NULL) {
+        oim_uring_free_pool();
+        return -1;
+    }
+
+    for (free_count = 0; free_count < uring_config.buffer_count; free_count++) {
+        free_buffers[free_count] = pool + (size_t)free_count * uring_config.buffer_size;
+    }
+
+    /* One extra entry leaves room for the stop marker when every read is in flight. */
+    int ret = io_uring_queue_init((unsigned int)uring_config.queue_depth + 1, &ring, 0);
+    if (ret < 0) {
+        LOG_WARN("io_uring unavailable (%s), downloads use sendfile", strerror(-ret));
+        oim_uring_free_pool();
+        return -1;
+    }
+
+    stop_requested = false;
+    uring_running = true;
+
+    if (pthread_create(&completion_thread, NULL, oim_uring_completion_main, NULL) != 0) {
+        LOG_ERROR("Failed to start io_uring completion thread");
+        uring_running = false;
+        io_uring_queue_exit(&ring);
+        oim_uring_free_pool();
+        return -1;
+    }
+
+    LOG_INFO("io_uring download engine: queue depth %d, %d buffers of %zu bytes",
+             uring_config.queue_depth, uring_config.buffer_count, uring_config.buffer_size);
+    return 0;
+}
+
+/*
+ * Waits for reads in flight, which also resumes every transfer waiting
+ * on one, so no connection is left suspended for MHD_stop_daemon.
+ * Transfers that outlive the engine fall back to pread.
+ */
+void oim_uring_stop() {
+    pthread_mutex_lock(&uring_lock);
+    if (!uring_running) {
+        pthread_mutex_unlock(&uring_lock);
+        return;
+    }
+
+    uring_running = false;
+
+    struct io_uring_sqe *sqe = io_uring_get_sqe(&ring);
+    if (sqe == NULL) {
+        io_uring_submit(&ring);
+        sqe = io_uring_get_sqe(&ring);
+    }
+    if (sqe) {
+        io_uring_prep_nop(sqe);
+        io_uring_sqe_set_data(sqe, NULL);
+        io_uring_submit(&ring);
+    }
+    pthread_mutex_unlock(&uring_lock);
+
+    pthread_join(completion_thread, NULL);
+    io_uring_queue_exit(&ring);
+
+    pthread_mutex_lock(&uring_lock);
+    if (free_count == uring_config.buffer_count) {
+        oim_uring_free_pool();
+    } else {
+        pool_orphaned = true;
+    }
+    pthread_mutex_unlock(&uring_lock);
+}
+
+bool oim_uring_enabled() {
+    pthread_mutex_lock(&uring_lock);
+    bool running = uring_running;
+    pthread_mutex_unlock(&uring_lock);
+    return running;
+}
+
+#else
+
+int oim_uring_init(const OIMUringConfig *config __attribute__((unused))) {
+    LOG_WARN("io_uring requested but not compiled in (build with WITH_URING=1), downloads use sendfile");
+    return -1;
+}
+
+void oim_uring_stop() {
+}
+
+bool oim_uring_enabled() {
+    return false;
+}
+
+void* oim_uring_open(
+    struct MHD_Connection *connection __attribute__((unused)),
+    int fd __attribute__((unused)),
+    uint64_t offset __attribute__((unused)),
+    uint64_t length __attribute__((unused))
+) {
+    return NULL;
+}
+
+ssize_t oim_uring_reader(
+    void *cls __attribute__((unused)),
+    uint64_t pos __attribute__((unused)),
+    char *buf __attribute__((unused)),
+    size_t max __attribute__((unused))
+) {
+    return MHD_CONTENT_READER_END_WITH_ERROR;
+}
+
+void oim_uring_close(void *cls __attribute__((unused))) {
+}
+
+#endif
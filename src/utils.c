@@ -8,7 +8,7 @@
 #include <sys/statvfs.h>
 #include <time.h>
 #include <uuid/uuid.h>
-#include <openssl/md5.h>
+#include <openssl/evp.h>
 
 #include "utils.h"
 
@@ -102,6 +102,28 @@ char* get_current_timestamp_str() {
     return str_duplicate(ctime(&now));
 }
 
+/* Returns the hex SHA-256 of input; the caller frees it. */
+char* hash_string(const char *input) {
+    unsigned char digest[EVP_MAX_MD_SIZE];
+    unsigned int length = 0;
+
+    if (input == NULL ||
+        EVP_Digest(input, strlen(input), digest, &length, EVP_sha256(), NULL) != 1) {
+        return NULL;
+    }
+
+    char *hex = malloc(length * 2 + 1);
+    if (hex == NULL) {
+        return NULL;
+    }
+
+    for (unsigned int i = 0; i < length; i++) {
+        sprintf(hex + i * 2, "%02x", digest[i]);
+    }
+
+    return hex;
+}
+
 long get_available_disk_space(const char *path) {
     struct statvfs stat;
     if (statvfs(path, &stat) != 0) {
@@ -0,0 +1,543 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#ifdef SYS_openat2
+#include <linux/openat2.h>
+#endif
+
+#include "walker.h"
+#include "logging.h"
+
+/*
+ * Queued subdirectories keep the descriptor opened relative to their
+ * parent, so no path is resolved twice. Past this many held descriptors
+ * new items fall back to being reopened by path when they are dequeued.
+ */
+#define OIM_WALK_MAX_HELD_FDS 256
+#define OIM_WALK_MAX_THREADS 64
+
+typedef struct {
+    int fd;
+    char *path;
+    size_t path_len;
+} OIMWalkItem;
+
+typedef struct {
+    pthread_mutex_t lock;
+    OIMWalkItem *items;
+    size_t begin;
+    size_t end;
+    size_t capacity;
+} OIMWalkDeque;
+
+typedef struct {
+    const OIMWalkOptions *options;
+    OIMWalkDeque *deques;
+    int worker_count;
+
+    /* Symlinked images are resolved beneath the root, as downloads are. */
+    int root_fd;
+    size_t root_len;
+
+    long outstanding;
+    long held_fds;
+    long failed;
+    OIMWalkStats stats;
+
+    /*
+     * Workers with nothing to take or steal park here. pushes counts
+     * every push, so a worker that saw it unchanged before and after
+     * searching knows it missed nothing and may sleep.
+     */
+    pthread_mutex_t idle_lock;
+    pthread_cond_t idle_cond;
+    long idle_workers;
+    unsigned long pushes;
+} OIMWalker;
+
+typedef struct {
+    OIMWalker *walker;
+    int index;
+} OIMWalkWorker;
+
+static int oim_deque_push(OIMWalkDeque *deque, OIMWalkItem item) {
+    pthread_mutex_lock(&deque->lock);
+
+    if (deque->end == deque->capacity) {
+        if (deque->begin > 0) {
+            memmove(deque->items, deque->items + deque->begin,
+                    (deque->end - deque->begin) * sizeof(OIMWalkItem));
+            deque->end -= deque->begin;
+            deque->begin = 0;
+        } else {
+            size_t capacity = deque->capacity ? deque->capacity * 2 : 64;
+            OIMWalkItem *grown = realloc(deque->items, capacity * sizeof(OIMWalkItem));
+            if (grown == NULL) {
+                pthread_mutex_unlock(&deque->lock);
+                return -1;
+            }
+            deque->items = grown;
+            deque->capacity = capacity;
+        }
+    }
+
+    deque->items[deque->end++] = item;
+    pthread_mutex_unlock(&deque->lock);
+    return 0;
+}
+
+/* Owners take the newest item (depth-first locality), thieves the oldest. */
+static bool oim_deque_take(OIMWalkDeque *deque, bool steal, OIMWalkItem *item) {
+    pthread_mutex_lock(&deque->lock);
+
+    if (deque->begin == deque->end) {
+        pthread_mutex_unlock(&deque->lock);
+        return false;
+    }
+
+    if (steal) {
+        *item = deque->items[deque->begin++];
+    } else {
+        *item = deque->items[--deque->end];
+    }
+
+    if (deque->begin == deque->end) {
+        deque->begin = 0;
+        deque->end = 0;
+    }
+
+    pthread_mutex_unlock(&deque->lock);
+    return true;
+}
+
+/* Wakes one parked worker for new work, or all of them once the walk is done. */
+static void oim_walk_wake(OIMWalker *walker, bool all) {
+    if (__atomic_load_n(&walker->idle_workers, __ATOMIC_SEQ_CST) == 0) {
+        return;
+    }
+
+    pthread_mutex_lock(&walker->idle_lock);
+    if (all) {
+        pthread_cond_broadcast(&walker->idle_cond);
+    } else {
+        pthread_cond_signal(&walker->idle_cond);
+    }
+    pthread_mutex_unlock(&walker->idle_lock);
+}
+
+/* Called with no work found since pushes read seen. */
+static void oim_walk_park(OIMWalker *walker, unsigned long seen) {
+    pthread_mutex_lock(&walker->idle_lock);
+    __atomic_add_fetch(&walker->idle_workers, 1, __ATOMIC_SEQ_CST);
+
+    if (__atomic_load_n(&walker->pushes, __ATOMIC_SEQ_CST) == seen &&
+        __atomic_load_n(&walker->outstanding, __ATOMIC_SEQ_CST) > 0) {
+        pthread_cond_wait(&walker->idle_cond, &walker->idle_lock);
+    }
+
+    __atomic_sub_fetch(&walker->idle_workers, 1, __ATOMIC_SEQ_CST);
+    pthread_mutex_unlock(&walker->idle_lock);
+}
+
+static void oim_walk_enqueue(
+    OIMWalker *walker,
+    int worker,
+    int parent_fd,
+    const OIMWalkItem *parent,
+    const char *name
+) {
+    size_t name_len = strlen(name);
+    OIMWalkItem item;
+
+    item.path_len = parent->path_len + 1 + name_len;
+    item.path = malloc(item.path_len + 1);
+    if (item.path == NULL) {
+        __atomic_add_fetch(&walker->failed, 1, __ATOMIC_RELAXED);
+        return;
+    }
+
+    memcpy(item.path, parent->path, parent->path_len);
+    item.path[parent->path_len] = '/';
+    memcpy(item.path + parent->path_len + 1, name, name_len + 1);
+
+    item.fd = -1;
+    if (__atomic_add_fetch(&walker->held_fds, 1, __ATOMIC_RELAXED) <= OIM_WALK_MAX_HELD_FDS) {
+        item.fd = openat(parent_fd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    }
+    if (item.fd == -1) {
+        __atomic_sub_fetch(&walker->held_fds, 1, __ATOMIC_RELAXED);
+    }
+
+    __atomic_add_fetch(&walker->outstanding, 1, __ATOMIC_SEQ_CST);
+
+    if (oim_deque_push(&walker->deques[worker], item) != 0) {
+        if (item.fd != -1) {
+            close(item.fd);
+            __atomic_sub_fetch(&walker->held_fds, 1, __ATOMIC_RELAXED);
+        }
+        free(item.path);
+        __atomic_sub_fetch(&walker->outstanding, 1, __ATOMIC_SEQ_CST);
+        __atomic_add_fetch(&walker->failed, 1, __ATOMIC_RELAXED);
+        return;
+    }
+
+    __atomic_add_fetch(&walker->pushes, 1, __ATOMIC_SEQ_CST);
+    oim_walk_wake(walker, false);
+}
+
+static bool openat2_supported = true;
+
+int oim_walk_stat_beneath(int root_fd, const char *relative_path, struct stat *file_stat) {
+#ifdef SYS_openat2
+    if (__atomic_load_n(&openat2_supported, __ATOMIC_RELAXED)) {
+        struct open_how how = {
+            .flags = O_PATH | O_CLOEXEC,
+            .resolve = RESOLVE_BENEATH | RESOLVE_NO_MAGICLINKS
+        };
+
+        int fd = (int)syscall(SYS_openat2, root_fd, relative_path, &how, sizeof(how));
+        if (fd != -1) {
+            int result = fstat(fd, file_stat);
+            close(fd);
+            return result;
+        }
+        if (errno != ENOSYS) {
+            return -1;
+        }
+        __atomic_store_n(&openat2_supported, false, __ATOMIC_RELAXED);
+    }
+#endif
+
+    return fstatat(root_fd, relative_path, file_stat, 0);
+}
+
+/* Stats the target of a symlinked image, or fails if it leaves the root. */
+static int oim_walk_stat_link(
+    OIMWalker *walker,
+    const OIMWalkItem *item,
+    const char *name,
+    struct stat *file_stat
+) {
+    char relative_path[PATH_MAX];
+    const char *directory = item->path + walker->root_len;
+
+    if (*directory == '/') {
+        directory++;
+    }
+
+    int length = snprintf(relative_path, sizeof(relative_path), "%s%s%s",
+                          directory, *directory ? "/" : "", name);
+    if (length < 0 || (size_t)length >= sizeof(relative_path)) {
+        return -1;
+    }
+
+    return oim_walk_stat_beneath(walker->root_fd, relative_path, file_stat);
+}
+
+/*
+ * Reopens a directory whose fd was not held, relative to the root and
+ * without following symlinks, so a directory swapped for a link since
+ * it was listed cannot take the walk outside the root.
+ */
+static int oim_walk_reopen(OIMWalker *walker, const OIMWalkItem *item) {
+    const char *relative_path = item->path + walker->root_len;
+    while (*relative_path == '/') {
+        relative_path++;
+    }
+
+#ifdef SYS_openat2
+    if (__atomic_load_n(&openat2_supported, __ATOMIC_RELAXED)) {
+        struct open_how how = {
+            .flags = O_RDONLY | O_DIRECTORY | O_CLOEXEC,
+            .resolve = RESOLVE_BENEATH | RESOLVE_NO_SYMLINKS
+        };
+
+        int fd = (int)syscall(SYS_openat2, walker->root_fd, relative_path, &how, sizeof(how));
+        if (fd != -1 || errno != ENOSYS) {
+            return fd;
+        }
+        __atomic_store_n(&openat2_supported, false, __ATOMIC_RELAXED);
+    }
+#endif
+
+    return openat(walker->root_fd, relative_path,
+                  O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+}
+
+static void oim_walk_emit(
+    OIMWalker *walker,
+    int worker,
+    const OIMWalkItem *item,
+    const char *name,
+    const struct stat *file_stat,
+    OIMWalkStats *stats
+) {
+    char full_path[PATH_MAX];
+    size_t name_len = strlen(name);
+
+    if (item->path_len + 1 + name_len >= sizeof(full_path)) {
+        return;
+    }
+
+    memcpy(full_path, item->path, item->path_len);
+    full_path[item->path_len] = '/';
+    memcpy(full_path + item->path_len + 1, name, name_len + 1);
+
+    stats->matches++;
+    walker->options->callback(walker->options->ctx, worker, full_path, name, file_stat);
+}
+
+static void oim_walk_process(OIMWalker *walker, int worker, OIMWalkItem *item, OIMWalkStats *stats) {
+    const OIMWalkOptions *options = walker->options;
+    bool held = item->fd != -1;
+
+    int dfd = held ? item->fd : oim_walk_reopen(walker, item);
+    if (dfd == -1) {
+        LOG_WARN("Cannot open directory: %s (Error: %s)", item->path, strerror(errno));
+        return;
+    }
+
+    DIR *dir = fdopendir(dfd);
+    if (dir == NULL) {
+        close(dfd);
+        if (held) {
+            __atomic_sub_fetch(&walker->held_fds, 1, __ATOMIC_RELAXED);
+        }
+        return;
+    }
+
+    stats->directories++;
+
+    struct dirent *entry;
+    struct stat file_stat;
+
+    while ((entry = readdir(dir)) != NULL) {
+        const char *name = entry->d_name;
+
+        if (name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0'))) {
+            continue;
+        }
+
+        stats->entries++;
+
+        switch (entry->d_type) {
+            case DT_DIR:
+                if (options->recursive) {
+                    oim_walk_enqueue(walker, worker, dfd, item, name);
+                }
+                break;
+
+            case DT_REG:
+                if (!options->filter(name)) {
+                    break;
+                }
+                stats->stat_calls++;
+                if (fstatat(dfd, name, &file_stat, 0) == 0 && S_ISREG(file_stat.st_mode)) {
+                    oim_walk_emit(walker, worker, item, name, &file_stat, stats);
+                }
+                break;
+
+            case DT_LNK:
+                /*
+                 * Symlinked images are served if they stay inside the root;
+                 * symlinked directories are not followed.
+                 */
+                if (!options->filter(name)) {
+                    break;
+                }
+                stats->stat_calls++;
+                if (oim_walk_stat_link(walker, item, name, &file_stat) == 0 &&
+                    S_ISREG(file_stat.st_mode)) {
+                    oim_walk_emit(walker, worker, item, name, &file_stat, stats);
+                }
+                break;
+
+            case DT_UNKNOWN: {
+                bool matches = options->filter(name);
+                if (!matches && !options->recursive) {
+                    break;
+                }
+                stats->stat_calls++;
+                if (fstatat(dfd, name, &file_stat, AT_SYMLINK_NOFOLLOW) != 0) {
+                    break;
+                }
+                if (S_ISDIR(file_stat.st_mode)) {
+                    if (options->recursive) {
+                        oim_walk_enqueue(walker, worker, dfd, item, name);
+                    }
+                } else if (matches && S_ISLNK(file_stat.st_mode)) {
+                    stats->stat_calls++;
+                    if (oim_walk_stat_link(walker, item, name, &file_stat) == 0 &&
+                        S_ISREG(file_stat.st_mode)) {
+                        oim_walk_emit(walker, worker, item, name, &file_stat, stats);
+                    }
+                } else if (matches && S_ISREG(file_stat.st_mode)) {
+                    oim_walk_emit(walker, worker, item, name, &file_stat, stats);
+                }
+                break;
+            }
+
+            default:
+                break;
+        }
+    }
+
+    closedir(dir);
+    if (held) {
+        __atomic_sub_fetch(&walker->held_fds, 1, __ATOMIC_RELAXED);
+    }
+}
+
+static void* oim_walk_worker_main(void *arg) {
+    OIMWalkWorker *worker = arg;
+    OIMWalker *walker = worker->walker;
+    OIMWalkStats stats = {0};
+    OIMWalkItem item;
+
+    for (;;) {
+        unsigned long seen = __atomic_load_n(&walker->pushes, __ATOMIC_SEQ_CST);
+        bool found = oim_deque_take(&walker->deques[worker->index], false, &item);
+
+        for (int i = 1; !found && i < walker->worker_count; i++) {
+            int victim = (worker->index + i) % walker->worker_count;
+            found = oim_deque_take(&walker->deques[victim], true, &item);
+        }
+
+        if (!found) {
+            if (__atomic_load_n(&walker->outstanding, __ATOMIC_SEQ_CST) == 0) {
+                break;
+            }
+            oim_walk_park(walker, seen);
+            continue;
+        }
+
+        oim_walk_process(walker, worker->index, &item, &stats);
+        free(item.path);
+
+        if (__atomic_sub_fetch(&walker->outstanding, 1, __ATOMIC_SEQ_CST) == 0) {
+            oim_walk_wake(walker, true);
+        }
+    }
+
+    __atomic_add_fetch(&walker->stats.directories, stats.directories, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&walker->stats.entries, stats.entries, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&walker->stats.stat_calls, stats.stat_calls, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&walker->stats.matches, stats.matches, __ATOMIC_RELAXED);
+
+    return NULL;
+}
+
+int oim_walk_directory(const OIMWalkOptions *options, OIMWalkStats *stats) {
+    if (options == NULL || options->root == NULL ||
+        options->filter == NULL || options->callback == NULL) {
+        return -1;
+    }
+
+    int worker_count = options->thread_count;
+    if (worker_count < 1) {
+        worker_count = 1;
+    }
+    if (worker_count > OIM_WALK_MAX_THREADS) {
+        worker_count = OIM_WALK_MAX_THREADS;
+    }
+
+    OIMWalker walker;
+    memset(&walker, 0, sizeof(walker));
+    walker.options = options;
+    walker.worker_count = worker_count;
+    pthread_mutex_init(&walker.idle_lock, NULL);
+    pthread_cond_init(&walker.idle_cond, NULL);
+
+    walker.deques = calloc(worker_count, sizeof(OIMWalkDeque));
+    OIMWalkWorker *workers = calloc(worker_count, sizeof(OIMWalkWorker));
+    pthread_t *threads = calloc(worker_count, sizeof(pthread_t));
+    if (walker.deques == NULL || workers == NULL || threads == NULL) {
+        pthread_cond_destroy(&walker.idle_cond);
+        pthread_mutex_destroy(&walker.idle_lock);
+        free(walker.deques);
+        free(workers);
+        free(threads);
+        return -1;
+    }
+
+    for (int i = 0; i < worker_count; i++) {
+        pthread_mutex_init(&walker.deques[i].lock, NULL);
+        workers[i].walker = &walker;
+        workers[i].index = i;
+    }
+
+    OIMWalkItem root;
+    root.path_len = strlen(options->root);
+    while (root.path_len > 1 && options->root[root.path_len - 1] == '/') {
+        root.path_len--;
+    }
+    root.path = strndup(options->root, root.path_len);
+    root.fd = open(options->root, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+
+    walker.root_len = root.path_len;
+    walker.root_fd = open(options->root, O_PATH | O_DIRECTORY | O_CLOEXEC);
+
+    int result = 0;
+
+    if (root.path == NULL || root.fd == -1 || walker.root_fd == -1) {
+        LOG_ERROR("Cannot open directory: %s (Error: %s)", options->root, strerror(errno));
+        if (root.fd != -1) {
+            close(root.fd);
+        }
+        free(root.path);
+        result = -1;
+    } else {
+        walker.held_fds = 1;
+        walker.outstanding = 1;
+        oim_deque_push(&walker.deques[0], root);
+
+        int started = 1;
+        for (int i = 1; i < worker_count; i++) {
+            if (pthread_create(&threads[i], NULL, oim_walk_worker_main, &workers[i]) != 0) {
+                LOG_WARN("Failed to start scan worker %d, continuing with %d", i, started);
+                break;
+            }
+            started++;
+        }
+
+        oim_walk_worker_main(&workers[0]);
+
+        for (int i = 1; i < started; i++) {
+            pthread_join(threads[i], NULL);
+        }
+
+        if (walker.failed > 0) {
+            LOG_ERROR("Directory walk dropped %ld director%s due to allocation failures",
+                      walker.failed, walker.failed == 1 ? "y" : "ies");
+            result = -1;
+        }
+    }
+
+    for (int i = 0; i < worker_count; i++) {
+        pthread_mutex_destroy(&walker.deques[i].lock);
+        free(walker.deques[i].items);
+    }
+    free(walker.deques);
+    free(workers);
+    free(threads);
+    pthread_cond_destroy(&walker.idle_cond);
+    pthread_mutex_destroy(&walker.idle_lock);
+    if (walker.root_fd != -1) {
+        close(walker.root_fd);
+    }
+
+    if (stats) {
+        *stats = walker.stats;
+    }
+
+    return result;
+}
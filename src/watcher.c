@@ -0,0 +1,395 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <unistd.h>
+#include <poll.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/inotify.h>
+#include <sys/eventfd.h>
+#include <sys/stat.h>
+
+#include "watcher.h"
+#include "imgMgr.h"
+#include "logging.h"
+
+#define OIM_WATCH_DIR_MASK (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | \
+                            IN_CLOSE_WRITE | IN_ATTRIB | IN_DELETE_SELF | IN_ONLYDIR)
+
+/* Quiet period before a batch of events is applied to the catalog. */
+#define OIM_WATCH_DEBOUNCE_MS 500
+#define OIM_WATCH_MAX_BATCH 4096
+
+typedef struct {
+    int wd;
+    char *path;
+} OIMWatch;
+
+static int inotify_fd = -1;
+static int wakeup_fd = -1;
+static bool watcher_recursive = true;
+static bool watcher_running = false;
+static pthread_t watcher_thread;
+
+/* Watch descriptors are handed out in increasing order, so this stays sorted. */
+static OIMWatch *watches = NULL;
+static size_t watch_count = 0;
+static size_t watch_capacity = 0;
+
+static OIMMirrorChange *pending = NULL;
+static size_t pending_count = 0;
+static size_t pending_capacity = 0;
+
+static void oim_queue_change(OIMMirrorChangeType type, const char *path) {
+    if (pending_count == pending_capacity) {
+        size_t capacity = pending_capacity ? pending_capacity * 2 : 64;
+        OIMMirrorChange *grown = realloc(pending, capacity * sizeof(OIMMirrorChange));
+        if (grown == NULL) {
+            LOG_ERROR("Out of memory queueing filesystem change, requesting full rescan");
+            oim_request_mirror_rescan();
+            return;
+        }
+        pending = grown;
+        pending_capacity = capacity;
+    }
+
+    char *copy = strdup(path);
+    if (copy == NULL) {
+        oim_request_mirror_rescan();
+        return;
+    }
+
+    pending[pending_count].type = type;
+    pending[pending_count].path = copy;
+    pending_count++;
+}
+
+static void oim_discard_pending() {
+    for (size_t i = 0; i < pending_count; i++) {
+        free(pending[i].path);
+    }
+    pending_count = 0;
+}
+
+static void oim_flush_pending() {
+    if (pending_count == 0) {
+        return;
+    }
+
+    oim_apply_mirror_changes(pending, pending_count);
+    oim_discard_pending();
+}
+
+static OIMWatch* oim_find_watch(int wd) {
+    size_t low = 0;
+    size_t high = watch_count;
+
+    while (low < high) {
+        size_t mid = (low + high) / 2;
+        if (watches[mid].wd == wd) {
+            return &watches[mid];
+        }
+        if (watches[mid].wd < wd) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+
+    return NULL;
+}
+
+static void oim_forget_watch(int wd) {
+    OIMWatch *watch = oim_find_watch(wd);
+    if (watch == NULL) {
+        return;
+    }
+
+    free(watch->path);
+    size_t index = (size_t)(watch - watches);
+    memmove(watch, watch + 1, (watch_count - index - 1) * sizeof(OIMWatch));
+    watch_count--;
+}
+
+static int oim_add_watch(const char *path) {
+    int wd = inotify_add_watch(inotify_fd, path, OIM_WATCH_DIR_MASK);
+    if (wd == -1) {
+        LOG_WARN("Cannot watch directory %s (Error: %s), relying on periodic rescans",
+                 path, strerror(errno));
+        return -1;
+    }
+
+    OIMWatch *existing = oim_find_watch(wd);
+    if (existing) {
+        char *copy = strdup(path);
+        if (copy) {
+            free(existing->path);
+            existing->path = copy;
+        }
+        return 0;
+    }
+
+    if (watch_count == watch_capacity) {
+        size_t capacity = watch_capacity ? watch_capacity * 2 : 64;
+        OIMWatch *grown = realloc(watches, capacity * sizeof(OIMWatch));
+        if (grown == NULL) {
+            inotify_rm_watch(inotify_fd, wd);
+            return -1;
+        }
+        watches = grown;
+        watch_capacity = capacity;
+    }
+
+    /* Reused descriptors can be smaller than the last one handed out. */
+    size_t index = watch_count;
+    while (index > 0 && watches[index - 1].wd > wd) {
+        index--;
+    }
+    memmove(&watches[index + 1], &watches[index], (watch_count - index) * sizeof(OIMWatch));
+
+    watches[index].wd = wd;
+    watches[index].path = strdup(path);
+    watch_count++;
+
+    return 0;
+}
+
+static void oim_remove_watch_tree(const char *path) {
+    size_t path_len = strlen(path);
+
+    for (size_t i = 0; i < watch_count; ) {
+        const char *watched = watches[i].path;
+        if (watched && strncmp(watched, path, path_len) == 0 &&
+            (watched[path_len] == '\0' || watched[path_len] == '/')) {
+            inotify_rm_watch(inotify_fd, watches[i].wd);
+            free(watches[i].path);
+            memmove(&watches[i], &watches[i + 1], (watch_count - i - 1) * sizeof(OIMWatch));
+            watch_count--;
+            continue;
+        }
+        i++;
+    }
+}
+
+/*
+ * Watches a directory (and its subdirectories when recursive) and,
+ * for directories that appeared after startup, queues their images.
+ * Like the scan walker it never follows a symlinked directory, so both
+ * see the same tree and a link cycle cannot recurse.
+ */
+static void oim_watch_tree(const char *path, bool queue_files) {
+    if (oim_add_watch(path) != 0) {
+        return;
+    }
+
+    DIR *dir = opendir(path);
+    if (dir == NULL) {
+        return;
+    }
+
+    struct dirent *entry;
+    char child[PATH_MAX];
+
+    while ((entry = readdir(dir)) != NULL) {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
+            continue;
+        }
+
+        snprintf(child, sizeof(child), "%s/%s", path, entry->d_name);
+
+        unsigned char type = entry->d_type;
+        if (type == DT_UNKNOWN) {
+            struct stat child_stat;
+            if (lstat(child, &child_stat) == -1) {
+                continue;
+            }
+            type = S_ISDIR(child_stat.st_mode) ? DT_DIR : DT_REG;
+        }
+
+        if (type == DT_DIR) {
+            if (watcher_recursive) {
+                oim_watch_tree(child, queue_files);
+            }
+        } else if (queue_files && oim_is_mirror_image(entry->d_name)) {
+            oim_queue_change(OIM_MIRROR_CHANGE_UPSERT, child);
+        }
+    }
+
+    closedir(dir);
+}
+
+static void oim_handle_event(const struct inotify_event *event) {
+    if (event->mask & IN_Q_OVERFLOW) {
+        LOG_WARN("inotify queue overflowed, falling back to a full rescan");
+        oim_discard_pending();
+        oim_request_mirror_rescan();
+        return;
+    }
+
+    if (event->mask & IN_IGNORED) {
+        oim_forget_watch(event->wd);
+        return;
+    }
+
+    OIMWatch *watch = oim_find_watch(event->wd);
+    if (watch == NULL || event->len == 0) {
+        return;
+    }
+
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/%s", watch->path, event->name);
+
+    if (event->mask & IN_ISDIR) {
+        if (event->mask & (IN_CREATE | IN_MOVED_TO)) {
+            if (watcher_recursive) {
+                oim_watch_tree(path, true);
+            }
+        } else if (event->mask & (IN_DELETE | IN_MOVED_FROM)) {
+            oim_remove_watch_tree(path);
+            oim_queue_change(OIM_MIRROR_CHANGE_REMOVE_TREE, path);
+        }
+        return;
+    }
+
+    if (!oim_is_mirror_image(event->name)) {
+        return;
+    }
+
+    /* IN_CREATE alone announces hard and symbolic links; the debounce merges it with writes. */
+    if (event->mask & (IN_CREATE | IN_CLOSE_WRITE | IN_MOVED_TO | IN_ATTRIB)) {
+        oim_queue_change(OIM_MIRROR_CHANGE_UPSERT, path);
+    } else if (event->mask & (IN_DELETE | IN_MOVED_FROM)) {
+        oim_queue_change(OIM_MIRROR_CHANGE_REMOVE, path);
+    }
+}
+
+static void* oim_mirror_watcher_main(void *arg __attribute__((unused))) {
+    char buffer[64 * 1024] __attribute__((aligned(__alignof__(struct inotify_event))));
+
+    struct pollfd fds[2] = {
+        { .fd = inotify_fd, .events = POLLIN },
+        { .fd = wakeup_fd, .events = POLLIN }
+    };
+
+    while (__atomic_load_n(&watcher_running, __ATOMIC_ACQUIRE)) {
+        int ready = poll(fds, 2, pending_count ? OIM_WATCH_DEBOUNCE_MS : -1);
+
+        if (ready == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            LOG_ERROR("inotify poll failed: %s", strerror(errno));
+            break;
+        }
+
+        if (ready == 0) {
+            oim_flush_pending();
+            continue;
+        }
+
+        if (fds[1].revents & POLLIN) {
+            break;
+        }
+
+        ssize_t length;
+        while ((length = read(inotify_fd, buffer, sizeof(buffer))) > 0) {
+            for (char *p = buffer; p < buffer + length; ) {
+                const struct inotify_event *event = (const struct inotify_event *)p;
+                oim_handle_event(event);
+                p += sizeof(struct inotify_event) + event->len;
+            }
+        }
+
+        if (pending_count >= OIM_WATCH_MAX_BATCH) {
+            oim_flush_pending();
+        }
+    }
+
+    oim_flush_pending();
+    return NULL;
+}
+
+int oim_start_mirror_watcher(const char *base_directory, bool recursive) {
+    if (watcher_running) {
+        return 0;
+    }
+
+    inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (inotify_fd == -1) {
+        LOG_ERROR("Failed to initialize inotify: %s", strerror(errno));
+        return -1;
+    }
+
+    wakeup_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (wakeup_fd == -1) {
+        LOG_ERROR("Failed to create watcher wakeup descriptor: %s", strerror(errno));
+        close(inotify_fd);
+        inotify_fd = -1;
+        return -1;
+    }
+
+    /* Event paths must match the walker's, which drops trailing slashes. */
+    char base[PATH_MAX];
+    size_t base_len = strlen(base_directory);
+    while (base_len > 1 && base_directory[base_len - 1] == '/') {
+        base_len--;
+    }
+    if (base_len >= sizeof(base)) {
+        LOG_ERROR("Mirror directory path too long to watch: %s", base_directory);
+        oim_stop_mirror_watcher();
+        return -1;
+    }
+    memcpy(base, base_directory, base_len);
+    base[base_len] = '\0';
+
+    watcher_recursive = recursive;
+    oim_watch_tree(base, false);
+
+    LOG_INFO("Watching %zu directories under %s for changes", watch_count, base);
+
+    watcher_running = true;
+    if (pthread_create(&watcher_thread, NULL, oim_mirror_watcher_main, NULL) != 0) {
+        LOG_ERROR("Failed to create Mirror watcher thread");
+        watcher_running = false;
+        oim_stop_mirror_watcher();
+        return -1;
+    }
+
+    return 0;
+}
+
+void oim_stop_mirror_watcher() {
+    if (__atomic_exchange_n(&watcher_running, false, __ATOMIC_ACQ_REL)) {
+        uint64_t one = 1;
+        if (write(wakeup_fd, &one, sizeof(one)) != sizeof(one)) {
+            LOG_WARN("Failed to wake Mirror watcher thread");
+        }
+        pthread_join(watcher_thread, NULL);
+    }
+
+    if (inotify_fd != -1) {
+        close(inotify_fd);
+        inotify_fd = -1;
+    }
+
+    if (wakeup_fd != -1) {
+        close(wakeup_fd);
+        wakeup_fd = -1;
+    }
+
+    for (size_t i = 0; i < watch_count; i++) {
+        free(watches[i].path);
+    }
+    free(watches);
+    watches = NULL;
+    watch_count = 0;
+    watch_capacity = 0;
+
+    oim_discard_pending();
+    free(pending);
+    pending = NULL;
+    pending_capacity = 0;
+}